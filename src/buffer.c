@@ -203,6 +203,41 @@ buffer_write(buffer_t *buffer, unsigned char *data, size_t len) {
     return true;
 }
 
+bool
+buffer_write_str(buffer_t *buffer, const char *str) {
+    return buffer_write(buffer, (unsigned char *)str, strlen(str));
+}
+
+unsigned char *
+buffer_reserve(buffer_t *buffer, size_t len) {
+    if (buffer->len + len > buffer->capacity) {
+        if (!buffer_grow(buffer, len)) {
+            return NULL;
+        }
+    }
+
+    return buffer->data + buffer->len;
+}
+
+void
+buffer_commit(buffer_t *buffer, size_t len) {
+    buffer->len += len;
+}
+
+void
+buffer_truncate(buffer_t *buffer, size_t len) {
+    if (len >= buffer->len) {
+        return;
+    }
+
+    //zero out the removed bytes if this is a secure buffer
+    if (buffer->flags & BUFFER_FLAGS_SECURE) {
+        memset(buffer->data + len, 0, buffer->len - len);
+    }
+
+    buffer->len = len;
+}
+
 bool
 buffer_write_uint8(buffer_t *buffer, uint8_t data) {
     return buffer_write(buffer, (unsigned char *)&data, sizeof(data));
@@ -270,12 +305,12 @@ buffer_remove(buffer_t *buffer, size_t len) {
     }
 
     if (len > 0) {
-        memmove(buffer->data, buffer->data + len, len);
+        memmove(buffer->data, buffer->data + len, buffer->len - len);
         buffer->len -= len;
 
         //zero out the remaining memory if this is a secure buffer
         if (buffer->flags & BUFFER_FLAGS_SECURE) {
-            memset(buffer->data + len, 0, len);
+            memset(buffer->data + buffer->len, 0, len);
         }
     }
 
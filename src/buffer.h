@@ -77,6 +77,46 @@ size_t buffer_length(buffer_t *buffer);
  */
 bool buffer_write(buffer_t *buffer, unsigned char *data, size_t len);
 
+/**
+ * Writes a NUL terminated string to the buffer, without the NUL terminator.
+ *
+ * @param[in] buffer The buffer.
+ * @param[in] str The string.
+ * @return true if the write was successful, otherwise false if not enough
+ * memory was available.
+ */
+bool buffer_write_str(buffer_t *buffer, const char *str);
+
+/**
+ * Makes room for at least <tt>len</tt> more bytes at the end of the buffer
+ * and returns a pointer to them, so data can be written in place. The
+ * buffer's length doesn't change until buffer_commit() is called.
+ *
+ * @param[in] buffer The buffer.
+ * @param[in] len The number of bytes to make room for.
+ * @return A pointer to the end of the buffer's data, or <tt>NULL</tt> if not
+ * enough memory was available.
+ */
+unsigned char * buffer_reserve(buffer_t *buffer, size_t len);
+
+/**
+ * Adds <tt>len</tt> bytes written in place after buffer_reserve() to the
+ * buffer's length.
+ *
+ * @param[in] buffer The buffer.
+ * @param[in] len The number of bytes written, no more than were reserved.
+ */
+void buffer_commit(buffer_t *buffer, size_t len);
+
+/**
+ * Shortens the buffer to <tt>len</tt> bytes, keeping its memory.
+ *
+ * @param[in] buffer The buffer.
+ * @param[in] len The new length, which is ignored if it's not shorter than
+ * the current length.
+ */
+void buffer_truncate(buffer_t *buffer, size_t len);
+
 /**
  * Writes an 8 bit unsigned integer to the buffer.
  *
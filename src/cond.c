@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if defined(_WIN32)
+# include <Windows.h>
+#else
+# include <pthread.h>
+# include <time.h>
+#endif
+#include "cond.h"
+
+struct cond_t {
+#if defined(_WIN32)
+    CRITICAL_SECTION mutex;
+    CONDITION_VARIABLE cond;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+};
+
+cond_t *
+cond_init() {
+    cond_t *cond;
+#if !defined(_WIN32)
+    pthread_condattr_t attr;
+#endif
+
+    cond = calloc(1, sizeof(*cond));
+    if (cond == NULL) {
+        return NULL;
+    }
+
+#if defined(_WIN32)
+    InitializeCriticalSection(&cond->mutex);
+    InitializeConditionVariable(&cond->cond);
+#else
+    pthread_mutex_init(&cond->mutex, NULL);
+
+    //use the monotonic clock so timed waits aren't affected by wall clock changes
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond->cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+
+    return cond;
+}
+
+void
+cond_free(cond_t *cond) {
+    if (cond == NULL) {
+        return;
+    }
+
+#if defined(_WIN32)
+    DeleteCriticalSection(&cond->mutex);
+#else
+    pthread_cond_destroy(&cond->cond);
+    pthread_mutex_destroy(&cond->mutex);
+#endif
+
+    free(cond);
+}
+
+void
+cond_lock(cond_t *cond) {
+#if defined(_WIN32)
+    EnterCriticalSection(&cond->mutex);
+#else
+    pthread_mutex_lock(&cond->mutex);
+#endif
+}
+
+void
+cond_unlock(cond_t *cond) {
+#if defined(_WIN32)
+    LeaveCriticalSection(&cond->mutex);
+#else
+    pthread_mutex_unlock(&cond->mutex);
+#endif
+}
+
+void
+cond_wait(cond_t *cond) {
+#if defined(_WIN32)
+    SleepConditionVariableCS(&cond->cond, &cond->mutex, INFINITE);
+#else
+    pthread_cond_wait(&cond->cond, &cond->mutex);
+#endif
+}
+
+bool
+cond_timedwait(cond_t *cond, unsigned int timeout_ms) {
+#if defined(_WIN32)
+    return SleepConditionVariableCS(&cond->cond, &cond->mutex, timeout_ms) != 0;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    return pthread_cond_timedwait(&cond->cond, &cond->mutex, &ts) != ETIMEDOUT;
+#endif
+}
+
+void
+cond_signal(cond_t *cond) {
+#if defined(_WIN32)
+    WakeConditionVariable(&cond->cond);
+#else
+    pthread_cond_signal(&cond->cond);
+#endif
+}
+
+void
+cond_broadcast(cond_t *cond) {
+#if defined(_WIN32)
+    WakeAllConditionVariable(&cond->cond);
+#else
+    pthread_cond_broadcast(&cond->cond);
+#endif
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+
+typedef struct cond_t cond_t;
+
+cond_t * cond_init();
+void cond_free(cond_t *cond);
+
+void cond_lock(cond_t *cond);
+void cond_unlock(cond_t *cond);
+
+void cond_wait(cond_t *cond);
+bool cond_timedwait(cond_t *cond, unsigned int timeout_ms);
+
+void cond_signal(cond_t *cond);
+void cond_broadcast(cond_t *cond);
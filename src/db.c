@@ -2,23 +2,691 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <float.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#if defined(LIBSCOTT_MYSQL)
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#endif
+#include "alist.h"
+#include "buffer.h"
+#include "cond.h"
+#include "hash.h"
 #include "lock.h"
+#include "queue.h"
+#include "thread.h"
 #include "db.h"
 
+#define DB_STMT_CACHE_CAPACITY 32  //initial number of buckets in each connection's statement cache
+#define DB_STMT_STR_CAPACITY   64  //initial room for a string column in a statement's result, grows as needed
+
+#define DB_BATCH_PACKET_SLACK 1024 //room left under max_allowed_packet for the protocol header
+#define DB_INFILE_NAME "libscott"  //the file name LOAD DATA LOCAL INFILE asks for, it's never opened
+
+#define DB_SQL_CAPACITY   256          //initial size of each thread's query buffers
+#define DB_SQL_KEEP_BYTES (64 * 1024)  //a query buffer that grew past this gives its memory back after the query
+
+#define DB_CACHE_CAPACITY  64 //initial number of buckets in a result cache
+#define DB_CACHE_MAX_ENTRY 4  //a result bigger than 1/N of a cache's size isn't cached so it can't push out everything else
+
+#if defined(LIBSCOTT_MYSQL)
+//MySQL 8.0 replaced my_bool with bool, but MariaDB still uses my_bool
+#if !defined(MARIADB_BASE_VERSION) && !defined(MARIADB_PACKAGE_VERSION_ID) && MYSQL_VERSION_ID >= 80001
+typedef bool db_mysql_bool_t;
+#else
+typedef my_bool db_mysql_bool_t;
+#endif
+#endif
+
+typedef struct db_cache_entry_t db_cache_entry_t;
+
 struct db_t {
-    MYSQL *mysql;
+    const db_driver_t *driver;
+    void *driver_data;
+    void *conn;                 //the driver's connection, NULL when not connected
     lock_t *lock;
+    hash_t *stmts;              //prepared statements keyed by their SQL text
+    db_result_t *stream;        //the streaming result that owns the connection until it's freed
+    db_result_t *measured;      //buffered results whose bytes are added to the metrics when they're freed
+    char *host;
+    char *user;
+    char *password;
+    char *database;
+    unsigned int port;
+    unsigned int error_code;    //the driver's code for the last failure, 0 if the last operation succeeded
+    unsigned long owner;        //thread that last checked this connection out of a pool
+    time_t last_used;           //when this connection was last returned to a pool
+    db_cache_t *cache;          //where db_select_cached() keeps results, NULL to not cache
+    bool metrics_enabled;
+    db_metrics_t metrics;
+    unsigned int slow_ms;       //queries taking at least this long are passed to slow_cb
+    db_slow_query_cb_t slow_cb;
+    void *slow_user_data;
     char error[256];
 };
 
 struct db_result_t {
-    MYSQL_RES *result;
+    const db_driver_t *driver;
+    void *result;               //the driver's result, NULL once the rows are cached
+    char **row;
+    unsigned long *lengths;     //lengths of the current row's columns
+    const db_field_t *fields;
+    unsigned int num_fields;
+    hash_t *names;              //column name to index + 1, built the first time a column is looked up by name
+    db_t *db;                   //set while a streaming result holds the connection
+    bool failed;                //a streaming result hit an error before the last row
+    db_cache_entry_t *cached;   //set when the rows come from a db_cache_t instead of the server
+    unsigned long long pos;     //the next cached row
+    db_t *measured;             //set while a buffered result's bytes are counted for its connection's metrics
+    uint64_t bytes;             //bytes read so far from a measured result
+    db_result_t *prev;          //neighbours in the connection's list of measured results
+    db_result_t *next;
+};
+
+#if defined(LIBSCOTT_MYSQL)
+typedef struct {
+    union {
+        int64_t i;
+        double d;
+    } value;
+    unsigned long length;
+    db_mysql_bool_t is_null;
+} db_stmt_param_t;
+
+typedef struct {
+    enum enum_field_types type; //the type the column is fetched as: MYSQL_TYPE_LONGLONG, MYSQL_TYPE_DOUBLE or MYSQL_TYPE_STRING
+    int64_t i;
+    double d;
+    char *data;                 //always NUL terminated for MYSQL_TYPE_STRING
+    unsigned long capacity;
+    unsigned long length;
+    db_mysql_bool_t is_null;
+    db_mysql_bool_t error;
+    char text[32];              //numeric columns formatted for db_stmt_str()
+} db_stmt_column_t;
+
+struct db_stmt_t {
+    db_t *db;
+    char *query;                //kept for the slow query hook
+    unsigned int query_len;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND *params;
+    db_stmt_param_t *param_values;
+    unsigned int num_params;
+    MYSQL_BIND *columns;
+    db_stmt_column_t *column_values;
+    unsigned int num_columns;
+    bool has_result;
+};
+#endif
+
+struct db_batch_t {
+    db_t *db;
+    int mode;
+    char *header;               //the INSERT prefix or the whole LOAD DATA statement
+    size_t header_len;
+    buffer_t *data;             //the statement, or the rows for LOAD DATA, that will be sent on the next flush
+    buffer_t *row;              //the row being built, added to data when the next row starts or on a flush
+    unsigned int rows;          //rows in data
+    unsigned int columns;       //values in row
+    unsigned int max_rows;
+    size_t max_bytes;
+    size_t packet_limit;        //the most the server accepts in one statement, 0 if there's no limit
+    unsigned long long count;   //rows sent so far
+};
+
+struct db_sql_t {
+    db_t *db;
+    buffer_t *buffer;
+    bool failed;                //set on the first append that fails, checked when the query is run
+};
+
+//query buffers each thread keeps and reuses so building a query doesn't allocate once they've grown
+typedef struct {
+    db_sql_t sql;               //used by db_sql_begin()
+    buffer_t *fmt;              //used by db_queryf() and db_selectf()
+    buffer_t *key;              //used by db_select_cached() to normalise the query into a cache key
+} db_thread_t;
+
+//a cached result and everything it points to live in a single allocation
+struct db_cache_entry_t {
+    db_cache_t *cache;
+    db_cache_entry_t *prev;     //more recently used
+    db_cache_entry_t *next;     //less recently used
+    char *key;
+    char *tables;               //what the result depends on, for db_cache_invalidate()
+    time_t expires;
+    size_t size;
+    unsigned int refs;          //results reading from this entry
+    bool removed;               //no longer in the cache, freed when the last result lets go
+    db_field_t *fields;
+    unsigned int num_fields;
+    unsigned long long num_rows;
+    char **cells;               //num_rows * num_fields column values, NULL for SQL NULL
+    unsigned long *lengths;     //lengths of the cells
+};
+
+struct db_cache_t {
+    lock_t *lock;
+    hash_t *entries;            //cache key to db_cache_entry_t
+    db_cache_entry_t *head;     //most recently used
+    db_cache_entry_t *tail;     //least recently used, evicted first
+    size_t size;
+    size_t max_bytes;
+    unsigned int ttl;
+    unsigned long long generation; //bumped by every invalidation so a query that ran across one isn't cached
+    unsigned long long hits;
+    unsigned long long misses;
+};
+
+typedef struct {
+    char *query;
+    unsigned int len;
+    bool select;
+    db_async_cb_t cb;
+    void *user_data;
+    bool success;
+    db_result_t *result;
+    char error[256];
+} db_async_request_t;
+
+struct db_async_t {
+    db_pool_t *pool;
+    thread_t **threads;
+    unsigned int num_threads;
+    queue_t *requests;          //waiting for a worker
+    queue_t *done;              //finished, waiting for db_async_process()
+    unsigned int pending;       //submitted but not yet handed to a callback
+    bool stop;
+    cond_t *cond;
+    int fds[2];                 //a byte is written to fds[1] when done goes from empty to not empty
+};
+
+struct db_pool_t {
+    char *host;
+    char *user;
+    char *password;
+    char *database;
+    unsigned int port;
+    unsigned int min;
+    unsigned int max;
+    unsigned int size;          //connections that are idle, checked out, or being opened
+    unsigned int ping_interval; //seconds a connection can sit idle before it's pinged on checkout
+    unsigned int idle_timeout;  //seconds a connection above the minimum can sit idle before it's closed
+    unsigned int timeout;       //milliseconds to wait for a connection on checkout, 0 waits forever
+    bool connected;             //db_pool_connect() succeeded
+    db_cache_t *cache;          //given to each connection the pool opens
+    const db_driver_t *driver;
+    void *driver_data;
+    alist_t *idle;
+    cond_t *cond;
+    char error[256];
+};
+
+#if defined(LIBSCOTT_MYSQL)
+
+/*****************************************************************************
+ * MySQL driver
+ ****************************************************************************/
+
+typedef struct {
+    MYSQL *mysql;
+    bool oom;                   //the last failure was ours rather than the client library's
+    const unsigned char *infile; //the data served to LOAD DATA LOCAL INFILE while a batch is being loaded
+    size_t infile_len;
+    size_t infile_pos;
+} db_mysql_t;
+
+typedef struct {
+    MYSQL_RES *res;
+    unsigned int num_fields;
+    db_field_t fields[];
+} db_mysql_result_t;
+
+//LOAD DATA LOCAL INFILE handlers. they only ever serve the rows of a batch being loaded, never a file on disk, so a
+//server can't use LOAD DATA LOCAL to read files from this machine
+static int
+db_mysql_infile_init(void **ptr, const char *filename, void *user_data) {
+    db_mysql_t *conn;
+
+    conn = user_data;
+    *ptr = conn;
+
+    if (conn->infile == NULL || strcmp(filename, DB_INFILE_NAME) != 0) {
+        return 1;
+    }
+
+    conn->infile_pos = 0;
+
+    return 0;
+}
+
+static int
+db_mysql_infile_read(void *ptr, char *buf, unsigned int len) {
+    db_mysql_t *conn;
+    size_t left;
+
+    conn = ptr;
+    left = conn->infile_len - conn->infile_pos;
+    if (left < len) {
+        len = (unsigned int)left;
+    }
+
+    memcpy(buf, conn->infile + conn->infile_pos, len);
+    conn->infile_pos += len;
+
+    return (int)len;
+}
+
+static void
+db_mysql_infile_end(void *ptr) {
+}
+
+static int
+db_mysql_infile_error(void *ptr, char *msg, unsigned int len) {
+    snprintf(msg, len, "%s", "LOAD DATA LOCAL INFILE is only allowed for a db_batch_t");
+
+    return CR_UNKNOWN_ERROR;
+}
+
+static void *
+db_mysql_connect(void *driver_data, const char *host, const char *user, const char *password, const char *database, unsigned int port, char *error, size_t error_size) {
+    unsigned int local_infile = 1;
+    db_mysql_t *conn;
+
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        snprintf(error, error_size, "%s", "Out of memory");
+        return NULL;
+    }
+
+    conn->mysql = mysql_init(NULL);
+    if (conn->mysql == NULL) {
+        snprintf(error, error_size, "%s", "Out of memory");
+        free(conn);
+        return NULL;
+    }
+
+    mysql_options(conn->mysql, MYSQL_OPT_LOCAL_INFILE, &local_infile);
+    mysql_set_local_infile_handler(conn->mysql, db_mysql_infile_init, db_mysql_infile_read, db_mysql_infile_end, db_mysql_infile_error, conn);
+
+    if (mysql_real_connect(conn->mysql, host, user, password, database, port, NULL, 0) == NULL) {
+        snprintf(error, error_size, "%s", mysql_error(conn->mysql));
+        mysql_close(conn->mysql);
+        free(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+static void
+db_mysql_close(void *ptr) {
+    db_mysql_t *conn;
+
+    conn = ptr;
+    mysql_close(conn->mysql);
+    free(conn);
+}
+
+static bool
+db_mysql_ping(void *ptr) {
+    db_mysql_t *conn;
+
+    conn = ptr;
+    conn->oom = false;
+
+    return mysql_ping(conn->mysql) == 0;
+}
+
+static bool
+db_mysql_query(void *ptr, const char *query, unsigned long len) {
+    db_mysql_t *conn;
+
+    conn = ptr;
+    conn->oom = false;
+
+    return mysql_real_query(conn->mysql, query, len) == 0;
+}
+
+static bool
+db_mysql_load(void *ptr, const char *query, unsigned long len, const void *data, size_t data_len) {
+    db_mysql_t *conn;
+    bool success;
+
+    conn = ptr;
+    conn->oom = false;
+    conn->infile = data;
+    conn->infile_len = data_len;
+
+    success = mysql_real_query(conn->mysql, query, len) == 0;
+
+    conn->infile = NULL;
+
+    return success;
+}
+
+static int
+db_mysql_type(const MYSQL_FIELD *field) {
+    switch (field->type) {
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONGLONG:
+        case MYSQL_TYPE_YEAR:
+            return DB_TYPE_INTEGER;
+        case MYSQL_TYPE_BIT:
+            //sent as raw big-endian bytes rather than digits, so db_result_int64() can't parse it
+            return DB_TYPE_BLOB;
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+            return DB_TYPE_FLOAT;
+        case MYSQL_TYPE_DECIMAL:
+        case MYSQL_TYPE_NEWDECIMAL:
+            return DB_TYPE_DECIMAL;
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_NEWDATE:
+        case MYSQL_TYPE_TIME:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP:
+            return DB_TYPE_TEMPORAL;
+        case MYSQL_TYPE_TINY_BLOB:
+        case MYSQL_TYPE_MEDIUM_BLOB:
+        case MYSQL_TYPE_LONG_BLOB:
+        case MYSQL_TYPE_BLOB:
+        case MYSQL_TYPE_GEOMETRY:
+            //TEXT columns are reported as blobs too, they're only told apart by the binary charset
+            return field->charsetnr == DB_CHARSET_BINARY ? DB_TYPE_BLOB : DB_TYPE_STRING;
+        case MYSQL_TYPE_NULL:
+            return DB_TYPE_NULL;
+        default:
+            return DB_TYPE_STRING;
+    }
+}
+
+static void *
+db_mysql_result(void *ptr, bool stream) {
+    db_mysql_result_t *result;
+    MYSQL_FIELD *fields;
+    unsigned int i, num_fields;
+    db_mysql_t *conn;
+    MYSQL_RES *res;
+
+    conn = ptr;
+
+    res = stream ? mysql_use_result(conn->mysql) : mysql_store_result(conn->mysql);
+    if (res == NULL) {
+        return NULL;
+    }
+
+    num_fields = mysql_num_fields(res);
+
+    result = malloc(sizeof(*result) + (num_fields * sizeof(db_field_t)));
+    if (result == NULL) {
+        mysql_free_result(res);
+        conn->oom = true;
+        return NULL;
+    }
+
+    result->res = res;
+    result->num_fields = num_fields;
+
+    fields = mysql_fetch_fields(res);
+    for (i = 0; i < num_fields; i++) {
+        result->fields[i].name = fields[i].name;
+        result->fields[i].type = db_mysql_type(&fields[i]);
+    }
+
+    return result;
+}
+
+static void
+db_mysql_result_free(void *ptr) {
+    db_mysql_result_t *result;
+
+    result = ptr;
+    mysql_free_result(result->res);
+    free(result);
+}
+
+static unsigned int
+db_mysql_num_fields(void *ptr) {
+    return ((db_mysql_result_t *)ptr)->num_fields;
+}
+
+static const db_field_t *
+db_mysql_fields(void *ptr) {
+    return ((db_mysql_result_t *)ptr)->fields;
+}
+
+static char **
+db_mysql_fetch(void *ptr, unsigned long **lengths) {
+    db_mysql_result_t *result;
     MYSQL_ROW row;
+
+    result = ptr;
+
+    row = mysql_fetch_row(result->res);
+    if (row != NULL) {
+        *lengths = mysql_fetch_lengths(result->res);
+    }
+
+    return row;
+}
+
+static unsigned long long
+db_mysql_num_rows(void *ptr) {
+    return mysql_num_rows(((db_mysql_result_t *)ptr)->res);
+}
+
+static void
+db_mysql_seek(void *ptr, unsigned long long row) {
+    mysql_data_seek(((db_mysql_result_t *)ptr)->res, row);
+}
+
+static unsigned long
+db_mysql_escape(void *ptr, char *dst, const char *src, unsigned long len) {
+    return mysql_real_escape_string(((db_mysql_t *)ptr)->mysql, dst, src, len);
+}
+
+static const char *
+db_mysql_error(void *ptr) {
+    db_mysql_t *conn;
+
+    conn = ptr;
+
+    return conn->oom ? "Out of memory" : mysql_error(conn->mysql);
+}
+
+static unsigned int
+db_mysql_error_code(void *ptr) {
+    db_mysql_t *conn;
+
+    conn = ptr;
+
+    return conn->oom ? CR_OUT_OF_MEMORY : mysql_errno(conn->mysql);
+}
+
+static bool
+db_mysql_error_is_connection(unsigned int code) {
+    return code == CR_SERVER_GONE_ERROR || code == CR_SERVER_LOST;
+}
+
+static const db_driver_t db_mysql_driver = {
+    "mysql",
+    db_mysql_connect,
+    db_mysql_close,
+    db_mysql_ping,
+    db_mysql_query,
+    db_mysql_load,
+    db_mysql_result,
+    db_mysql_result_free,
+    db_mysql_num_fields,
+    db_mysql_fields,
+    db_mysql_fetch,
+    db_mysql_num_rows,
+    db_mysql_seek,
+    db_mysql_escape,
+    db_mysql_error,
+    db_mysql_error_code,
+    db_mysql_error_is_connection
 };
 
+//the client library handle under a connection, for the parts that only work with MySQL
+static MYSQL *
+db_mysql_handle(db_t *db) {
+    return ((db_mysql_t *)db->conn)->mysql;
+}
+
+#endif
+
+const db_driver_t *
+db_driver_mysql() {
+#if defined(LIBSCOTT_MYSQL)
+    return &db_mysql_driver;
+#else
+    return NULL;
+#endif
+}
+
+/*****************************************************************************
+ * db
+ ****************************************************************************/
+
+//must be called with the write lock held
+static void
+db_set_error(db_t *db) {
+    snprintf(db->error, sizeof(db->error), "%s", db->driver->error(db->conn));
+    db->error_code = db->driver->error_code(db->conn);
+}
+
+//true if the last failure means the connection needs to be reopened
+static bool
+db_error_is_connection(db_t *db) {
+    return db->conn == NULL || (db->error_code != 0 && db->driver->error_is_connection(db->error_code));
+}
+
+static void
+db_free_params(db_t *db) {
+    free(db->host);
+    free(db->user);
+    free(db->password);
+    free(db->database);
+
+    db->host = NULL;
+    db->user = NULL;
+    db->password = NULL;
+    db->database = NULL;
+}
+
+//must be called with the write lock held
+static bool
+db_connected(db_t *db) {
+    if (db->conn == NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "Not connected");
+        return false;
+    }
+
+    return true;
+}
+
+//must be called with the write lock held
+static bool
+db_available(db_t *db) {
+    if (!db_connected(db)) {
+        return false;
+    }
+
+    if (db->stream != NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "Connection is busy with a streaming result that hasn't been freed");
+        return false;
+    }
+
+    return true;
+}
+
+//the rest of a streaming result can't be read once its connection is closed, so release it now and let the
+//caller find out on their next db_result_next(). must be called with the write lock held
+static void
+db_stream_abort(db_t *db) {
+    if (db->stream == NULL) {
+        return;
+    }
+
+    db->driver->result_free(db->stream->result);
+    db->stream->result = NULL;
+    db->stream->failed = true;
+    db->stream->db = NULL;
+    db->stream = NULL;
+}
+
+//buffered results can outlive their connection, so they stop counting for it when it's freed. must be called with the
+//write lock held
+static void
+db_result_unmeasure(db_t *db) {
+    db_result_t *result;
+
+    for (result = db->measured; result != NULL; result = result->next) {
+        result->measured = NULL;
+    }
+
+    db->measured = NULL;
+}
+
+#if defined(LIBSCOTT_MYSQL)
+static void
+db_stmt_set_error(db_stmt_t *stmt) {
+    snprintf(stmt->db->error, sizeof(stmt->db->error), "%s", mysql_stmt_error(stmt->stmt));
+    stmt->db->error_code = mysql_stmt_errno(stmt->stmt);
+}
+
+static void
+db_stmt_free(db_stmt_t *stmt) {
+    unsigned int i;
+
+    if (stmt->stmt != NULL) {
+        mysql_stmt_close(stmt->stmt);
+    }
+
+    if (stmt->column_values != NULL) {
+        for (i = 0; i < stmt->num_columns; i++) {
+            free(stmt->column_values[i].data);
+        }
+    }
+
+    free(stmt->query);
+    free(stmt->params);
+    free(stmt->param_values);
+    free(stmt->columns);
+    free(stmt->column_values);
+    free(stmt);
+}
+#endif
+
+//statements belong to the MYSQL handle they were prepared on, so they must be thrown away whenever that handle is
+//closed. must be called with the write lock held
+static void
+db_stmt_cache_clear(db_t *db) {
+#if defined(LIBSCOTT_MYSQL)
+    hash_free_func(db->stmts, (void (*)(void *))db_stmt_free);
+#endif
+    db->stmts = NULL;
+}
+
 db_t *
 db_init() {
+    return db_init_driver(db_driver_mysql(), NULL);
+}
+
+db_t *
+db_init_driver(const db_driver_t *driver, void *driver_data) {
     db_t *db;
 
     db = calloc(1, sizeof(*db));
@@ -26,6 +694,9 @@ db_init() {
         return NULL;
     }
 
+    db->driver = driver;
+    db->driver_data = driver_data;
+
     db->lock = lock_init();
     if (db->lock == NULL) {
         free(db);
@@ -42,12 +713,16 @@ db_free(db_t *db) {
     }
 
     lock_write_lock(db->lock);
-    if (db->mysql != NULL) {
-        mysql_close(db->mysql);
+    db_stream_abort(db);
+    db_stmt_cache_clear(db);
+    db_result_unmeasure(db);
+    if (db->conn != NULL) {
+        db->driver->close(db->conn);
     }
     lock_write_unlock(db->lock);
 
     lock_free(db->lock);
+    db_free_params(db);
 
     free(db);
 }
@@ -57,28 +732,51 @@ db_error(db_t *db) {
     return db->error;
 }
 
+//must be called with the write lock held
+static bool
+db_connect_locked(db_t *db) {
+    db_stream_abort(db);
+    db_stmt_cache_clear(db);
+
+    if (db->conn != NULL) {
+        db->driver->close(db->conn);
+        db->conn = NULL;
+    }
+
+    db->error_code = 0;
+
+    if (db->driver == NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "libscott was built without MySQL");
+        return false;
+    }
+
+    db->conn = db->driver->connect(db->driver_data, db->host, db->user, db->password, db->database, db->port, db->error, sizeof(db->error));
+
+    return db->conn != NULL;
+}
+
 bool
 db_connect(db_t *db, const char *host, const char *user, const char *password, const char *database, unsigned int port) {
     bool success = true;
 
     lock_write_lock(db->lock);
 
-    if (db->mysql != NULL) {
-        mysql_close(db->mysql);
-    }
+    //keep a copy of the connection parameters so we can reconnect later
+    db_free_params(db);
+    db->host = host == NULL ? NULL : strdup(host);
+    db->user = user == NULL ? NULL : strdup(user);
+    db->password = password == NULL ? NULL : strdup(password);
+    db->database = database == NULL ? NULL : strdup(database);
+    db->port = port;
 
-    db->mysql = mysql_init(NULL);
-    if (db->mysql == NULL) {
+    if ((host != NULL && db->host == NULL) || (user != NULL && db->user == NULL) ||
+        (password != NULL && db->password == NULL) || (database != NULL && db->database == NULL)) {
         snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
         success = false;
     }
 
     if (success) {
-        if (mysql_real_connect(db->mysql, host, user, password, database, port, NULL, 0) == NULL) {
-            snprintf(db->error, sizeof(db->error), "%s", mysql_error(db->mysql));
-            db_disconnect(db);
-            success = false;
-        }
+        success = db_connect_locked(db);
     }
 
     lock_write_unlock(db->lock);
@@ -86,80 +784,370 @@ db_connect(db_t *db, const char *host, const char *user, const char *password, c
     return success;
 }
 
+bool
+db_reconnect(db_t *db) {
+    bool success;
+
+    lock_write_lock(db->lock);
+    success = db_connect_locked(db);
+    lock_write_unlock(db->lock);
+
+    return success;
+}
+
 void
 db_disconnect(db_t *db) {
     lock_write_lock(db->lock);
 
-    if (db->mysql != NULL) {
-        mysql_close(db->mysql);
-        db->mysql = NULL;
+    db_stream_abort(db);
+    db_stmt_cache_clear(db);
+
+    if (db->conn != NULL) {
+        db->driver->close(db->conn);
+        db->conn = NULL;
     }
 
     lock_write_unlock(db->lock);
 }
 
 bool
-db_query(db_t *db, const char *query, unsigned int len) {
-    int ret;
+db_ping(db_t *db) {
+    bool success;
 
     lock_write_lock(db->lock);
-    ret = mysql_real_query(db->mysql, query, (unsigned long)len);
-    if (ret == -1) {
-        snprintf(db->error, sizeof(db->error), "%s", mysql_error(db->mysql));
+    success = db_available(db);
+    if (success) {
+        success = db->driver->ping(db->conn);
+        if (success) {
+            db->error_code = 0;
+        }
+        else {
+            db_set_error(db);
+        }
     }
     lock_write_unlock(db->lock);
 
-    return ret == 0;
-
+    return success;
 }
 
-bool
-db_queryf(db_t *db, const char *fmt, ...) {
-    bool success;
-    char *query;
-    va_list ap;
-    int len;
+static uint64_t
+db_now_ns() {
+    struct timespec ts;
 
-    va_start(ap, fmt);
-    len = vasprintf(&query, fmt, ap);
-    va_end(ap);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    if (len == -1) {
-        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
-        return false;
-    }
+    return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
 
-    success = db_query(db, query, (unsigned int)len);
-    free(query);
+//adds the time since the last lap to a timing
+static void
+db_lap(uint64_t *mark, uint64_t *timing) {
+    uint64_t now;
 
-    return success;
+    now = db_now_ns();
+    *timing += now - *mark;
+    *mark = now;
 }
 
-db_result_t *
-db_select(db_t *db, const char *query, unsigned int len) {
-    db_result_t *result;
-    int ret;
+//true if queries on this connection need to be timed. must be called with the write lock held
+static bool
+db_timed(db_t *db) {
+    return db->metrics_enabled || db->slow_cb != NULL;
+}
 
-    result = calloc(1, sizeof(*result));
-    if (result == NULL) {
-        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
-        return NULL;
-    }
+//adds a finished query to the connection's metrics and returns the slow query hook if it should be called. must be
+//called with the write lock held
+static db_slow_query_cb_t
+db_record(db_t *db, db_timings_t *timings, bool select, bool success, void **user_data) {
+    uint64_t us;
+    unsigned int bucket = 0;
 
-    lock_write_lock(db->lock);
-    ret = mysql_real_query(db->mysql, query, (unsigned long)len);
-    if (ret == -1) {
-        snprintf(db->error, sizeof(db->error), "%s", mysql_error(db->mysql));
-    }
-    else {
-        result->result = mysql_store_result(db->mysql);
-        if (result->result == NULL) {
-            snprintf(db->error, sizeof(db->error), "%s", mysql_error(db->mysql));
+    timings->total_ns = timings->lock_wait_ns + timings->exec_ns + timings->fetch_ns;
+
+    if (db->metrics_enabled) {
+        if (select) {
+            ++db->metrics.selects;
+        }
+        else {
+            ++db->metrics.queries;
         }
-    }
-    lock_write_unlock(db->lock);
 
-    if (result->result == NULL) {
+        if (!success) {
+            ++db->metrics.errors;
+        }
+
+        db->metrics.lock_wait_ns += timings->lock_wait_ns;
+        db->metrics.exec_ns += timings->exec_ns;
+        db->metrics.fetch_ns += timings->fetch_ns;
+        db->metrics.rows += timings->rows;
+        db->metrics.bytes += timings->bytes;
+
+        //bucket i holds [2^i, 2^(i+1)) microseconds
+        for (us = timings->total_ns / 1000; us > 1 && bucket < DB_METRICS_BUCKETS - 1; us >>= 1) {
+            ++bucket;
+        }
+        ++db->metrics.histogram[bucket];
+    }
+
+    if (db->slow_cb == NULL || timings->total_ns < (uint64_t)db->slow_ms * 1000000) {
+        return NULL;
+    }
+
+    *user_data = db->slow_user_data;
+    return db->slow_cb;
+}
+
+bool
+db_query(db_t *db, const char *query, unsigned int len) {
+    db_slow_query_cb_t slow_cb = NULL;
+    void *slow_user_data = NULL;
+    db_timings_t timings;
+    bool success, timed;
+    uint64_t mark;
+
+    memset(&timings, 0, sizeof(timings));
+    mark = db_now_ns();
+
+    lock_write_lock(db->lock);
+    timed = db_timed(db);
+    if (timed) {
+        db_lap(&mark, &timings.lock_wait_ns);
+    }
+
+    success = db_available(db);
+    if (success) {
+        success = db->driver->query(db->conn, query, (unsigned long)len);
+        if (timed) {
+            db_lap(&mark, &timings.exec_ns);
+        }
+        if (!success) {
+            db_set_error(db);
+        }
+    }
+
+    if (timed) {
+        slow_cb = db_record(db, &timings, false, success, &slow_user_data);
+    }
+    lock_write_unlock(db->lock);
+
+    //outside the lock so the hook can use the connection
+    if (slow_cb != NULL) {
+        slow_cb(db, query, len, &timings, slow_user_data);
+    }
+
+    return success;
+}
+
+static pthread_key_t db_thread_key;
+static pthread_once_t db_thread_once = PTHREAD_ONCE_INIT;
+
+static void
+db_thread_free(void *user_data) {
+    db_thread_t *thread;
+
+    thread = user_data;
+    buffer_free(thread->sql.buffer);
+    buffer_free(thread->fmt);
+    buffer_free(thread->key);
+    free(thread);
+}
+
+static void
+db_thread_key_create() {
+    pthread_key_create(&db_thread_key, db_thread_free);
+}
+
+//gets the calling thread's query buffers, creating them the first time. they're freed when the thread exits
+static db_thread_t *
+db_thread_get() {
+    db_thread_t *thread;
+
+    pthread_once(&db_thread_once, db_thread_key_create);
+
+    thread = pthread_getspecific(db_thread_key);
+    if (thread != NULL) {
+        return thread;
+    }
+
+    thread = calloc(1, sizeof(*thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+
+    thread->sql.buffer = buffer_init_ex(DB_SQL_CAPACITY);
+    thread->fmt = buffer_init_ex(DB_SQL_CAPACITY);
+    thread->key = buffer_init_ex(DB_SQL_CAPACITY);
+    if (thread->sql.buffer == NULL || thread->fmt == NULL || thread->key == NULL || pthread_setspecific(db_thread_key, thread) != 0) {
+        db_thread_free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+//empties a query buffer for the next query, giving back the memory if one unusually large query grew it
+static void
+db_thread_reset(buffer_t *buffer) {
+    if (buffer_length(buffer) > DB_SQL_KEEP_BYTES) {
+        buffer_set_free_memory(buffer, true);
+        buffer_clear(buffer);
+        buffer_set_free_memory(buffer, false);
+    }
+    else {
+        buffer_clear(buffer);
+    }
+}
+
+//formats straight into the thread's reusable buffer instead of allocating a new string for every query
+static const char *
+db_vformat(db_t *db, unsigned int *len, const char *fmt, va_list ap) {
+    db_thread_t *thread;
+    unsigned char *dst;
+    va_list copy;
+    size_t room;
+    int ret;
+
+    thread = db_thread_get();
+    if (thread == NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        return NULL;
+    }
+
+    db_thread_reset(thread->fmt);
+
+    room = DB_SQL_CAPACITY;
+    while (true) {
+        dst = buffer_reserve(thread->fmt, room);
+        if (dst == NULL) {
+            snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+            return NULL;
+        }
+
+        va_copy(copy, ap);
+        ret = vsnprintf((char *)dst, room, fmt, copy);
+        va_end(copy);
+
+        if (ret < 0) {
+            snprintf(db->error, sizeof(db->error), "%s", "Invalid query format");
+            return NULL;
+        }
+
+        if ((size_t)ret < room) {
+            break;
+        }
+
+        room = (size_t)ret + 1;
+    }
+
+    *len = (unsigned int)ret;
+    return (const char *)dst;
+}
+
+bool
+db_queryf(db_t *db, const char *fmt, ...) {
+    const char *query;
+    unsigned int len;
+    va_list ap;
+
+    va_start(ap, fmt);
+    query = db_vformat(db, &len, fmt, ap);
+    va_end(ap);
+
+    if (query == NULL) {
+        return false;
+    }
+
+    return db_query(db, query, len);
+}
+
+//starts counting the bytes of a buffered result as they're read, instead of walking the rows up front. must be called
+//with the write lock held
+static void
+db_result_measure(db_t *db, db_result_t *result) {
+    result->measured = db;
+    result->next = db->measured;
+    if (db->measured != NULL) {
+        db->measured->prev = result;
+    }
+    db->measured = result;
+}
+
+static db_result_t *
+db_select_ex(db_t *db, const char *query, unsigned int len, bool stream) {
+    db_slow_query_cb_t slow_cb = NULL;
+    void *slow_user_data = NULL;
+    db_timings_t timings;
+    db_result_t *result;
+    bool success, timed;
+    uint64_t mark;
+
+    result = calloc(1, sizeof(*result));
+    if (result == NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        return NULL;
+    }
+
+    result->driver = db->driver;
+
+    memset(&timings, 0, sizeof(timings));
+    mark = db_now_ns();
+
+    lock_write_lock(db->lock);
+    timed = db_timed(db);
+    if (timed) {
+        db_lap(&mark, &timings.lock_wait_ns);
+    }
+
+    if (db_available(db)) {
+        success = db->driver->query(db->conn, query, (unsigned long)len);
+        if (timed) {
+            db_lap(&mark, &timings.exec_ns);
+        }
+
+        if (!success) {
+            db_set_error(db);
+        }
+        else {
+            result->result = db->driver->result(db->conn, stream);
+            if (timed) {
+                db_lap(&mark, &timings.fetch_ns);
+            }
+
+            if (result->result == NULL) {
+                db_set_error(db);
+                if (db->error_code == 0) {
+                    snprintf(db->error, sizeof(db->error), "%s", "Query didn't return a result set");
+                }
+            }
+            else {
+                result->fields = db->driver->fields(result->result);
+                result->num_fields = db->driver->num_fields(result->result);
+
+                if (stream) {
+                    //the rows are still on the wire, so nothing else can use the connection until they've been read
+                    result->db = db;
+                    db->stream = result;
+                }
+                else if (timed) {
+                    timings.rows = db->driver->num_rows(result->result);
+                    if (db->metrics_enabled) {
+                        db_result_measure(db, result);
+                    }
+                }
+            }
+        }
+    }
+
+    if (timed) {
+        slow_cb = db_record(db, &timings, true, result->result != NULL, &slow_user_data);
+    }
+    lock_write_unlock(db->lock);
+
+    if (slow_cb != NULL) {
+        slow_cb(db, query, len, &timings, slow_user_data);
+    }
+
+    if (result->result == NULL) {
         db_result_free(result);
         return NULL;
     }
@@ -167,26 +1155,31 @@ db_select(db_t *db, const char *query, unsigned int len) {
     return result;
 }
 
+db_result_t *
+db_select(db_t *db, const char *query, unsigned int len) {
+    return db_select_ex(db, query, len, false);
+}
+
+db_result_t *
+db_select_stream(db_t *db, const char *query, unsigned int len) {
+    return db_select_ex(db, query, len, true);
+}
+
 db_result_t *
 db_selectf(db_t *db, const char *fmt, ...) {
-    db_result_t *result;
-    char *query;
+    const char *query;
+    unsigned int len;
     va_list ap;
-    int len;
 
     va_start(ap, fmt);
-    len = vasprintf(&query, fmt, ap);
+    query = db_vformat(db, &len, fmt, ap);
     va_end(ap);
 
-    if (len == -1) {
-        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+    if (query == NULL) {
         return NULL;
     }
 
-    result = db_select(db, query, (unsigned int)len);
-    free(query);
-
-    return result;
+    return db_select(db, query, len);
 }
 
 char *
@@ -195,33 +1188,2648 @@ db_escape(db_t *db, const char *str) {
     char *esc;
 
     len = strlen(str);
-    esc = malloc(strlen(str) * 2 + 1);
+    esc = malloc((len * 2) + 1);
     if (esc != NULL) {
         lock_write_lock(db->lock);
-        mysql_real_escape_string(db->mysql, esc, str, len);
+        if (db_connected(db)) {
+            db->driver->escape(db->conn, esc, str, len);
+        }
+        else {
+            free(esc);
+            esc = NULL;
+        }
         lock_write_unlock(db->lock);
     }
 
     return esc;
 }
 
+//escapes a string for use inside a quoted SQL literal straight into a buffer. must be called with the write lock held
+static bool
+db_escape_append(db_t *db, buffer_t *buffer, const char *str, size_t len) {
+    unsigned char *dst;
+    unsigned long written;
+
+    dst = buffer_reserve(buffer, (len * 2) + 1);
+    if (dst == NULL) {
+        return false;
+    }
+
+    written = db->driver->escape(db->conn, (char *)dst, str, (unsigned long)len);
+    buffer_commit(buffer, written);
+
+    return true;
+}
+
+bool
+db_escape_into(db_t *db, buffer_t *buffer, const char *str, size_t len) {
+    bool success;
+
+    //escaping only needs the connection's character set, so it's fine while a stream is open
+    lock_write_lock(db->lock);
+    success = db_connected(db);
+    if (success) {
+        success = db_escape_append(db, buffer, str, len);
+        if (!success) {
+            snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        }
+    }
+    lock_write_unlock(db->lock);
+
+    return success;
+}
+
+//writes bytes as a hex literal, which needs no escaping and is safe for any data
+static bool
+db_write_hex(buffer_t *buffer, const void *data, size_t len) {
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *bytes;
+    unsigned char *dst;
+    size_t i;
+
+    dst = buffer_reserve(buffer, (len * 2) + 3);
+    if (dst == NULL) {
+        return false;
+    }
+
+    bytes = data;
+    *dst++ = 'X';
+    *dst++ = '\'';
+    for (i = 0; i < len; i++) {
+        *dst++ = hex[bytes[i] >> 4];
+        *dst++ = hex[bytes[i] & 0x0F];
+    }
+    *dst = '\'';
+
+    buffer_commit(buffer, (len * 2) + 3);
+
+    return true;
+}
+
+//must be called with the cache's lock held
+static void
+db_cache_remove(db_cache_t *cache, db_cache_entry_t *entry) {
+    hash_delete(cache->entries, entry->key);
+
+    if (entry->prev == NULL) {
+        cache->head = entry->next;
+    }
+    else {
+        entry->prev->next = entry->next;
+    }
+
+    if (entry->next == NULL) {
+        cache->tail = entry->prev;
+    }
+    else {
+        entry->next->prev = entry->prev;
+    }
+
+    entry->prev = NULL;
+    entry->next = NULL;
+    entry->removed = true;
+    cache->size -= entry->size;
+
+    //results still reading from it free it when they're done
+    if (entry->refs == 0) {
+        free(entry);
+    }
+}
+
+static void
+db_cache_release(db_cache_entry_t *entry) {
+    db_cache_t *cache;
+
+    cache = entry->cache;
+
+    lock_write_lock(cache->lock);
+    if (--entry->refs == 0 && entry->removed) {
+        free(entry);
+    }
+    lock_write_unlock(cache->lock);
+}
+
 void
 db_result_free(db_result_t *result) {
-    if (result->result != NULL) {
-        mysql_free_result(result->result);
+    db_t *db;
+
+    db = result->db;
+    if (db != NULL) {
+        //freeing a streaming result reads and throws away any rows that are left, then gives the connection back
+        lock_write_lock(db->lock);
+        if (result->result != NULL) {
+            result->driver->result_free(result->result);
+        }
+        db->stream = NULL;
+        lock_write_unlock(db->lock);
+    }
+    else if (result->result != NULL) {
+        result->driver->result_free(result->result);
+    }
+
+    db = result->measured;
+    if (db != NULL) {
+        lock_write_lock(db->lock);
+        if (db->metrics_enabled) {
+            db->metrics.bytes += result->bytes;
+        }
+        if (result->prev != NULL) {
+            result->prev->next = result->next;
+        }
+        else {
+            db->measured = result->next;
+        }
+        if (result->next != NULL) {
+            result->next->prev = result->prev;
+        }
+        lock_write_unlock(db->lock);
+    }
+
+    if (result->cached != NULL) {
+        db_cache_release(result->cached);
     }
 
+    hash_free(result->names);
     free(result);
 }
 
+//reads a streaming result's next row off the wire while it holds the connection
+static bool
+db_result_next_stream(db_result_t *result) {
+    unsigned int i;
+    db_t *db;
+
+    db = result->db;
+    lock_write_lock(db->lock);
+    result->row = db->driver->fetch(result->result, &result->lengths);
+    if (result->row == NULL && db->driver->error_code(db->conn) != 0) {
+        db_set_error(db);
+        result->failed = true;
+    }
+    else if (result->row != NULL && db->metrics_enabled) {
+        //a streaming result's rows are only known as they're read
+        ++db->metrics.rows;
+        for (i = 0; i < result->num_fields; i++) {
+            db->metrics.bytes += result->lengths[i];
+        }
+    }
+    lock_write_unlock(db->lock);
+
+    return result->row != NULL;
+}
+
 bool
 db_result_next(db_result_t *result) {
-    result->row = mysql_fetch_row(result->result);
+    unsigned int i;
+
+    result->lengths = NULL;
+
+    if (result->cached != NULL) {
+        if (result->pos >= result->cached->num_rows) {
+            result->row = NULL;
+            return false;
+        }
+
+        result->row = result->cached->cells + (result->pos * result->num_fields);
+        result->lengths = result->cached->lengths + (result->pos * result->num_fields);
+        ++result->pos;
+    }
+    else if (result->db == NULL) {
+        //a buffered result, or a streaming result whose connection was closed out from under it
+        result->row = result->result == NULL ? NULL : result->driver->fetch(result->result, &result->lengths);
+    }
+    else {
+        return db_result_next_stream(result);
+    }
+
+    //kept on the result so reading a buffered result doesn't take the connection's lock
+    if (result->row != NULL && result->measured != NULL) {
+        for (i = 0; i < result->num_fields; i++) {
+            result->bytes += result->lengths[i];
+        }
+    }
 
     return result->row != NULL;
 }
 
+bool
+db_result_failed(db_result_t *result) {
+    return result->failed;
+}
+
 const char *
 db_result_str(db_result_t *result, unsigned int index) {
     return result->row[index];
 }
+
+unsigned int
+db_result_columns(db_result_t *result) {
+    return result->num_fields;
+}
+
+const char *
+db_result_column_name(db_result_t *result, unsigned int index) {
+    return result->fields[index].name;
+}
+
+int
+db_result_column_type(db_result_t *result, unsigned int index) {
+    return result->fields[index].type;
+}
+
+int
+db_result_index(db_result_t *result, const char *name) {
+    unsigned int i;
+    void *index;
+
+    if (result->names == NULL) {
+        result->names = hash_init_ex(result->num_fields * 2 + 1);
+        if (result->names == NULL) {
+            return -1;
+        }
+
+        //store index + 1 so the first column isn't mistaken for a missing key. if a name is used more than once the
+        //first column wins, like it does for hash_get()
+        for (i = 0; i < result->num_fields; i++) {
+            if (!hash_contains(result->names, result->fields[i].name)) {
+                hash_set(result->names, result->fields[i].name, (void *)(uintptr_t)(i + 1));
+            }
+        }
+    }
+
+    index = hash_get(result->names, name);
+
+    return index == NULL ? -1 : (int)((uintptr_t)index - 1);
+}
+
+bool
+db_result_is_null(db_result_t *result, unsigned int index) {
+    return result->row[index] == NULL;
+}
+
+unsigned long
+db_result_len(db_result_t *result, unsigned int index) {
+    return result->lengths[index];
+}
+
+//integers come back from the text protocol as plain decimal digits with an optional sign, so skip the locale and
+//error handling that strtoll() does
+static int64_t
+db_parse_int64(const char *str, unsigned long len) {
+    unsigned long i = 0;
+    bool negative = false;
+    uint64_t value = 0;
+    unsigned int digit;
+
+    if (len > 0 && (str[0] == '-' || str[0] == '+')) {
+        negative = str[0] == '-';
+        i = 1;
+    }
+
+    for (; i < len; i++) {
+        digit = (unsigned int)(str[i] - '0');
+        if (digit > 9) {
+            break;
+        }
+
+        value = (value * 10) + digit;
+    }
+
+    return negative ? (int64_t)(0 - value) : (int64_t)value;
+}
+
+int64_t
+db_result_int64(db_result_t *result, unsigned int index) {
+    const char *str;
+
+    str = result->row[index];
+    if (str == NULL) {
+        return 0;
+    }
+
+    switch (db_result_column_type(result, index)) {
+        case DB_TYPE_FLOAT:
+        case DB_TYPE_DECIMAL:
+            return (int64_t)strtod(str, NULL);
+        default:
+            return db_parse_int64(str, db_result_len(result, index));
+    }
+}
+
+double
+db_result_double(db_result_t *result, unsigned int index) {
+    const char *str;
+
+    str = result->row[index];
+    if (str == NULL) {
+        return 0.0;
+    }
+
+    if (db_result_column_type(result, index) == DB_TYPE_INTEGER) {
+        return (double)db_parse_int64(str, db_result_len(result, index));
+    }
+
+    return strtod(str, NULL);
+}
+
+const void *
+db_result_blob(db_result_t *result, unsigned int index, unsigned long *len) {
+    *len = result->row[index] == NULL ? 0 : db_result_len(result, index);
+
+    return result->row[index];
+}
+
+/*****************************************************************************
+ * db_metrics
+ ****************************************************************************/
+
+void
+db_set_metrics(db_t *db, bool enabled) {
+    lock_write_lock(db->lock);
+    db->metrics_enabled = enabled;
+    lock_write_unlock(db->lock);
+}
+
+void
+db_set_slow_query(db_t *db, unsigned int threshold_ms, db_slow_query_cb_t cb, void *user_data) {
+    lock_write_lock(db->lock);
+    db->slow_ms = threshold_ms;
+    db->slow_cb = cb;
+    db->slow_user_data = user_data;
+    lock_write_unlock(db->lock);
+}
+
+void
+db_metrics(db_t *db, db_metrics_t *metrics) {
+    lock_write_lock(db->lock);
+    memcpy(metrics, &db->metrics, sizeof(*metrics));
+    lock_write_unlock(db->lock);
+}
+
+void
+db_metrics_reset(db_t *db) {
+    lock_write_lock(db->lock);
+    memset(&db->metrics, 0, sizeof(db->metrics));
+    lock_write_unlock(db->lock);
+}
+
+/*****************************************************************************
+ * db_stmt
+ ****************************************************************************/
+
+#if defined(LIBSCOTT_MYSQL)
+
+static bool
+db_stmt_setup_params(db_stmt_t *stmt) {
+    unsigned int i;
+
+    stmt->num_params = (unsigned int)mysql_stmt_param_count(stmt->stmt);
+    if (stmt->num_params == 0) {
+        return true;
+    }
+
+    stmt->params = calloc(stmt->num_params, sizeof(*stmt->params));
+    stmt->param_values = calloc(stmt->num_params, sizeof(*stmt->param_values));
+    if (stmt->params == NULL || stmt->param_values == NULL) {
+        return false;
+    }
+
+    //anything the caller doesn't bind is sent as NULL
+    for (i = 0; i < stmt->num_params; i++) {
+        stmt->params[i].buffer_type = MYSQL_TYPE_NULL;
+    }
+
+    return true;
+}
+
+static void
+db_stmt_bind_column(db_stmt_t *stmt, unsigned int index) {
+    db_stmt_column_t *column;
+    MYSQL_BIND *bind;
+
+    column = &stmt->column_values[index];
+    bind = &stmt->columns[index];
+
+    bind->buffer_type = column->type;
+    bind->length = &column->length;
+    bind->is_null = &column->is_null;
+    bind->error = &column->error;
+
+    switch (column->type) {
+        case MYSQL_TYPE_LONGLONG:
+            bind->buffer = &column->i;
+            break;
+        case MYSQL_TYPE_DOUBLE:
+            bind->buffer = &column->d;
+            break;
+        default:
+            //leave room for the NUL terminator
+            bind->buffer = column->data;
+            bind->buffer_length = column->capacity - 1;
+            break;
+    }
+}
+
+static bool
+db_stmt_setup_columns(db_stmt_t *stmt) {
+    db_stmt_column_t *column;
+    MYSQL_FIELD *fields;
+    MYSQL_RES *meta;
+    unsigned int i;
+    bool success = true;
+
+    //statements that don't return rows don't have any metadata
+    meta = mysql_stmt_result_metadata(stmt->stmt);
+    if (meta == NULL) {
+        return true;
+    }
+
+    stmt->num_columns = mysql_num_fields(meta);
+    stmt->columns = calloc(stmt->num_columns, sizeof(*stmt->columns));
+    stmt->column_values = calloc(stmt->num_columns, sizeof(*stmt->column_values));
+    if (stmt->columns == NULL || stmt->column_values == NULL) {
+        success = false;
+    }
+
+    fields = mysql_fetch_fields(meta);
+    for (i = 0; success && i < stmt->num_columns; i++) {
+        column = &stmt->column_values[i];
+
+        switch (fields[i].type) {
+            case MYSQL_TYPE_TINY:
+            case MYSQL_TYPE_SHORT:
+            case MYSQL_TYPE_LONG:
+            case MYSQL_TYPE_INT24:
+            case MYSQL_TYPE_LONGLONG:
+            case MYSQL_TYPE_YEAR:
+                column->type = MYSQL_TYPE_LONGLONG;
+                stmt->columns[i].is_unsigned = (fields[i].flags & UNSIGNED_FLAG) != 0;
+                break;
+            case MYSQL_TYPE_FLOAT:
+            case MYSQL_TYPE_DOUBLE:
+                column->type = MYSQL_TYPE_DOUBLE;
+                break;
+            default:
+                column->type = MYSQL_TYPE_STRING;
+                column->capacity = DB_STMT_STR_CAPACITY;
+                column->data = malloc(column->capacity);
+                if (column->data == NULL) {
+                    success = false;
+                }
+                break;
+        }
+
+        if (success) {
+            db_stmt_bind_column(stmt, i);
+        }
+    }
+
+    mysql_free_result(meta);
+
+    if (success && mysql_stmt_bind_result(stmt->stmt, stmt->columns) != 0) {
+        db_stmt_set_error(stmt);
+        return false;
+    }
+
+    return success;
+}
+
+//must be called with the write lock held
+static db_stmt_t *
+db_stmt_new(db_t *db, const char *query) {
+    db_stmt_t *stmt;
+
+    stmt = calloc(1, sizeof(*stmt));
+    if (stmt == NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        return NULL;
+    }
+
+    stmt->db = db;
+    stmt->query = strdup(query);
+    stmt->query_len = (unsigned int)strlen(query);
+
+    stmt->stmt = stmt->query == NULL ? NULL : mysql_stmt_init(db_mysql_handle(db));
+    if (stmt->stmt == NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        db_stmt_free(stmt);
+        return NULL;
+    }
+
+    if (mysql_stmt_prepare(stmt->stmt, query, (unsigned long)strlen(query)) != 0) {
+        db_stmt_set_error(stmt);
+        db_stmt_free(stmt);
+        return NULL;
+    }
+
+    if (!db_stmt_setup_params(stmt)) {
+        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        db_stmt_free(stmt);
+        return NULL;
+    }
+
+    if (!db_stmt_setup_columns(stmt)) {
+        if (stmt->num_columns > 0 && (stmt->columns == NULL || stmt->column_values == NULL)) {
+            snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        }
+        db_stmt_free(stmt);
+        return NULL;
+    }
+
+    return stmt;
+}
+
+db_stmt_t *
+db_prepare(db_t *db, const char *query) {
+    db_stmt_t *stmt = NULL;
+
+    lock_write_lock(db->lock);
+
+    if (db->driver != &db_mysql_driver) {
+        snprintf(db->error, sizeof(db->error), "Prepared statements aren't supported by the %s driver", db->driver == NULL ? "missing" : db->driver->name);
+    }
+    else if (db_available(db)) {
+        if (db->stmts == NULL) {
+            db->stmts = hash_init_ex(DB_STMT_CACHE_CAPACITY);
+        }
+
+        if (db->stmts == NULL) {
+            snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        }
+        else {
+            stmt = hash_get(db->stmts, query);
+            if (stmt == NULL) {
+                stmt = db_stmt_new(db, query);
+                if (stmt != NULL && !hash_set(db->stmts, query, stmt)) {
+                    snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+                    db_stmt_free(stmt);
+                    stmt = NULL;
+                }
+            }
+        }
+    }
+
+    lock_write_unlock(db->lock);
+
+    return stmt;
+}
+
+static MYSQL_BIND *
+db_stmt_param(db_stmt_t *stmt, unsigned int index) {
+    MYSQL_BIND *bind;
+
+    if (index >= stmt->num_params) {
+        snprintf(stmt->db->error, sizeof(stmt->db->error), "Parameter %u is out of range, the statement has %u", index, stmt->num_params);
+        return NULL;
+    }
+
+    bind = &stmt->params[index];
+    memset(bind, 0, sizeof(*bind));
+
+    stmt->param_values[index].is_null = 0;
+    bind->is_null = &stmt->param_values[index].is_null;
+
+    return bind;
+}
+
+bool
+db_stmt_bind_null(db_stmt_t *stmt, unsigned int index) {
+    MYSQL_BIND *bind;
+
+    bind = db_stmt_param(stmt, index);
+    if (bind == NULL) {
+        return false;
+    }
+
+    bind->buffer_type = MYSQL_TYPE_NULL;
+    stmt->param_values[index].is_null = 1;
+
+    return true;
+}
+
+bool
+db_stmt_bind_int64(db_stmt_t *stmt, unsigned int index, int64_t value) {
+    MYSQL_BIND *bind;
+
+    bind = db_stmt_param(stmt, index);
+    if (bind == NULL) {
+        return false;
+    }
+
+    stmt->param_values[index].value.i = value;
+    bind->buffer_type = MYSQL_TYPE_LONGLONG;
+    bind->buffer = &stmt->param_values[index].value.i;
+
+    return true;
+}
+
+bool
+db_stmt_bind_double(db_stmt_t *stmt, unsigned int index, double value) {
+    MYSQL_BIND *bind;
+
+    bind = db_stmt_param(stmt, index);
+    if (bind == NULL) {
+        return false;
+    }
+
+    stmt->param_values[index].value.d = value;
+    bind->buffer_type = MYSQL_TYPE_DOUBLE;
+    bind->buffer = &stmt->param_values[index].value.d;
+
+    return true;
+}
+
+bool
+db_stmt_bind_blob(db_stmt_t *stmt, unsigned int index, const void *data, unsigned long len) {
+    MYSQL_BIND *bind;
+
+    bind = db_stmt_param(stmt, index);
+    if (bind == NULL) {
+        return false;
+    }
+
+    stmt->param_values[index].length = len;
+    bind->buffer_type = MYSQL_TYPE_BLOB;
+    bind->buffer = (void *)data;
+    bind->buffer_length = len;
+    bind->length = &stmt->param_values[index].length;
+
+    return true;
+}
+
+bool
+db_stmt_bind_str(db_stmt_t *stmt, unsigned int index, const char *str) {
+    MYSQL_BIND *bind;
+
+    if (str == NULL) {
+        return db_stmt_bind_null(stmt, index);
+    }
+
+    bind = db_stmt_param(stmt, index);
+    if (bind == NULL) {
+        return false;
+    }
+
+    stmt->param_values[index].length = (unsigned long)strlen(str);
+    bind->buffer_type = MYSQL_TYPE_STRING;
+    bind->buffer = (void *)str;
+    bind->buffer_length = stmt->param_values[index].length;
+    bind->length = &stmt->param_values[index].length;
+
+    return true;
+}
+
+bool
+db_stmt_execute(db_stmt_t *stmt) {
+    db_slow_query_cb_t slow_cb = NULL;
+    void *slow_user_data = NULL;
+    db_timings_t timings;
+    bool success = true, timed;
+    unsigned int query_len;
+    uint64_t mark;
+    char *query;
+    db_t *db;
+
+    db = stmt->db;
+
+    memset(&timings, 0, sizeof(timings));
+    mark = db_now_ns();
+
+    lock_write_lock(db->lock);
+    timed = db_timed(db);
+    if (timed) {
+        db_lap(&mark, &timings.lock_wait_ns);
+    }
+
+    if (stmt->has_result) {
+        mysql_stmt_free_result(stmt->stmt);
+        stmt->has_result = false;
+    }
+
+    if (!db_available(db)) {
+        success = false;
+    }
+
+    if (success && stmt->num_params > 0 && mysql_stmt_bind_param(stmt->stmt, stmt->params) != 0) {
+        db_stmt_set_error(stmt);
+        success = false;
+    }
+
+    if (success && mysql_stmt_execute(stmt->stmt) != 0) {
+        db_stmt_set_error(stmt);
+        success = false;
+    }
+
+    if (timed) {
+        db_lap(&mark, &timings.exec_ns);
+    }
+
+    //buffer the rows on the client like db_select() does so the connection is free again once we return
+    if (success && stmt->num_columns > 0) {
+        if (mysql_stmt_store_result(stmt->stmt) != 0) {
+            db_stmt_set_error(stmt);
+            success = false;
+        }
+        else {
+            stmt->has_result = true;
+        }
+
+        if (timed) {
+            db_lap(&mark, &timings.fetch_ns);
+            timings.rows = success ? mysql_stmt_num_rows(stmt->stmt) : 0;
+        }
+    }
+
+    //counted like db_query() or db_select(), depending on whether it returns rows
+    if (timed) {
+        slow_cb = db_record(db, &timings, stmt->num_columns > 0, success, &slow_user_data);
+    }
+
+    //the hook gets a copy since reconnecting from it would free the statement
+    query = slow_cb == NULL ? NULL : strdup(stmt->query);
+    query_len = stmt->query_len;
+    lock_write_unlock(db->lock);
+
+    if (query != NULL) {
+        slow_cb(db, query, query_len, &timings, slow_user_data);
+        free(query);
+    }
+
+    return success;
+}
+
+unsigned long long
+db_stmt_affected_rows(db_stmt_t *stmt) {
+    return mysql_stmt_affected_rows(stmt->stmt);
+}
+
+unsigned long long
+db_stmt_insert_id(db_stmt_t *stmt) {
+    return mysql_stmt_insert_id(stmt->stmt);
+}
+
+//a string column was bigger than its buffer, so grow the buffer and fetch just that column again
+static bool
+db_stmt_fetch_truncated(db_stmt_t *stmt) {
+    db_stmt_column_t *column;
+    unsigned int i;
+    char *data;
+
+    for (i = 0; i < stmt->num_columns; i++) {
+        column = &stmt->column_values[i];
+        if (column->type != MYSQL_TYPE_STRING || !column->error) {
+            continue;
+        }
+
+        data = realloc(column->data, column->length + 1);
+        if (data == NULL) {
+            snprintf(stmt->db->error, sizeof(stmt->db->error), "%s", "Out of memory");
+            return false;
+        }
+
+        column->data = data;
+        column->capacity = column->length + 1;
+        db_stmt_bind_column(stmt, i);
+
+        if (mysql_stmt_fetch_column(stmt->stmt, &stmt->columns[i], i, 0) != 0) {
+            db_stmt_set_error(stmt);
+            return false;
+        }
+    }
+
+    //the bigger buffers are used for the rest of the rows too
+    if (mysql_stmt_bind_result(stmt->stmt, stmt->columns) != 0) {
+        db_stmt_set_error(stmt);
+        return false;
+    }
+
+    return true;
+}
+
+bool
+db_stmt_next(db_stmt_t *stmt) {
+    db_stmt_column_t *column;
+    unsigned int i;
+    bool success;
+    int ret;
+
+    if (!stmt->has_result) {
+        return false;
+    }
+
+    lock_write_lock(stmt->db->lock);
+    ret = mysql_stmt_fetch(stmt->stmt);
+    if (ret == 0) {
+        success = true;
+    }
+    else if (ret == MYSQL_DATA_TRUNCATED) {
+        success = db_stmt_fetch_truncated(stmt);
+    }
+    else {
+        if (ret != MYSQL_NO_DATA) {
+            db_stmt_set_error(stmt);
+        }
+        success = false;
+    }
+    lock_write_unlock(stmt->db->lock);
+
+    for (i = 0; success && i < stmt->num_columns; i++) {
+        column = &stmt->column_values[i];
+        if (column->type == MYSQL_TYPE_STRING) {
+            column->data[column->is_null ? 0 : column->length] = '\0';
+        }
+    }
+
+    return success;
+}
+
+bool
+db_stmt_is_null(db_stmt_t *stmt, unsigned int index) {
+    return stmt->column_values[index].is_null;
+}
+
+int64_t
+db_stmt_int64(db_stmt_t *stmt, unsigned int index) {
+    db_stmt_column_t *column;
+
+    column = &stmt->column_values[index];
+    if (column->is_null) {
+        return 0;
+    }
+
+    switch (column->type) {
+        case MYSQL_TYPE_LONGLONG:
+            return column->i;
+        case MYSQL_TYPE_DOUBLE:
+            return (int64_t)column->d;
+        default:
+            return strtoll(column->data, NULL, 10);
+    }
+}
+
+double
+db_stmt_double(db_stmt_t *stmt, unsigned int index) {
+    db_stmt_column_t *column;
+
+    column = &stmt->column_values[index];
+    if (column->is_null) {
+        return 0.0;
+    }
+
+    switch (column->type) {
+        case MYSQL_TYPE_LONGLONG:
+            //an unsigned BIGINT past INT64_MAX is stored in the same 8 bytes
+            return stmt->columns[index].is_unsigned ? (double)(uint64_t)column->i : (double)column->i;
+        case MYSQL_TYPE_DOUBLE:
+            return column->d;
+        default:
+            return strtod(column->data, NULL);
+    }
+}
+
+const char *
+db_stmt_str(db_stmt_t *stmt, unsigned int index) {
+    db_stmt_column_t *column;
+
+    column = &stmt->column_values[index];
+    if (column->is_null) {
+        return NULL;
+    }
+
+    switch (column->type) {
+        case MYSQL_TYPE_LONGLONG:
+            if (stmt->columns[index].is_unsigned) {
+                snprintf(column->text, sizeof(column->text), "%" PRIu64, (uint64_t)column->i);
+            }
+            else {
+                snprintf(column->text, sizeof(column->text), "%" PRId64, column->i);
+            }
+            return column->text;
+        case MYSQL_TYPE_DOUBLE:
+            snprintf(column->text, sizeof(column->text), "%.17g", column->d);
+            return column->text;
+        default:
+            return column->data;
+    }
+}
+
+const void *
+db_stmt_blob(db_stmt_t *stmt, unsigned int index, unsigned long *len) {
+    db_stmt_column_t *column;
+    const char *str;
+
+    column = &stmt->column_values[index];
+    if (column->type == MYSQL_TYPE_STRING) {
+        *len = column->is_null ? 0 : column->length;
+        return column->is_null ? NULL : column->data;
+    }
+
+    str = db_stmt_str(stmt, index);
+    *len = str == NULL ? 0 : (unsigned long)strlen(str);
+
+    return str;
+}
+
+#else
+
+db_stmt_t *
+db_prepare(db_t *db, const char *query) {
+    snprintf(db->error, sizeof(db->error), "%s", "Prepared statements need libscott to be built with MySQL");
+
+    return NULL;
+}
+
+//db_prepare() never returns a statement without MySQL, so there's nothing for the rest to do
+
+bool
+db_stmt_bind_null(db_stmt_t *stmt, unsigned int index) {
+    return false;
+}
+
+bool
+db_stmt_bind_int64(db_stmt_t *stmt, unsigned int index, int64_t value) {
+    return false;
+}
+
+bool
+db_stmt_bind_double(db_stmt_t *stmt, unsigned int index, double value) {
+    return false;
+}
+
+bool
+db_stmt_bind_blob(db_stmt_t *stmt, unsigned int index, const void *data, unsigned long len) {
+    return false;
+}
+
+bool
+db_stmt_bind_str(db_stmt_t *stmt, unsigned int index, const char *str) {
+    return false;
+}
+
+bool
+db_stmt_execute(db_stmt_t *stmt) {
+    return false;
+}
+
+unsigned long long
+db_stmt_affected_rows(db_stmt_t *stmt) {
+    return 0;
+}
+
+unsigned long long
+db_stmt_insert_id(db_stmt_t *stmt) {
+    return 0;
+}
+
+bool
+db_stmt_next(db_stmt_t *stmt) {
+    return false;
+}
+
+bool
+db_stmt_is_null(db_stmt_t *stmt, unsigned int index) {
+    return true;
+}
+
+int64_t
+db_stmt_int64(db_stmt_t *stmt, unsigned int index) {
+    return 0;
+}
+
+double
+db_stmt_double(db_stmt_t *stmt, unsigned int index) {
+    return 0.0;
+}
+
+const char *
+db_stmt_str(db_stmt_t *stmt, unsigned int index) {
+    return NULL;
+}
+
+const void *
+db_stmt_blob(db_stmt_t *stmt, unsigned int index, unsigned long *len) {
+    *len = 0;
+
+    return NULL;
+}
+
+#endif
+
+/*****************************************************************************
+ * db_batch
+ ****************************************************************************/
+
+//the escaping LOAD DATA expects with its default FIELDS ESCAPED BY '\\'
+static bool
+db_batch_escape_infile(buffer_t *buffer, const char *str, size_t len) {
+    unsigned char *dst;
+    size_t i, j = 0;
+
+    dst = buffer_reserve(buffer, len * 2);
+    if (dst == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        switch (str[i]) {
+            case '\\': dst[j++] = '\\'; dst[j++] = '\\'; break;
+            case '\t': dst[j++] = '\\'; dst[j++] = 't';  break;
+            case '\n': dst[j++] = '\\'; dst[j++] = 'n';  break;
+            case '\r': dst[j++] = '\\'; dst[j++] = 'r';  break;
+            case '\0': dst[j++] = '\\'; dst[j++] = '0';  break;
+            default:   dst[j++] = (unsigned char)str[i]; break;
+        }
+    }
+
+    buffer_commit(buffer, j);
+
+    return true;
+}
+
+static size_t
+db_batch_packet_limit(db_t *db) {
+    db_result_t *result;
+    size_t limit = 0;
+
+    result = db_selectf(db, "SELECT @@max_allowed_packet");
+    if (result != NULL) {
+        if (db_result_next(result)) {
+            limit = (size_t)strtoull(db_result_str(result, 0), NULL, 10);
+        }
+
+        db_result_free(result);
+    }
+
+    return limit > DB_BATCH_PACKET_SLACK ? limit - DB_BATCH_PACKET_SLACK : limit;
+}
+
+static bool
+db_batch_start(db_batch_t *batch) {
+    buffer_clear(batch->data);
+    batch->rows = 0;
+
+    if (batch->mode == DB_BATCH_INSERT) {
+        return buffer_write(batch->data, (unsigned char *)batch->header, batch->header_len);
+    }
+
+    return true;
+}
+
+db_batch_t *
+db_batch_init(db_t *db, const char *table, const char *columns, int mode) {
+    db_batch_t *batch;
+    int len;
+
+    batch = calloc(1, sizeof(*batch));
+    if (batch == NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        return NULL;
+    }
+
+    batch->db = db;
+    batch->mode = mode;
+    batch->max_rows = DB_BATCH_MAX_ROWS;
+    batch->max_bytes = DB_BATCH_MAX_BYTES;
+
+    if (mode == DB_BATCH_INSERT) {
+        len = asprintf(&batch->header, "INSERT INTO %s%s%s%s VALUES ", table,
+                       columns == NULL ? "" : " (", columns == NULL ? "" : columns, columns == NULL ? "" : ")");
+
+        //a multi row INSERT has to fit in one packet
+        batch->packet_limit = db_batch_packet_limit(db);
+        if (batch->packet_limit > 0 && batch->max_bytes > batch->packet_limit) {
+            batch->max_bytes = batch->packet_limit;
+        }
+    }
+    else {
+        len = asprintf(&batch->header, "LOAD DATA LOCAL INFILE '" DB_INFILE_NAME "' INTO TABLE %s "
+                       "FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' LINES TERMINATED BY '\\n'%s%s%s", table,
+                       columns == NULL ? "" : " (", columns == NULL ? "" : columns, columns == NULL ? "" : ")");
+    }
+
+    if (len == -1) {
+        batch->header = NULL;
+    }
+    else {
+        batch->header_len = (size_t)len;
+    }
+
+    batch->data = buffer_init();
+    batch->row = buffer_init();
+
+    if (batch->header == NULL || batch->data == NULL || batch->row == NULL || !db_batch_start(batch)) {
+        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        db_batch_free(batch);
+        return NULL;
+    }
+
+    return batch;
+}
+
+void
+db_batch_free(db_batch_t *batch) {
+    if (batch == NULL) {
+        return;
+    }
+
+    buffer_free(batch->data);
+    buffer_free(batch->row);
+    free(batch->header);
+    free(batch);
+}
+
+void
+db_batch_set_limits(db_batch_t *batch, unsigned int max_rows, size_t max_bytes) {
+    batch->max_rows = max_rows == 0 ? DB_BATCH_MAX_ROWS : max_rows;
+    batch->max_bytes = max_bytes == 0 ? DB_BATCH_MAX_BYTES : max_bytes;
+
+    if (batch->packet_limit > 0 && batch->max_bytes > batch->packet_limit) {
+        batch->max_bytes = batch->packet_limit;
+    }
+}
+
+unsigned long long
+db_batch_count(db_batch_t *batch) {
+    return batch->count;
+}
+
+static bool
+db_batch_oom(db_batch_t *batch) {
+    snprintf(batch->db->error, sizeof(batch->db->error), "%s", "Out of memory");
+
+    return false;
+}
+
+static bool
+db_batch_send(db_batch_t *batch) {
+    db_t *db;
+    bool success;
+
+    if (batch->rows == 0) {
+        return true;
+    }
+
+    db = batch->db;
+
+    if (batch->mode == DB_BATCH_INSERT) {
+        success = db_query(db, (const char *)buffer_data(batch->data), (unsigned int)buffer_length(batch->data));
+    }
+    else {
+        lock_write_lock(db->lock);
+        success = db_available(db);
+        if (success && db->driver->load == NULL) {
+            snprintf(db->error, sizeof(db->error), "LOAD DATA isn't supported by the %s driver", db->driver->name);
+            success = false;
+        }
+        if (success) {
+            success = db->driver->load(db->conn, batch->header, (unsigned long)batch->header_len, buffer_data(batch->data), buffer_length(batch->data));
+            if (!success) {
+                db_set_error(db);
+            }
+        }
+        lock_write_unlock(db->lock);
+    }
+
+    if (success) {
+        batch->count += batch->rows;
+    }
+
+    //the rows are dropped either way, otherwise one bad row would fail every flush after it
+    if (!db_batch_start(batch)) {
+        return db_batch_oom(batch);
+    }
+
+    return success;
+}
+
+//moves the row being built into the statement, sending the statement first if the row would push it over a limit.
+//if sending fails the row is still kept for the next statement
+static bool
+db_batch_end_row(db_batch_t *batch) {
+    bool success = true;
+    size_t len;
+
+    if (batch->columns == 0) {
+        return true;
+    }
+
+    //the row's parentheses or newline, plus the comma between rows
+    len = buffer_length(batch->row) + 3;
+
+    if (batch->rows > 0 && (batch->rows >= batch->max_rows || buffer_length(batch->data) + len > batch->max_bytes)) {
+        success = db_batch_send(batch);
+    }
+
+    if (batch->mode == DB_BATCH_INSERT) {
+        if ((batch->rows > 0 && !buffer_write_char(batch->data, ',')) ||
+            !buffer_write_char(batch->data, '(') ||
+            !buffer_write(batch->data, (unsigned char *)buffer_data(batch->row), buffer_length(batch->row)) ||
+            !buffer_write_char(batch->data, ')')) {
+            return db_batch_oom(batch);
+        }
+    }
+    else {
+        if (!buffer_write(batch->data, (unsigned char *)buffer_data(batch->row), buffer_length(batch->row)) ||
+            !buffer_write_char(batch->data, '\n')) {
+            return db_batch_oom(batch);
+        }
+    }
+
+    ++batch->rows;
+    buffer_clear(batch->row);
+    batch->columns = 0;
+
+    return success;
+}
+
+bool
+db_batch_row(db_batch_t *batch) {
+    return db_batch_end_row(batch);
+}
+
+bool
+db_batch_flush(db_batch_t *batch) {
+    return db_batch_end_row(batch) && db_batch_send(batch);
+}
+
+//writes the separator between values in a row
+static bool
+db_batch_value(db_batch_t *batch, size_t *mark) {
+    *mark = buffer_length(batch->row);
+
+    if (batch->columns++ == 0) {
+        return true;
+    }
+
+    return buffer_write_char(batch->row, batch->mode == DB_BATCH_INSERT ? ',' : '\t');
+}
+
+//takes back a value that couldn't be added, separator and all, so the row is still good to add to
+static void
+db_batch_undo(db_batch_t *batch, size_t mark) {
+    buffer_truncate(batch->row, mark);
+    --batch->columns;
+}
+
+bool
+db_batch_null(db_batch_t *batch) {
+    size_t mark;
+
+    if (!db_batch_value(batch, &mark) || !buffer_write_str(batch->row, batch->mode == DB_BATCH_INSERT ? "NULL" : "\\N")) {
+        db_batch_undo(batch, mark);
+        return db_batch_oom(batch);
+    }
+
+    return true;
+}
+
+bool
+db_batch_int64(db_batch_t *batch, int64_t value) {
+    char str[32];
+    size_t mark;
+    int len;
+
+    len = snprintf(str, sizeof(str), "%" PRId64, value);
+
+    if (!db_batch_value(batch, &mark) || !buffer_write(batch->row, (unsigned char *)str, (size_t)len)) {
+        db_batch_undo(batch, mark);
+        return db_batch_oom(batch);
+    }
+
+    return true;
+}
+
+bool
+db_batch_double(db_batch_t *batch, double value) {
+    char str[32];
+    size_t mark;
+    int len;
+
+    //MySQL has no way to store NaN or infinity
+    if (value != value || value > DBL_MAX || value < -DBL_MAX) {
+        return db_batch_null(batch);
+    }
+
+    len = snprintf(str, sizeof(str), "%.17g", value);
+
+    if (!db_batch_value(batch, &mark) || !buffer_write(batch->row, (unsigned char *)str, (size_t)len)) {
+        db_batch_undo(batch, mark);
+        return db_batch_oom(batch);
+    }
+
+    return true;
+}
+
+bool
+db_batch_str(db_batch_t *batch, const char *str) {
+    size_t len, mark;
+    bool success;
+    db_t *db;
+
+    if (str == NULL) {
+        return db_batch_null(batch);
+    }
+
+    len = strlen(str);
+    db = batch->db;
+
+    if (batch->mode == DB_BATCH_INSERT) {
+        //escaping needs the connection, and db_available() says why it can't be used
+        lock_write_lock(db->lock);
+        success = db_available(db);
+        if (success) {
+            success = db_batch_value(batch, &mark) &&
+                      buffer_write_char(batch->row, '\'') && db_escape_append(db, batch->row, str, len) && buffer_write_char(batch->row, '\'');
+            if (!success) {
+                db_batch_undo(batch, mark);
+                snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+            }
+        }
+        lock_write_unlock(db->lock);
+
+        return success;
+    }
+
+    if (!db_batch_value(batch, &mark) || !db_batch_escape_infile(batch->row, str, len)) {
+        db_batch_undo(batch, mark);
+        return db_batch_oom(batch);
+    }
+
+    return true;
+}
+
+bool
+db_batch_blob(db_batch_t *batch, const void *data, size_t len) {
+    size_t mark;
+
+    if (data == NULL) {
+        return db_batch_null(batch);
+    }
+
+    if (!db_batch_value(batch, &mark) ||
+        !(batch->mode == DB_BATCH_INSERT ? db_write_hex(batch->row, data, len) : db_batch_escape_infile(batch->row, data, len))) {
+        db_batch_undo(batch, mark);
+        return db_batch_oom(batch);
+    }
+
+    return true;
+}
+
+/*****************************************************************************
+ * db_sql
+ ****************************************************************************/
+
+db_sql_t *
+db_sql_begin(db_t *db) {
+    db_thread_t *thread;
+
+    thread = db_thread_get();
+    if (thread == NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        return NULL;
+    }
+
+    db_thread_reset(thread->sql.buffer);
+    thread->sql.db = db;
+    thread->sql.failed = false;
+
+    return &thread->sql;
+}
+
+//remembers the first failure so the appends can be chained and checked once when the query is run
+static bool
+db_sql_check(db_sql_t *sql, bool success) {
+    if (!success && !sql->failed) {
+        sql->failed = true;
+        snprintf(sql->db->error, sizeof(sql->db->error), "%s", "Out of memory");
+    }
+
+    return success;
+}
+
+bool
+db_sql_append(db_sql_t *sql, const char *str) {
+    return db_sql_check(sql, buffer_write_str(sql->buffer, str));
+}
+
+bool
+db_sql_append_len(db_sql_t *sql, const char *str, size_t len) {
+    return db_sql_check(sql, buffer_write(sql->buffer, (unsigned char *)str, len));
+}
+
+bool
+db_sql_null(db_sql_t *sql) {
+    return db_sql_append_len(sql, "NULL", 4);
+}
+
+bool
+db_sql_int64(db_sql_t *sql, int64_t value) {
+    char str[32];
+    int len;
+
+    len = snprintf(str, sizeof(str), "%" PRId64, value);
+
+    return db_sql_append_len(sql, str, (size_t)len);
+}
+
+bool
+db_sql_double(db_sql_t *sql, double value) {
+    char str[32];
+    int len;
+
+    //MySQL has no way to store NaN or infinity
+    if (value != value || value > DBL_MAX || value < -DBL_MAX) {
+        return db_sql_null(sql);
+    }
+
+    len = snprintf(str, sizeof(str), "%.17g", value);
+
+    return db_sql_append_len(sql, str, (size_t)len);
+}
+
+bool
+db_sql_str(db_sql_t *sql, const char *str) {
+    db_t *db;
+    bool success;
+
+    if (str == NULL) {
+        return db_sql_null(sql);
+    }
+
+    db = sql->db;
+
+    //same as db_escape_into(), a stream being open doesn't matter
+    lock_write_lock(db->lock);
+    success = db_connected(db);
+    if (success) {
+        success = buffer_write_char(sql->buffer, '\'') && db_escape_append(db, sql->buffer, str, strlen(str)) && buffer_write_char(sql->buffer, '\'');
+        if (!success && !sql->failed) {
+            snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        }
+    }
+    lock_write_unlock(db->lock);
+
+    if (!success) {
+        sql->failed = true;
+    }
+
+    return success;
+}
+
+bool
+db_sql_blob(db_sql_t *sql, const void *data, size_t len) {
+    if (data == NULL) {
+        return db_sql_null(sql);
+    }
+
+    return db_sql_check(sql, db_write_hex(sql->buffer, data, len));
+}
+
+const char *
+db_sql_data(db_sql_t *sql, size_t *len) {
+    if (len != NULL) {
+        *len = buffer_length(sql->buffer);
+    }
+
+    return (const char *)buffer_data(sql->buffer);
+}
+
+bool
+db_sql_query(db_sql_t *sql) {
+    if (sql->failed) {
+        return false;
+    }
+
+    return db_query(sql->db, (const char *)buffer_data(sql->buffer), (unsigned int)buffer_length(sql->buffer));
+}
+
+db_result_t *
+db_sql_select(db_sql_t *sql) {
+    if (sql->failed) {
+        return NULL;
+    }
+
+    return db_select(sql->db, (const char *)buffer_data(sql->buffer), (unsigned int)buffer_length(sql->buffer));
+}
+
+/*****************************************************************************
+ * db_cache
+ ****************************************************************************/
+
+db_cache_t *
+db_cache_init(size_t max_bytes) {
+    db_cache_t *cache;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->max_bytes = max_bytes;
+    cache->ttl = DB_CACHE_TTL;
+
+    cache->lock = lock_init();
+    cache->entries = hash_init_ex(DB_CACHE_CAPACITY);
+    if (cache->lock == NULL || cache->entries == NULL) {
+        lock_free(cache->lock);
+        hash_free(cache->entries);
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+void
+db_cache_free(db_cache_t *cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    db_cache_clear(cache);
+
+    hash_free(cache->entries);
+    lock_free(cache->lock);
+    free(cache);
+}
+
+void
+db_cache_set_ttl(db_cache_t *cache, unsigned int seconds) {
+    lock_write_lock(cache->lock);
+    cache->ttl = seconds;
+    lock_write_unlock(cache->lock);
+}
+
+//true if table is one of the comma separated names in tables
+static bool
+db_cache_depends(const char *tables, const char *table) {
+    size_t table_len, len;
+    const char *end;
+
+    table_len = strlen(table);
+
+    while (*tables != '\0') {
+        while (*tables == ',' || isspace((unsigned char)*tables)) {
+            ++tables;
+        }
+
+        end = tables;
+        while (*end != '\0' && *end != ',' && !isspace((unsigned char)*end)) {
+            ++end;
+        }
+
+        len = (size_t)(end - tables);
+        if (len > 0 && len == table_len && strncasecmp(tables, table, len) == 0) {
+            return true;
+        }
+
+        tables = end;
+    }
+
+    return false;
+}
+
+void
+db_cache_invalidate(db_cache_t *cache, const char *table) {
+    db_cache_entry_t *entry, *next;
+
+    lock_write_lock(cache->lock);
+
+    ++cache->generation;
+
+    for (entry = cache->head; entry != NULL; entry = next) {
+        next = entry->next;
+        if (db_cache_depends(entry->tables, table)) {
+            db_cache_remove(cache, entry);
+        }
+    }
+
+    lock_write_unlock(cache->lock);
+}
+
+void
+db_cache_clear(db_cache_t *cache) {
+    lock_write_lock(cache->lock);
+
+    ++cache->generation;
+
+    while (cache->head != NULL) {
+        db_cache_remove(cache, cache->head);
+    }
+
+    lock_write_unlock(cache->lock);
+}
+
+size_t
+db_cache_size(db_cache_t *cache) {
+    size_t size;
+
+    lock_write_lock(cache->lock);
+    size = cache->size;
+    lock_write_unlock(cache->lock);
+
+    return size;
+}
+
+unsigned long long
+db_cache_hits(db_cache_t *cache) {
+    unsigned long long hits;
+
+    lock_write_lock(cache->lock);
+    hits = cache->hits;
+    lock_write_unlock(cache->lock);
+
+    return hits;
+}
+
+unsigned long long
+db_cache_misses(db_cache_t *cache) {
+    unsigned long long misses;
+
+    lock_write_lock(cache->lock);
+    misses = cache->misses;
+    lock_write_unlock(cache->lock);
+
+    return misses;
+}
+
+void
+db_set_cache(db_t *db, db_cache_t *cache) {
+    lock_write_lock(db->lock);
+    db->cache = cache;
+    lock_write_unlock(db->lock);
+}
+
+//builds the cache key in the thread's key buffer: the server and database, then the query with runs of whitespace
+//outside of quotes collapsed to a single space and any trailing semicolons dropped
+static const char *
+db_cache_key(db_t *db, const char *query, unsigned int len) {
+    db_thread_t *thread;
+    unsigned char *dst;
+    size_t i, j = 0;
+    bool space = false;
+    char quote = 0;
+    int header;
+
+    thread = db_thread_get();
+    if (thread == NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        return NULL;
+    }
+
+    db_thread_reset(thread->key);
+
+    lock_write_lock(db->lock);
+    header = snprintf(NULL, 0, "%s:%u/%s\n", db->host == NULL ? "" : db->host, db->port, db->database == NULL ? "" : db->database);
+    dst = buffer_reserve(thread->key, (size_t)header + 1);
+    if (dst != NULL) {
+        snprintf((char *)dst, (size_t)header + 1, "%s:%u/%s\n", db->host == NULL ? "" : db->host, db->port, db->database == NULL ? "" : db->database);
+        buffer_commit(thread->key, (size_t)header);
+    }
+    lock_write_unlock(db->lock);
+
+    while (len > 0 && (isspace((unsigned char)query[len - 1]) || query[len - 1] == ';')) {
+        --len;
+    }
+
+    if (dst != NULL) {
+        dst = buffer_reserve(thread->key, (size_t)len + 1);
+    }
+    if (dst == NULL) {
+        snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+        return NULL;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (quote != 0) {
+            dst[j++] = query[i];
+            if (query[i] == '\\' && quote != '`' && i + 1 < len) {
+                dst[j++] = query[++i];
+            }
+            else if (query[i] == quote) {
+                quote = 0;
+            }
+        }
+        else if (isspace((unsigned char)query[i])) {
+            space = j > 0;
+        }
+        else {
+            if (space) {
+                dst[j++] = ' ';
+                space = false;
+            }
+
+            if (query[i] == '\'' || query[i] == '"' || query[i] == '`') {
+                quote = query[i];
+            }
+
+            dst[j++] = query[i];
+        }
+    }
+
+    dst[j] = '\0';
+    buffer_commit(thread->key, j + 1);
+
+    return (const char *)buffer_data(thread->key);
+}
+
+//finds a fresh entry and takes a reference to it. must be called with the cache's lock held
+static db_cache_entry_t *
+db_cache_lookup(db_cache_t *cache, const char *key) {
+    db_cache_entry_t *entry;
+
+    entry = hash_get(cache->entries, key);
+    if (entry != NULL && entry->expires <= time(NULL)) {
+        db_cache_remove(cache, entry);
+        entry = NULL;
+    }
+
+    if (entry == NULL) {
+        ++cache->misses;
+        return NULL;
+    }
+
+    //move it to the front of the LRU list
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+        if (entry->next == NULL) {
+            cache->tail = entry->prev;
+        }
+        else {
+            entry->next->prev = entry->prev;
+        }
+
+        entry->prev = NULL;
+        entry->next = cache->head;
+        cache->head->prev = entry;
+        cache->head = entry;
+    }
+
+    ++entry->refs;
+    ++cache->hits;
+
+    return entry;
+}
+
+//copies a buffered result into a single allocation. returns NULL if it's too big to cache or memory ran out, and
+//leaves the result rewound either way
+static db_cache_entry_t *
+db_cache_build(db_cache_t *cache, db_result_t *result, const char *key, const char *tables, size_t max_size) {
+    const db_driver_t *driver;
+    db_cache_entry_t *entry;
+    unsigned long long num_rows, row;
+    unsigned long *lengths;
+    unsigned int i, num_fields;
+    size_t size, cells;
+    char **values;
+    char *str;
+
+    driver = result->driver;
+    num_fields = result->num_fields;
+    num_rows = driver->num_rows(result->result);
+    cells = (size_t)num_rows * num_fields;
+
+    size = sizeof(*entry) + (num_fields * sizeof(db_field_t)) + (cells * (sizeof(char *) + sizeof(unsigned long)));
+    size += strlen(key) + 1 + strlen(tables) + 1;
+    for (i = 0; i < num_fields; i++) {
+        size += strlen(result->fields[i].name) + 1;
+    }
+
+    //size up the values first so nothing is copied for a result that's too big
+    while (size <= max_size && (values = driver->fetch(result->result, &lengths)) != NULL) {
+        for (i = 0; i < num_fields; i++) {
+            if (values[i] != NULL) {
+                size += lengths[i] + 1;
+            }
+        }
+    }
+
+    driver->seek(result->result, 0);
+
+    if (size > max_size) {
+        return NULL;
+    }
+
+    entry = malloc(size);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->cache = cache;
+    entry->size = size;
+    entry->num_fields = num_fields;
+    entry->num_rows = num_rows;
+    entry->fields = (db_field_t *)(entry + 1);
+    entry->cells = (char **)(entry->fields + num_fields);
+    entry->lengths = (unsigned long *)(entry->cells + cells);
+    str = (char *)(entry->lengths + cells);
+
+    for (i = 0; i < num_fields; i++) {
+        entry->fields[i].name = str;
+        entry->fields[i].type = result->fields[i].type;
+        str = stpcpy(str, result->fields[i].name) + 1;
+    }
+
+    for (row = 0; (values = driver->fetch(result->result, &lengths)) != NULL; row++) {
+        for (i = 0; i < num_fields; i++) {
+            if (values[i] == NULL) {
+                entry->cells[(row * num_fields) + i] = NULL;
+                entry->lengths[(row * num_fields) + i] = 0;
+            }
+            else {
+                entry->cells[(row * num_fields) + i] = str;
+                entry->lengths[(row * num_fields) + i] = lengths[i];
+                memcpy(str, values[i], lengths[i]);
+                str[lengths[i]] = '\0';
+                str += lengths[i] + 1;
+            }
+        }
+    }
+
+    driver->seek(result->result, 0);
+
+    entry->key = str;
+    str = stpcpy(str, key) + 1;
+    entry->tables = str;
+    strcpy(str, tables);
+
+    return entry;
+}
+
+//adds an entry and takes a reference to it for the caller's result
+static void
+db_cache_insert(db_cache_t *cache, db_cache_entry_t *entry, unsigned long long generation) {
+    db_cache_entry_t *old;
+
+    lock_write_lock(cache->lock);
+
+    entry->refs = 1;
+
+    //the result might already be stale if the tables were invalidated while the query ran
+    if (cache->generation != generation) {
+        entry->removed = true;
+        lock_write_unlock(cache->lock);
+        return;
+    }
+
+    //another thread cached the same query in the meantime
+    old = hash_get(cache->entries, entry->key);
+    if (old != NULL) {
+        db_cache_remove(cache, old);
+    }
+
+    while (cache->tail != NULL && cache->size + entry->size > cache->max_bytes) {
+        db_cache_remove(cache, cache->tail);
+    }
+
+    if (!hash_set(cache->entries, entry->key, entry)) {
+        entry->removed = true;
+        lock_write_unlock(cache->lock);
+        return;
+    }
+
+    entry->expires = time(NULL) + cache->ttl;
+    entry->next = cache->head;
+    if (cache->head == NULL) {
+        cache->tail = entry;
+    }
+    else {
+        cache->head->prev = entry;
+    }
+    cache->head = entry;
+    cache->size += entry->size;
+
+    lock_write_unlock(cache->lock);
+}
+
+db_result_t *
+db_select_cached(db_t *db, const char *tables, const char *query, unsigned int len) {
+    unsigned long long generation;
+    db_cache_entry_t *entry;
+    db_result_t *result;
+    db_cache_t *cache;
+    size_t max_size;
+    const char *key;
+
+    lock_write_lock(db->lock);
+    cache = db->cache;
+    lock_write_unlock(db->lock);
+
+    if (cache == NULL) {
+        return db_select(db, query, len);
+    }
+
+    if (tables == NULL) {
+        tables = "";
+    }
+
+    key = db_cache_key(db, query, len);
+    if (key == NULL) {
+        return NULL;
+    }
+
+    lock_write_lock(cache->lock);
+    entry = db_cache_lookup(cache, key);
+    generation = cache->generation;
+    max_size = cache->max_bytes / DB_CACHE_MAX_ENTRY;
+    lock_write_unlock(cache->lock);
+
+    if (entry != NULL) {
+        result = calloc(1, sizeof(*result));
+        if (result == NULL) {
+            db_cache_release(entry);
+            snprintf(db->error, sizeof(db->error), "%s", "Out of memory");
+            return NULL;
+        }
+
+        result->cached = entry;
+        result->fields = entry->fields;
+        result->num_fields = entry->num_fields;
+
+        return result;
+    }
+
+    result = db_select(db, query, len);
+    if (result == NULL) {
+        return NULL;
+    }
+
+    //if it can't be cached the result from the server is just as good
+    entry = db_cache_build(cache, result, key, tables, max_size);
+    if (entry == NULL) {
+        return result;
+    }
+
+    db_cache_insert(cache, entry, generation);
+
+    result->driver->result_free(result->result);
+    result->result = NULL;
+    result->cached = entry;
+    result->fields = entry->fields;
+
+    return result;
+}
+
+db_result_t *
+db_selectf_cached(db_t *db, const char *tables, const char *fmt, ...) {
+    const char *query;
+    unsigned int len;
+    va_list ap;
+
+    va_start(ap, fmt);
+    query = db_vformat(db, &len, fmt, ap);
+    va_end(ap);
+
+    if (query == NULL) {
+        return NULL;
+    }
+
+    return db_select_cached(db, tables, query, len);
+}
+
+/*****************************************************************************
+ * db_pool
+ ****************************************************************************/
+
+db_pool_t *
+db_pool_init(unsigned int min, unsigned int max) {
+    db_pool_t *pool;
+
+    if (max == 0) {
+        max = 1;
+    }
+    if (min > max) {
+        min = max;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->min = min;
+    pool->max = max;
+    pool->ping_interval = DB_POOL_PING_INTERVAL;
+    pool->driver = db_driver_mysql();
+    pool->idle_timeout = DB_POOL_IDLE_TIMEOUT;
+
+    pool->idle = alist_init();
+    pool->cond = cond_init();
+    if (pool->idle == NULL || pool->cond == NULL) {
+        alist_free(pool->idle);
+        cond_free(pool->cond);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void
+db_pool_free(db_pool_t *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    alist_free_func(pool->idle, (void (*)(void *))db_free);
+    cond_free(pool->cond);
+
+    free(pool->host);
+    free(pool->user);
+    free(pool->password);
+    free(pool->database);
+
+    free(pool);
+}
+
+const char *
+db_pool_error(db_pool_t *pool) {
+    return pool->error;
+}
+
+void
+db_pool_set_ping_interval(db_pool_t *pool, unsigned int seconds) {
+    pool->ping_interval = seconds;
+}
+
+void
+db_pool_set_idle_timeout(db_pool_t *pool, unsigned int seconds) {
+    pool->idle_timeout = seconds;
+}
+
+void
+db_pool_set_cache(db_pool_t *pool, db_cache_t *cache) {
+    pool->cache = cache;
+}
+
+void
+db_pool_set_driver(db_pool_t *pool, const db_driver_t *driver, void *driver_data) {
+    pool->driver = driver;
+    pool->driver_data = driver_data;
+}
+
+void
+db_pool_set_timeout(db_pool_t *pool, unsigned int timeout_ms) {
+    pool->timeout = timeout_ms;
+}
+
+unsigned int
+db_pool_size(db_pool_t *pool) {
+    unsigned int size;
+
+    cond_lock(pool->cond);
+    size = pool->size;
+    cond_unlock(pool->cond);
+
+    return size;
+}
+
+//opens a new connection. the caller must have already reserved room for it in pool->size
+static db_t *
+db_pool_open(db_pool_t *pool) {
+    db_t *db;
+
+    db = db_init_driver(pool->driver, pool->driver_data);
+    if (db == NULL) {
+        cond_lock(pool->cond);
+        snprintf(pool->error, sizeof(pool->error), "%s", "Out of memory");
+        cond_unlock(pool->cond);
+        return NULL;
+    }
+
+    if (!db_connect(db, pool->host, pool->user, pool->password, pool->database, pool->port)) {
+        cond_lock(pool->cond);
+        snprintf(pool->error, sizeof(pool->error), "%s", db_error(db));
+        cond_unlock(pool->cond);
+        db_free(db);
+        return NULL;
+    }
+
+    db->last_used = time(NULL);
+    db->cache = pool->cache;
+
+    return db;
+}
+
+//gives back a reserved slot in pool->size after a connection failed to open or was closed
+static void
+db_pool_release(db_pool_t *pool) {
+    cond_lock(pool->cond);
+    --pool->size;
+    cond_signal(pool->cond);
+    cond_unlock(pool->cond);
+}
+
+bool
+db_pool_connect(db_pool_t *pool, const char *host, const char *user, const char *password, const char *database, unsigned int port) {
+    char *new_host, *new_user, *new_password, *new_database;
+    bool done;
+    db_t *db;
+
+    if (pool->connected) {
+        snprintf(pool->error, sizeof(pool->error), "%s", "The pool is already connected");
+        return false;
+    }
+
+    new_host = host == NULL ? NULL : strdup(host);
+    new_user = user == NULL ? NULL : strdup(user);
+    new_password = password == NULL ? NULL : strdup(password);
+    new_database = database == NULL ? NULL : strdup(database);
+
+    if ((host != NULL && new_host == NULL) || (user != NULL && new_user == NULL) ||
+        (password != NULL && new_password == NULL) || (database != NULL && new_database == NULL)) {
+        free(new_host);
+        free(new_user);
+        free(new_password);
+        free(new_database);
+        snprintf(pool->error, sizeof(pool->error), "%s", "Out of memory");
+        return false;
+    }
+
+    //a retry after a failed connect replaces what the last attempt was given
+    free(pool->host);
+    free(pool->user);
+    free(pool->password);
+    free(pool->database);
+    pool->host = new_host;
+    pool->user = new_user;
+    pool->password = new_password;
+    pool->database = new_database;
+    pool->port = port;
+
+    //open the minimum number of connections up front so a bad host or password is reported right away. the ones
+    //a failed attempt already opened are kept
+    while (true) {
+        cond_lock(pool->cond);
+        done = pool->size >= pool->min;
+        if (!done) {
+            ++pool->size;
+        }
+        cond_unlock(pool->cond);
+
+        if (done) {
+            break;
+        }
+
+        db = db_pool_open(pool);
+        if (db == NULL) {
+            db_pool_release(pool);
+            return false;
+        }
+
+        cond_lock(pool->cond);
+        if (!alist_add(pool->idle, db)) {
+            snprintf(pool->error, sizeof(pool->error), "%s", "Out of memory");
+            --pool->size;
+            cond_unlock(pool->cond);
+            db_free(db);
+            return false;
+        }
+        cond_unlock(pool->cond);
+    }
+
+    pool->connected = true;
+
+    return true;
+}
+
+//must be called with the pool locked. prefers the connection this thread used last so a thread keeps hitting
+//the same server session, otherwise takes the most recently returned connection since it's most likely alive
+static db_t *
+db_pool_take_idle(db_pool_t *pool, unsigned long self) {
+    unsigned int i, size, index;
+    db_t *db;
+
+    size = alist_size(pool->idle);
+    if (size == 0) {
+        return NULL;
+    }
+
+    index = size - 1;
+    for (i = size; i > 0; i--) {
+        db = alist_get(pool->idle, i - 1);
+        if (db->owner == self) {
+            index = i - 1;
+            break;
+        }
+    }
+
+    return alist_remove(pool->idle, index);
+}
+
+//pings connections that have been idle for a while or saw a connection error, and reconnects dead ones
+static bool
+db_pool_check(db_pool_t *pool, db_t *db) {
+    bool healthy = true;
+
+    if (db_error_is_connection(db) || difftime(time(NULL), db->last_used) >= pool->ping_interval) {
+        healthy = db_ping(db);
+    }
+
+    if (!healthy) {
+        healthy = db_reconnect(db);
+        if (!healthy) {
+            cond_lock(pool->cond);
+            snprintf(pool->error, sizeof(pool->error), "%s", db_error(db));
+            cond_unlock(pool->cond);
+        }
+    }
+
+    return healthy;
+}
+
+db_t *
+db_pool_checkout(db_pool_t *pool) {
+    uint64_t deadline, now;
+    unsigned long self;
+    bool open = false;
+    db_t *db = NULL;
+
+    self = thread_id();
+
+    //the timeout covers the whole checkout, so waking up and losing the connection to another thread doesn't
+    //start it over
+    deadline = db_now_ns() + ((uint64_t)pool->timeout * 1000000);
+
+    cond_lock(pool->cond);
+    while (db == NULL) {
+        db = db_pool_take_idle(pool, self);
+        if (db != NULL) {
+            break;
+        }
+
+        if (pool->size < pool->max) {
+            ++pool->size;
+            open = true;
+            break;
+        }
+
+        if (pool->timeout == 0) {
+            cond_wait(pool->cond);
+            continue;
+        }
+
+        now = db_now_ns();
+        if (now >= deadline || !cond_timedwait(pool->cond, (unsigned int)((deadline - now + 999999) / 1000000))) {
+            snprintf(pool->error, sizeof(pool->error), "Timed out after %ums waiting for a connection", pool->timeout);
+            break;
+        }
+    }
+    cond_unlock(pool->cond);
+
+    if (open) {
+        db = db_pool_open(pool);
+        if (db == NULL) {
+            db_pool_release(pool);
+        }
+    }
+    else if (db != NULL) {
+        if (!db_pool_check(pool, db)) {
+            db_free(db);
+            db_pool_release(pool);
+            db = NULL;
+        }
+    }
+
+    if (db != NULL) {
+        db->owner = self;
+    }
+
+    return db;
+}
+
+void
+db_pool_return(db_pool_t *pool, db_t *db) {
+    alist_t *expired = NULL;
+    unsigned int i;
+    time_t now;
+    db_t *idle;
+
+    now = time(NULL);
+    db->last_used = now;
+
+    cond_lock(pool->cond);
+
+    if (!alist_add(pool->idle, db)) {
+        //can't keep track of it, so close it and give its slot to someone else
+        --pool->size;
+        cond_signal(pool->cond);
+        cond_unlock(pool->cond);
+        db_free(db);
+        return;
+    }
+
+    //close connections above the minimum that nobody has needed for a while. the oldest are at the front
+    i = 0;
+    while (pool->size > pool->min && i < alist_size(pool->idle)) {
+        idle = alist_get(pool->idle, i);
+        if (difftime(now, idle->last_used) < pool->idle_timeout) {
+            break;
+        }
+
+        if (expired == NULL) {
+            expired = alist_init();
+            if (expired == NULL) {
+                break;
+            }
+        }
+
+        if (!alist_add(expired, idle)) {
+            break;
+        }
+
+        alist_remove(pool->idle, i);
+        --pool->size;
+    }
+
+    cond_signal(pool->cond);
+    cond_unlock(pool->cond);
+
+    //do the actual closing outside of the lock since it talks to the server
+    alist_free_func(expired, (void (*)(void *))db_free);
+}
+
+/*****************************************************************************
+ * db_async
+ ****************************************************************************/
+
+static void
+db_async_request_free(db_async_request_t *request) {
+    free(request->query);
+    free(request);
+}
+
+static void
+db_async_run(db_async_t *async, db_async_request_t *request) {
+    db_t *db;
+
+    db = db_pool_checkout(async->pool);
+    if (db == NULL) {
+        snprintf(request->error, sizeof(request->error), "%s", db_pool_error(async->pool));
+        return;
+    }
+
+    if (request->select) {
+        request->result = db_select(db, request->query, request->len);
+        request->success = request->result != NULL;
+    }
+    else {
+        request->success = db_query(db, request->query, request->len);
+    }
+
+    if (!request->success) {
+        snprintf(request->error, sizeof(request->error), "%s", db_error(db));
+    }
+
+    db_pool_return(async->pool, db);
+}
+
+static void *
+db_async_worker(void *user_data) {
+    db_async_request_t *request;
+    db_async_t *async;
+    bool wake;
+    char byte = 0;
+
+    async = user_data;
+
+    cond_lock(async->cond);
+    while (true) {
+        while (!async->stop && queue_size(async->requests) == 0) {
+            cond_wait(async->cond);
+        }
+
+        if (async->stop) {
+            break;
+        }
+
+        request = queue_pop(async->requests);
+        cond_unlock(async->cond);
+
+        db_async_run(async, request);
+
+        cond_lock(async->cond);
+        wake = queue_size(async->done) == 0;
+        if (!queue_push(async->done, request)) {
+            //nowhere to put it, so the callback can never run. at least don't leak it
+            --async->pending;
+            if (request->result != NULL) {
+                db_result_free(request->result);
+            }
+            db_async_request_free(request);
+            wake = false;
+        }
+
+        //only the first completion needs to wake the event loop, it'll pick up the rest in the same call
+        if (wake) {
+            if (write(async->fds[1], &byte, 1) == -1) {
+                //the pipe is non-blocking and already has something to read, so the event loop will still wake up
+            }
+        }
+    }
+    cond_unlock(async->cond);
+
+    return NULL;
+}
+
+db_async_t *
+db_async_init(db_pool_t *pool, unsigned int threads) {
+    db_async_t *async;
+    unsigned int i;
+
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    async = calloc(1, sizeof(*async));
+    if (async == NULL) {
+        return NULL;
+    }
+
+    async->pool = pool;
+    async->fds[0] = -1;
+    async->fds[1] = -1;
+
+    async->requests = queue_init();
+    async->done = queue_init();
+    async->cond = cond_init();
+    async->threads = calloc(threads, sizeof(*async->threads));
+    if (async->requests == NULL || async->done == NULL || async->cond == NULL || async->threads == NULL) {
+        db_async_free(async);
+        return NULL;
+    }
+
+    if (pipe(async->fds) != 0) {
+        async->fds[0] = -1;
+        async->fds[1] = -1;
+        db_async_free(async);
+        return NULL;
+    }
+
+    fcntl(async->fds[0], F_SETFL, fcntl(async->fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(async->fds[1], F_SETFL, fcntl(async->fds[1], F_GETFL) | O_NONBLOCK);
+
+    for (i = 0; i < threads; i++) {
+        async->threads[i] = thread_create(db_async_worker, async);
+        if (async->threads[i] == NULL) {
+            db_async_free(async);
+            return NULL;
+        }
+
+        ++async->num_threads;
+    }
+
+    return async;
+}
+
+void
+db_async_free(db_async_t *async) {
+    db_async_request_t *request;
+    unsigned int i;
+
+    if (async == NULL) {
+        return;
+    }
+
+    if (async->cond != NULL) {
+        cond_lock(async->cond);
+        async->stop = true;
+        cond_broadcast(async->cond);
+        cond_unlock(async->cond);
+    }
+
+    for (i = 0; i < async->num_threads; i++) {
+        thread_join(async->threads[i]);
+    }
+
+    //deliver what finished, then tell everyone still waiting for a worker that they never ran
+    if (async->done != NULL) {
+        db_async_process(async);
+    }
+
+    if (async->requests != NULL) {
+        while ((request = queue_pop(async->requests)) != NULL) {
+            request->cb(false, NULL, "Cancelled", request->user_data);
+            db_async_request_free(request);
+        }
+    }
+
+    if (async->fds[0] != -1) {
+        close(async->fds[0]);
+        close(async->fds[1]);
+    }
+
+    queue_free(async->requests);
+    queue_free(async->done);
+    cond_free(async->cond);
+    free(async->threads);
+    free(async);
+}
+
+static bool
+db_async_submit(db_async_t *async, const char *query, unsigned int len, bool select, db_async_cb_t cb, void *user_data) {
+    db_async_request_t *request;
+    bool success;
+
+    request = calloc(1, sizeof(*request));
+    if (request == NULL) {
+        return false;
+    }
+
+    //the caller's query might not outlive the call, so the worker gets its own copy
+    request->query = malloc(len);
+    if (request->query == NULL) {
+        free(request);
+        return false;
+    }
+
+    memcpy(request->query, query, len);
+    request->len = len;
+    request->select = select;
+    request->cb = cb;
+    request->user_data = user_data;
+
+    cond_lock(async->cond);
+    success = queue_push(async->requests, request);
+    if (success) {
+        ++async->pending;
+        cond_signal(async->cond);
+    }
+    cond_unlock(async->cond);
+
+    if (!success) {
+        db_async_request_free(request);
+    }
+
+    return success;
+}
+
+bool
+db_async_query(db_async_t *async, const char *query, unsigned int len, db_async_cb_t cb, void *user_data) {
+    return db_async_submit(async, query, len, false, cb, user_data);
+}
+
+bool
+db_async_select(db_async_t *async, const char *query, unsigned int len, db_async_cb_t cb, void *user_data) {
+    return db_async_submit(async, query, len, true, cb, user_data);
+}
+
+int
+db_async_fd(db_async_t *async) {
+    return async->fds[0];
+}
+
+unsigned int
+db_async_pending(db_async_t *async) {
+    unsigned int pending;
+
+    cond_lock(async->cond);
+    pending = async->pending;
+    cond_unlock(async->cond);
+
+    return pending;
+}
+
+unsigned int
+db_async_process(db_async_t *async) {
+    db_async_request_t *request;
+    unsigned int i, count;
+    char bytes[64];
+
+    //drain the wake up bytes first. anything finishing after this writes a new one, so nothing gets missed
+    while (read(async->fds[0], bytes, sizeof(bytes)) > 0) {
+    }
+
+    //only what's finished by now, so workers that keep finishing can't keep this going. each one is taken out
+    //under the lock on its own, so nothing is allocated and the callbacks run without holding it
+    cond_lock(async->cond);
+    count = queue_size(async->done);
+    cond_unlock(async->cond);
+
+    for (i = 0; i < count; i++) {
+        cond_lock(async->cond);
+        request = queue_pop(async->done);
+        if (request != NULL) {
+            --async->pending;
+        }
+        cond_unlock(async->cond);
+
+        if (request == NULL) {
+            break;
+        }
+
+        request->cb(request->success, request->result, request->success ? NULL : request->error, request->user_data);
+        db_async_request_free(request);
+    }
+
+    //anything that finished while these ran found the queue not empty and didn't write a wake up byte, so write
+    //one for it
+    cond_lock(async->cond);
+    if (queue_size(async->done) > 0 && write(async->fds[1], bytes, 1) == -1) {
+        //the pipe is non-blocking and already has something to read, so the event loop will still wake up
+    }
+    cond_unlock(async->cond);
+
+    return i;
+}
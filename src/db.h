@@ -1,28 +1,410 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+#define DB_TYPE_NULL     0  //!< A column that is always NULL.
+#define DB_TYPE_INTEGER  1  //!< TINYINT, SMALLINT, MEDIUMINT, INT, BIGINT and YEAR.
+#define DB_TYPE_FLOAT    2  //!< FLOAT and DOUBLE.
+#define DB_TYPE_DECIMAL  3  //!< DECIMAL.
+#define DB_TYPE_STRING   4  //!< CHAR, VARCHAR, TEXT, ENUM, SET and anything else shown as text.
+#define DB_TYPE_BLOB     5  //!< BINARY, VARBINARY, BLOB, GEOMETRY and BIT, which is big-endian bytes.
+#define DB_TYPE_TEMPORAL 6  //!< DATE, TIME, DATETIME and TIMESTAMP.
+
+#define DB_CHARSET_BINARY 63 //!< The character set number MySQL uses for binary data.
+
+#define DB_BATCH_INSERT    0 //!< A db_batch_t that sends multi row INSERT statements.
+#define DB_BATCH_LOAD_DATA 1 //!< A db_batch_t that streams rows through LOAD DATA LOCAL INFILE.
+
+#define DB_BATCH_MAX_ROWS  1000          //!< Default number of rows a db_batch_t sends at a time.
+#define DB_BATCH_MAX_BYTES (1024 * 1024) //!< Default number of bytes a db_batch_t sends at a time.
+
+#define DB_CACHE_TTL 60 //!< Default seconds a db_cache_t keeps a result.
+
+#define DB_METRICS_BUCKETS 32 //!< Number of buckets in a db_metrics_t latency histogram.
+
+#define DB_POOL_PING_INTERVAL 30    //!< Default seconds a pooled connection can sit idle before it's pinged on checkout.
+#define DB_POOL_IDLE_TIMEOUT  60    //!< Default seconds a pooled connection above the minimum can sit idle before it's closed.
 
 typedef struct db_t db_t;
 typedef struct db_result_t db_result_t;
+typedef struct db_stmt_t db_stmt_t;
+typedef struct db_batch_t db_batch_t;
+typedef struct db_sql_t db_sql_t;
+typedef struct db_cache_t db_cache_t;
+typedef struct db_pool_t db_pool_t;
+typedef struct db_async_t db_async_t;
+
+/**
+ * How long one query spent in each stage. rows is only counted for buffered
+ * selects. bytes is always 0 since they're only known once the rows are read.
+ */
+typedef struct {
+    uint64_t lock_wait_ns;      //!< Waiting for the connection's lock.
+    uint64_t exec_ns;           //!< Sending the query and waiting for the server to respond.
+    uint64_t fetch_ns;          //!< Reading a buffered result from the server.
+    uint64_t total_ns;
+    uint64_t rows;
+    uint64_t bytes;
+} db_timings_t;
+
+/**
+ * Totals for a connection since metrics were enabled or last reset. A
+ * streaming result's rows and bytes are added as they're read, and the bytes
+ * read from a buffered result are added when it's freed.
+ */
+typedef struct {
+    uint64_t queries;
+    uint64_t selects;
+    uint64_t errors;
+    uint64_t lock_wait_ns;
+    uint64_t exec_ns;
+    uint64_t fetch_ns;
+    uint64_t rows;
+    uint64_t bytes;
+    uint64_t histogram[DB_METRICS_BUCKETS]; //!< Queries by total time, bucket i counts 2^i up to 2^(i+1) microseconds. The first and last buckets also count anything faster or slower.
+} db_metrics_t;
+
+/**
+ * A column as described by a driver's result.
+ */
+typedef struct {
+    const char *name;
+    int type;                   //!< One of the DB_TYPE_* constants.
+} db_field_t;
+
+/**
+ * The functions behind a db_t that talk to the actual database. conn is what
+ * connect() returned and result is what result() returned. Every function
+ * that fails leaves a message and code for error() and error_code(), except
+ * connect(), which writes its message into the given buffer. All of them are
+ * called with the connection's lock held, so a driver only needs its own
+ * locking for state that's shared between connections.
+ *
+ * result() is called after a successful query() and returns NULL with an
+ * error code of 0 when the query had no result set. With stream set the rows
+ * may be read from the server as fetch() asks for them, and num_rows() and
+ * seek() are never called. fetch() returns the next row and its column
+ * lengths, or NULL after the last row or on an error.
+ *
+ * load() runs a LOAD DATA LOCAL INFILE statement with data standing in for
+ * the file, and may be NULL if the driver can't do that.
+ */
+typedef struct {
+    const char *name;
+
+    void * (*connect)(void *driver_data, const char *host, const char *user, const char *password, const char *database, unsigned int port, char *error, size_t error_size);
+    void (*close)(void *conn);
+    bool (*ping)(void *conn);
+
+    bool (*query)(void *conn, const char *query, unsigned long len);
+    bool (*load)(void *conn, const char *query, unsigned long len, const void *data, size_t data_len);
+
+    void * (*result)(void *conn, bool stream);
+    void (*result_free)(void *result);
+    unsigned int (*num_fields)(void *result);
+    const db_field_t * (*fields)(void *result);
+    char ** (*fetch)(void *result, unsigned long **lengths);
+    unsigned long long (*num_rows)(void *result);
+    void (*seek)(void *result, unsigned long long row);
+
+    unsigned long (*escape)(void *conn, char *dst, const char *src, unsigned long len);
+
+    const char * (*error)(void *conn);
+    unsigned int (*error_code)(void *conn);
+    bool (*error_is_connection)(unsigned int code);
+} db_driver_t;
 
+typedef void (*db_slow_query_cb_t)(db_t *db, const char *query, unsigned int len, const db_timings_t *timings, void *user_data);
+
+typedef void (*db_async_cb_t)(bool success, db_result_t *result, const char *error, void *user_data);
+
+/**
+ * The MySQL driver, or NULL if the library was built without MySQL.
+ */
+const db_driver_t * db_driver_mysql();
+
+/**
+ * Allocates a connection that uses the MySQL driver. If the library was built
+ * without MySQL, db_connect() fails on it.
+ */
 db_t * db_init();
+
+/**
+ * Allocates a connection that uses the given driver. driver_data is passed to
+ * the driver's connect() and must outlive the connection.
+ */
+db_t * db_init_driver(const db_driver_t *driver, void *driver_data);
 void db_free(db_t *db);
 
 const char * db_error(db_t *db);
 
 bool db_connect(db_t *db, const char *host, const char *user, const char *password, const char *database, unsigned int port);
+bool db_reconnect(db_t *db);
 void db_disconnect(db_t *db);
 
+bool db_ping(db_t *db);
+
 bool db_query(db_t *db, const char *query, unsigned int len);
 bool db_queryf(db_t *db, const char *fmt, ...);
 
 db_result_t * db_select(db_t *db, const char *query, unsigned int len);
 db_result_t * db_selectf(db_t *db, const char *fmt, ...);
 
+/**
+ * Runs a query and streams its rows from the server as db_result_next() asks
+ * for them, instead of reading the whole result into memory first.
+ *
+ * The connection belongs to the result until db_result_free() is called. Any
+ * other query, select, prepared statement or ping on the same db_t fails with
+ * a "busy" error in the meantime, so a pooled connection shouldn't be returned
+ * while a stream is open. Freeing the result early reads and discards the rows
+ * that are left. If db_result_next() returns false, db_result_failed() tells
+ * the end of the rows apart from an error, which is reported by db_error().
+ */
+db_result_t * db_select_stream(db_t *db, const char *query, unsigned int len);
+
 char * db_escape(db_t *db, const char *str);
 
+/**
+ * Escapes <tt>len</tt> bytes of <tt>str</tt> for use inside a quoted SQL
+ * literal and appends them to <tt>buffer</tt>, without the quotes. Nothing is
+ * allocated once the buffer has room, so the same buffer can be cleared and
+ * reused for every query.
+ */
+bool db_escape_into(db_t *db, buffer_t *buffer, const char *str, size_t len);
+
 void db_result_free(db_result_t *result);
 
 bool db_result_next(db_result_t *result);
+bool db_result_failed(db_result_t *result);
 
 const char * db_result_str(db_result_t *result, unsigned int index);
+
+unsigned int db_result_columns(db_result_t *result);
+const char * db_result_column_name(db_result_t *result, unsigned int index);
+int db_result_column_type(db_result_t *result, unsigned int index);
+int db_result_index(db_result_t *result, const char *name);
+
+bool db_result_is_null(db_result_t *result, unsigned int index);
+unsigned long db_result_len(db_result_t *result, unsigned int index);
+int64_t db_result_int64(db_result_t *result, unsigned int index);
+double db_result_double(db_result_t *result, unsigned int index);
+const void * db_result_blob(db_result_t *result, unsigned int index, unsigned long *len);
+
+/*****************************************************************************
+ * db_metrics
+ *
+ * Optional per connection instrumentation of db_query(), db_select(),
+ * db_stmt_execute() and everything built on them. Nothing is counted until
+ * db_set_metrics() turns it on, and only the bytes of the rows actually read
+ * from a db_result_t are counted. The slow query hook works on its own: it's
+ * called after any query whose total time reaches the threshold, outside the
+ * connection's lock and on the thread that ran the query, so it can use the
+ * connection. Pass a NULL callback to turn it off.
+ ****************************************************************************/
+
+void db_set_metrics(db_t *db, bool enabled);
+void db_set_slow_query(db_t *db, unsigned int threshold_ms, db_slow_query_cb_t cb, void *user_data);
+
+void db_metrics(db_t *db, db_metrics_t *metrics);
+void db_metrics_reset(db_t *db);
+
+/*****************************************************************************
+ * db_stmt
+ *
+ * Server side prepared statements using the binary protocol. db_prepare()
+ * caches statements per connection by their SQL text, so calling it again
+ * with the same query is only a hash lookup. The statement belongs to the
+ * connection and must not be freed; it stays valid until the connection is
+ * disconnected, reconnected or freed, so call db_prepare() each time it's
+ * needed rather than holding on to it.
+ *
+ * Parameter and column indexes start at 0. Strings and blobs passed to
+ * db_stmt_bind_str() and db_stmt_bind_blob() are not copied and must stay
+ * valid until db_stmt_execute() returns. An unsigned BIGINT past INT64_MAX
+ * wraps around in db_stmt_int64(), but db_stmt_str() and db_stmt_double()
+ * give its real value. Errors are reported by db_error(). Prepared statements
+ * need the MySQL driver.
+ ****************************************************************************/
+
+db_stmt_t * db_prepare(db_t *db, const char *query);
+
+bool db_stmt_bind_null(db_stmt_t *stmt, unsigned int index);
+bool db_stmt_bind_int64(db_stmt_t *stmt, unsigned int index, int64_t value);
+bool db_stmt_bind_double(db_stmt_t *stmt, unsigned int index, double value);
+bool db_stmt_bind_blob(db_stmt_t *stmt, unsigned int index, const void *data, unsigned long len);
+bool db_stmt_bind_str(db_stmt_t *stmt, unsigned int index, const char *str);
+
+bool db_stmt_execute(db_stmt_t *stmt);
+
+unsigned long long db_stmt_affected_rows(db_stmt_t *stmt);
+unsigned long long db_stmt_insert_id(db_stmt_t *stmt);
+
+bool db_stmt_next(db_stmt_t *stmt);
+
+bool db_stmt_is_null(db_stmt_t *stmt, unsigned int index);
+int64_t db_stmt_int64(db_stmt_t *stmt, unsigned int index);
+double db_stmt_double(db_stmt_t *stmt, unsigned int index);
+const char * db_stmt_str(db_stmt_t *stmt, unsigned int index);
+const void * db_stmt_blob(db_stmt_t *stmt, unsigned int index, unsigned long *len);
+
+/*****************************************************************************
+ * db_batch
+ *
+ * Collects rows and sends many of them at once, either as one multi row
+ * INSERT or as the data for a LOAD DATA LOCAL INFILE which is read straight
+ * from memory. Start each row with db_batch_row() and then add its values in
+ * column order. Rows are sent whenever the row or byte limit would be passed;
+ * for INSERT batches the byte limit is also kept under the server's
+ * max_allowed_packet. Call db_batch_flush() to send whatever is left before
+ * freeing the batch, otherwise those rows are thrown away.
+ *
+ * The table and column names are put into the statement as they are, so they
+ * must not come from untrusted input. Errors are reported by db_error().
+ ****************************************************************************/
+
+db_batch_t * db_batch_init(db_t *db, const char *table, const char *columns, int mode);
+void db_batch_free(db_batch_t *batch);
+
+void db_batch_set_limits(db_batch_t *batch, unsigned int max_rows, size_t max_bytes);
+
+bool db_batch_row(db_batch_t *batch);
+bool db_batch_null(db_batch_t *batch);
+bool db_batch_int64(db_batch_t *batch, int64_t value);
+bool db_batch_double(db_batch_t *batch, double value);
+bool db_batch_str(db_batch_t *batch, const char *str);
+bool db_batch_blob(db_batch_t *batch, const void *data, size_t len);
+
+bool db_batch_flush(db_batch_t *batch);
+
+unsigned long long db_batch_count(db_batch_t *batch);
+
+/*****************************************************************************
+ * db_sql
+ *
+ * Builds a query in a buffer that belongs to the calling thread and is reused
+ * for every query, so nothing is allocated once it has grown to fit. Strings
+ * are escaped and quoted, blobs are written as hex literals, and a NULL string
+ * or blob, or a NaN or infinite double, is written as NULL. The appends can be
+ * chained without checking each one; if any fails, db_sql_query() and
+ * db_sql_select() fail too. Errors are reported by db_error().
+ *
+ * Each thread has only one builder, so db_sql_begin() throws away anything a
+ * previous call on the same thread was building.
+ ****************************************************************************/
+
+db_sql_t * db_sql_begin(db_t *db);
+
+bool db_sql_append(db_sql_t *sql, const char *str);
+bool db_sql_append_len(db_sql_t *sql, const char *str, size_t len);
+bool db_sql_null(db_sql_t *sql);
+bool db_sql_int64(db_sql_t *sql, int64_t value);
+bool db_sql_double(db_sql_t *sql, double value);
+bool db_sql_str(db_sql_t *sql, const char *str);
+bool db_sql_blob(db_sql_t *sql, const void *data, size_t len);
+
+const char * db_sql_data(db_sql_t *sql, size_t *len);
+
+bool db_sql_query(db_sql_t *sql);
+db_result_t * db_sql_select(db_sql_t *sql);
+
+/*****************************************************************************
+ * db_cache
+ *
+ * An optional client side cache for read only queries against tables that
+ * rarely change. db_select_cached() looks the query up by its text, after
+ * collapsing whitespace and adding the server and database, and only goes to
+ * the server on a miss. The rows are then copied into a single allocation
+ * that later results read straight from. Results expire after the cache's TTL
+ * and the least recently used are evicted to stay under its size; a result
+ * bigger than a quarter of the cache isn't cached at all.
+ *
+ * tables is a comma separated list of the tables the query reads from, and
+ * db_cache_invalidate() drops every result that listed the given table. It's
+ * up to the caller to invalidate after writing to those tables, and to only
+ * cache queries whose results depend on nothing but their text, so no NOW(),
+ * RAND() or session variables. Without a cache set on the connection,
+ * db_select_cached() is the same as db_select().
+ *
+ * A cache can be shared by any number of connections and threads. It must
+ * outlive the connections using it, and every result it returned must be
+ * freed before db_cache_free() is called.
+ ****************************************************************************/
+
+db_cache_t * db_cache_init(size_t max_bytes);
+void db_cache_free(db_cache_t *cache);
+
+void db_cache_set_ttl(db_cache_t *cache, unsigned int seconds);
+
+void db_cache_invalidate(db_cache_t *cache, const char *table);
+void db_cache_clear(db_cache_t *cache);
+
+size_t db_cache_size(db_cache_t *cache);
+unsigned long long db_cache_hits(db_cache_t *cache);
+unsigned long long db_cache_misses(db_cache_t *cache);
+
+void db_set_cache(db_t *db, db_cache_t *cache);
+
+db_result_t * db_select_cached(db_t *db, const char *tables, const char *query, unsigned int len);
+db_result_t * db_selectf_cached(db_t *db, const char *tables, const char *fmt, ...);
+
+/*****************************************************************************
+ * db_pool
+ *
+ * A pool of connections to the same server. Each thread checks out its own
+ * db_t, so queries from different threads run in parallel instead of queuing
+ * behind a single connection. Connections are handed back to the thread that
+ * used them last when possible, pinged on checkout if they've been idle for
+ * longer than the ping interval, and reconnected if the ping fails.
+ *
+ * Every connection that is checked out must be returned with
+ * db_pool_return() before db_pool_free() is called.
+ ****************************************************************************/
+
+db_pool_t * db_pool_init(unsigned int min, unsigned int max);
+void db_pool_free(db_pool_t *pool);
+
+const char * db_pool_error(db_pool_t *pool);
+
+void db_pool_set_ping_interval(db_pool_t *pool, unsigned int seconds);
+void db_pool_set_idle_timeout(db_pool_t *pool, unsigned int seconds);
+void db_pool_set_timeout(db_pool_t *pool, unsigned int timeout_ms);
+void db_pool_set_cache(db_pool_t *pool, db_cache_t *cache);
+void db_pool_set_driver(db_pool_t *pool, const db_driver_t *driver, void *driver_data);
+
+//can be called again after it fails, but not once it has succeeded
+bool db_pool_connect(db_pool_t *pool, const char *host, const char *user, const char *password, const char *database, unsigned int port);
+
+unsigned int db_pool_size(db_pool_t *pool);
+
+db_t * db_pool_checkout(db_pool_t *pool);
+void db_pool_return(db_pool_t *pool, db_t *db);
+
+/*****************************************************************************
+ * db_async
+ *
+ * Runs queries on a set of worker threads that each check out a connection
+ * from a pool, so one thread can keep many queries in flight without
+ * blocking. The query text is copied when it's submitted.
+ *
+ * Callbacks don't run on the worker threads. Instead, db_async_fd() becomes
+ * readable when queries have finished, which fits into poll()/epoll() or any
+ * event loop, and db_async_process() then runs the callbacks for everything
+ * that's done on the calling thread. A select's callback owns the result and
+ * must call db_result_free() on it. db_async_free() waits for running queries,
+ * runs their callbacks, and fails anything that never started with
+ * "Cancelled".
+ ****************************************************************************/
+
+db_async_t * db_async_init(db_pool_t *pool, unsigned int threads);
+void db_async_free(db_async_t *async);
+
+bool db_async_query(db_async_t *async, const char *query, unsigned int len, db_async_cb_t cb, void *user_data);
+bool db_async_select(db_async_t *async, const char *query, unsigned int len, db_async_cb_t cb, void *user_data);
+
+int db_async_fd(db_async_t *async);
+unsigned int db_async_pending(db_async_t *async);
+unsigned int db_async_process(db_async_t *async);
@@ -0,0 +1,694 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include "alist.h"
+#include "buffer.h"
+#include "lock.h"
+#include "string.h"
+#include "db_mock.h"
+
+typedef struct {
+    char *prefix;
+    size_t prefix_len;
+    unsigned int latency_us;
+    unsigned int error_code;    //0 if the rule succeeds
+    char *error;
+    unsigned int num_fields;    //0 for a rule without a result set
+    db_field_t *fields;
+    unsigned long long num_rows;
+    char **cells;               //num_rows * num_fields values, NULL for SQL NULL
+    unsigned long *lengths;
+    char *columns;              //the column names and values point into these copies
+    char *rows;
+} db_mock_rule_t;
+
+struct db_mock_t {
+    lock_t *lock;
+    alist_t *rules;
+    unsigned int latency_us;
+    unsigned int connect_latency_us;
+    char *connect_error;
+    buffer_t *last_query;
+    unsigned long long connects;
+    unsigned long long queries;
+    unsigned long long loaded_bytes;
+    unsigned long long loaded_rows;
+};
+
+typedef struct {
+    db_mock_t *mock;
+    bool lost;                  //a DB_MOCK_ERROR_LOST rule fired, nothing works until it reconnects
+    const db_mock_rule_t *pending; //the rule whose rows result() returns
+    unsigned int error_code;
+    char error[256];
+} db_mock_conn_t;
+
+typedef struct {
+    const db_mock_rule_t *rule;
+    unsigned long long pos;
+} db_mock_result_t;
+
+static void
+db_mock_rule_free(db_mock_rule_t *rule) {
+    free(rule->prefix);
+    free(rule->error);
+    free(rule->fields);
+    free(rule->cells);
+    free(rule->lengths);
+    free(rule->columns);
+    free(rule->rows);
+    free(rule);
+}
+
+db_mock_t *
+db_mock_init() {
+    db_mock_t *mock;
+
+    mock = calloc(1, sizeof(*mock));
+    if (mock == NULL) {
+        return NULL;
+    }
+
+    mock->lock = lock_init();
+    mock->rules = alist_init();
+    mock->last_query = buffer_init();
+    if (mock->lock == NULL || mock->rules == NULL || mock->last_query == NULL) {
+        db_mock_free(mock);
+        return NULL;
+    }
+
+    return mock;
+}
+
+void
+db_mock_free(db_mock_t *mock) {
+    if (mock == NULL) {
+        return;
+    }
+
+    if (mock->rules != NULL) {
+        alist_free_func(mock->rules, (void (*)(void *))db_mock_rule_free);
+    }
+
+    lock_free(mock->lock);
+    buffer_free(mock->last_query);
+    free(mock->connect_error);
+    free(mock);
+}
+
+void
+db_mock_set_latency(db_mock_t *mock, unsigned int latency_us) {
+    lock_write_lock(mock->lock);
+    mock->latency_us = latency_us;
+    lock_write_unlock(mock->lock);
+}
+
+void
+db_mock_set_connect_latency(db_mock_t *mock, unsigned int latency_us) {
+    lock_write_lock(mock->lock);
+    mock->connect_latency_us = latency_us;
+    lock_write_unlock(mock->lock);
+}
+
+void
+db_mock_set_connect_error(db_mock_t *mock, const char *error) {
+    lock_write_lock(mock->lock);
+    free(mock->connect_error);
+    mock->connect_error = error == NULL ? NULL : strdup(error);
+    lock_write_unlock(mock->lock);
+}
+
+static int
+db_mock_parse_type(const char *type) {
+    static const struct {
+        const char *name;
+        int type;
+    } types[] = {
+        {"integer",  DB_TYPE_INTEGER},
+        {"float",    DB_TYPE_FLOAT},
+        {"decimal",  DB_TYPE_DECIMAL},
+        {"string",   DB_TYPE_STRING},
+        {"blob",     DB_TYPE_BLOB},
+        {"temporal", DB_TYPE_TEMPORAL},
+        {"null",     DB_TYPE_NULL}
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcasecmp(type, types[i].name) == 0) {
+            return types[i].type;
+        }
+    }
+
+    return DB_TYPE_STRING;
+}
+
+//splits the column list in place into names and types
+static bool
+db_mock_parse_columns(db_mock_rule_t *rule) {
+    char *str, *type;
+    unsigned int i;
+
+    rule->num_fields = 1;
+    for (str = rule->columns; *str != '\0'; str++) {
+        if (*str == ',') {
+            ++rule->num_fields;
+        }
+    }
+
+    rule->fields = calloc(rule->num_fields, sizeof(*rule->fields));
+    if (rule->fields == NULL) {
+        return false;
+    }
+
+    str = rule->columns;
+    for (i = 0; i < rule->num_fields; i++) {
+        rule->fields[i].name = str;
+        rule->fields[i].type = DB_TYPE_STRING;
+
+        str += strcspn(str, ",");
+        if (*str == ',') {
+            *str++ = '\0';
+        }
+
+        type = strchr(rule->fields[i].name, ':');
+        if (type != NULL) {
+            *type++ = '\0';
+            rule->fields[i].type = db_mock_parse_type(type);
+        }
+    }
+
+    return true;
+}
+
+//turns \0 into a NUL and \\ into a backslash in place and returns the new length, so blobs can hold any byte
+static unsigned long
+db_mock_unescape(char *str, size_t len) {
+    size_t i, j = 0;
+
+    for (i = 0; i < len; i++) {
+        if (str[i] == '\\' && i + 1 < len && (str[i + 1] == '0' || str[i + 1] == '\\')) {
+            str[j++] = str[++i] == '0' ? '\0' : '\\';
+        }
+        else {
+            str[j++] = str[i];
+        }
+    }
+
+    str[j] = '\0';
+
+    return (unsigned long)j;
+}
+
+//splits the rows in place into values. missing values are NULL and extra ones are ignored
+static bool
+db_mock_parse_rows(db_mock_rule_t *rule) {
+    unsigned long long row;
+    unsigned int i;
+    size_t len;
+    char *str, *end, *next;
+
+    len = strlen(rule->rows);
+    if (len > 0 && rule->rows[len - 1] == '\n') {
+        rule->rows[--len] = '\0';
+    }
+
+    if (len > 0) {
+        rule->num_rows = 1;
+        for (str = rule->rows; *str != '\0'; str++) {
+            if (*str == '\n') {
+                ++rule->num_rows;
+            }
+        }
+    }
+
+    if (rule->num_rows == 0) {
+        return true;
+    }
+
+    rule->cells = calloc((size_t)rule->num_rows * rule->num_fields, sizeof(*rule->cells));
+    rule->lengths = calloc((size_t)rule->num_rows * rule->num_fields, sizeof(*rule->lengths));
+    if (rule->cells == NULL || rule->lengths == NULL) {
+        return false;
+    }
+
+    str = rule->rows;
+    for (row = 0; row < rule->num_rows; row++) {
+        end = str + strcspn(str, "\n");
+        if (*end == '\n') {
+            *end++ = '\0';
+        }
+
+        for (i = 0; i < rule->num_fields && str != NULL; i++) {
+            len = strcspn(str, "\t");
+            next = str[len] == '\t' ? str + len + 1 : NULL;
+
+            if (!(len == 2 && str[0] == '\\' && str[1] == 'N')) {
+                rule->cells[(row * rule->num_fields) + i] = str;
+                rule->lengths[(row * rule->num_fields) + i] = db_mock_unescape(str, len);
+            }
+            else {
+                str[len] = '\0';
+            }
+
+            str = next;
+        }
+
+        str = end;
+    }
+
+    return true;
+}
+
+static bool
+db_mock_add(db_mock_t *mock, db_mock_rule_t *rule, const char *prefix) {
+    bool success;
+
+    rule->prefix = strdup(prefix);
+    if (rule->prefix == NULL) {
+        db_mock_rule_free(rule);
+        return false;
+    }
+
+    rule->prefix_len = strlen(prefix);
+
+    lock_write_lock(mock->lock);
+    success = alist_add(mock->rules, rule);
+    lock_write_unlock(mock->lock);
+
+    if (!success) {
+        db_mock_rule_free(rule);
+    }
+
+    return success;
+}
+
+bool
+db_mock_result(db_mock_t *mock, const char *prefix, unsigned int latency_us, const char *columns, const char *rows) {
+    db_mock_rule_t *rule;
+
+    rule = calloc(1, sizeof(*rule));
+    if (rule == NULL) {
+        return false;
+    }
+
+    rule->latency_us = latency_us;
+
+    if (columns != NULL) {
+        rule->columns = strdup(columns);
+        rule->rows = strdup(rows == NULL ? "" : rows);
+        if (rule->columns == NULL || rule->rows == NULL || !db_mock_parse_columns(rule) || !db_mock_parse_rows(rule)) {
+            db_mock_rule_free(rule);
+            return false;
+        }
+    }
+
+    return db_mock_add(mock, rule, prefix);
+}
+
+bool
+db_mock_error(db_mock_t *mock, const char *prefix, unsigned int latency_us, unsigned int code, const char *error) {
+    db_mock_rule_t *rule;
+
+    rule = calloc(1, sizeof(*rule));
+    if (rule == NULL) {
+        return false;
+    }
+
+    rule->latency_us = latency_us;
+    rule->error_code = code == 0 ? 1 : code;
+    rule->error = strdup(error);
+    if (rule->error == NULL) {
+        db_mock_rule_free(rule);
+        return false;
+    }
+
+    return db_mock_add(mock, rule, prefix);
+}
+
+unsigned long long
+db_mock_connects(db_mock_t *mock) {
+    unsigned long long connects;
+
+    lock_write_lock(mock->lock);
+    connects = mock->connects;
+    lock_write_unlock(mock->lock);
+
+    return connects;
+}
+
+unsigned long long
+db_mock_queries(db_mock_t *mock) {
+    unsigned long long queries;
+
+    lock_write_lock(mock->lock);
+    queries = mock->queries;
+    lock_write_unlock(mock->lock);
+
+    return queries;
+}
+
+unsigned long long
+db_mock_loaded_bytes(db_mock_t *mock) {
+    unsigned long long bytes;
+
+    lock_write_lock(mock->lock);
+    bytes = mock->loaded_bytes;
+    lock_write_unlock(mock->lock);
+
+    return bytes;
+}
+
+unsigned long long
+db_mock_loaded_rows(db_mock_t *mock) {
+    unsigned long long rows;
+
+    lock_write_lock(mock->lock);
+    rows = mock->loaded_rows;
+    lock_write_unlock(mock->lock);
+
+    return rows;
+}
+
+size_t
+db_mock_last_query(db_mock_t *mock, char *dst, size_t size) {
+    size_t len;
+
+    lock_write_lock(mock->lock);
+    len = buffer_length(mock->last_query);
+    if (size > 0) {
+        if (len == 0) {
+            dst[0] = '\0';
+        }
+        else {
+            strlcpy(dst, (const char *)buffer_data(mock->last_query), size);
+        }
+    }
+    lock_write_unlock(mock->lock);
+
+    return len == 0 ? 0 : len - 1;
+}
+
+static void
+db_mock_sleep(unsigned int latency_us) {
+    struct timespec ts;
+
+    if (latency_us == 0) {
+        return;
+    }
+
+    ts.tv_sec = latency_us / 1000000;
+    ts.tv_nsec = (long)(latency_us % 1000000) * 1000;
+
+    //a signal leaves the rest of the time in ts, but anything else would fail the same way forever
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+/*****************************************************************************
+ * driver
+ ****************************************************************************/
+
+static void *
+db_mock_connect(void *driver_data, const char *host, const char *user, const char *password, const char *database, unsigned int port, char *error, size_t error_size) {
+    unsigned int latency_us;
+    db_mock_conn_t *conn;
+    db_mock_t *mock;
+    bool refused;
+
+    mock = driver_data;
+    if (mock == NULL) {
+        snprintf(error, error_size, "%s", "The mock driver needs a db_mock_t");
+        return NULL;
+    }
+
+    lock_write_lock(mock->lock);
+    latency_us = mock->connect_latency_us;
+    refused = mock->connect_error != NULL;
+    if (refused) {
+        snprintf(error, error_size, "%s", mock->connect_error);
+    }
+    else {
+        ++mock->connects;
+    }
+    lock_write_unlock(mock->lock);
+
+    db_mock_sleep(latency_us);
+
+    if (refused) {
+        return NULL;
+    }
+
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        snprintf(error, error_size, "%s", "Out of memory");
+        return NULL;
+    }
+
+    conn->mock = mock;
+
+    return conn;
+}
+
+static void
+db_mock_close(void *conn) {
+    free(conn);
+}
+
+static bool
+db_mock_lost(db_mock_conn_t *conn) {
+    snprintf(conn->error, sizeof(conn->error), "%s", "Lost connection to the mock server");
+    conn->error_code = DB_MOCK_ERROR_LOST;
+
+    return false;
+}
+
+static bool
+db_mock_ping(void *ptr) {
+    db_mock_conn_t *conn;
+
+    conn = ptr;
+    if (conn->lost) {
+        return db_mock_lost(conn);
+    }
+
+    conn->error_code = 0;
+
+    return true;
+}
+
+//runs a query against the rules. data is what a LOAD DATA statement sends, NULL for anything else
+static bool
+db_mock_run(db_mock_conn_t *conn, const char *query, unsigned long len, const void *data, size_t data_len) {
+    const db_mock_rule_t *rule = NULL, *check;
+    unsigned int i, latency_us;
+    const char *end;
+    db_mock_t *mock;
+    size_t j;
+
+    mock = conn->mock;
+    conn->pending = NULL;
+    conn->error_code = 0;
+    conn->error[0] = '\0';
+
+    end = query + len;
+    while (query < end && isspace((unsigned char)*query)) {
+        ++query;
+    }
+
+    lock_write_lock(mock->lock);
+
+    ++mock->queries;
+
+    buffer_clear(mock->last_query);
+    if (buffer_write(mock->last_query, (unsigned char *)query, (size_t)(end - query))) {
+        buffer_write_char(mock->last_query, '\0');
+    }
+
+    //newest rule first so later rules can override earlier ones
+    for (i = alist_size(mock->rules); i > 0 && rule == NULL; i--) {
+        check = alist_get(mock->rules, i - 1);
+        if (check->prefix_len <= (size_t)(end - query) && memcmp(query, check->prefix, check->prefix_len) == 0) {
+            rule = check;
+        }
+    }
+
+    latency_us = rule == NULL ? mock->latency_us : rule->latency_us;
+
+    if (data != NULL && !conn->lost && (rule == NULL || rule->error_code == 0)) {
+        mock->loaded_bytes += data_len;
+        for (j = 0; j < data_len; j++) {
+            if (((const char *)data)[j] == '\n') {
+                ++mock->loaded_rows;
+            }
+        }
+    }
+
+    lock_write_unlock(mock->lock);
+
+    //rules are never removed, so it's safe to use without the lock
+    db_mock_sleep(latency_us);
+
+    if (conn->lost) {
+        return db_mock_lost(conn);
+    }
+
+    if (rule != NULL && rule->error_code != 0) {
+        snprintf(conn->error, sizeof(conn->error), "%s", rule->error);
+        conn->error_code = rule->error_code;
+        conn->lost = rule->error_code == DB_MOCK_ERROR_LOST;
+        return false;
+    }
+
+    if (rule != NULL && rule->num_fields > 0) {
+        conn->pending = rule;
+    }
+
+    return true;
+}
+
+static bool
+db_mock_query(void *conn, const char *query, unsigned long len) {
+    return db_mock_run(conn, query, len, NULL, 0);
+}
+
+static bool
+db_mock_load(void *conn, const char *query, unsigned long len, const void *data, size_t data_len) {
+    return db_mock_run(conn, query, len, data, data_len);
+}
+
+static void *
+db_mock_result_init(void *ptr, bool stream) {
+    db_mock_result_t *result;
+    db_mock_conn_t *conn;
+
+    conn = ptr;
+    if (conn->pending == NULL) {
+        return NULL;
+    }
+
+    result = calloc(1, sizeof(*result));
+    if (result == NULL) {
+        snprintf(conn->error, sizeof(conn->error), "%s", "Out of memory");
+        conn->error_code = 1;
+        return NULL;
+    }
+
+    result->rule = conn->pending;
+    conn->pending = NULL;
+
+    return result;
+}
+
+static void
+db_mock_result_free(void *result) {
+    free(result);
+}
+
+static unsigned int
+db_mock_num_fields(void *result) {
+    return ((db_mock_result_t *)result)->rule->num_fields;
+}
+
+static const db_field_t *
+db_mock_fields(void *result) {
+    return ((db_mock_result_t *)result)->rule->fields;
+}
+
+static char **
+db_mock_fetch(void *ptr, unsigned long **lengths) {
+    db_mock_result_t *result;
+    const db_mock_rule_t *rule;
+    size_t offset;
+
+    result = ptr;
+    rule = result->rule;
+
+    if (result->pos >= rule->num_rows) {
+        return NULL;
+    }
+
+    offset = (size_t)result->pos * rule->num_fields;
+    ++result->pos;
+
+    *lengths = rule->lengths + offset;
+
+    return rule->cells + offset;
+}
+
+static unsigned long long
+db_mock_num_rows(void *result) {
+    return ((db_mock_result_t *)result)->rule->num_rows;
+}
+
+static void
+db_mock_seek(void *result, unsigned long long row) {
+    ((db_mock_result_t *)result)->pos = row;
+}
+
+//the same characters mysql_real_escape_string() escapes
+static unsigned long
+db_mock_escape(void *conn, char *dst, const char *src, unsigned long len) {
+    unsigned long i, j = 0;
+
+    for (i = 0; i < len; i++) {
+        switch (src[i]) {
+            case '\0':   dst[j++] = '\\'; dst[j++] = '0';  break;
+            case '\n':   dst[j++] = '\\'; dst[j++] = 'n';  break;
+            case '\r':   dst[j++] = '\\'; dst[j++] = 'r';  break;
+            case '\\':   dst[j++] = '\\'; dst[j++] = '\\'; break;
+            case '\'':   dst[j++] = '\\'; dst[j++] = '\''; break;
+            case '"':    dst[j++] = '\\'; dst[j++] = '"';  break;
+            case '\032': dst[j++] = '\\'; dst[j++] = 'Z';  break;
+            default:     dst[j++] = src[i];                break;
+        }
+    }
+
+    dst[j] = '\0';
+
+    return j;
+}
+
+static const char *
+db_mock_error_str(void *conn) {
+    return ((db_mock_conn_t *)conn)->error;
+}
+
+static unsigned int
+db_mock_error_code(void *conn) {
+    return ((db_mock_conn_t *)conn)->error_code;
+}
+
+static bool
+db_mock_error_is_connection(unsigned int code) {
+    return code == DB_MOCK_ERROR_LOST;
+}
+
+static const db_driver_t db_mock = {
+    "mock",
+    db_mock_connect,
+    db_mock_close,
+    db_mock_ping,
+    db_mock_query,
+    db_mock_load,
+    db_mock_result_init,
+    db_mock_result_free,
+    db_mock_num_fields,
+    db_mock_fields,
+    db_mock_fetch,
+    db_mock_num_rows,
+    db_mock_seek,
+    db_mock_escape,
+    db_mock_error_str,
+    db_mock_error_code,
+    db_mock_error_is_connection
+};
+
+const db_driver_t *
+db_mock_driver() {
+    return &db_mock;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "db.h"
+
+#define DB_MOCK_ERROR_LOST 2013 //!< An error code that also drops the connection, like a server going away.
+
+typedef struct db_mock_t db_mock_t;
+
+/*****************************************************************************
+ * db_mock
+ *
+ * An in-process driver that answers queries from a script instead of a
+ * server, so code using db_t, db_pool_t, db_batch_t and the rest can be tested
+ * and load tested without MySQL. Pass db_mock_driver() and the db_mock_t to
+ * db_init_driver() or db_pool_set_driver(); any number of connections can
+ * share one db_mock_t.
+ *
+ * Each rule matches queries that start with its prefix, ignoring leading
+ * whitespace, and the newest matching rule wins. A rule sleeps for its
+ * latency and then returns rows, an error, or nothing. Queries that match no
+ * rule succeed without a result set after the default latency.
+ *
+ * Result columns are comma separated names, each optionally followed by a
+ * type: "id:integer,name,price:decimal". The types are integer, float,
+ * decimal, string, blob, temporal and null, and string is the default. Rows
+ * are separated by newlines and values by tabs, with \N for NULL, the same as
+ * a LOAD DATA file. The only other escapes are \0 for a NUL byte and \\ for
+ * a backslash. NULL columns make a rule that succeeds without a result set,
+ * for INSERTs and the like.
+ *
+ * LOAD DATA LOCAL INFILE is matched like any other query and the data is
+ * counted by db_mock_loaded_bytes() and db_mock_loaded_rows(). Strings are
+ * escaped the way MySQL escapes them. Rules can't be removed, and the
+ * db_mock_t must outlive every connection using it.
+ ****************************************************************************/
+
+db_mock_t * db_mock_init();
+void db_mock_free(db_mock_t *mock);
+
+const db_driver_t * db_mock_driver();
+
+void db_mock_set_latency(db_mock_t *mock, unsigned int latency_us);
+void db_mock_set_connect_latency(db_mock_t *mock, unsigned int latency_us);
+void db_mock_set_connect_error(db_mock_t *mock, const char *error);
+
+bool db_mock_result(db_mock_t *mock, const char *prefix, unsigned int latency_us, const char *columns, const char *rows);
+bool db_mock_error(db_mock_t *mock, const char *prefix, unsigned int latency_us, unsigned int code, const char *error);
+
+unsigned long long db_mock_connects(db_mock_t *mock);
+unsigned long long db_mock_queries(db_mock_t *mock);
+unsigned long long db_mock_loaded_bytes(db_mock_t *mock);
+unsigned long long db_mock_loaded_rows(db_mock_t *mock);
+
+size_t db_mock_last_query(db_mock_t *mock, char *dst, size_t size);
@@ -0,0 +1,423 @@
+#include <stdint.h>
+#include <string.h>
+#include "dtoa.h"
+
+//Grisu2 from Florian Loitsch's "Printing Floating-Point Numbers Quickly and Accurately with Integers", by way of
+//Milo Yip's version. it always gives digits that read back as the same double, and almost always the fewest
+
+#define DTOA_SIGNIFICAND_MASK UINT64_C(0x000fffffffffffff)
+#define DTOA_EXPONENT_MASK    UINT64_C(0x7ff0000000000000)
+#define DTOA_HIDDEN_BIT       UINT64_C(0x0010000000000000)
+#define DTOA_EXPONENT_BIAS    (0x3ff + 52)
+
+#define DTOA_MAX_DIGITS 17 //significant digits it takes to tell any two doubles apart
+
+//a 64 bit significand and a binary exponent, without any rounding or special values
+typedef struct {
+    uint64_t f;
+    int e;
+} dtoa_fp_t;
+
+//10^-348 through 10^340 in steps of 8, normalized so the significand's top bit is set
+static const uint64_t dtoa_powers_f[] = {
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+    UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+    UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+    UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+    UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+    UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+    UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+    UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+    UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+    UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+    UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+    UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+    UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+    UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+    UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b)
+};
+
+static const int16_t dtoa_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066
+};
+
+static const uint64_t dtoa_pow10[] = {
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000),
+    UINT64_C(10000000), UINT64_C(100000000), UINT64_C(1000000000), UINT64_C(10000000000), UINT64_C(100000000000),
+    UINT64_C(1000000000000), UINT64_C(10000000000000), UINT64_C(100000000000000), UINT64_C(1000000000000000),
+    UINT64_C(10000000000000000), UINT64_C(100000000000000000), UINT64_C(1000000000000000000),
+    UINT64_C(10000000000000000000)
+};
+
+static dtoa_fp_t
+dtoa_fp(uint64_t f, int e) {
+    dtoa_fp_t fp;
+
+    fp.f = f;
+    fp.e = e;
+
+    return fp;
+}
+
+//the upper half of the 128 bit product, rounded
+static dtoa_fp_t
+dtoa_fp_multiply(dtoa_fp_t x, dtoa_fp_t y) {
+    uint64_t a, b, c, d, ac, bc, ad, bd, tmp;
+
+    a = x.f >> 32;
+    b = x.f & 0xffffffff;
+    c = y.f >> 32;
+    d = y.f & 0xffffffff;
+
+    ac = a * c;
+    bc = b * c;
+    ad = a * d;
+    bd = b * d;
+
+    tmp = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff);
+    tmp += UINT64_C(1) << 31;
+
+    return dtoa_fp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64);
+}
+
+static dtoa_fp_t
+dtoa_fp_normalize(dtoa_fp_t fp) {
+    while (!(fp.f & (UINT64_C(1) << 63))) {
+        fp.f <<= 1;
+        fp.e--;
+    }
+
+    return fp;
+}
+
+//the points halfway to the doubles on either side of v, which every digit string between them reads back as v
+static void
+dtoa_boundaries(dtoa_fp_t v, dtoa_fp_t *minus, dtoa_fp_t *plus) {
+    dtoa_fp_t p, m;
+
+    p = dtoa_fp((v.f << 1) + 1, v.e - 1);
+    while (!(p.f & (DTOA_HIDDEN_BIT << 1))) {
+        p.f <<= 1;
+        p.e--;
+    }
+    p.f <<= 64 - 52 - 2;
+    p.e -= 64 - 52 - 2;
+
+    //the double below a power of 2 is half as far away as the one above it
+    if (v.f == DTOA_HIDDEN_BIT) {
+        m = dtoa_fp((v.f << 2) - 1, v.e - 2);
+    }
+    else {
+        m = dtoa_fp((v.f << 1) - 1, v.e - 1);
+    }
+
+    m.f <<= m.e - p.e;
+    m.e = p.e;
+
+    *plus = p;
+    *minus = m;
+}
+
+//a cached power of 10 that brings a number with binary exponent e into the range digit generation works in
+static dtoa_fp_t
+dtoa_cached_power(int e, int *k) {
+    double dk;
+    int kk;
+    unsigned int index;
+
+    dk = ((-61 - e) * 0.30102999566398114) + 347;
+    kk = (int)dk;
+    if (dk - kk > 0.0) {
+        kk++;
+    }
+
+    index = (unsigned int)((kk >> 3) + 1);
+    *k = -(-348 + (int)(index * 8));
+
+    return dtoa_fp(dtoa_powers_f[index], dtoa_powers_e[index]);
+}
+
+//nudges the last digit toward w while it stays inside the boundaries
+static void
+dtoa_round(char *digits, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int
+dtoa_count_digits(uint32_t n) {
+    int count = 1;
+
+    while (n >= 10) {
+        n /= 10;
+        count++;
+    }
+
+    return count;
+}
+
+static int
+dtoa_digit_gen(dtoa_fp_t w, dtoa_fp_t mp, uint64_t delta, char *digits, int *k) {
+    dtoa_fp_t one;
+    uint64_t wp_w, p2, tmp;
+    uint32_t p1, d;
+    int kappa, len = 0, index;
+
+    one = dtoa_fp(UINT64_C(1) << -mp.e, mp.e);
+    wp_w = mp.f - w.f;
+    p1 = (uint32_t)(mp.f >> -one.e);
+    p2 = mp.f & (one.f - 1);
+
+    //the integer part
+    for (kappa = dtoa_count_digits(p1); kappa > 0;) {
+        d = p1 / (uint32_t)dtoa_pow10[kappa - 1];
+        p1 %= (uint32_t)dtoa_pow10[kappa - 1];
+
+        if (d != 0 || len != 0) {
+            digits[len++] = (char)('0' + d);
+        }
+
+        kappa--;
+        tmp = ((uint64_t)p1 << -one.e) + p2;
+        if (tmp <= delta) {
+            *k += kappa;
+            dtoa_round(digits, len, delta, tmp, dtoa_pow10[kappa] << -one.e, wp_w);
+            return len;
+        }
+    }
+
+    //and then the fraction
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        d = (uint32_t)(p2 >> -one.e);
+
+        if (d != 0 || len != 0) {
+            digits[len++] = (char)('0' + d);
+        }
+
+        p2 &= one.f - 1;
+        kappa--;
+
+        if (p2 < delta) {
+            *k += kappa;
+            index = -kappa;
+            dtoa_round(digits, len, delta, p2, one.f, wp_w * (index < 20 ? dtoa_pow10[index] : 0));
+            return len;
+        }
+    }
+}
+
+//the digits of a positive, finite, non-zero v, which is digits * 10^k
+static int
+dtoa_grisu2(double value, char *digits, int *k) {
+    dtoa_fp_t v, w, wm, wp, c;
+    uint64_t bits;
+    int biased_e;
+
+    memcpy(&bits, &value, sizeof(bits));
+    biased_e = (int)((bits & DTOA_EXPONENT_MASK) >> 52);
+
+    if (biased_e != 0) {
+        v = dtoa_fp((bits & DTOA_SIGNIFICAND_MASK) + DTOA_HIDDEN_BIT, biased_e - DTOA_EXPONENT_BIAS);
+    }
+    else {
+        v = dtoa_fp(bits & DTOA_SIGNIFICAND_MASK, 1 - DTOA_EXPONENT_BIAS);
+    }
+
+    dtoa_boundaries(v, &wm, &wp);
+    c = dtoa_cached_power(wp.e, k);
+
+    w = dtoa_fp_multiply(dtoa_fp_normalize(v), c);
+    wp = dtoa_fp_multiply(wp, c);
+    wm = dtoa_fp_multiply(wm, c);
+    wm.f++;
+    wp.f--;
+
+    return dtoa_digit_gen(w, wp, wp.f - wm.f, digits, k);
+}
+
+//rounds the digits to end at the 10^-precision place, dropping any zeros left at the end
+static int
+dtoa_round_places(char *digits, int len, int *k, int precision) {
+    int keep, i;
+
+    //how many digits are left of the cut
+    keep = len + *k + precision;
+    if (keep >= len) {
+        return len;
+    }
+
+    if (keep < 0) {
+        return 0;
+    }
+
+    if (digits[keep] >= '5') {
+        for (i = keep - 1; i >= 0 && digits[i] == '9'; i--) {
+            keep--;
+        }
+
+        //all nines carry into a new leading 1
+        if (i < 0) {
+            digits[0] = '1';
+            *k += len;
+            return 1;
+        }
+
+        digits[i]++;
+    }
+
+    while (keep > 0 && digits[keep - 1] == '0') {
+        keep--;
+    }
+
+    *k += len - keep;
+
+    return keep;
+}
+
+static size_t
+dtoa_write_exponent(char *dst, int exponent) {
+    size_t len = 0;
+
+    dst[len++] = 'e';
+    if (exponent < 0) {
+        dst[len++] = '-';
+        exponent = -exponent;
+    }
+
+    if (exponent >= 100) {
+        dst[len++] = (char)('0' + (exponent / 100));
+        exponent %= 100;
+        dst[len++] = (char)('0' + (exponent / 10));
+    }
+    else if (exponent >= 10) {
+        dst[len++] = (char)('0' + (exponent / 10));
+    }
+
+    dst[len++] = (char)('0' + (exponent % 10));
+
+    return len;
+}
+
+//lays out digits * 10^k in plain notation when that isn't too long, and scientific notation when it is
+static size_t
+dtoa_layout(char *dst, const char *digits, int len, int k) {
+    size_t pos = 0;
+    int point, i;
+
+    //where the decimal point goes, counting from the first digit
+    point = len + k;
+
+    if (k >= 0 && point <= 21) {
+        memcpy(dst, digits, (size_t)len);
+        pos = (size_t)len;
+        for (i = 0; i < k; i++) {
+            dst[pos++] = '0';
+        }
+    }
+    else if (point > 0 && point <= 21) {
+        memcpy(dst, digits, (size_t)point);
+        pos = (size_t)point;
+        dst[pos++] = '.';
+        memcpy(dst + pos, digits + point, (size_t)(len - point));
+        pos += (size_t)(len - point);
+    }
+    else if (point > -6 && point <= 0) {
+        dst[pos++] = '0';
+        dst[pos++] = '.';
+        for (i = point; i < 0; i++) {
+            dst[pos++] = '0';
+        }
+        memcpy(dst + pos, digits, (size_t)len);
+        pos += (size_t)len;
+    }
+    else {
+        dst[pos++] = digits[0];
+        if (len > 1) {
+            dst[pos++] = '.';
+            memcpy(dst + pos, digits + 1, (size_t)(len - 1));
+            pos += (size_t)(len - 1);
+        }
+        pos += dtoa_write_exponent(dst + pos, point - 1);
+    }
+
+    return pos;
+}
+
+size_t
+dtoa_format(char *dst, double value, int precision) {
+    char digits[DTOA_MAX_DIGITS + 8];
+    uint64_t bits;
+    size_t pos = 0;
+    int len, k;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    if ((bits & DTOA_EXPONENT_MASK) == DTOA_EXPONENT_MASK) {
+        if (bits & DTOA_SIGNIFICAND_MASK) {
+            memcpy(dst, "nan", 4);
+            return 3;
+        }
+
+        if (value < 0) {
+            memcpy(dst, "-inf", 5);
+            return 4;
+        }
+
+        memcpy(dst, "inf", 4);
+        return 3;
+    }
+
+    if (bits >> 63) {
+        dst[pos++] = '-';
+        value = -value;
+    }
+
+    if (value == 0.0) {
+        len = 0;
+    }
+    else {
+        k = 0;
+        len = dtoa_grisu2(value, digits, &k);
+
+        if (precision >= 0) {
+            len = dtoa_round_places(digits, len, &k, precision);
+        }
+    }
+
+    //zero, or something that rounded away to nothing, which loses its sign
+    if (len == 0) {
+        dst[0] = '0';
+        dst[1] = '\0';
+        return 1;
+    }
+
+    pos += dtoa_layout(dst + pos, digits, len, k);
+    dst[pos] = '\0';
+
+    return pos;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+#define DTOA_SHORTEST   -1 //!< As many digits as it takes to read back as the same double, and no more.
+#define DTOA_BUFFER_SIZE 32 //!< Big enough for any double dtoa_format() writes, with its terminator.
+
+/*****************************************************************************
+ * dtoa
+ *
+ * Formats doubles as text without going through printf, using Grisu2 to get
+ * the shortest digits that read back as the same double. With a precision of
+ * 0 or more, those digits are rounded to that many places after the decimal
+ * point instead, and either way there are no zeros left hanging at the end.
+ * Numbers are plain, like 12.5 or 0.001, unless they'd be very long, like
+ * 1e+300 would be, and then they're scientific like 1e300. Zero is always 0,
+ * and infinities and NaN are inf, -inf and nan.
+ *
+ * dst needs room for DTOA_BUFFER_SIZE bytes. It's terminated, and the
+ * length without the terminator is returned.
+ ****************************************************************************/
+
+size_t dtoa_format(char *dst, double value, int precision);
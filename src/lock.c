@@ -52,7 +52,7 @@ lock_read_lock(lock_t *lock) {
 #if defined(_WIN32)
     AcquireSRWLockShared(&lock->lock);
 #else
-    pthread_rwlock_wrlock(&lock->lock);
+    pthread_rwlock_rdlock(&lock->lock);
 #endif
 }
 
@@ -70,7 +70,7 @@ lock_write_lock(lock_t *lock) {
 #if defined(_WIN32)
     AcquireSRWLockExclusive(&lock->lock);
 #else
-    pthread_rwlock_rdlock(&lock->lock);
+    pthread_rwlock_wrlock(&lock->lock);
 #endif
 }
 
@@ -0,0 +1,608 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#if !defined(_WIN32)
+# include <sys/stat.h>
+#endif
+#include "stdio.h"
+#include "string.h"
+#include "endian.h"
+#include "rtree.h"
+
+#define RTREE_MAGIC 0x32585452 //"RTX2" at the start of a saved tree
+
+#define RTREE_MAX_LEVELS 64
+
+#define RTREE_HILBERT_SIZE 65536 //centers are scaled to a grid this wide before being put on the curve
+
+#define RTREE_IO_CHUNK 512 //values converted at a time when saving or loading
+
+typedef struct {
+    uint32_t hilbert;           //distance along the curve of the box's center
+    uint32_t id;
+    rtree_box_t box;
+} rtree_item_t;
+
+struct rtree_t {
+    unsigned int node_size;
+    rtree_item_t *items;        //boxes added so far, freed once the tree is packed
+    uint32_t num_items;
+    uint32_t items_size;
+    rtree_box_t *boxes;         //every node, the leaves first and the root last
+    uint32_t *indices;          //the id of each leaf, or where the children of any other node start in boxes
+    uint32_t num_nodes;
+    uint32_t level_bounds[RTREE_MAX_LEVELS]; //end of each level in boxes, starting with the leaves
+    unsigned int num_levels;
+    uint32_t *stack;            //node and level pairs still to be searched
+    uint64_t stamp[RTREE_STAMP_SIZE]; //saved and loaded with the tree, for whoever built it
+    bool finished;
+    char error[256];
+};
+
+rtree_t *
+rtree_init(unsigned int node_size) {
+    rtree_t *rtree;
+
+    if (node_size == 0) {
+        node_size = RTREE_NODE_SIZE;
+    }
+
+    if (node_size < 2 || node_size > UINT16_MAX) {
+        return NULL;
+    }
+
+    rtree = calloc(1, sizeof(*rtree));
+    if (rtree == NULL) {
+        return NULL;
+    }
+
+    rtree->node_size = node_size;
+
+    return rtree;
+}
+
+static void
+rtree_clear(rtree_t *rtree) {
+    free(rtree->items);
+    free(rtree->boxes);
+    free(rtree->indices);
+    free(rtree->stack);
+
+    rtree->items = NULL;
+    rtree->num_items = 0;
+    rtree->items_size = 0;
+    rtree->boxes = NULL;
+    rtree->indices = NULL;
+    rtree->num_nodes = 0;
+    rtree->num_levels = 0;
+    rtree->stack = NULL;
+    rtree->finished = false;
+}
+
+void
+rtree_free(rtree_t *rtree) {
+    if (rtree == NULL) {
+        return;
+    }
+
+    rtree_clear(rtree);
+    free(rtree);
+}
+
+bool
+rtree_add(rtree_t *rtree, uint32_t id, const rtree_box_t *box) {
+    rtree_item_t *items;
+    uint32_t size;
+
+    if (rtree->finished) {
+        strlcpy(rtree->error, "The tree has already been finished", sizeof(rtree->error));
+        return false;
+    }
+
+    if (rtree->num_items == rtree->items_size) {
+        if (rtree->items_size == UINT32_MAX) {
+            strlcpy(rtree->error, "The tree is full", sizeof(rtree->error));
+            return false;
+        }
+
+        size = rtree->items_size == 0 ? 256 : (rtree->items_size > UINT32_MAX / 2 ? UINT32_MAX : rtree->items_size * 2);
+        items = realloc(rtree->items, (size_t)size * sizeof(*items));
+        if (items == NULL) {
+            strlcpy(rtree->error, "Out of memory", sizeof(rtree->error));
+            return false;
+        }
+
+        rtree->items = items;
+        rtree->items_size = size;
+    }
+
+    rtree->items[rtree->num_items].id = id;
+    rtree->items[rtree->num_items].box = *box;
+    rtree->num_items++;
+
+    return true;
+}
+
+//works out where each level starts and ends, which only depends on the number of items and the node size, and
+//allocates the nodes and the search stack
+static bool
+rtree_alloc(rtree_t *rtree) {
+    uint64_t n, total;
+
+    n = rtree->num_items;
+    total = n;
+
+    rtree->num_levels = 0;
+    rtree->level_bounds[rtree->num_levels++] = (uint32_t)n;
+
+    //an empty tree has no nodes at all, and anything else has a root over its leaves
+    if (n > 0) {
+        do {
+            n = (n + rtree->node_size - 1) / rtree->node_size;
+            total += n;
+
+            if (total > UINT32_MAX) {
+                strlcpy(rtree->error, "The tree has too many nodes", sizeof(rtree->error));
+                return false;
+            }
+
+            rtree->level_bounds[rtree->num_levels++] = (uint32_t)total;
+        } while (n != 1);
+    }
+
+    rtree->num_nodes = (uint32_t)total;
+
+    if (rtree->num_nodes == 0) {
+        return true;
+    }
+
+    //each node searched pushes at most node_size children, and only one node per level is being searched at a time
+    rtree->boxes = malloc((size_t)rtree->num_nodes * sizeof(*rtree->boxes));
+    rtree->indices = malloc((size_t)rtree->num_nodes * sizeof(*rtree->indices));
+    rtree->stack = malloc((size_t)rtree->num_levels * rtree->node_size * 2 * sizeof(*rtree->stack));
+
+    if (rtree->boxes == NULL || rtree->indices == NULL || rtree->stack == NULL) {
+        free(rtree->boxes);
+        free(rtree->indices);
+        free(rtree->stack);
+        rtree->boxes = NULL;
+        rtree->indices = NULL;
+        rtree->stack = NULL;
+        strlcpy(rtree->error, "Out of memory", sizeof(rtree->error));
+        return false;
+    }
+
+    return true;
+}
+
+//distance along a Hilbert curve filling a RTREE_HILBERT_SIZE square
+static uint32_t
+rtree_hilbert(uint32_t x, uint32_t y) {
+    uint32_t rx, ry, s, t, d = 0;
+
+    for (s = RTREE_HILBERT_SIZE / 2; s > 0; s /= 2) {
+        rx = (x & s) > 0;
+        ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        //rotate the quadrant so the curve inside it lines up
+        if (ry == 0) {
+            if (rx == 1) {
+                x = RTREE_HILBERT_SIZE - 1 - x;
+                y = RTREE_HILBERT_SIZE - 1 - y;
+            }
+
+            t = x;
+            x = y;
+            y = t;
+        }
+    }
+
+    return d;
+}
+
+static uint32_t
+rtree_hilbert_scale(double value, double min, double width) {
+    double scaled;
+
+    if (width <= 0) {
+        return 0;
+    }
+
+    scaled = ((value - min) / width) * (RTREE_HILBERT_SIZE - 1);
+    if (!(scaled >= 0)) {
+        return 0;
+    }
+    if (scaled > RTREE_HILBERT_SIZE - 1) {
+        return RTREE_HILBERT_SIZE - 1;
+    }
+
+    return (uint32_t)scaled;
+}
+
+static int
+rtree_item_compare(const void *a, const void *b) {
+    const rtree_item_t *item_a = a, *item_b = b;
+
+    if (item_a->hilbert != item_b->hilbert) {
+        return item_a->hilbert < item_b->hilbert ? -1 : 1;
+    }
+
+    //ties keep the order of the ids so a tree always packs the same way
+    return item_a->id < item_b->id ? -1 : (item_a->id > item_b->id ? 1 : 0);
+}
+
+static void
+rtree_box_extend(rtree_box_t *box, const rtree_box_t *other) {
+    if (other->min_x < box->min_x) {
+        box->min_x = other->min_x;
+    }
+    if (other->min_y < box->min_y) {
+        box->min_y = other->min_y;
+    }
+    if (other->max_x > box->max_x) {
+        box->max_x = other->max_x;
+    }
+    if (other->max_y > box->max_y) {
+        box->max_y = other->max_y;
+    }
+}
+
+bool
+rtree_finish(rtree_t *rtree) {
+    rtree_box_t extent, *box;
+    uint32_t i, pos, end, parent;
+    unsigned int level, j;
+
+    if (rtree->finished) {
+        strlcpy(rtree->error, "The tree has already been finished", sizeof(rtree->error));
+        return false;
+    }
+
+    if (!rtree_alloc(rtree)) {
+        return false;
+    }
+
+    //sort the items along the curve through the center of everything
+    if (rtree->num_items > 0) {
+        extent = rtree->items[0].box;
+        for (i = 1; i < rtree->num_items; i++) {
+            rtree_box_extend(&extent, &rtree->items[i].box);
+        }
+
+        for (i = 0; i < rtree->num_items; i++) {
+            box = &rtree->items[i].box;
+            rtree->items[i].hilbert = rtree_hilbert(rtree_hilbert_scale((box->min_x + box->max_x) / 2, extent.min_x, extent.max_x - extent.min_x),
+                                                    rtree_hilbert_scale((box->min_y + box->max_y) / 2, extent.min_y, extent.max_y - extent.min_y));
+        }
+
+        qsort(rtree->items, rtree->num_items, sizeof(*rtree->items), rtree_item_compare);
+    }
+
+    for (i = 0; i < rtree->num_items; i++) {
+        rtree->boxes[i] = rtree->items[i].box;
+        rtree->indices[i] = rtree->items[i].id;
+    }
+
+    free(rtree->items);
+    rtree->items = NULL;
+    rtree->items_size = 0;
+
+    //pack each level into full nodes on the level above it, which follows right after it
+    pos = 0;
+    parent = rtree->num_items;
+
+    for (level = 0; level + 1 < rtree->num_levels; level++) {
+        end = rtree->level_bounds[level];
+
+        while (pos < end) {
+            rtree->boxes[parent] = rtree->boxes[pos];
+            rtree->indices[parent] = pos;
+
+            for (j = 0; j < rtree->node_size && pos < end; j++, pos++) {
+                rtree_box_extend(&rtree->boxes[parent], &rtree->boxes[pos]);
+            }
+
+            parent++;
+        }
+    }
+
+    rtree->finished = true;
+
+    return true;
+}
+
+uint32_t
+rtree_count(rtree_t *rtree) {
+    return rtree->num_items;
+}
+
+bool
+rtree_bounds(rtree_t *rtree, rtree_box_t *box) {
+    if (!rtree->finished || rtree->num_nodes == 0) {
+        return false;
+    }
+
+    *box = rtree->boxes[rtree->num_nodes - 1];
+    return true;
+}
+
+bool
+rtree_search(rtree_t *rtree, const rtree_box_t *box, bool (*cb)(uint32_t id, void *user_data), void *user_data) {
+    const rtree_box_t *node_box;
+    uint32_t node, end, pos, level;
+    size_t depth = 0;
+
+    if (!rtree->finished) {
+        strlcpy(rtree->error, "The tree hasn't been finished", sizeof(rtree->error));
+        return false;
+    }
+
+    if (rtree->num_nodes == 0) {
+        return true;
+    }
+
+    node = rtree->num_nodes - 1;
+    level = rtree->num_levels - 1;
+
+    for (;;) {
+        end = node + rtree->node_size;
+        if (end > rtree->level_bounds[level] || end < node) {
+            end = rtree->level_bounds[level];
+        }
+
+        for (pos = node; pos < end; pos++) {
+            node_box = &rtree->boxes[pos];
+            if (node_box->max_x < box->min_x || node_box->max_y < box->min_y || node_box->min_x > box->max_x || node_box->min_y > box->max_y) {
+                continue;
+            }
+
+            if (level == 0) {
+                if (!cb(rtree->indices[pos], user_data)) {
+                    return true;
+                }
+            }
+            else {
+                rtree->stack[depth++] = rtree->indices[pos];
+                rtree->stack[depth++] = level - 1;
+            }
+        }
+
+        if (depth == 0) {
+            break;
+        }
+
+        level = rtree->stack[--depth];
+        node = rtree->stack[--depth];
+    }
+
+    return true;
+}
+
+static bool
+rtree_write_uint32s(FILE *f, const uint32_t *values, size_t count) {
+    uint32_t chunk[RTREE_IO_CHUNK];
+    size_t i, n;
+
+    while (count > 0) {
+        n = count < RTREE_IO_CHUNK ? count : RTREE_IO_CHUNK;
+        for (i = 0; i < n; i++) {
+            chunk[i] = htole32(values[i]);
+        }
+
+        if (fwrite(chunk, sizeof(*chunk), n, f) != n) {
+            return false;
+        }
+
+        values += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+static bool
+rtree_write_doubles(FILE *f, const double *values, size_t count) {
+    uint64_t chunk[RTREE_IO_CHUNK];
+    size_t i, n;
+
+    while (count > 0) {
+        n = count < RTREE_IO_CHUNK ? count : RTREE_IO_CHUNK;
+        for (i = 0; i < n; i++) {
+            memcpy(&chunk[i], &values[i], sizeof(chunk[i]));
+            chunk[i] = htole64(chunk[i]);
+        }
+
+        if (fwrite(chunk, sizeof(*chunk), n, f) != n) {
+            return false;
+        }
+
+        values += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+void
+rtree_set_stamp(rtree_t *rtree, const uint64_t *stamp) {
+    memcpy(rtree->stamp, stamp, sizeof(rtree->stamp));
+}
+
+void
+rtree_stamp(rtree_t *rtree, uint64_t *stamp) {
+    memcpy(stamp, rtree->stamp, sizeof(rtree->stamp));
+}
+
+//the file is the magic, node size, number of items and the stamp split into 32 bit halves, followed by the boxes and
+//then the indices of every node
+bool
+rtree_save(rtree_t *rtree, const char *path) {
+    uint32_t header[3 + (RTREE_STAMP_SIZE * 2)];
+    unsigned int i;
+    bool success;
+    FILE *f;
+
+    if (!rtree->finished) {
+        strlcpy(rtree->error, "The tree hasn't been finished", sizeof(rtree->error));
+        return false;
+    }
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        snprintf(rtree->error, sizeof(rtree->error), "Error opening %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    header[0] = RTREE_MAGIC;
+    header[1] = rtree->node_size;
+    header[2] = rtree->num_items;
+    for (i = 0; i < RTREE_STAMP_SIZE; i++) {
+        header[3 + (i * 2)] = (uint32_t)rtree->stamp[i];
+        header[4 + (i * 2)] = (uint32_t)(rtree->stamp[i] >> 32);
+    }
+
+    success = rtree_write_uint32s(f, header, sizeof(header) / sizeof(header[0])) &&
+              rtree_write_doubles(f, (const double *)rtree->boxes, (size_t)rtree->num_nodes * 4) &&
+              rtree_write_uint32s(f, rtree->indices, rtree->num_nodes);
+
+    if (fclose(f) != 0) {
+        success = false;
+    }
+
+    if (!success) {
+        snprintf(rtree->error, sizeof(rtree->error), "Error writing %s: %s", path, strerror(errno));
+        remove(path);
+    }
+
+    return success;
+}
+
+static bool
+rtree_read_uint32s(FILE *f, uint32_t *values, size_t count) {
+    size_t i;
+
+    if (fread(values, sizeof(*values), count, f) != count) {
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        values[i] = le32toh(values[i]);
+    }
+
+    return true;
+}
+
+static bool
+rtree_read_doubles(FILE *f, double *values, size_t count) {
+    uint64_t data;
+    size_t i;
+
+    if (fread(values, sizeof(*values), count, f) != count) {
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        memcpy(&data, &values[i], sizeof(data));
+        data = le64toh(data);
+        memcpy(&values[i], &data, sizeof(data));
+    }
+
+    return true;
+}
+
+static bool
+rtree_file_size(FILE *f, uint64_t *size) {
+#if defined(_WIN32)
+    __int64 end;
+
+    if (_fseeki64(f, 0, SEEK_END) != 0 || (end = _ftelli64(f)) < 0 || _fseeki64(f, 0, SEEK_SET) != 0) {
+        return false;
+    }
+
+    *size = (uint64_t)end;
+#else
+    struct stat st;
+
+    if (fstat(fileno(f), &st) != 0) {
+        return false;
+    }
+
+    *size = (uint64_t)st.st_size;
+#endif
+
+    return true;
+}
+
+bool
+rtree_load(rtree_t *rtree, const char *path) {
+    uint32_t header[3 + (RTREE_STAMP_SIZE * 2)], i;
+    uint64_t size;
+    bool success;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        snprintf(rtree->error, sizeof(rtree->error), "Error opening %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    rtree_clear(rtree);
+
+    if (!rtree_file_size(f, &size)) {
+        snprintf(rtree->error, sizeof(rtree->error), "Error getting the size of %s: %s", path, strerror(errno));
+        fclose(f);
+        return false;
+    }
+
+    if (!rtree_read_uint32s(f, header, sizeof(header) / sizeof(header[0])) || header[0] != RTREE_MAGIC || header[1] < 2 || header[1] > UINT16_MAX) {
+        snprintf(rtree->error, sizeof(rtree->error), "%s isn't a saved tree", path);
+        fclose(f);
+        return false;
+    }
+
+    //every item has at least its own box and index in the file, so a count the file can't hold is never allocated
+    if (size < sizeof(header) || header[2] > (size - sizeof(header)) / ((sizeof(double) * 4) + sizeof(uint32_t))) {
+        snprintf(rtree->error, sizeof(rtree->error), "%s is truncated or corrupt", path);
+        fclose(f);
+        return false;
+    }
+
+    rtree->node_size = header[1];
+    rtree->num_items = header[2];
+    for (i = 0; i < RTREE_STAMP_SIZE; i++) {
+        rtree->stamp[i] = header[3 + (i * 2)] | ((uint64_t)header[4 + (i * 2)] << 32);
+    }
+
+    success = rtree_alloc(rtree);
+    if (success) {
+        success = rtree_read_doubles(f, (double *)rtree->boxes, (size_t)rtree->num_nodes * 4) &&
+                  rtree_read_uint32s(f, rtree->indices, rtree->num_nodes) &&
+                  fgetc(f) == EOF;
+
+        //the children of every node above the leaves have to be on the level below it
+        for (i = rtree->num_items; success && i < rtree->num_nodes; i++) {
+            success = rtree->indices[i] < i;
+        }
+
+        if (!success) {
+            snprintf(rtree->error, sizeof(rtree->error), "%s is truncated or corrupt", path);
+        }
+    }
+
+    fclose(f);
+
+    if (!success) {
+        rtree_clear(rtree);
+        return false;
+    }
+
+    rtree->finished = true;
+
+    return true;
+}
+
+const char *
+rtree_error(rtree_t *rtree) {
+    return rtree->error;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RTREE_NODE_SIZE 16 //!< Children per node when 0 is passed to rtree_init().
+#define RTREE_STAMP_SIZE 3 //!< Values in a stamp.
+
+typedef struct rtree_t rtree_t;
+
+typedef struct {
+    double min_x;
+    double min_y;
+    double max_x;
+    double max_y;
+} rtree_box_t;
+
+/*****************************************************************************
+ * rtree
+ *
+ * A packed Hilbert R-tree of boxes that's built once and then only searched.
+ * Boxes are added with an id, then rtree_finish() sorts them along a Hilbert
+ * curve through their centers and packs them into full nodes level by level,
+ * so the whole tree is two flat arrays with no pointers. That also makes it
+ * cheap to save to a file and load back without rebuilding.
+ *
+ * Searching doesn't allocate, but it isn't safe to search the same tree from
+ * more than one thread at a time. The callback gets the id of every box that
+ * touches the search box, in no particular order, and returns false to stop.
+ * rtree_init() returns NULL if the node size is less than 2.
+ *
+ * A stamp is whatever the caller wants to save with the tree, such as the
+ * size of the data it was built from, so a loaded tree can be checked
+ * against that data before it's trusted. It's all zeros until it's set.
+ ****************************************************************************/
+
+rtree_t * rtree_init(unsigned int node_size);
+void rtree_free(rtree_t *rtree);
+
+bool rtree_add(rtree_t *rtree, uint32_t id, const rtree_box_t *box);
+bool rtree_finish(rtree_t *rtree);
+
+uint32_t rtree_count(rtree_t *rtree);
+bool rtree_bounds(rtree_t *rtree, rtree_box_t *box);
+
+bool rtree_search(rtree_t *rtree, const rtree_box_t *box, bool (*cb)(uint32_t id, void *user_data), void *user_data);
+
+void rtree_set_stamp(rtree_t *rtree, const uint64_t *stamp);
+void rtree_stamp(rtree_t *rtree, uint64_t *stamp);
+
+bool rtree_save(rtree_t *rtree, const char *path);
+bool rtree_load(rtree_t *rtree, const char *path);
+
+const char * rtree_error(rtree_t *rtree);
@@ -6,8 +6,13 @@
 
 #include "alist.h"
 #include "buffer.h"
+#include "cond.h"
 #include "db.h"
+#include "db_mock.h"
+#include "dtoa.h"
 #include "hash.h"
 #include "lock.h"
 #include "queue.h"
+#include "rtree.h"
 #include "shapefile.h"
+#include "thread.h"
@@ -1,9 +1,26 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+#if !defined(_WIN32)
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
 #include "stdio.h"
 #include "string.h"
 #include "endian.h"
+#include "buffer.h"
+#include "cond.h"
+#include "dtoa.h"
+#include "thread.h"
+#include "rtree.h"
 #include "shapefile.h"
 
 //https://www.esri.com/content/dam/esrisites/sitecore-archive/Files/Pdfs/library/whitepapers/pdfs/shapefile.pdf
@@ -16,34 +33,50 @@
 
 #define SHAPEFILE_SHX_RECORD_SIZE (2 * sizeof(int32_t))
 
-typedef struct {
-    double x;
-    double y;
-} shapefile_shape_point_t;
+#define SHAPEFILE_DBF_HEADER_SIZE 32
+
+#define SHAPEFILE_DBF_FIELD_SIZE 32
+
+#define SHAPEFILE_DBF_TERMINATOR 0x0d //ends the field descriptors
+
+#define SHAPEFILE_BUFFER_SIZE (4 * 1024 * 1024) //read buffer used when a file can't be memory mapped
+
+#define SHAPEFILE_PARALLEL_CHUNK 256 //records a parallel worker decodes each time it goes back for more
 
+#define SHAPEFILE_WRITE_CHUNK (1024 * 1024) //bytes a writer holds for each file before writing them out in one go
+
+#define SHAPEFILE_DBF_EOF 0x1a //ends the .dbf records
+
+#define SHAPEFILE_M_WRITE_NO_DATA -1e39 //written for M types when there are no M values
+
+//off_t is a 32 bit long on Windows, which would cut off seeks past 2GB
+#if defined(_WIN32)
+# define fseeko _fseeki64
+typedef __int64 shapefile_off_t;
+#else
+typedef off_t shapefile_off_t;
+#endif
+
+//shape flags for what shapefile_shape_new() allocates past the points
+#define SHAPEFILE_SHAPE_Z          0x01
+#define SHAPEFILE_SHAPE_M          0x02
+#define SHAPEFILE_SHAPE_PART_TYPES 0x04
+
+//a shape and all of its arrays are a single allocation. the doubles come first (points, then z, then m) followed by
+//the parts and part types, and each array is its own column so reading x and y never touches z or m
 struct shapefile_shape_t {
     int32_t type;
-    void *geometry;
+    int32_t num_parts;
+    int32_t num_points;
+    shapefile_mbr_t mbr;        //for a point, the point itself
+    shapefile_range_t range;    //only set for the arrays that are present
+    shapefile_point_t *points;
+    double *z;                  //NULL if the shape has no Z
+    double *m;                  //NULL if the shape has no M, which is optional in everything but PointM
+    int32_t *parts;             //index into points where each part starts
+    int32_t *part_types;        //MultiPatch only, otherwise NULL
 };
 
-typedef struct {
-    double min_x;
-    double min_y;
-    double max_x;
-    double max_y;
-} shapefile_mbr_t;
-
-typedef struct {
-    struct {
-        double min;
-        double max;
-    } z;
-    struct {
-        double min;
-        double max;
-    } m;
-} shapefile_range_t;
-
 typedef struct {
     int32_t code;               //always SHAPEFILE_HEADER_MAGIC
     int32_t unused[5];
@@ -54,8 +87,26 @@ typedef struct {
     shapefile_range_t range;    //range of Z (min/max) and M (min/max)
 } shapefile_header_t;
 
+//an open .shp or .shx, either mapped into memory as a whole or read through a buffer
 typedef struct {
     FILE *f;
+    uint64_t size;              //size of the file in bytes
+    unsigned char *map;         //the whole file if it's memory mapped, otherwise NULL
+    unsigned char *buf;         //the part of the file last read if it isn't mapped
+    size_t buf_size;
+    size_t buf_len;
+    uint64_t buf_offset;        //offset in the file of buf[0]
+} shapefile_file_t;
+
+//bounds checked reads from a record or header that's been loaded into memory
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+} shapefile_cursor_t;
+
+typedef struct {
+    shapefile_file_t file;
     shapefile_header_t header;
 } shapefile_shp_t;
 
@@ -70,7 +121,8 @@ typedef struct {
 } shapefile_shp_record_t;
 
 typedef struct {
-    FILE *f;
+    shapefile_file_t file;
+    uint32_t count;             //number of records
 } shapefile_shx_t;
 
 typedef struct {
@@ -78,9 +130,81 @@ typedef struct {
     int32_t length;             //record length in the .shp file
 } shapefile_shx_record_t;
 
+typedef struct {
+    shapefile_field_t field;
+    unsigned int offset;        //offset of the field in a record, past the deleted flag
+} shapefile_dbf_field_t;
+
+//the .dbf, which is optional. records are fixed width and start right after the field descriptors
+typedef struct {
+    shapefile_file_t file;
+    uint32_t count;             //number of records
+    uint32_t header_length;     //offset of the first record
+    uint32_t record_length;     //including the deleted flag
+    shapefile_dbf_field_t *fields;
+    unsigned int num_fields;
+    unsigned int *columns;      //index into fields of each selected field, or NULL when they all are
+    unsigned int num_columns;
+} shapefile_dbf_t;
+
+struct shapefile_record_t {
+    shapefile_dbf_t *dbf;
+    const unsigned char *data;  //the whole record, starting with the deleted flag
+    unsigned int index;
+};
+
+//a chunk of decoded shapes waiting for its turn in an ordered parallel parse
+typedef struct {
+    uint32_t chunk;
+    bool ready;
+    unsigned int count;
+    shapefile_shape_t *shapes[SHAPEFILE_PARALLEL_CHUNK];
+} shapefile_slot_t;
+
+typedef struct {
+    cond_t *cond;
+    uint32_t count;             //number of records
+    uint32_t num_chunks;
+    uint32_t next_chunk;        //next chunk a worker will take
+    uint32_t delivered;         //chunks the ordered callback has had so far
+    bool stop;
+    bool failed;
+    char error[256];            //the first worker's error
+    shapefile_slot_t *slots;    //NULL unless ordered
+    unsigned int num_slots;
+} shapefile_parallel_t;
+
+typedef struct {
+    shapefile_parallel_t *parallel;
+    shapefile_t *shapefile;     //each worker has its own handles on the files
+    shapefile_parse_cb_t *cb;   //called from the worker, or NULL when ordered
+    thread_t *thread;
+} shapefile_worker_t;
+
 struct shapefile_t {
     shapefile_shp_t shp;
     shapefile_shx_t shx;
+    shapefile_dbf_t dbf;
+    shapefile_record_t record;  //the last record read from the .dbf
+    unsigned int next;          //index of the next shape for shapefile_next()
+    char *path_prefix;          //the path without the .shp while a shapefile is open
+    rtree_t *index;             //NULL until built or loaded
+    uint32_t *results;          //the indices from the last query
+    size_t results_len;
+    size_t results_size;
+    bool mmap;                  //map files into memory when possible instead of reading them through a buffer
+    bool open;                  //opened with shapefile_open() and not closed yet
+    bool reuse;                 //hand callbacks the scratch shape instead of allocating one per record
+    bool borrowing;             //whether shapes being decoded right now go in the scratch shape
+    bool validate;              //check decoded coordinates against their record's bounds
+    int crs;                    //the projection of the open file, from its .prj or shapefile_set_source_crs()
+    int source_crs;             //overrides the .prj when not 0
+    int target_crs;             //decoded shapes are reprojected to this when not 0
+    shapefile_transform_t transform; //run on decoded shapes after reprojecting when its callback isn't NULL
+    bool filter;                //parsing skips shapes whose boxes don't touch filter_mbr
+    shapefile_mbr_t filter_mbr;
+    shapefile_shape_t *scratch;
+    size_t scratch_size;
     char error[256];
 };
 
@@ -129,466 +253,5174 @@ shapefile_type_valid(int32_t type) {
     return false;
 }
 
-static shapefile_shape_t *
-shapefile_shape_new(int32_t type) {
-    shapefile_shape_t *shape;
-
-    shape = malloc(sizeof(*shape));
-    if (shape == NULL) {
-        return NULL;
+//the type without its Z or M, with MultiPatch being its own thing
+static int32_t
+shapefile_type_base(int32_t type) {
+    switch (type) {
+        case SHAPEFILE_TYPE_POINT_Z:
+        case SHAPEFILE_TYPE_POINT_M:
+            return SHAPEFILE_TYPE_POINT;
+        case SHAPEFILE_TYPE_POLYLINE_Z:
+        case SHAPEFILE_TYPE_POLYLINE_M:
+            return SHAPEFILE_TYPE_POLYLINE;
+        case SHAPEFILE_TYPE_POLYGON_Z:
+        case SHAPEFILE_TYPE_POLYGON_M:
+            return SHAPEFILE_TYPE_POLYGON;
+        case SHAPEFILE_TYPE_MULTIPOINT_Z:
+        case SHAPEFILE_TYPE_MULTIPOINT_M:
+            return SHAPEFILE_TYPE_MULTIPOINT;
     }
 
-    shape->type = type;
-    shape->geometry = NULL;
-
-    return shape;
-}
-
-static void
-shapefile_shape_point_free(shapefile_shape_point_t *point) {
+    return type;
 }
 
-static void
-shapefile_shape_free(shapefile_shape_t *shape) {
-    switch (shape->type) {
-        case SHAPEFILE_TYPE_NULL:
-            break;
-        case SHAPEFILE_TYPE_POINT:
-            shapefile_shape_point_free(shape->geometry);
-            break;
-        case SHAPEFILE_TYPE_POLYLINE:
-        case SHAPEFILE_TYPE_POLYGON:
-        case SHAPEFILE_TYPE_MULTIPOINT:
+static bool
+shapefile_type_has_z(int32_t type) {
+    switch (type) {
         case SHAPEFILE_TYPE_POINT_Z:
         case SHAPEFILE_TYPE_POLYLINE_Z:
         case SHAPEFILE_TYPE_POLYGON_Z:
         case SHAPEFILE_TYPE_MULTIPOINT_Z:
+        case SHAPEFILE_TYPE_MULTIPATCH:
+            return true;
+    }
+
+    return false;
+}
+
+//whether the type can have M values, not whether a particular record does
+static bool
+shapefile_type_has_m(int32_t type) {
+    switch (type) {
         case SHAPEFILE_TYPE_POINT_M:
         case SHAPEFILE_TYPE_POLYLINE_M:
         case SHAPEFILE_TYPE_POLYGON_M:
         case SHAPEFILE_TYPE_MULTIPOINT_M:
-        case SHAPEFILE_TYPE_MULTIPATCH:
-            break;
-    }
-
-    //SHAPEFILE_TYPE_NULL's geometry will be NULL
-    if (shape->geometry != NULL) {
-        free(shape->geometry);
+            return true;
     }
 
-    free(shape);
+    return shapefile_type_has_z(type);
 }
 
-char *
-shapefile_shape_null_wkt() {
-    return strdup("NULL");
-}
+/****************************************************************************
+ * Kernels
+ *
+ * Min/max reductions over decoded coordinates, picked at compile time: AVX
+ * (with -mavx or -mavx2) takes two points at a time, SSE2 and NEON one, and
+ * everything else gets the scalar loop. Points are x, y pairs, so one vector
+ * register holds the running minimum of x and y together.
+ ****************************************************************************/
 
-char *
-shapefile_shape_point_wkt(shapefile_shape_point_t *point) {
-    char *wkt;
-    int len;
+//the smallest and largest x and y of count points, which must be at least 1. returns false if any of them is NaN,
+//and the box isn't set
+static bool
+shapefile_points_bounds(const shapefile_point_t *points, size_t count, shapefile_mbr_t *mbr) {
+    size_t i = 0;
+#if defined(__AVX__)
+    __m256d lo4, hi4, nan4, v;
+    __m128d lo, hi, nan, v2;
 
-    len = asprintf(&wkt, "POINT(%f %f)", point->x, point->y);
-    if (len == -1) {
-        return NULL;
+    lo4 = _mm256_broadcast_pd((const __m128d *)&points[0]);
+    hi4 = lo4;
+    nan4 = _mm256_setzero_pd();
+
+    for (; i + 2 <= count; i += 2) {
+        v = _mm256_loadu_pd(&points[i].x);
+        lo4 = _mm256_min_pd(lo4, v);
+        hi4 = _mm256_max_pd(hi4, v);
+        nan4 = _mm256_or_pd(nan4, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
     }
 
-    return wkt;
-}
+    lo = _mm_min_pd(_mm256_castpd256_pd128(lo4), _mm256_extractf128_pd(lo4, 1));
+    hi = _mm_max_pd(_mm256_castpd256_pd128(hi4), _mm256_extractf128_pd(hi4, 1));
+    nan = _mm_or_pd(_mm256_castpd256_pd128(nan4), _mm256_extractf128_pd(nan4, 1));
 
-char *
-shapefile_shape_wkt(shapefile_shape_t *shape) {
-    char *wkt = NULL;
+    if (i < count) {
+        v2 = _mm_loadu_pd(&points[i].x);
+        lo = _mm_min_pd(lo, v2);
+        hi = _mm_max_pd(hi, v2);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(v2, v2));
+    }
 
-    switch (shape->type) {
-        case SHAPEFILE_TYPE_NULL:
-            wkt = shapefile_shape_null_wkt();
-            break;
-        case SHAPEFILE_TYPE_POINT:
-            wkt = shapefile_shape_point_wkt(shape->geometry);
-            break;
-        case SHAPEFILE_TYPE_POLYLINE:
-        case SHAPEFILE_TYPE_POLYGON:
-        case SHAPEFILE_TYPE_MULTIPOINT:
-        case SHAPEFILE_TYPE_POINT_Z:
-        case SHAPEFILE_TYPE_POLYLINE_Z:
-        case SHAPEFILE_TYPE_POLYGON_Z:
-        case SHAPEFILE_TYPE_MULTIPOINT_Z:
-        case SHAPEFILE_TYPE_POINT_M:
-        case SHAPEFILE_TYPE_POLYLINE_M:
-        case SHAPEFILE_TYPE_POLYGON_M:
-        case SHAPEFILE_TYPE_MULTIPOINT_M:
-        case SHAPEFILE_TYPE_MULTIPATCH:
-            break;
+    if (_mm_movemask_pd(nan) != 0) {
+        return false;
     }
 
-    return wkt;
-}
+    _mm_storeu_pd(&mbr->min_x, lo);
+    _mm_storeu_pd(&mbr->max_x, hi);
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128d lo, hi, lo2, hi2, nan, v, v2;
 
-//TODO: handle partial reads and not EOF
-static bool
-shapefile_read(shapefile_t *shapefile, FILE *f, void *buf, size_t len, int32_t *length) {
-    size_t count;
+    lo = _mm_loadu_pd(&points[0].x);
+    hi = lo;
+    lo2 = lo;
+    hi2 = lo;
+    nan = _mm_setzero_pd();
+
+    //two sets of accumulators so each min and max doesn't wait on the one before it
+    for (; i + 2 <= count; i += 2) {
+        v = _mm_loadu_pd(&points[i].x);
+        v2 = _mm_loadu_pd(&points[i + 1].x);
+        lo = _mm_min_pd(lo, v);
+        hi = _mm_max_pd(hi, v);
+        lo2 = _mm_min_pd(lo2, v2);
+        hi2 = _mm_max_pd(hi2, v2);
+        nan = _mm_or_pd(nan, _mm_or_pd(_mm_cmpunord_pd(v, v), _mm_cmpunord_pd(v2, v2)));
+    }
 
-    count = fread(buf, 1, len, f);
-    if (count != len) {
-        snprintf(shapefile->error, sizeof(shapefile->error), "Error reading %zu bytes: Only read %zu", len, count);
+    if (i < count) {
+        v = _mm_loadu_pd(&points[i].x);
+        lo = _mm_min_pd(lo, v);
+        hi = _mm_max_pd(hi, v);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+    }
+
+    if (_mm_movemask_pd(nan) != 0) {
         return false;
     }
 
-    if (length != NULL) {
-        *length -= (int32_t)count;
+    _mm_storeu_pd(&mbr->min_x, _mm_min_pd(lo, lo2));
+    _mm_storeu_pd(&mbr->max_x, _mm_max_pd(hi, hi2));
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    float64x2_t lo, hi, v;
+    uint64x2_t ok;
+
+    lo = vld1q_f64(&points[0].x);
+    hi = lo;
+    ok = vceqq_f64(lo, lo);
+
+    for (; i < count; i++) {
+        v = vld1q_f64(&points[i].x);
+        lo = vminq_f64(lo, v);
+        hi = vmaxq_f64(hi, v);
+        ok = vandq_u64(ok, vceqq_f64(v, v));
     }
 
-    return true;
-}
+    if ((vgetq_lane_u64(ok, 0) & vgetq_lane_u64(ok, 1)) == 0) {
+        return false;
+    }
 
-#if 0
-static bool
-shapefile_read_int16_be(shapefile_t *shapefile, FILE *f, int16_t *value, int32_t *length) {
-    int16_t data;
+    vst1q_f64(&mbr->min_x, lo);
+    vst1q_f64(&mbr->max_x, hi);
+#else
+    shapefile_mbr_t box;
+    bool nan = false;
+
+    box.min_x = box.max_x = points[0].x;
+    box.min_y = box.max_y = points[0].y;
+
+    for (; i < count; i++) {
+        box.min_x = points[i].x < box.min_x ? points[i].x : box.min_x;
+        box.min_y = points[i].y < box.min_y ? points[i].y : box.min_y;
+        box.max_x = points[i].x > box.max_x ? points[i].x : box.max_x;
+        box.max_y = points[i].y > box.max_y ? points[i].y : box.max_y;
+        nan |= points[i].x != points[i].x || points[i].y != points[i].y;
+    }
 
-    if (!shapefile_read(shapefile, f, &data, sizeof(data), length)) {
+    if (nan) {
         return false;
     }
 
-    *value = be16toh(data);
+    *mbr = box;
+#endif
+
     return true;
 }
-#endif
 
+//the same for an array of Z or M values
 static bool
-shapefile_read_int32_le(shapefile_t *shapefile, FILE *f, int32_t *value, int32_t *length) {
-    int32_t data;
+shapefile_values_range(const double *values, size_t count, double *min, double *max) {
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128d lo, hi, nan, v;
 
-    if (!shapefile_read(shapefile, f, &data, sizeof(data), length)) {
+    lo = _mm_set1_pd(values[0]);
+    hi = lo;
+    nan = _mm_setzero_pd();
+
+    for (; i + 2 <= count; i += 2) {
+        v = _mm_loadu_pd(&values[i]);
+        lo = _mm_min_pd(lo, v);
+        hi = _mm_max_pd(hi, v);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+    }
+
+    if (i < count) {
+        v = _mm_set1_pd(values[i]);
+        lo = _mm_min_pd(lo, v);
+        hi = _mm_max_pd(hi, v);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+    }
+
+    if (_mm_movemask_pd(nan) != 0) {
         return false;
     }
 
-    *value = le32toh(data);
-    return true;
-}
+    lo = _mm_min_pd(lo, _mm_unpackhi_pd(lo, lo));
+    hi = _mm_max_pd(hi, _mm_unpackhi_pd(hi, hi));
+    _mm_store_sd(min, lo);
+    _mm_store_sd(max, hi);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    float64x2_t lo, hi, v;
+    uint64x2_t ok;
 
-static bool
-shapefile_read_int32_be(shapefile_t *shapefile, FILE *f, int32_t *value, int32_t *length) {
-    int32_t data;
+    lo = vdupq_n_f64(values[0]);
+    hi = lo;
+    ok = vceqq_f64(lo, lo);
 
-    if (!shapefile_read(shapefile, f, &data, sizeof(data), length)) {
+    for (; i + 2 <= count; i += 2) {
+        v = vld1q_f64(&values[i]);
+        lo = vminq_f64(lo, v);
+        hi = vmaxq_f64(hi, v);
+        ok = vandq_u64(ok, vceqq_f64(v, v));
+    }
+
+    if (i < count) {
+        v = vdupq_n_f64(values[i]);
+        lo = vminq_f64(lo, v);
+        hi = vmaxq_f64(hi, v);
+        ok = vandq_u64(ok, vceqq_f64(v, v));
+    }
+
+    if ((vgetq_lane_u64(ok, 0) & vgetq_lane_u64(ok, 1)) == 0) {
         return false;
     }
 
-    *value = be32toh(data);
-    return true;
-}
+    *min = vminvq_f64(lo);
+    *max = vmaxvq_f64(hi);
+#else
+    double lo, hi;
+    bool nan = false;
 
-static bool
-shapefile_read_double_le(shapefile_t *shapefile, FILE *f, double *value, int32_t *length) {
-    double data;
+    lo = hi = values[0];
+
+    for (; i < count; i++) {
+        lo = values[i] < lo ? values[i] : lo;
+        hi = values[i] > hi ? values[i] : hi;
+        nan |= values[i] != values[i];
+    }
 
-    if (!shapefile_read(shapefile, f, &data, sizeof(data), length)) {
+    if (nan) {
         return false;
     }
 
-    *value = le64toh(data);
+    *min = lo;
+    *max = hi;
+#endif
+
     return true;
 }
 
-#if 0
-//The documentation talks about the sizes as 16 bit numbers, but i haven't found a file that actually
-//uses two 16 bit fields to make a 32 bit field.
-//Maybe they don't exist anymore?
-//Maybe they're written to file as a 32 bit field?
-static bool
-shapefile_read_int32_size_be(shapefile_t *shapefile, FILE *f, int32_t *value, int32_t *length) {
-    int16_t low, high;
-    bool success;
+/****************************************************************************
+ * Transforms
+ *
+ * Reprojection goes through WGS84 longitude and latitude in degrees, so any
+ * of the known projections can go to any other in at most two steps. UTM is
+ * the transverse Mercator series from Snyder's Map Projections: A Working
+ * Manual on the WGS84 ellipsoid, good to well under a millimeter inside a
+ * zone.
+ ****************************************************************************/
 
-    success = shapefile_read_int16_be(shapefile, f, &low, length) &&
-              shapefile_read_int16_be(shapefile, f, &high, length);
+#define SHAPEFILE_PI 3.14159265358979323846
 
-    if (success) {
-        *value = (high << 16) | (low & 0xFFFF);
-    }
+#define SHAPEFILE_WGS84_A 6378137.0                  //semi-major axis, and the sphere Web Mercator uses
+#define SHAPEFILE_WGS84_F (1.0 / 298.257223563)      //flattening
 
-    return success;
-}
-#endif
+#define SHAPEFILE_MERCATOR_MAX_LAT 85.0511287798066  //the latitude Web Mercator squares off at
+
+#define SHAPEFILE_UTM_K0             0.9996
+#define SHAPEFILE_UTM_FALSE_EASTING  500000.0
+#define SHAPEFILE_UTM_FALSE_NORTHING 10000000.0      //southern hemisphere only
 
 static bool
-shapefile_read_header(shapefile_t *shapefile, FILE *f, shapefile_header_t *header) {
-    bool success;
+shapefile_crs_valid(int crs) {
+    return crs == SHAPEFILE_CRS_WGS84 ||
+           crs == SHAPEFILE_CRS_WEB_MERCATOR ||
+           (crs > SHAPEFILE_CRS_UTM_NORTH && crs <= SHAPEFILE_CRS_UTM_NORTH + 60) ||
+           (crs > SHAPEFILE_CRS_UTM_SOUTH && crs <= SHAPEFILE_CRS_UTM_SOUTH + 60);
+}
 
-    success = shapefile_read_int32_be(shapefile,      f, &header->code,        NULL) &&
-              shapefile_read_int32_be(shapefile,      f, &header->unused[0],   NULL) &&
-              shapefile_read_int32_be(shapefile,      f, &header->unused[1],   NULL) &&
-              shapefile_read_int32_be(shapefile,      f, &header->unused[2],   NULL) &&
-              shapefile_read_int32_be(shapefile,      f, &header->unused[3],   NULL) &&
-              shapefile_read_int32_be(shapefile,      f, &header->unused[4],   NULL) &&
-              shapefile_read_int32_be(shapefile, f, &header->length,      NULL) &&
-              shapefile_read_int32_le(shapefile,      f, &header->version,     NULL) &&
-              shapefile_read_int32_le(shapefile,      f, &header->type,        NULL) &&
-              shapefile_read_double_le(shapefile,     f, &header->mbr.min_x,   NULL) &&
-              shapefile_read_double_le(shapefile,     f, &header->mbr.max_x,   NULL) &&
-              shapefile_read_double_le(shapefile,     f, &header->mbr.min_y,   NULL) &&
-              shapefile_read_double_le(shapefile,     f, &header->mbr.max_y,   NULL) &&
-              shapefile_read_double_le(shapefile,     f, &header->range.z.min, NULL) &&
-              shapefile_read_double_le(shapefile,     f, &header->range.z.max, NULL) &&
-              shapefile_read_double_le(shapefile,     f, &header->range.m.min, NULL) &&
-              shapefile_read_double_le(shapefile,     f, &header->range.m.max, NULL);
+static void
+shapefile_mercator_to_wgs84(shapefile_point_t *points, size_t count) {
+    const double scale = 180.0 / (SHAPEFILE_PI * SHAPEFILE_WGS84_A);
+    size_t i;
 
-    if (success) {
-        if (header->code != SHAPEFILE_HEADER_MAGIC) {
-            snprintf(shapefile->error, sizeof(shapefile->error), "Header magic number %08x is invalid", header->code);
-            success = false;
-        }
+    for (i = 0; i < count; i++) {
+        points[i].x *= scale;
+        points[i].y = ((2.0 * atan(exp(points[i].y / SHAPEFILE_WGS84_A))) - (SHAPEFILE_PI / 2.0)) * (180.0 / SHAPEFILE_PI);
     }
+}
 
-    if (success) {
-        if (!shapefile_type_valid(header->type)) {
-            snprintf(shapefile->error, sizeof(shapefile->error), "Header Type %d is invalid", header->type);
-            success = false;
-        }
-    }
+static void
+shapefile_wgs84_to_mercator(shapefile_point_t *points, size_t count) {
+    const double scale = SHAPEFILE_PI * SHAPEFILE_WGS84_A / 180.0;
+    double lat;
+    size_t i;
 
-    if (success) {
-        if (header->length < SHAPEFILE_HEADER_SIZE) {
-            snprintf(shapefile->error, sizeof(shapefile->error), "Size in header %d cannot be less than header size %lu", header->length, SHAPEFILE_HEADER_SIZE);
-            success = false;
-        }
-    }
+    for (i = 0; i < count; i++) {
+        //the poles are infinitely far away, so latitudes are clamped to the square
+        lat = points[i].y;
+        lat = lat > SHAPEFILE_MERCATOR_MAX_LAT ? SHAPEFILE_MERCATOR_MAX_LAT : (lat < -SHAPEFILE_MERCATOR_MAX_LAT ? -SHAPEFILE_MERCATOR_MAX_LAT : lat);
 
-    return success;
+        points[i].x *= scale;
+        points[i].y = SHAPEFILE_WGS84_A * log(tan((SHAPEFILE_PI / 4.0) + (lat * SHAPEFILE_PI / 360.0)));
+    }
 }
 
-static bool
-shapefile_read_shp_record_header(shapefile_t *shapefile, FILE *f, shapefile_shp_record_header_t *header, int32_t *length) {
-    return shapefile_read_int32_be(shapefile,      shapefile->shp.f, &header->number, length) &&
-           shapefile_read_int32_be(shapefile, shapefile->shp.f, &header->length, length);
+//the central meridian of a UTM zone in radians
+static double
+shapefile_utm_meridian(int zone) {
+    return (((zone - 1) * 6) - 177) * (SHAPEFILE_PI / 180.0);
 }
 
-static bool
-shapefile_read_shp_record_null(shapefile_t *shapefile, FILE *f, shapefile_shp_record_header_t *record_header, shapefile_shp_record_t *record, int32_t *length) {
-    return true;
-}
+static void
+shapefile_utm_to_wgs84(shapefile_point_t *points, size_t count, int zone, bool south) {
+    const double e2 = SHAPEFILE_WGS84_F * (2.0 - SHAPEFILE_WGS84_F);
+    const double ep2 = e2 / (1.0 - e2);
+    const double e1 = (1.0 - sqrt(1.0 - e2)) / (1.0 + sqrt(1.0 - e2));
+    const double mu_scale = SHAPEFILE_WGS84_A * (1.0 - (e2 / 4.0) - (3.0 * e2 * e2 / 64.0) - (5.0 * e2 * e2 * e2 / 256.0));
+    const double lon0 = shapefile_utm_meridian(zone);
+    double mu, phi1, sin1, cos1, tan1, c1, t1, n1, r1, d, d2;
+    size_t i;
 
-static bool
-shapefile_read_shp_record_point(shapefile_t *shapefile, FILE *f, shapefile_shp_record_header_t *record_header, shapefile_shp_record_t *record, int32_t *length) {
-    shapefile_shape_point_t *point;
+    for (i = 0; i < count; i++) {
+        mu = ((points[i].y - (south ? SHAPEFILE_UTM_FALSE_NORTHING : 0.0)) / SHAPEFILE_UTM_K0) / mu_scale;
 
-    point = malloc(sizeof(*point));
-    if (point == NULL) {
-        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
-        return false;
-    }
+        //the footpoint latitude
+        phi1 = mu +
+               (((3.0 * e1 / 2.0) - (27.0 * e1 * e1 * e1 / 32.0)) * sin(2.0 * mu)) +
+               (((21.0 * e1 * e1 / 16.0) - (55.0 * e1 * e1 * e1 * e1 / 32.0)) * sin(4.0 * mu)) +
+               ((151.0 * e1 * e1 * e1 / 96.0) * sin(6.0 * mu)) +
+               ((1097.0 * e1 * e1 * e1 * e1 / 512.0) * sin(8.0 * mu));
 
-    record->shape->geometry = point;
+        sin1 = sin(phi1);
+        cos1 = cos(phi1);
+        tan1 = sin1 / cos1;
+        c1 = ep2 * cos1 * cos1;
+        t1 = tan1 * tan1;
+        n1 = SHAPEFILE_WGS84_A / sqrt(1.0 - (e2 * sin1 * sin1));
+        r1 = SHAPEFILE_WGS84_A * (1.0 - e2) / pow(1.0 - (e2 * sin1 * sin1), 1.5);
+        d = (points[i].x - SHAPEFILE_UTM_FALSE_EASTING) / (n1 * SHAPEFILE_UTM_K0);
+        d2 = d * d;
 
-    return shapefile_read_double_le(shapefile, shapefile->shp.f, &point->x, length) &&
-           shapefile_read_double_le(shapefile, shapefile->shp.f, &point->y, length);
+        points[i].y = (phi1 - ((n1 * tan1 / r1) *
+                               ((d2 / 2.0) -
+                                ((5.0 + (3.0 * t1) + (10.0 * c1) - (4.0 * c1 * c1) - (9.0 * ep2)) * d2 * d2 / 24.0) +
+                                ((61.0 + (90.0 * t1) + (298.0 * c1) + (45.0 * t1 * t1) - (252.0 * ep2) - (3.0 * c1 * c1)) * d2 * d2 * d2 / 720.0)))) *
+                      (180.0 / SHAPEFILE_PI);
+        points[i].x = (lon0 + ((d -
+                                ((1.0 + (2.0 * t1) + c1) * d2 * d / 6.0) +
+                                ((5.0 - (2.0 * c1) + (28.0 * t1) - (3.0 * c1 * c1) + (8.0 * ep2) + (24.0 * t1 * t1)) * d2 * d2 * d / 120.0)) / cos1)) *
+                      (180.0 / SHAPEFILE_PI);
+    }
 }
 
-static bool
-shapefile_read_shp_record(shapefile_t *shapefile, FILE *f, shapefile_shp_record_header_t *record_header, shapefile_shp_record_t *record, int32_t *length) {
-    bool success = false;
+static void
+shapefile_wgs84_to_utm(shapefile_point_t *points, size_t count, int zone, bool south) {
+    const double e2 = SHAPEFILE_WGS84_F * (2.0 - SHAPEFILE_WGS84_F);
+    const double e4 = e2 * e2, e6 = e4 * e2;
+    const double ep2 = e2 / (1.0 - e2);
+    const double lon0 = shapefile_utm_meridian(zone);
+    double phi, sin_phi, cos_phi, tan_phi, n, t, c, a, a2, m;
+    size_t i;
 
-    if (!shapefile_read_int32_le(shapefile, shapefile->shp.f, &record->type, length)) {
-        return false;
+    for (i = 0; i < count; i++) {
+        phi = points[i].y * (SHAPEFILE_PI / 180.0);
+        sin_phi = sin(phi);
+        cos_phi = cos(phi);
+        tan_phi = sin_phi / cos_phi;
+
+        n = SHAPEFILE_WGS84_A / sqrt(1.0 - (e2 * sin_phi * sin_phi));
+        t = tan_phi * tan_phi;
+        c = ep2 * cos_phi * cos_phi;
+        a = cos_phi * ((points[i].x * (SHAPEFILE_PI / 180.0)) - lon0);
+        a2 = a * a;
+
+        //distance along the meridian from the equator
+        m = SHAPEFILE_WGS84_A * (((1.0 - (e2 / 4.0) - (3.0 * e4 / 64.0) - (5.0 * e6 / 256.0)) * phi) -
+                                 (((3.0 * e2 / 8.0) + (3.0 * e4 / 32.0) + (45.0 * e6 / 1024.0)) * sin(2.0 * phi)) +
+                                 (((15.0 * e4 / 256.0) + (45.0 * e6 / 1024.0)) * sin(4.0 * phi)) -
+                                 ((35.0 * e6 / 3072.0) * sin(6.0 * phi)));
+
+        points[i].x = SHAPEFILE_UTM_FALSE_EASTING +
+                      (SHAPEFILE_UTM_K0 * n * (a +
+                                               ((1.0 - t + c) * a2 * a / 6.0) +
+                                               ((5.0 - (18.0 * t) + (t * t) + (72.0 * c) - (58.0 * ep2)) * a2 * a2 * a / 120.0)));
+        points[i].y = (south ? SHAPEFILE_UTM_FALSE_NORTHING : 0.0) +
+                      (SHAPEFILE_UTM_K0 * (m + (n * tan_phi * ((a2 / 2.0) +
+                                                               ((5.0 - t + (9.0 * c) + (4.0 * c * c)) * a2 * a2 / 24.0) +
+                                                               ((61.0 - (58.0 * t) + (t * t) + (600.0 * c) - (330.0 * ep2)) * a2 * a2 * a2 / 720.0)))));
     }
+}
 
-    if (!shapefile_type_valid(record->type)) {
-        snprintf(shapefile->error, sizeof(shapefile->error), "Shape type %d in record %d is not valid", record->type, record_header->number);
+bool
+shapefile_reproject(shapefile_point_t *points, size_t count, int from, int to) {
+    if (!shapefile_crs_valid(from) || !shapefile_crs_valid(to)) {
         return false;
     }
 
-    record->shape = shapefile_shape_new(record->type);
+    if (from == to) {
+        return true;
+    }
 
-    switch (record->type) {
-        case SHAPEFILE_TYPE_NULL:
-            success = shapefile_read_shp_record_null(shapefile, shapefile->shp.f, record_header, record, length);
-            break;
-        case SHAPEFILE_TYPE_POINT:
-            success = shapefile_read_shp_record_point(shapefile, shapefile->shp.f, record_header, record, length);
-            break;
-        case SHAPEFILE_TYPE_POLYLINE:
-        case SHAPEFILE_TYPE_POLYGON:
-        case SHAPEFILE_TYPE_MULTIPOINT:
-        case SHAPEFILE_TYPE_POINT_Z:
-        case SHAPEFILE_TYPE_POLYLINE_Z:
-        case SHAPEFILE_TYPE_POLYGON_Z:
-        case SHAPEFILE_TYPE_MULTIPOINT_Z:
-        case SHAPEFILE_TYPE_POINT_M:
-        case SHAPEFILE_TYPE_POLYLINE_M:
-        case SHAPEFILE_TYPE_POLYGON_M:
-        case SHAPEFILE_TYPE_MULTIPOINT_M:
-        case SHAPEFILE_TYPE_MULTIPATCH:
-            snprintf(shapefile->error, sizeof(shapefile->error), "Shape type %d (%s) in record %d is not supported", record->type, shapefile_type_str(record->type), record_header->number);
-            success = false;
-            break;
+    if (from == SHAPEFILE_CRS_WEB_MERCATOR) {
+        shapefile_mercator_to_wgs84(points, count);
+    }
+    else if (from > SHAPEFILE_CRS_UTM_SOUTH) {
+        shapefile_utm_to_wgs84(points, count, from - SHAPEFILE_CRS_UTM_SOUTH, true);
+    }
+    else if (from > SHAPEFILE_CRS_UTM_NORTH) {
+        shapefile_utm_to_wgs84(points, count, from - SHAPEFILE_CRS_UTM_NORTH, false);
     }
 
-    if (!success) {
-        shapefile_shape_free(record->shape);
+    if (to == SHAPEFILE_CRS_WEB_MERCATOR) {
+        shapefile_wgs84_to_mercator(points, count);
+    }
+    else if (to > SHAPEFILE_CRS_UTM_SOUTH) {
+        shapefile_wgs84_to_utm(points, count, to - SHAPEFILE_CRS_UTM_SOUTH, true);
+    }
+    else if (to > SHAPEFILE_CRS_UTM_NORTH) {
+        shapefile_wgs84_to_utm(points, count, to - SHAPEFILE_CRS_UTM_NORTH, false);
     }
 
-    return success;
+    return true;
 }
 
-static bool
-shapefile_parse_shx(shapefile_t *shapefile, const char *path_prefix) {
-    shapefile_header_t header;
-    bool success = false;
-    char *path;
-    int len;
+bool
+shapefile_transform_affine(shapefile_point_t *points, double *z, size_t count, void *user_data) {
+    const shapefile_affine_t *affine = user_data;
+    size_t i;
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128d cx, cy, offset, v;
 
-    len = asprintf(&path, "%s.shx", path_prefix);
-    if (len == -1) {
-        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
-        return false;
-    }
+    //each point is one register, so x' and y' come out of the same multiplies
+    cx = _mm_set_pd(affine->d, affine->a);
+    cy = _mm_set_pd(affine->e, affine->b);
+    offset = _mm_set_pd(affine->f, affine->c);
 
-    shapefile->shx.f = fopen(path, "r");
-    if (shapefile->shx.f == NULL) {
-        snprintf(shapefile->error, sizeof(shapefile->error), "Error opening %s: %s", path, strerror(errno));
-        goto done;
+    for (i = 0; i < count; i++) {
+        v = _mm_loadu_pd(&points[i].x);
+        v = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_unpacklo_pd(v, v), cx), _mm_mul_pd(_mm_unpackhi_pd(v, v), cy)), offset);
+        _mm_storeu_pd(&points[i].x, v);
     }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    float64x2_t cx, cy, offset, v;
 
-    //read the shapefile header, just because. we don't need to store it though because it's the same exact header
-    //in the .shp file. we're store that one
-    if (!shapefile_read_header(shapefile, shapefile->shx.f, &header)) {
-        goto done;
+    cx = vsetq_lane_f64(affine->d, vdupq_n_f64(affine->a), 1);
+    cy = vsetq_lane_f64(affine->e, vdupq_n_f64(affine->b), 1);
+    offset = vsetq_lane_f64(affine->f, vdupq_n_f64(affine->c), 1);
+
+    for (i = 0; i < count; i++) {
+        v = vld1q_f64(&points[i].x);
+        v = vaddq_f64(vaddq_f64(vmulq_laneq_f64(cx, v, 0), vmulq_laneq_f64(cy, v, 1)), offset);
+        vst1q_f64(&points[i].x, v);
     }
+#else
+    double x;
 
-    success = true;
+    for (i = 0; i < count; i++) {
+        x = points[i].x;
+        points[i].x = (affine->a * x) + (affine->b * points[i].y) + affine->c;
+        points[i].y = (affine->d * x) + (affine->e * points[i].y) + affine->f;
+    }
+#endif
 
-done:
-    if (!success) {
-        if (shapefile->shx.f != NULL) {
-            fclose(shapefile->shx.f);
-            shapefile->shx.f = NULL;
+    return true;
+}
+
+//allocates a shape, or when borrowing, lays it out in the shapefile's scratch shape after growing it if needed
+static shapefile_shape_t *
+shapefile_shape_new(shapefile_t *shapefile, int32_t type, int32_t num_parts, int32_t num_points, int flags) {
+    shapefile_shape_t *shape;
+    size_t size, doubles;
+
+    doubles = ((flags & SHAPEFILE_SHAPE_Z) ? 1 : 0) + ((flags & SHAPEFILE_SHAPE_M) ? 1 : 0);
+
+    size = sizeof(*shape) +
+           ((size_t)num_points * (sizeof(*shape->points) + (doubles * sizeof(double)))) +
+           ((size_t)num_parts * sizeof(*shape->parts) * ((flags & SHAPEFILE_SHAPE_PART_TYPES) ? 2 : 1));
+
+    if (shapefile->borrowing) {
+        if (size > shapefile->scratch_size) {
+            //grow by at least half so a run of slightly bigger shapes doesn't reallocate every time
+            if (size < shapefile->scratch_size + (shapefile->scratch_size / 2)) {
+                size = shapefile->scratch_size + (shapefile->scratch_size / 2);
+            }
+
+            shape = realloc(shapefile->scratch, size);
+            if (shape == NULL) {
+                return NULL;
+            }
+
+            shapefile->scratch = shape;
+            shapefile->scratch_size = size;
+        }
+
+        shape = shapefile->scratch;
+    }
+    else {
+        shape = malloc(size);
+        if (shape == NULL) {
+            return NULL;
         }
     }
 
-    free(path);
+    shape->type = type;
+    shape->num_parts = num_parts;
+    shape->num_points = num_points;
+    memset(&shape->mbr, 0, sizeof(shape->mbr));
+    memset(&shape->range, 0, sizeof(shape->range));
 
-    return success;
+    shape->points = (shapefile_point_t *)(shape + 1);
+    shape->z = (double *)(shape->points + num_points);
+    shape->m = shape->z + ((flags & SHAPEFILE_SHAPE_Z) ? num_points : 0);
+    shape->parts = (int32_t *)(shape->m + ((flags & SHAPEFILE_SHAPE_M) ? num_points : 0));
+    shape->part_types = shape->parts + num_parts;
+
+    if (!(flags & SHAPEFILE_SHAPE_Z)) {
+        shape->z = NULL;
+    }
+    if (!(flags & SHAPEFILE_SHAPE_M)) {
+        shape->m = NULL;
+    }
+    if (!(flags & SHAPEFILE_SHAPE_PART_TYPES)) {
+        shape->part_types = NULL;
+    }
+
+    return shape;
+}
+
+//frees a shape the parser is done with, unless it's the borrowed scratch shape
+static void
+shapefile_shape_release(shapefile_t *shapefile, shapefile_shape_t *shape) {
+    if (shape != shapefile->scratch) {
+        free(shape);
+    }
+}
+
+void
+shapefile_shape_free(shapefile_shape_t *shape) {
+    free(shape);
 }
 
+//writes the tag along with Z, M or ZM when the shape has them
 static bool
-shapefile_parse_shp(shapefile_t *shapefile, const char *path_prefix, bool *stop, shapefile_parse_cb_t *cb) {
-    shapefile_shp_record_header_t record_header;
-    shapefile_shp_record_t record;
-    int32_t length;
-    bool success = true;
-    char *path;
-    int len;
+shapefile_wkt_tag(buffer_t *wkt, shapefile_shape_t *shape, const char *tag) {
+    return buffer_write_str(wkt, tag) &&
+           (shape->z == NULL || buffer_write_str(wkt, shape->m == NULL ? " Z" : " ZM")) &&
+           (shape->z != NULL || shape->m == NULL || buffer_write_str(wkt, " M"));
+}
 
-    len = asprintf(&path, "%s.shp", path_prefix);
-    if (len == -1) {
-        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+//formats straight into the buffer, with room for the separator and every number and the spaces between them
+static bool
+shapefile_wkt_coord(buffer_t *wkt, shapefile_shape_t *shape, int32_t index, bool first, int precision) {
+    char *dst;
+    size_t len = 0;
+
+    dst = (char *)buffer_reserve(wkt, 2 + (4 * DTOA_BUFFER_SIZE));
+    if (dst == NULL) {
         return false;
     }
 
-    shapefile->shp.f = fopen(path, "r");
-    if (shapefile->shp.f == NULL) {
-        snprintf(shapefile->error, sizeof(shapefile->error), "Error opening %s: %s", path, strerror(errno));
-        success = false;
+    if (!first) {
+        dst[len++] = ',';
+        dst[len++] = ' ';
     }
 
-    if (success) {
-        success = shapefile_read_header(shapefile, shapefile->shp.f, &shapefile->shp.header);
+    len += dtoa_format(dst + len, shape->points[index].x, precision);
+    dst[len++] = ' ';
+    len += dtoa_format(dst + len, shape->points[index].y, precision);
+
+    if (shape->z != NULL) {
+        dst[len++] = ' ';
+        len += dtoa_format(dst + len, shape->z[index], precision);
+    }
+    if (shape->m != NULL) {
+        dst[len++] = ' ';
+        len += dtoa_format(dst + len, shape->m[index], precision);
     }
 
-    if (success) {
-        //IMPORTANT!!! the sizes are the number of 16bit words in the file, so we need to muliply by sizeof(int16_t) to get bytes
-        //also, the size includes the size of the header so decrease that immediately
-        length = (shapefile->shp.header.length * sizeof(int16_t)) - SHAPEFILE_HEADER_SIZE;
+    buffer_commit(wkt, len);
 
-        while (success && !*stop && length > 0) {
+    return true;
+}
 
-            success = shapefile_read_shp_record_header(shapefile, shapefile->shp.f, &record_header, &length);
-            if (!success) {
-                break;
-            }
+static bool
+shapefile_wkt_coords(buffer_t *wkt, shapefile_shape_t *shape, int32_t start, int32_t count, int precision) {
+    int32_t i;
+    bool success;
 
-            success = shapefile_read_shp_record(shapefile, shapefile->shp.f, &record_header, &record, &length);
-            if (!success) {
-                //if we fail, the record->shape doesn't need to be free'd
-                break;
-            }
+    success = buffer_write_char(wkt, '(');
+    for (i = start; success && i < start + count; i++) {
+        success = shapefile_wkt_coord(wkt, shape, i, i == start, precision);
+    }
+
+    return success && buffer_write_char(wkt, ')');
+}
+
+//twice the signed area of a ring, which is negative for the clockwise outer rings of a polygon
+static double
+shapefile_ring_area(const shapefile_point_t *points, int32_t count) {
+    double area = 0.0;
+    int32_t i;
+
+    for (i = 0; i + 1 < count; i++) {
+        area += (points[i].x * points[i + 1].y) - (points[i + 1].x * points[i].y);
+    }
+
+    return area;
+}
+
+static int32_t
+shapefile_shape_part_end(shapefile_shape_t *shape, int32_t index) {
+    return index + 1 < shape->num_parts ? shape->parts[index + 1] : shape->num_points;
+}
+
+static bool
+shapefile_shape_multipoint_wkt(shapefile_shape_t *shape, buffer_t *wkt, int precision) {
+    int32_t i;
+    bool success;
+
+    success = shapefile_wkt_tag(wkt, shape, "MULTIPOINT");
+    if (shape->num_points == 0) {
+        return success && buffer_write_str(wkt, " EMPTY");
+    }
+
+    success = success && buffer_write_char(wkt, '(');
+    for (i = 0; success && i < shape->num_points; i++) {
+        success = (i == 0 || buffer_write_str(wkt, ", ")) &&
+                  shapefile_wkt_coords(wkt, shape, i, 1, precision);
+    }
+
+    return success && buffer_write_char(wkt, ')');
+}
+
+static bool
+shapefile_shape_polyline_wkt(shapefile_shape_t *shape, buffer_t *wkt, int precision) {
+    int32_t i;
+    bool success;
+
+    if (shape->num_parts <= 1) {
+        success = shapefile_wkt_tag(wkt, shape, "LINESTRING");
+        if (shape->num_parts == 0) {
+            return success && buffer_write_str(wkt, " EMPTY");
+        }
+
+        return success && shapefile_wkt_coords(wkt, shape, 0, shape->num_points, precision);
+    }
+
+    success = shapefile_wkt_tag(wkt, shape, "MULTILINESTRING") && buffer_write_char(wkt, '(');
+    for (i = 0; success && i < shape->num_parts; i++) {
+        success = (i == 0 || buffer_write_str(wkt, ", ")) &&
+                  shapefile_wkt_coords(wkt, shape, shape->parts[i], shapefile_shape_part_end(shape, i) - shape->parts[i], precision);
+    }
+
+    return success && buffer_write_char(wkt, ')');
+}
+
+//whether a polygon part starts a new polygon rather than being a hole in the one before it. for polygons that's
+//clockwise rings, and for multipatches it's outer and first rings
+static bool
+shapefile_shape_polygon_starts(shapefile_shape_t *shape, int32_t index) {
+    if (index == 0) {
+        return true;
+    }
+
+    if (shape->part_types != NULL) {
+        return shape->part_types[index] != SHAPEFILE_PART_INNER_RING && shape->part_types[index] != SHAPEFILE_PART_RING;
+    }
+
+    return shapefile_ring_area(shape->points + shape->parts[index], shapefile_shape_part_end(shape, index) - shape->parts[index]) < 0.0;
+}
+
+static bool
+shapefile_shape_polygon_wkt(shapefile_shape_t *shape, buffer_t *wkt, int precision) {
+    unsigned int polygons = 0;
+    int32_t i;
+    bool success;
+
+    if (shape->num_parts == 0) {
+        return shapefile_wkt_tag(wkt, shape, "POLYGON") && buffer_write_str(wkt, " EMPTY");
+    }
+
+    for (i = 0; i < shape->num_parts; i++) {
+        if (shapefile_shape_polygon_starts(shape, i)) {
+            ++polygons;
+        }
+    }
+
+    success = shapefile_wkt_tag(wkt, shape, polygons > 1 ? "MULTIPOLYGON" : "POLYGON") &&
+              (polygons == 1 || buffer_write_char(wkt, '(')) &&
+              buffer_write_char(wkt, '(');
+    for (i = 0; success && i < shape->num_parts; i++) {
+        if (i > 0) {
+            success = buffer_write_str(wkt, polygons > 1 && shapefile_shape_polygon_starts(shape, i) ? "), (" : ", ");
+        }
+
+        success = success && shapefile_wkt_coords(wkt, shape, shape->parts[i], shapefile_shape_part_end(shape, i) - shape->parts[i], precision);
+    }
+
+    return success && buffer_write_str(wkt, polygons > 1 ? "))" : ")");
+}
+
+//whether part index starts a polygon of its own, which for a multipatch is also any ring after triangles since
+//there's nothing for it to be a hole in
+static bool
+shapefile_shape_ring_starts(shapefile_shape_t *shape, int32_t index) {
+    if (shapefile_shape_polygon_starts(shape, index)) {
+        return true;
+    }
+
+    return shape->part_types != NULL &&
+           (shape->part_types[index - 1] == SHAPEFILE_PART_TRIANGLE_STRIP || shape->part_types[index - 1] == SHAPEFILE_PART_TRIANGLE_FAN);
+}
+
+static bool
+shapefile_shape_part_triangles(shapefile_shape_t *shape, int32_t index) {
+    return shape->part_types != NULL &&
+           (shape->part_types[index] == SHAPEFILE_PART_TRIANGLE_STRIP || shape->part_types[index] == SHAPEFILE_PART_TRIANGLE_FAN);
+}
+
+//the number of rings in the polygon that starts at part index
+static uint32_t
+shapefile_shape_polygon_rings(shapefile_shape_t *shape, int32_t index) {
+    uint32_t rings = 1;
+
+    while (++index < shape->num_parts && !shapefile_shape_part_triangles(shape, index) && !shapefile_shape_ring_starts(shape, index)) {
+        rings++;
+    }
+
+    return rings;
+}
 
-            if (cb != NULL) {
-                //call the callback, which returns true on success, and false to stop
-                *stop = !cb->shape(record.shape, cb->user_data);
+//the number of polygons a polygon or multipatch becomes, with every triangle being one
+static uint32_t
+shapefile_shape_polygons(shapefile_shape_t *shape) {
+    uint32_t polygons = 0;
+    int32_t i, points;
 
-                shapefile_shape_free(record.shape);
-                record.shape = NULL;
+    for (i = 0; i < shape->num_parts; i++) {
+        if (shapefile_shape_part_triangles(shape, i)) {
+            points = shapefile_shape_part_end(shape, i) - shape->parts[i];
+            polygons += points > 2 ? (uint32_t)(points - 2) : 0;
+        }
+        else if (shapefile_shape_ring_starts(shape, i)) {
+            polygons++;
+        }
+    }
+
+    return polygons;
+}
+
+//the first corner of triangle j of a strip or fan, which is repeated to close it
+static int32_t
+shapefile_shape_triangle_corner(shapefile_shape_t *shape, int32_t part, int32_t j) {
+    return shape->part_types[part] == SHAPEFILE_PART_TRIANGLE_FAN ? shape->parts[part] : j - 2;
+}
+
+//rings become polygons like they do for a Polygon, and strips and fans are split into one polygon per triangle
+static bool
+shapefile_shape_multipatch_wkt(shapefile_shape_t *shape, buffer_t *wkt, int precision) {
+    int32_t i, j, start, end, corner;
+    bool success, first = true;
+
+    success = shapefile_wkt_tag(wkt, shape, "MULTIPOLYGON");
+    if (shapefile_shape_polygons(shape) == 0) {
+        return success && buffer_write_str(wkt, " EMPTY");
+    }
+
+    success = success && buffer_write_char(wkt, '(');
+    for (i = 0; success && i < shape->num_parts; i++) {
+        start = shape->parts[i];
+        end = shapefile_shape_part_end(shape, i);
+
+        if (shape->part_types[i] != SHAPEFILE_PART_TRIANGLE_STRIP && shape->part_types[i] != SHAPEFILE_PART_TRIANGLE_FAN) {
+            if (first || shapefile_shape_ring_starts(shape, i)) {
+                success = (first || buffer_write_str(wkt, "), ")) && buffer_write_char(wkt, '(');
             }
             else {
-                //adding to a list?
+                success = buffer_write_str(wkt, ", ");
             }
+
+            success = success && shapefile_wkt_coords(wkt, shape, start, end - start, precision);
+            first = false;
+            continue;
         }
-    }
 
-    if (!success) {
-        if (shapefile->shx.f != NULL) {
-            fclose(shapefile->shx.f);
-            shapefile->shx.f = NULL;
+        for (j = start + 2; success && j < end; j++) {
+            corner = shape->part_types[i] == SHAPEFILE_PART_TRIANGLE_FAN ? start : j - 2;
+
+            success = (first || buffer_write_str(wkt, "), ")) &&
+                      buffer_write_str(wkt, "((") &&
+                      shapefile_wkt_coord(wkt, shape, corner, true, precision) &&
+                      shapefile_wkt_coord(wkt, shape, j - 1, false, precision) &&
+                      shapefile_wkt_coord(wkt, shape, j, false, precision) &&
+                      shapefile_wkt_coord(wkt, shape, corner, false, precision) &&
+                      buffer_write_char(wkt, ')');
+            first = false;
         }
     }
 
-    free(path);
+    return success && buffer_write_str(wkt, first ? ")" : "))");
+}
 
-    return success;
+char *
+shapefile_shape_null_wkt() {
+    return strdup("NULL");
 }
 
-shapefile_t *
-shapefile_init() {
-    shapefile_t *shapefile;
+bool
+shapefile_shape_wkt_write(shapefile_shape_t *shape, buffer_t *wkt, int precision) {
+    switch (shapefile_type_base(shape->type)) {
+        case SHAPEFILE_TYPE_NULL:
+            return buffer_write_str(wkt, "NULL");
+        case SHAPEFILE_TYPE_POINT:
+            return shapefile_wkt_tag(wkt, shape, "POINT") &&
+                   shapefile_wkt_coords(wkt, shape, 0, 1, precision);
+        case SHAPEFILE_TYPE_POLYLINE:
+            return shapefile_shape_polyline_wkt(shape, wkt, precision);
+        case SHAPEFILE_TYPE_POLYGON:
+            return shapefile_shape_polygon_wkt(shape, wkt, precision);
+        case SHAPEFILE_TYPE_MULTIPOINT:
+            return shapefile_shape_multipoint_wkt(shape, wkt, precision);
+        case SHAPEFILE_TYPE_MULTIPATCH:
+            return shapefile_shape_multipatch_wkt(shape, wkt, precision);
+    }
 
-    shapefile = calloc(1, sizeof(*shapefile));
+    return false;
+}
 
-    return shapefile;
+char *
+shapefile_shape_wkt(shapefile_shape_t *shape) {
+    buffer_t *wkt;
+    char *str = NULL;
+
+    if (shape->type == SHAPEFILE_TYPE_NULL) {
+        return shapefile_shape_null_wkt();
+    }
+
+    wkt = buffer_init();
+    if (wkt == NULL) {
+        return NULL;
+    }
+
+    if (shapefile_shape_wkt_write(shape, wkt, DTOA_SHORTEST) && buffer_write_char(wkt, '\0')) {
+        str = strdup((const char *)buffer_data(wkt));
+    }
+
+    buffer_free(wkt);
+
+    return str;
 }
 
-void
-shapefile_free(shapefile_t *shapefile) {
-    free(shapefile);
+/****************************************************************************
+ * WKB
+ ****************************************************************************/
+
+#define SHAPEFILE_WKB_POINT              1
+#define SHAPEFILE_WKB_LINESTRING         2
+#define SHAPEFILE_WKB_POLYGON            3
+#define SHAPEFILE_WKB_MULTIPOINT         4
+#define SHAPEFILE_WKB_MULTILINESTRING    5
+#define SHAPEFILE_WKB_MULTIPOLYGON       6
+#define SHAPEFILE_WKB_GEOMETRYCOLLECTION 7
+
+#define SHAPEFILE_EWKB_Z    0x80000000
+#define SHAPEFILE_EWKB_M    0x40000000
+#define SHAPEFILE_EWKB_SRID 0x20000000
+
+typedef struct {
+    buffer_t *buffer;
+    shapefile_shape_t *shape;
+    bool z;                     //whether Z and M are being written
+    bool m;
+    bool ewkb;
+    uint32_t srid;              //written on the outermost geometry only, and not at all when 0
+} shapefile_wkb_t;
+
+//everything is written in the machine's byte order, which WKB says in the first byte of each geometry
+static uint8_t
+shapefile_wkb_byte_order() {
+    uint32_t one = 1;
+    uint8_t first;
+
+    memcpy(&first, &one, sizeof(first));
+
+    return first;
 }
 
-bool
-shapefile_parse_cb(shapefile_t *shapefile, const char *path, shapefile_parse_cb_t *cb) {
-    char *path_prefix, *ptr;
-    bool success, stop;
+static bool
+shapefile_wkb_header(shapefile_wkb_t *wkb, uint32_t type) {
+    uint32_t srid;
 
-    //if <path>/<file>.shp is passed in, strip the .shp so we can get the base name
-    path_prefix = strdup(path);
-    ptr = strrchr(path_prefix, '.');
-    if (ptr != NULL) {
-        *ptr = '\0';
+    srid = wkb->srid;
+    wkb->srid = 0;
+
+    if (wkb->ewkb) {
+        type |= (wkb->z ? SHAPEFILE_EWKB_Z : 0) | (wkb->m ? SHAPEFILE_EWKB_M : 0) | (srid != 0 ? SHAPEFILE_EWKB_SRID : 0);
+    }
+    else {
+        type += (wkb->z ? 1000 : 0) + (wkb->m ? 2000 : 0);
     }
 
-    stop = false;
+    return buffer_write_uint8(wkb->buffer, shapefile_wkb_byte_order()) &&
+           buffer_write_uint32(wkb->buffer, type) &&
+           (srid == 0 || buffer_write_uint32(wkb->buffer, srid));
+}
 
-    success = shapefile_parse_shx(shapefile, path_prefix) &&
-              shapefile_parse_shp(shapefile, path_prefix, &stop, cb);
+static bool
+shapefile_wkb_coords(shapefile_wkb_t *wkb, int32_t start, int32_t count) {
+    shapefile_shape_t *shape = wkb->shape;
+    unsigned char *dst;
+    size_t size;
+    int32_t i;
+
+    //x and y are already laid out the way WKB has them
+    if (!wkb->z && !wkb->m) {
+        return count == 0 || buffer_write(wkb->buffer, (unsigned char *)(shape->points + start), (size_t)count * sizeof(*shape->points));
+    }
+
+    size = sizeof(*shape->points) + (wkb->z ? sizeof(double) : 0) + (wkb->m ? sizeof(double) : 0);
+    dst = buffer_reserve(wkb->buffer, (size_t)count * size);
+    if (dst == NULL) {
+        return false;
+    }
+
+    for (i = start; i < start + count; i++) {
+        memcpy(dst, &shape->points[i], sizeof(*shape->points));
+        dst += sizeof(*shape->points);
+
+        if (wkb->z) {
+            memcpy(dst, &shape->z[i], sizeof(double));
+            dst += sizeof(double);
+        }
+        if (wkb->m) {
+            memcpy(dst, &shape->m[i], sizeof(double));
+            dst += sizeof(double);
+        }
+    }
+
+    buffer_commit(wkb->buffer, (size_t)count * size);
+
+    return true;
+}
+
+static bool
+shapefile_wkb_linestring(shapefile_wkb_t *wkb, int32_t start, int32_t count) {
+    return shapefile_wkb_header(wkb, SHAPEFILE_WKB_LINESTRING) &&
+           buffer_write_uint32(wkb->buffer, (uint32_t)count) &&
+           shapefile_wkb_coords(wkb, start, count);
+}
+
+static bool
+shapefile_wkb_polygon(shapefile_wkb_t *wkb, int32_t part) {
+    shapefile_shape_t *shape = wkb->shape;
+    uint32_t rings, i;
+    int32_t start, count;
+    bool success;
+
+    rings = shapefile_shape_polygon_rings(shape, part);
 
-    if (shapefile->shx.f != NULL) {
-        fclose(shapefile->shx.f);
-        shapefile->shx.f = NULL;
+    success = shapefile_wkb_header(wkb, SHAPEFILE_WKB_POLYGON) &&
+              buffer_write_uint32(wkb->buffer, rings);
+
+    for (i = 0; success && i < rings; i++, part++) {
+        start = shape->parts[part];
+        count = shapefile_shape_part_end(shape, part) - start;
+
+        success = buffer_write_uint32(wkb->buffer, (uint32_t)count) &&
+                  shapefile_wkb_coords(wkb, start, count);
+    }
+
+    return success;
+}
+
+static bool
+shapefile_wkb_triangle(shapefile_wkb_t *wkb, int32_t corner, int32_t j) {
+    return shapefile_wkb_header(wkb, SHAPEFILE_WKB_POLYGON) &&
+           buffer_write_uint32(wkb->buffer, 1) &&
+           buffer_write_uint32(wkb->buffer, 4) &&
+           shapefile_wkb_coords(wkb, corner, 1) &&
+           shapefile_wkb_coords(wkb, j - 1, 1) &&
+           shapefile_wkb_coords(wkb, j, 1) &&
+           shapefile_wkb_coords(wkb, corner, 1);
+}
+
+//polygons and multipatches, split up the same way as their WKT
+static bool
+shapefile_wkb_polygons(shapefile_wkb_t *wkb) {
+    shapefile_shape_t *shape = wkb->shape;
+    uint32_t polygons;
+    int32_t i, j;
+    bool success;
+
+    if (shape->num_parts == 0) {
+        return shapefile_wkb_header(wkb, shape->part_types != NULL ? SHAPEFILE_WKB_MULTIPOLYGON : SHAPEFILE_WKB_POLYGON) &&
+               buffer_write_uint32(wkb->buffer, 0);
+    }
+
+    polygons = shapefile_shape_polygons(shape);
+    if (polygons == 1 && shape->part_types == NULL) {
+        return shapefile_wkb_polygon(wkb, 0);
     }
 
-    if (shapefile->shp.f != NULL) {
-        fclose(shapefile->shp.f);
-        shapefile->shp.f = NULL;
+    success = shapefile_wkb_header(wkb, SHAPEFILE_WKB_MULTIPOLYGON) &&
+              buffer_write_uint32(wkb->buffer, polygons);
+
+    for (i = 0; success && i < shape->num_parts; i++) {
+        if (shapefile_shape_part_triangles(shape, i)) {
+            for (j = shape->parts[i] + 2; success && j < shapefile_shape_part_end(shape, i); j++) {
+                success = shapefile_wkb_triangle(wkb, shapefile_shape_triangle_corner(shape, i, j), j);
+            }
+        }
+        else if (shapefile_shape_ring_starts(shape, i)) {
+            success = shapefile_wkb_polygon(wkb, i);
+        }
     }
 
-    free(path_prefix);
     return success;
 }
 
+static bool
+shapefile_shape_wkb(shapefile_shape_t *shape, buffer_t *buffer, bool ewkb, uint32_t srid, int flags) {
+    shapefile_wkb_t wkb;
+    int32_t i;
+    bool success;
 
-const char *
-shapefile_error(shapefile_t *shapefile) {
-    return shapefile->error;
+    wkb.buffer = buffer;
+    wkb.shape = shape;
+    wkb.z = shape->z != NULL && !(flags & SHAPEFILE_WKB_2D);
+    wkb.m = shape->m != NULL && !(flags & SHAPEFILE_WKB_2D);
+    wkb.ewkb = ewkb;
+    wkb.srid = srid;
+
+    switch (shapefile_type_base(shape->type)) {
+        case SHAPEFILE_TYPE_NULL:
+            return shapefile_wkb_header(&wkb, SHAPEFILE_WKB_GEOMETRYCOLLECTION) &&
+                   buffer_write_uint32(buffer, 0);
+        case SHAPEFILE_TYPE_POINT:
+            return shapefile_wkb_header(&wkb, SHAPEFILE_WKB_POINT) &&
+                   shapefile_wkb_coords(&wkb, 0, 1);
+        case SHAPEFILE_TYPE_MULTIPOINT:
+            success = shapefile_wkb_header(&wkb, SHAPEFILE_WKB_MULTIPOINT) &&
+                      buffer_write_uint32(buffer, (uint32_t)shape->num_points);
+            for (i = 0; success && i < shape->num_points; i++) {
+                success = shapefile_wkb_header(&wkb, SHAPEFILE_WKB_POINT) &&
+                          shapefile_wkb_coords(&wkb, i, 1);
+            }
+            return success;
+        case SHAPEFILE_TYPE_POLYLINE:
+            if (shape->num_parts <= 1) {
+                return shapefile_wkb_linestring(&wkb, 0, shape->num_parts == 0 ? 0 : shape->num_points);
+            }
+
+            success = shapefile_wkb_header(&wkb, SHAPEFILE_WKB_MULTILINESTRING) &&
+                      buffer_write_uint32(buffer, (uint32_t)shape->num_parts);
+            for (i = 0; success && i < shape->num_parts; i++) {
+                success = shapefile_wkb_linestring(&wkb, shape->parts[i], shapefile_shape_part_end(shape, i) - shape->parts[i]);
+            }
+            return success;
+        case SHAPEFILE_TYPE_POLYGON:
+        case SHAPEFILE_TYPE_MULTIPATCH:
+            return shapefile_wkb_polygons(&wkb);
+    }
+
+    return false;
+}
+
+bool
+shapefile_shape_wkb_write(shapefile_shape_t *shape, buffer_t *wkb, int flags) {
+    return shapefile_shape_wkb(shape, wkb, false, 0, flags);
+}
+
+bool
+shapefile_shape_ewkb_write(shapefile_shape_t *shape, buffer_t *wkb, uint32_t srid, int flags) {
+    return shapefile_shape_wkb(shape, wkb, true, srid, flags);
+}
+
+/****************************************************************************
+ * GeoJSON
+ ****************************************************************************/
+
+//JSON has no NaN or infinity, so they're written as null like they are in the properties
+static size_t
+shapefile_geojson_number(char *dst, double value, int precision) {
+    if (isnan(value) || isinf(value)) {
+        memcpy(dst, "null", 4);
+        return 4;
+    }
+
+    return dtoa_format(dst, value, precision);
+}
+
+//only Z goes in a position since GeoJSON has nowhere for M
+static bool
+shapefile_geojson_coord(buffer_t *json, shapefile_shape_t *shape, int32_t index, bool first, int precision) {
+    char *dst;
+    size_t len = 0;
+
+    dst = (char *)buffer_reserve(json, 3 + (3 * DTOA_BUFFER_SIZE));
+    if (dst == NULL) {
+        return false;
+    }
+
+    if (!first) {
+        dst[len++] = ',';
+    }
+
+    dst[len++] = '[';
+    len += shapefile_geojson_number(dst + len, shape->points[index].x, precision);
+    dst[len++] = ',';
+    len += shapefile_geojson_number(dst + len, shape->points[index].y, precision);
+
+    if (shape->z != NULL) {
+        dst[len++] = ',';
+        len += shapefile_geojson_number(dst + len, shape->z[index], precision);
+    }
+
+    dst[len++] = ']';
+
+    buffer_commit(json, len);
+
+    return true;
+}
+
+//rings are written backwards, since GeoJSON winds outer rings counterclockwise where shapefiles wind them clockwise
+static bool
+shapefile_geojson_coords(buffer_t *json, shapefile_shape_t *shape, int32_t start, int32_t count, bool reverse, int precision) {
+    int32_t i;
+    bool success;
+
+    success = buffer_write_char(json, '[');
+    for (i = 0; success && i < count; i++) {
+        success = shapefile_geojson_coord(json, shape, reverse ? start + count - 1 - i : start + i, i == 0, precision);
+    }
+
+    return success && buffer_write_char(json, ']');
+}
+
+static bool
+shapefile_geojson_polygon(buffer_t *json, shapefile_shape_t *shape, int32_t part, int precision) {
+    uint32_t rings, i;
+    bool success;
+
+    rings = shapefile_shape_polygon_rings(shape, part);
+
+    success = buffer_write_char(json, '[');
+    for (i = 0; success && i < rings; i++, part++) {
+        success = (i == 0 || buffer_write_char(json, ',')) &&
+                  shapefile_geojson_coords(json, shape, shape->parts[part], shapefile_shape_part_end(shape, part) - shape->parts[part], true, precision);
+    }
+
+    return success && buffer_write_char(json, ']');
+}
+
+static bool
+shapefile_geojson_polygons(buffer_t *json, shapefile_shape_t *shape, int precision) {
+    int32_t i, j, corner;
+    bool success, first = true;
+
+    if (shape->num_parts == 0) {
+        return buffer_write_str(json, shape->part_types != NULL ? "{\"type\":\"MultiPolygon\",\"coordinates\":[]}" : "{\"type\":\"Polygon\",\"coordinates\":[]}");
+    }
+
+    if (shape->part_types == NULL && shapefile_shape_polygons(shape) == 1) {
+        return buffer_write_str(json, "{\"type\":\"Polygon\",\"coordinates\":") &&
+               shapefile_geojson_polygon(json, shape, 0, precision) &&
+               buffer_write_char(json, '}');
+    }
+
+    success = buffer_write_str(json, "{\"type\":\"MultiPolygon\",\"coordinates\":[");
+    for (i = 0; success && i < shape->num_parts; i++) {
+        if (shapefile_shape_part_triangles(shape, i)) {
+            for (j = shape->parts[i] + 2; success && j < shapefile_shape_part_end(shape, i); j++) {
+                corner = shapefile_shape_triangle_corner(shape, i, j);
+                success = (first || buffer_write_char(json, ',')) &&
+                          buffer_write_str(json, "[[") &&
+                          shapefile_geojson_coord(json, shape, corner, true, precision) &&
+                          shapefile_geojson_coord(json, shape, j - 1, false, precision) &&
+                          shapefile_geojson_coord(json, shape, j, false, precision) &&
+                          shapefile_geojson_coord(json, shape, corner, false, precision) &&
+                          buffer_write_str(json, "]]");
+                first = false;
+            }
+        }
+        else if (shapefile_shape_ring_starts(shape, i)) {
+            success = (first || buffer_write_char(json, ',')) &&
+                      shapefile_geojson_polygon(json, shape, i, precision);
+            first = false;
+        }
+    }
+
+    return success && buffer_write_str(json, "]}");
+}
+
+bool
+shapefile_shape_geojson_write(shapefile_shape_t *shape, buffer_t *json, int precision) {
+    int32_t i;
+    bool success;
+
+    switch (shapefile_type_base(shape->type)) {
+        case SHAPEFILE_TYPE_NULL:
+            return buffer_write_str(json, "null");
+        case SHAPEFILE_TYPE_POINT:
+            return buffer_write_str(json, "{\"type\":\"Point\",\"coordinates\":") &&
+                   shapefile_geojson_coord(json, shape, 0, true, precision) &&
+                   buffer_write_char(json, '}');
+        case SHAPEFILE_TYPE_MULTIPOINT:
+            return buffer_write_str(json, "{\"type\":\"MultiPoint\",\"coordinates\":") &&
+                   shapefile_geojson_coords(json, shape, 0, shape->num_points, false, precision) &&
+                   buffer_write_char(json, '}');
+        case SHAPEFILE_TYPE_POLYLINE:
+            if (shape->num_parts <= 1) {
+                return buffer_write_str(json, "{\"type\":\"LineString\",\"coordinates\":") &&
+                       shapefile_geojson_coords(json, shape, 0, shape->num_parts == 0 ? 0 : shape->num_points, false, precision) &&
+                       buffer_write_char(json, '}');
+            }
+
+            success = buffer_write_str(json, "{\"type\":\"MultiLineString\",\"coordinates\":[");
+            for (i = 0; success && i < shape->num_parts; i++) {
+                success = (i == 0 || buffer_write_char(json, ',')) &&
+                          shapefile_geojson_coords(json, shape, shape->parts[i], shapefile_shape_part_end(shape, i) - shape->parts[i], false, precision);
+            }
+            return success && buffer_write_str(json, "]}");
+        case SHAPEFILE_TYPE_POLYGON:
+        case SHAPEFILE_TYPE_MULTIPATCH:
+            return shapefile_geojson_polygons(json, shape, precision);
+    }
+
+    return false;
+}
+
+int
+shapefile_shape_type(shapefile_shape_t *shape) {
+    return shape->type;
+}
+
+const shapefile_mbr_t *
+shapefile_shape_mbr(shapefile_shape_t *shape) {
+    return &shape->mbr;
+}
+
+const shapefile_range_t *
+shapefile_shape_range(shapefile_shape_t *shape) {
+    return &shape->range;
+}
+
+unsigned int
+shapefile_shape_num_parts(shapefile_shape_t *shape) {
+    return (unsigned int)shape->num_parts;
+}
+
+unsigned int
+shapefile_shape_num_points(shapefile_shape_t *shape) {
+    return (unsigned int)shape->num_points;
+}
+
+const shapefile_point_t *
+shapefile_shape_points(shapefile_shape_t *shape) {
+    return shape->points;
+}
+
+const double *
+shapefile_shape_z(shapefile_shape_t *shape) {
+    return shape->z;
+}
+
+const double *
+shapefile_shape_m(shapefile_shape_t *shape) {
+    return shape->m;
+}
+
+const int32_t *
+shapefile_shape_parts(shapefile_shape_t *shape) {
+    return shape->parts;
+}
+
+const int32_t *
+shapefile_shape_part_types(shapefile_shape_t *shape) {
+    return shape->part_types;
+}
+
+const shapefile_point_t *
+shapefile_shape_part(shapefile_shape_t *shape, unsigned int index, unsigned int *count) {
+    if (index >= (unsigned int)shape->num_parts) {
+        *count = 0;
+        return NULL;
+    }
+
+    *count = (unsigned int)(shapefile_shape_part_end(shape, (int32_t)index) - shape->parts[index]);
+
+    return shape->points + shape->parts[index];
+}
+
+static void
+shapefile_file_close(shapefile_file_t *file) {
+#if !defined(_WIN32)
+    if (file->map != NULL) {
+        munmap(file->map, (size_t)file->size);
+    }
+#endif
+
+    if (file->f != NULL) {
+        fclose(file->f);
+    }
+
+    free(file->buf);
+    memset(file, 0, sizeof(*file));
+}
+
+static bool
+shapefile_file_open(shapefile_t *shapefile, shapefile_file_t *file, const char *path_prefix, const char *extension) {
+#if !defined(_WIN32)
+    struct stat st;
+    void *map;
+#endif
+    char *path;
+    int len, error;
+
+    len = asprintf(&path, "%s.%s", path_prefix, extension);
+    if (len == -1) {
+        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+        return false;
+    }
+
+    file->f = fopen(path, "rb");
+    if (file->f == NULL) {
+        //errno is put back so callers can tell a missing file apart from other errors
+        error = errno;
+        snprintf(shapefile->error, sizeof(shapefile->error), "Error opening %s: %s", path, strerror(error));
+        free(path);
+        errno = error;
+        return false;
+    }
+
+#if defined(_WIN32)
+    if (_fseeki64(file->f, 0, SEEK_END) != 0 || (file->size = (uint64_t)_ftelli64(file->f)) == (uint64_t)-1) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Error getting the size of %s: %s", path, strerror(errno));
+        free(path);
+        shapefile_file_close(file);
+        return false;
+    }
+#else
+    if (fstat(fileno(file->f), &st) != 0) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Error getting the size of %s: %s", path, strerror(errno));
+        free(path);
+        shapefile_file_close(file);
+        return false;
+    }
+
+    file->size = (uint64_t)st.st_size;
+
+    //anything that can't be mapped, like a file bigger than the address space, falls back to reading through a buffer
+    if (shapefile->mmap && file->size > 0 && file->size <= SIZE_MAX) {
+        map = mmap(NULL, (size_t)file->size, PROT_READ, MAP_PRIVATE, fileno(file->f), 0);
+        if (map != MAP_FAILED) {
+            file->map = map;
+        }
+    }
+#endif
+
+    free(path);
+
+    return true;
+}
+
+//tells the kernel whether the mapping will be read from start to end or jumped around in
+static void
+shapefile_file_advise(shapefile_file_t *file, bool sequential) {
+#if !defined(_WIN32)
+    if (file->map != NULL) {
+        madvise(file->map, (size_t)file->size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+    }
+#endif
+}
+
+//returns len bytes of the file starting at offset. the pointer is good until the next call for the same file
+static const unsigned char *
+shapefile_file_view(shapefile_t *shapefile, shapefile_file_t *file, uint64_t offset, size_t len) {
+    unsigned char *buf;
+    size_t size;
+
+    if (offset > file->size || len > file->size - offset) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Reading %zu bytes at offset %llu runs past the end of the file (%llu bytes)", len, (unsigned long long)offset, (unsigned long long)file->size);
+        return NULL;
+    }
+
+    if (file->map != NULL) {
+        return file->map + offset;
+    }
+
+    if (file->buf != NULL && offset >= file->buf_offset && offset + len <= file->buf_offset + file->buf_len) {
+        return file->buf + (offset - file->buf_offset);
+    }
+
+    //refill the buffer starting at offset, growing it for records that don't fit
+    size = len > SHAPEFILE_BUFFER_SIZE ? len : SHAPEFILE_BUFFER_SIZE;
+    if (size > file->buf_size) {
+        buf = realloc(file->buf, size);
+        if (buf == NULL) {
+            strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+            return NULL;
+        }
+
+        file->buf = buf;
+        file->buf_size = size;
+    }
+
+    if (size > file->size - offset) {
+        size = (size_t)(file->size - offset);
+    }
+
+    if (fseeko(file->f, (shapefile_off_t)offset, SEEK_SET) != 0) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Error seeking to offset %llu: %s", (unsigned long long)offset, strerror(errno));
+        return NULL;
+    }
+
+    file->buf_offset = offset;
+    file->buf_len = fread(file->buf, 1, size, file->f);
+    if (file->buf_len < len) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Error reading %zu bytes: Only read %zu", len, file->buf_len);
+        file->buf_len = 0;
+        return NULL;
+    }
+
+    return file->buf;
+}
+
+static void
+shapefile_cursor_init(shapefile_cursor_t *cursor, const unsigned char *data, size_t len) {
+    cursor->data = data;
+    cursor->len = len;
+    cursor->pos = 0;
+}
+
+static bool
+shapefile_cursor_check(shapefile_t *shapefile, shapefile_cursor_t *cursor, size_t len) {
+    if (len > cursor->len - cursor->pos) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Reading %zu bytes at %zu runs past the end of a %zu byte record", len, cursor->pos, cursor->len);
+        return false;
+    }
+
+    return true;
+}
+
+//the loads go through memcpy() since nothing in a shapefile is aligned, and compile down to a single move
+static bool
+shapefile_get_uint16_le(shapefile_t *shapefile, shapefile_cursor_t *cursor, uint16_t *value) {
+    uint16_t data;
+
+    if (!shapefile_cursor_check(shapefile, cursor, sizeof(data))) {
+        return false;
+    }
+
+    memcpy(&data, cursor->data + cursor->pos, sizeof(data));
+    cursor->pos += sizeof(data);
+
+    *value = le16toh(data);
+    return true;
+}
+
+static bool
+shapefile_get_int32_le(shapefile_t *shapefile, shapefile_cursor_t *cursor, int32_t *value) {
+    uint32_t data;
+
+    if (!shapefile_cursor_check(shapefile, cursor, sizeof(data))) {
+        return false;
+    }
+
+    memcpy(&data, cursor->data + cursor->pos, sizeof(data));
+    cursor->pos += sizeof(data);
+
+    *value = (int32_t)le32toh(data);
+    return true;
+}
+
+static bool
+shapefile_get_int32_be(shapefile_t *shapefile, shapefile_cursor_t *cursor, int32_t *value) {
+    uint32_t data;
+
+    if (!shapefile_cursor_check(shapefile, cursor, sizeof(data))) {
+        return false;
+    }
+
+    memcpy(&data, cursor->data + cursor->pos, sizeof(data));
+    cursor->pos += sizeof(data);
+
+    *value = (int32_t)be32toh(data);
+    return true;
+}
+
+static bool
+shapefile_get_double_le(shapefile_t *shapefile, shapefile_cursor_t *cursor, double *value) {
+    uint64_t data;
+
+    if (!shapefile_cursor_check(shapefile, cursor, sizeof(data))) {
+        return false;
+    }
+
+    memcpy(&data, cursor->data + cursor->pos, sizeof(data));
+    cursor->pos += sizeof(data);
+
+    data = le64toh(data);
+    memcpy(value, &data, sizeof(*value));
+    return true;
+}
+
+//copies count doubles in one go. on little endian machines the byte swapping is a no-op and the loop goes away
+static bool
+shapefile_get_doubles_le(shapefile_t *shapefile, shapefile_cursor_t *cursor, double *values, size_t count) {
+    uint64_t data;
+    size_t i;
+
+    if (count > (cursor->len - cursor->pos) / sizeof(data)) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Reading %zu doubles at %zu runs past the end of a %zu byte record", count, cursor->pos, cursor->len);
+        return false;
+    }
+
+    memcpy(values, cursor->data + cursor->pos, count * sizeof(data));
+    cursor->pos += count * sizeof(data);
+
+    for (i = 0; i < count; i++) {
+        memcpy(&data, &values[i], sizeof(data));
+        data = le64toh(data);
+        memcpy(&values[i], &data, sizeof(data));
+    }
+
+    return true;
+}
+
+static bool
+shapefile_get_int32s_le(shapefile_t *shapefile, shapefile_cursor_t *cursor, int32_t *values, size_t count) {
+    size_t i;
+
+    if (count > (cursor->len - cursor->pos) / sizeof(*values)) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Reading %zu integers at %zu runs past the end of a %zu byte record", count, cursor->pos, cursor->len);
+        return false;
+    }
+
+    memcpy(values, cursor->data + cursor->pos, count * sizeof(*values));
+    cursor->pos += count * sizeof(*values);
+
+    for (i = 0; i < count; i++) {
+        values[i] = (int32_t)le32toh((uint32_t)values[i]);
+    }
+
+    return true;
+}
+
+#if 0
+//The documentation talks about the sizes as 16 bit numbers, but i haven't found a file that actually
+//uses two 16 bit fields to make a 32 bit field.
+//Maybe they don't exist anymore?
+//Maybe they're written to file as a 32 bit field?
+static bool
+shapefile_read_int32_size_be(shapefile_t *shapefile, FILE *f, int32_t *value, int32_t *length) {
+    int16_t low, high;
+    bool success;
+
+    success = shapefile_read_int16_be(shapefile, f, &low, length) &&
+              shapefile_read_int16_be(shapefile, f, &high, length);
+
+    if (success) {
+        *value = (high << 16) | (low & 0xFFFF);
+    }
+
+    return success;
+}
+#endif
+
+static bool
+shapefile_read_header(shapefile_t *shapefile, shapefile_file_t *file, shapefile_header_t *header) {
+    shapefile_cursor_t cursor;
+    const unsigned char *data;
+    bool success;
+
+    data = shapefile_file_view(shapefile, file, 0, SHAPEFILE_HEADER_SIZE);
+    if (data == NULL) {
+        return false;
+    }
+
+    shapefile_cursor_init(&cursor, data, SHAPEFILE_HEADER_SIZE);
+
+    success = shapefile_get_int32_be(shapefile,  &cursor, &header->code) &&
+              shapefile_get_int32_be(shapefile,  &cursor, &header->unused[0]) &&
+              shapefile_get_int32_be(shapefile,  &cursor, &header->unused[1]) &&
+              shapefile_get_int32_be(shapefile,  &cursor, &header->unused[2]) &&
+              shapefile_get_int32_be(shapefile,  &cursor, &header->unused[3]) &&
+              shapefile_get_int32_be(shapefile,  &cursor, &header->unused[4]) &&
+              shapefile_get_int32_be(shapefile,  &cursor, &header->length) &&
+              shapefile_get_int32_le(shapefile,  &cursor, &header->version) &&
+              shapefile_get_int32_le(shapefile,  &cursor, &header->type) &&
+              shapefile_get_double_le(shapefile, &cursor, &header->mbr.min_x) &&
+              shapefile_get_double_le(shapefile, &cursor, &header->mbr.min_y) &&
+              shapefile_get_double_le(shapefile, &cursor, &header->mbr.max_x) &&
+              shapefile_get_double_le(shapefile, &cursor, &header->mbr.max_y) &&
+              shapefile_get_double_le(shapefile, &cursor, &header->range.z.min) &&
+              shapefile_get_double_le(shapefile, &cursor, &header->range.z.max) &&
+              shapefile_get_double_le(shapefile, &cursor, &header->range.m.min) &&
+              shapefile_get_double_le(shapefile, &cursor, &header->range.m.max);
+
+    if (success) {
+        if (header->code != SHAPEFILE_HEADER_MAGIC) {
+            snprintf(shapefile->error, sizeof(shapefile->error), "Header magic number %08x is invalid", header->code);
+            success = false;
+        }
+    }
+
+    if (success) {
+        if (!shapefile_type_valid(header->type)) {
+            snprintf(shapefile->error, sizeof(shapefile->error), "Header Type %d is invalid", header->type);
+            success = false;
+        }
+    }
+
+    if (success) {
+        //IMPORTANT!!! the length is the number of 16bit words in the file
+        if ((uint64_t)(uint32_t)header->length * sizeof(int16_t) < SHAPEFILE_HEADER_SIZE) {
+            snprintf(shapefile->error, sizeof(shapefile->error), "Size in header %d cannot be less than header size %lu", header->length, SHAPEFILE_HEADER_SIZE);
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+static bool
+shapefile_read_shp_record_header(shapefile_t *shapefile, shapefile_cursor_t *cursor, shapefile_shp_record_header_t *header) {
+    return shapefile_get_int32_be(shapefile, cursor, &header->number) &&
+           shapefile_get_int32_be(shapefile, cursor, &header->length);
+}
+
+static bool
+shapefile_read_mbr(shapefile_t *shapefile, shapefile_cursor_t *cursor, shapefile_mbr_t *mbr) {
+    return shapefile_get_double_le(shapefile, cursor, &mbr->min_x) &&
+           shapefile_get_double_le(shapefile, cursor, &mbr->min_y) &&
+           shapefile_get_double_le(shapefile, cursor, &mbr->max_x) &&
+           shapefile_get_double_le(shapefile, cursor, &mbr->max_y);
+}
+
+static bool
+shapefile_read_range(shapefile_t *shapefile, shapefile_cursor_t *cursor, double *min, double *max) {
+    return shapefile_get_double_le(shapefile, cursor, min) &&
+           shapefile_get_double_le(shapefile, cursor, max);
+}
+
+static bool
+shapefile_read_shp_record_null(shapefile_t *shapefile, shapefile_cursor_t *cursor, shapefile_shp_record_header_t *record_header, shapefile_shp_record_t *record) {
+    record->shape = shapefile_shape_new(shapefile, record->type, 0, 0, 0);
+    if (record->shape == NULL) {
+        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+        return false;
+    }
+
+    return true;
+}
+
+//Point, PointZ and PointM
+static bool
+shapefile_read_shp_record_point(shapefile_t *shapefile, shapefile_cursor_t *cursor, shapefile_shp_record_header_t *record_header, shapefile_shp_record_t *record) {
+    shapefile_shape_t *shape;
+    bool has_z, has_m;
+
+    //PointM always has its M, but for PointZ it's only there if the record is long enough
+    has_z = shapefile_type_has_z(record->type);
+    has_m = record->type == SHAPEFILE_TYPE_POINT_M || (has_z && cursor->len - cursor->pos >= 4 * sizeof(double));
+
+    shape = shapefile_shape_new(shapefile, record->type, 0, 1, (has_z ? SHAPEFILE_SHAPE_Z : 0) | (has_m ? SHAPEFILE_SHAPE_M : 0));
+    if (shape == NULL) {
+        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+        return false;
+    }
+
+    record->shape = shape;
+
+    if (!shapefile_get_doubles_le(shapefile, cursor, (double *)shape->points, 2) ||
+        (has_z && !shapefile_get_double_le(shapefile, cursor, shape->z)) ||
+        (has_m && !shapefile_get_double_le(shapefile, cursor, shape->m))) {
+        return false;
+    }
+
+    shape->mbr.min_x = shape->mbr.max_x = shape->points[0].x;
+    shape->mbr.min_y = shape->mbr.max_y = shape->points[0].y;
+
+    if (has_z) {
+        shape->range.z.min = shape->range.z.max = shape->z[0];
+    }
+    if (has_m) {
+        shape->range.m.min = shape->range.m.max = shape->m[0];
+    }
+
+    return true;
+}
+
+//everything with parts or more than one point. they all share the same layout, with MultiPoints not having parts,
+//only MultiPatches having part types, and the Z and M sections at the end
+static bool
+shapefile_read_shp_record_poly(shapefile_t *shapefile, shapefile_cursor_t *cursor, shapefile_shp_record_header_t *record_header, shapefile_shp_record_t *record, bool has_parts) {
+    shapefile_shape_t *shape;
+    shapefile_mbr_t mbr;
+    int32_t num_parts = 0, num_points, i;
+    uint64_t size, left;
+    bool success, has_z, has_m, has_part_types;
+
+    success = shapefile_read_mbr(shapefile, cursor, &mbr) &&
+              (!has_parts || shapefile_get_int32_le(shapefile, cursor, &num_parts)) &&
+              shapefile_get_int32_le(shapefile, cursor, &num_points);
+    if (!success) {
+        return false;
+    }
+
+    has_z = shapefile_type_has_z(record->type);
+    has_part_types = record->type == SHAPEFILE_TYPE_MULTIPATCH;
+
+    //check the counts against what's left of the record before trusting them with an allocation
+    left = cursor->len - cursor->pos;
+    size = ((uint64_t)(uint32_t)num_parts * sizeof(int32_t) * (has_part_types ? 2 : 1)) +
+           ((uint64_t)(uint32_t)num_points * sizeof(shapefile_point_t)) +
+           (has_z ? (2 * sizeof(double)) + ((uint64_t)(uint32_t)num_points * sizeof(double)) : 0);
+
+    if (num_parts < 0 || num_points < 0 || size > left) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Record %d has %d parts and %d points, which don't fit in its length", record_header->number, num_parts, num_points);
+        return false;
+    }
+
+    //the M range and array are optional, and only there if the record has room for them
+    has_m = shapefile_type_has_m(record->type) && left - size >= (2 * sizeof(double)) + ((uint64_t)num_points * sizeof(double));
+
+    shape = shapefile_shape_new(shapefile, record->type, num_parts, num_points, (has_z ? SHAPEFILE_SHAPE_Z : 0) | (has_m ? SHAPEFILE_SHAPE_M : 0) | (has_part_types ? SHAPEFILE_SHAPE_PART_TYPES : 0));
+    if (shape == NULL) {
+        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+        return false;
+    }
+
+    record->shape = shape;
+    shape->mbr = mbr;
+
+    //each array is decoded in one go. the points are stored as x, y pairs, the same as the record
+    success = shapefile_get_int32s_le(shapefile, cursor, shape->parts, (size_t)num_parts) &&
+              (!has_part_types || shapefile_get_int32s_le(shapefile, cursor, shape->part_types, (size_t)num_parts)) &&
+              shapefile_get_doubles_le(shapefile, cursor, (double *)shape->points, (size_t)num_points * 2) &&
+              (!has_z || (shapefile_read_range(shapefile, cursor, &shape->range.z.min, &shape->range.z.max) &&
+                          shapefile_get_doubles_le(shapefile, cursor, shape->z, (size_t)num_points))) &&
+              (!has_m || (shapefile_read_range(shapefile, cursor, &shape->range.m.min, &shape->range.m.max) &&
+                          shapefile_get_doubles_le(shapefile, cursor, shape->m, (size_t)num_points)));
+    if (!success) {
+        return false;
+    }
+
+    for (i = 0; i < num_parts; i++) {
+        if (shape->parts[i] < (i == 0 ? 0 : shape->parts[i - 1]) || shape->parts[i] > num_points || (i == 0 && shape->parts[i] != 0)) {
+            snprintf(shapefile->error, sizeof(shapefile->error), "Part %d in %s record %d starts at invalid point %d", i, shapefile_type_str(record->type), record_header->number, shape->parts[i]);
+            return false;
+        }
+
+        if (has_part_types && (shape->part_types[i] < SHAPEFILE_PART_TRIANGLE_STRIP || shape->part_types[i] > SHAPEFILE_PART_RING)) {
+            snprintf(shapefile->error, sizeof(shapefile->error), "Part %d in %s record %d has invalid type %d", i, shapefile_type_str(record->type), record_header->number, shape->part_types[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//with validation on, a shape's coordinates have to be finite numbers inside the bounding box and Z range its record
+//gives for them
+static bool
+shapefile_validate_shape(shapefile_t *shapefile, shapefile_shape_t *shape, int32_t number) {
+    shapefile_mbr_t mbr;
+    double min, max;
+
+    if (shape->num_points == 0) {
+        return true;
+    }
+
+    if (!shapefile_points_bounds(shape->points, (size_t)shape->num_points, &mbr) ||
+        isinf(mbr.min_x) || isinf(mbr.min_y) || isinf(mbr.max_x) || isinf(mbr.max_y)) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Record %d has a coordinate that isn't a finite number", number);
+        return false;
+    }
+
+    if (mbr.min_x < shape->mbr.min_x || mbr.min_y < shape->mbr.min_y || mbr.max_x > shape->mbr.max_x || mbr.max_y > shape->mbr.max_y) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Record %d has points outside its bounding box", number);
+        return false;
+    }
+
+    if (shape->z != NULL) {
+        if (!shapefile_values_range(shape->z, (size_t)shape->num_points, &min, &max) || isinf(min) || isinf(max)) {
+            snprintf(shapefile->error, sizeof(shapefile->error), "Record %d has a Z value that isn't a finite number", number);
+            return false;
+        }
+
+        if (min < shape->range.z.min || max > shape->range.z.max) {
+            snprintf(shapefile->error, sizeof(shapefile->error), "Record %d has Z values outside its range", number);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+shapefile_reprojecting(shapefile_t *shapefile) {
+    return shapefile->target_crs != SHAPEFILE_CRS_UNKNOWN && shapefile->target_crs != shapefile->crs;
+}
+
+//reprojects and then runs the custom transform over a freshly decoded shape, while its points are still in cache,
+//and then brings its box and Z range up to date
+static bool
+shapefile_transform_shape(shapefile_t *shapefile, shapefile_shape_t *shape, int32_t number) {
+    size_t count;
+
+    if (shape->num_points == 0) {
+        return true;
+    }
+
+    count = (size_t)shape->num_points;
+
+    if (shapefile_reprojecting(shapefile)) {
+        shapefile_reproject(shape->points, count, shapefile->crs, shapefile->target_crs);
+    }
+
+    if (shapefile->transform.transform != NULL && !shapefile->transform.transform(shape->points, shape->z, count, shapefile->transform.user_data)) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "The transform failed on record %d", number);
+        return false;
+    }
+
+    if (!shapefile_points_bounds(shape->points, count, &shape->mbr) ||
+        (shape->z != NULL && !shapefile_values_range(shape->z, count, &shape->range.z.min, &shape->range.z.max))) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Record %d has a coordinate that isn't a number after transforming", number);
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+shapefile_read_shp_record(shapefile_t *shapefile, shapefile_cursor_t *cursor, shapefile_shp_record_header_t *record_header, shapefile_shp_record_t *record) {
+    bool success = false;
+
+    record->shape = NULL;
+
+    if (!shapefile_get_int32_le(shapefile, cursor, &record->type)) {
+        return false;
+    }
+
+    if (!shapefile_type_valid(record->type)) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Shape type %d in record %d is not valid", record->type, record_header->number);
+        return false;
+    }
+
+    switch (record->type) {
+        case SHAPEFILE_TYPE_NULL:
+            success = shapefile_read_shp_record_null(shapefile, cursor, record_header, record);
+            break;
+        case SHAPEFILE_TYPE_POINT:
+        case SHAPEFILE_TYPE_POINT_Z:
+        case SHAPEFILE_TYPE_POINT_M:
+            success = shapefile_read_shp_record_point(shapefile, cursor, record_header, record);
+            break;
+        case SHAPEFILE_TYPE_POLYLINE:
+        case SHAPEFILE_TYPE_POLYGON:
+        case SHAPEFILE_TYPE_POLYLINE_Z:
+        case SHAPEFILE_TYPE_POLYGON_Z:
+        case SHAPEFILE_TYPE_POLYLINE_M:
+        case SHAPEFILE_TYPE_POLYGON_M:
+        case SHAPEFILE_TYPE_MULTIPATCH:
+            success = shapefile_read_shp_record_poly(shapefile, cursor, record_header, record, true);
+            break;
+        case SHAPEFILE_TYPE_MULTIPOINT:
+        case SHAPEFILE_TYPE_MULTIPOINT_Z:
+        case SHAPEFILE_TYPE_MULTIPOINT_M:
+            success = shapefile_read_shp_record_poly(shapefile, cursor, record_header, record, false);
+            break;
+    }
+
+    if (success && shapefile->validate) {
+        success = shapefile_validate_shape(shapefile, record->shape, record_header->number);
+    }
+
+    if (success && (shapefile_reprojecting(shapefile) || shapefile->transform.transform != NULL)) {
+        success = shapefile_transform_shape(shapefile, record->shape, record_header->number);
+    }
+
+    if (!success && record->shape != NULL) {
+        shapefile_shape_release(shapefile, record->shape);
+        record->shape = NULL;
+    }
+
+    return success;
+}
+
+static bool
+shapefile_parse_shx(shapefile_t *shapefile, const char *path_prefix) {
+    shapefile_header_t header;
+    uint64_t end;
+
+    if (!shapefile_file_open(shapefile, &shapefile->shx.file, path_prefix, "shx")) {
+        return false;
+    }
+
+    //read the shapefile header, just because. we don't need to store it though because it's the same exact header
+    //in the .shp file. we're store that one
+    if (!shapefile_read_header(shapefile, &shapefile->shx.file, &header)) {
+        shapefile_file_close(&shapefile->shx.file);
+        return false;
+    }
+
+    //the records are left in the file and read straight out of it when needed
+    end = (uint64_t)(uint32_t)header.length * sizeof(int16_t);
+    if (end > shapefile->shx.file.size) {
+        end = shapefile->shx.file.size;
+    }
+
+    shapefile->shx.count = (uint32_t)((end - SHAPEFILE_HEADER_SIZE) / SHAPEFILE_SHX_RECORD_SIZE);
+
+    return true;
+}
+
+//reads the .dbf header and field descriptors. the records are left in the file and sliced out of it when needed
+static bool
+shapefile_parse_dbf(shapefile_t *shapefile, const char *path_prefix) {
+    shapefile_dbf_t *dbf = &shapefile->dbf;
+    shapefile_dbf_field_t *field;
+    shapefile_cursor_t cursor;
+    const unsigned char *data;
+    uint16_t header_length, record_length;
+    int32_t count;
+    unsigned int i, offset;
+
+    if (!shapefile_file_open(shapefile, &dbf->file, path_prefix, "dbf")) {
+        return false;
+    }
+
+    data = shapefile_file_view(shapefile, &dbf->file, 0, SHAPEFILE_DBF_HEADER_SIZE);
+    if (data == NULL) {
+        return false;
+    }
+
+    //dBASE III and IV, with or without memos, all have 3 in the low bits of the version
+    if ((data[0] & 0x07) != 0x03) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Unsupported .dbf version 0x%02x", data[0]);
+        return false;
+    }
+
+    //skip the version and the date it was last updated
+    shapefile_cursor_init(&cursor, data, SHAPEFILE_DBF_HEADER_SIZE);
+    cursor.pos = 4;
+
+    if (!shapefile_get_int32_le(shapefile, &cursor, &count) ||
+        !shapefile_get_uint16_le(shapefile, &cursor, &header_length) ||
+        !shapefile_get_uint16_le(shapefile, &cursor, &record_length)) {
+        return false;
+    }
+
+    if (header_length < SHAPEFILE_DBF_HEADER_SIZE + 1 || record_length < 1) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Invalid .dbf header length %u and record length %u", header_length, record_length);
+        return false;
+    }
+
+    dbf->count = (uint32_t)count;
+    dbf->header_length = header_length;
+    dbf->record_length = record_length;
+
+    data = shapefile_file_view(shapefile, &dbf->file, 0, header_length);
+    if (data == NULL) {
+        return false;
+    }
+
+    //count the descriptors up to the terminator, which some writers leave out when the header is full
+    for (i = 0; SHAPEFILE_DBF_HEADER_SIZE + ((i + 1) * SHAPEFILE_DBF_FIELD_SIZE) <= header_length; i++) {
+        if (data[SHAPEFILE_DBF_HEADER_SIZE + (i * SHAPEFILE_DBF_FIELD_SIZE)] == SHAPEFILE_DBF_TERMINATOR) {
+            break;
+        }
+    }
+
+    dbf->num_fields = i;
+    dbf->num_columns = i;
+
+    if (dbf->num_fields > 0) {
+        dbf->fields = calloc(dbf->num_fields, sizeof(*dbf->fields));
+        if (dbf->fields == NULL) {
+            strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+            return false;
+        }
+    }
+
+    //the first byte of each record is the deleted flag
+    offset = 1;
+
+    for (i = 0; i < dbf->num_fields; i++) {
+        data = shapefile_file_view(shapefile, &dbf->file, SHAPEFILE_DBF_HEADER_SIZE + (i * SHAPEFILE_DBF_FIELD_SIZE), SHAPEFILE_DBF_FIELD_SIZE);
+        if (data == NULL) {
+            return false;
+        }
+
+        field = &dbf->fields[i];
+        memcpy(field->field.name, data, sizeof(field->field.name) - 1);
+        field->field.type = (char)data[11];
+        field->field.length = data[16];
+        field->field.decimals = data[17];
+        field->offset = offset;
+
+        //character fields wider than 255 keep the high byte of their length where the decimals would be
+        if (field->field.type == SHAPEFILE_FIELD_CHARACTER) {
+            field->field.length |= field->field.decimals << 8;
+            field->field.decimals = 0;
+        }
+
+        offset += field->field.length;
+        if (offset > dbf->record_length) {
+            snprintf(shapefile->error, sizeof(shapefile->error), "Field %s runs past the end of a %u byte .dbf record", field->field.name, dbf->record_length);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//finds needle in haystack without case, returning where it ends
+static const char *
+shapefile_prj_find(const char *haystack, const char *needle) {
+    size_t i;
+
+    for (; *haystack != '\0'; haystack++) {
+        for (i = 0; needle[i] != '\0' && tolower((unsigned char)haystack[i]) == tolower((unsigned char)needle[i]); i++) {
+        }
+
+        if (needle[i] == '\0') {
+            return haystack + i;
+        }
+    }
+
+    return NULL;
+}
+
+//true if the horizontal datum is named as WGS84. only the DATUM's own name counts, since a TOWGS84 clause on another
+//datum only says how to shift it onto WGS84
+static bool
+shapefile_prj_wgs84(const char *prj) {
+    static const char *names[] = {"WGS_1984", "D_WGS_1984", "WGS 84", "WGS84", "World Geodetic System 1984"};
+    const char *datum, *name;
+    size_t i, j, len;
+
+    for (datum = prj; (datum = shapefile_prj_find(datum, "DATUM[")) != NULL;) {
+        //VERT_DATUM and the like are some other kind of datum
+        if (datum - 6 > prj && (isalnum((unsigned char)datum[-7]) || datum[-7] == '_')) {
+            continue;
+        }
+
+        while (isspace((unsigned char)*datum)) {
+            datum++;
+        }
+
+        if (*datum++ != '"') {
+            return false;
+        }
+
+        len = strcspn(datum, "\"");
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            name = names[i];
+            for (j = 0; j < len && tolower((unsigned char)datum[j]) == tolower((unsigned char)name[j]); j++) {
+            }
+
+            if (j == len && name[j] == '\0') {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    return false;
+}
+
+//picks the projection out of .prj WKT by name, since ESRI's WKT usually doesn't have EPSG codes. only WGS84 and the
+//known projections on top of it are recognized
+static int
+shapefile_prj_crs(const char *prj) {
+    const char *utm;
+    char *end;
+    long zone;
+
+    while (isspace((unsigned char)*prj)) {
+        prj++;
+    }
+
+    if (!shapefile_prj_wgs84(prj)) {
+        return SHAPEFILE_CRS_UNKNOWN;
+    }
+
+    if (strncmp(prj, "GEOGCS[", 7) == 0) {
+        return SHAPEFILE_CRS_WGS84;
+    }
+
+    if (strncmp(prj, "PROJCS[", 7) != 0) {
+        return SHAPEFILE_CRS_UNKNOWN;
+    }
+
+    if (shapefile_prj_find(prj, "Web_Mercator") != NULL || shapefile_prj_find(prj, "Pseudo-Mercator") != NULL || shapefile_prj_find(prj, "Popular Visualisation") != NULL) {
+        return SHAPEFILE_CRS_WEB_MERCATOR;
+    }
+
+    //WGS_1984_UTM_Zone_33N from ESRI or WGS 84 / UTM zone 33N from EPSG
+    utm = shapefile_prj_find(prj, "UTM");
+    if (utm != NULL && (*utm == '_' || *utm == ' ') && (utm = shapefile_prj_find(utm, "zone")) != NULL && (*utm == '_' || *utm == ' ')) {
+        zone = strtol(utm + 1, &end, 10);
+        if (zone >= 1 && zone <= 60 && (*end == 'N' || *end == 'n')) {
+            return SHAPEFILE_CRS_UTM_NORTH + (int)zone;
+        }
+        if (zone >= 1 && zone <= 60 && (*end == 'S' || *end == 's')) {
+            return SHAPEFILE_CRS_UTM_SOUTH + (int)zone;
+        }
+    }
+
+    return SHAPEFILE_CRS_UNKNOWN;
+}
+
+//works out the projection of the shapefile being opened, and whether shapes can be reprojected from it
+static bool
+shapefile_read_prj(shapefile_t *shapefile, const char *path_prefix) {
+    char *path, prj[4096];
+    size_t len;
+    FILE *f;
+
+    shapefile->crs = shapefile->source_crs;
+
+    if (shapefile->crs == SHAPEFILE_CRS_UNKNOWN) {
+        if (asprintf(&path, "%s.prj", path_prefix) == -1) {
+            strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+            return false;
+        }
+
+        //a missing .prj only means the projection isn't known
+        f = fopen(path, "rb");
+        free(path);
+
+        if (f != NULL) {
+            len = fread(prj, 1, sizeof(prj) - 1, f);
+            prj[len] = '\0';
+            fclose(f);
+
+            shapefile->crs = shapefile_prj_crs(prj);
+        }
+    }
+
+    if (shapefile->target_crs == SHAPEFILE_CRS_UNKNOWN || shapefile->target_crs == shapefile->crs) {
+        return true;
+    }
+
+    if (shapefile->crs == SHAPEFILE_CRS_UNKNOWN) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Can't reproject %s.shp without knowing its projection", path_prefix);
+        return false;
+    }
+
+    if (!shapefile_crs_valid(shapefile->crs) || !shapefile_crs_valid(shapefile->target_crs)) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Can't reproject from EPSG:%d to EPSG:%d", shapefile->crs, shapefile->target_crs);
+        return false;
+    }
+
+    return true;
+}
+
+static void
+shapefile_close_files(shapefile_t *shapefile) {
+    shapefile_file_close(&shapefile->shx.file);
+    shapefile_file_close(&shapefile->shp.file);
+    shapefile_file_close(&shapefile->dbf.file);
+    free(shapefile->dbf.fields);
+    free(shapefile->dbf.columns);
+    memset(&shapefile->dbf, 0, sizeof(shapefile->dbf));
+    memset(&shapefile->record, 0, sizeof(shapefile->record));
+    rtree_free(shapefile->index);
+    shapefile->index = NULL;
+    free(shapefile->path_prefix);
+    shapefile->path_prefix = NULL;
+    shapefile->shx.count = 0;
+    shapefile->next = 0;
+    shapefile->crs = SHAPEFILE_CRS_UNKNOWN;
+    shapefile->open = false;
+}
+
+//opens the .shx and .shp and reads their headers, leaving them open until shapefile_close_files(). the .dbf is
+//opened too when asked for and it exists
+static bool
+shapefile_open_files(shapefile_t *shapefile, const char *path, bool dbf) {
+    char *path_prefix, *ptr;
+    bool success;
+
+    if (shapefile->open) {
+        strlcpy(shapefile->error, "A shapefile is already open", sizeof(shapefile->error));
+        return false;
+    }
+
+    //if <path>/<file>.shp is passed in, strip the .shp so we can get the base name
+    path_prefix = strdup(path);
+    if (path_prefix == NULL) {
+        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+        return false;
+    }
+
+    ptr = strrchr(path_prefix, '.');
+    if (ptr != NULL && strchr(ptr, '/') == NULL) {
+        *ptr = '\0';
+    }
+
+    success = shapefile_parse_shx(shapefile, path_prefix) &&
+              shapefile_file_open(shapefile, &shapefile->shp.file, path_prefix, "shp") &&
+              shapefile_read_header(shapefile, &shapefile->shp.file, &shapefile->shp.header) &&
+              shapefile_read_prj(shapefile, path_prefix);
+
+    if (success && dbf && !shapefile_parse_dbf(shapefile, path_prefix)) {
+        //a shapefile without attributes is still a shapefile
+        if (shapefile->dbf.file.f == NULL && errno == ENOENT) {
+            shapefile->error[0] = '\0';
+        }
+        else {
+            success = false;
+        }
+    }
+
+    //the path is kept for the files that are opened later, like the index
+    if (success) {
+        shapefile->path_prefix = path_prefix;
+        shapefile->open = true;
+    }
+    else {
+        free(path_prefix);
+        shapefile_close_files(shapefile);
+    }
+
+    return success;
+}
+
+//reads and decodes the record at offset in the .shp, and sets next to the offset of the record after it
+static bool
+shapefile_read_shp_at(shapefile_t *shapefile, uint64_t offset, shapefile_shp_record_header_t *record_header, shapefile_shp_record_t *record, uint64_t *next) {
+    shapefile_cursor_t cursor;
+    const unsigned char *data;
+    size_t length;
+
+    data = shapefile_file_view(shapefile, &shapefile->shp.file, offset, SHAPEFILE_SHP_RECORD_SIZE);
+    if (data == NULL) {
+        return false;
+    }
+
+    shapefile_cursor_init(&cursor, data, SHAPEFILE_SHP_RECORD_SIZE);
+    if (!shapefile_read_shp_record_header(shapefile, &cursor, record_header)) {
+        return false;
+    }
+
+    if (record_header->length < 0) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Record %d has a negative length %d", record_header->number, record_header->length);
+        return false;
+    }
+
+    //IMPORTANT!!! the sizes are the number of 16bit words in the file, so we need to muliply by sizeof(int16_t) to get bytes
+    offset += SHAPEFILE_SHP_RECORD_SIZE;
+    length = (size_t)record_header->length * sizeof(int16_t);
+
+    //the whole record is loaded at once and decoded from memory, which can't read past its length
+    data = shapefile_file_view(shapefile, &shapefile->shp.file, offset, length);
+    if (data == NULL) {
+        return false;
+    }
+
+    shapefile_cursor_init(&cursor, data, length);
+
+    if (next != NULL) {
+        *next = offset + length;
+    }
+
+    //if we fail, the record->shape doesn't need to be free'd
+    return shapefile_read_shp_record(shapefile, &cursor, record_header, record);
+}
+
+//reads where a record is in the .shp from the .shx
+static bool
+shapefile_read_shx(shapefile_t *shapefile, unsigned int index, shapefile_shx_record_t *shx_record) {
+    shapefile_cursor_t cursor;
+    const unsigned char *data;
+
+    if (!shapefile->open) {
+        strlcpy(shapefile->error, "No shapefile is open", sizeof(shapefile->error));
+        return false;
+    }
+
+    if (index >= shapefile->shx.count) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Shape %u is out of range, there are %u", index, shapefile->shx.count);
+        return false;
+    }
+
+    data = shapefile_file_view(shapefile, &shapefile->shx.file, SHAPEFILE_HEADER_SIZE + ((uint64_t)index * SHAPEFILE_SHX_RECORD_SIZE), SHAPEFILE_SHX_RECORD_SIZE);
+    if (data == NULL) {
+        return false;
+    }
+
+    shapefile_cursor_init(&cursor, data, SHAPEFILE_SHX_RECORD_SIZE);
+
+    return shapefile_get_int32_be(shapefile, &cursor, &shx_record->offset) &&
+           shapefile_get_int32_be(shapefile, &cursor, &shx_record->length);
+}
+
+//reads just the type and bounding box at the start of the record at offset, which is all that's needed to tell if
+//it's worth decoding. null shapes have no box and are empty
+static bool
+shapefile_read_shp_mbr_at(shapefile_t *shapefile, uint64_t offset, size_t length, shapefile_mbr_t *mbr, bool *empty) {
+    shapefile_cursor_t cursor;
+    const unsigned char *data;
+    int32_t type;
+    double x, y;
+
+    //a point's x and y are shorter than a box, so only as much of the record as it has is read
+    if (length > sizeof(int32_t) + (4 * sizeof(double))) {
+        length = sizeof(int32_t) + (4 * sizeof(double));
+    }
+
+    data = shapefile_file_view(shapefile, &shapefile->shp.file, offset, length);
+    if (data == NULL) {
+        return false;
+    }
+
+    shapefile_cursor_init(&cursor, data, length);
+    if (!shapefile_get_int32_le(shapefile, &cursor, &type)) {
+        return false;
+    }
+
+    if (!shapefile_type_valid(type)) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Invalid shape type %d", type);
+        return false;
+    }
+
+    *empty = type == SHAPEFILE_TYPE_NULL;
+    if (*empty) {
+        return true;
+    }
+
+    if (shapefile_type_base(type) != SHAPEFILE_TYPE_POINT) {
+        return shapefile_read_mbr(shapefile, &cursor, mbr);
+    }
+
+    if (!shapefile_get_double_le(shapefile, &cursor, &x) || !shapefile_get_double_le(shapefile, &cursor, &y)) {
+        return false;
+    }
+
+    mbr->min_x = x;
+    mbr->min_y = y;
+    mbr->max_x = x;
+    mbr->max_y = y;
+
+    return true;
+}
+
+//reads a shape by its index in the .shx, which is borrowed or not depending on the shapefile's borrowing
+static shapefile_shape_t *
+shapefile_read_index(shapefile_t *shapefile, unsigned int index) {
+    shapefile_shp_record_header_t record_header;
+    shapefile_shp_record_t record;
+    shapefile_shx_record_t shx_record;
+
+    if (!shapefile_read_shx(shapefile, index, &shx_record)) {
+        return NULL;
+    }
+
+    if (!shapefile_read_shp_at(shapefile, (uint64_t)(uint32_t)shx_record.offset * sizeof(int16_t), &record_header, &record, NULL)) {
+        return NULL;
+    }
+
+    if (record_header.length != shx_record.length) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Shape %u has length %d in the .shx but %d in the .shp", index, shx_record.length, record_header.length);
+        shapefile_shape_release(shapefile, record.shape);
+        return NULL;
+    }
+
+    return record.shape;
+}
+
+static bool
+shapefile_mbr_intersects(const shapefile_mbr_t *a, const shapefile_mbr_t *b) {
+    return a->min_x <= b->max_x && a->max_x >= b->min_x && a->min_y <= b->max_y && a->max_y >= b->min_y;
+}
+
+//decides from the box at the start of the record at offset in the .shp whether the filter skips it, without decoding
+//the rest. next is set to the offset of the record after it
+static bool
+shapefile_filter_at(shapefile_t *shapefile, uint64_t offset, bool *skip, uint64_t *next) {
+    shapefile_shp_record_header_t record_header;
+    shapefile_cursor_t cursor;
+    const unsigned char *data;
+    shapefile_mbr_t mbr;
+    size_t length;
+    bool empty;
+
+    data = shapefile_file_view(shapefile, &shapefile->shp.file, offset, SHAPEFILE_SHP_RECORD_SIZE);
+    if (data == NULL) {
+        return false;
+    }
+
+    shapefile_cursor_init(&cursor, data, SHAPEFILE_SHP_RECORD_SIZE);
+    if (!shapefile_read_shp_record_header(shapefile, &cursor, &record_header)) {
+        return false;
+    }
+
+    if (record_header.length < 0) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Record %d has a negative length %d", record_header.number, record_header.length);
+        return false;
+    }
+
+    offset += SHAPEFILE_SHP_RECORD_SIZE;
+    length = (size_t)record_header.length * sizeof(int16_t);
+
+    if (!shapefile_read_shp_mbr_at(shapefile, offset, length, &mbr, &empty)) {
+        return false;
+    }
+
+    *skip = empty || !shapefile_mbr_intersects(&mbr, &shapefile->filter_mbr);
+
+    if (next != NULL) {
+        *next = offset + length;
+    }
+
+    return true;
+}
+
+static bool
+shapefile_filter_index(shapefile_t *shapefile, unsigned int index, bool *skip) {
+    shapefile_shx_record_t shx_record;
+
+    return shapefile_read_shx(shapefile, index, &shx_record) &&
+           shapefile_filter_at(shapefile, (uint64_t)(uint32_t)shx_record.offset * sizeof(int16_t), skip, NULL);
+}
+
+static bool
+shapefile_parse_shp(shapefile_t *shapefile, bool *stop, shapefile_parse_cb_t *cb) {
+    shapefile_shp_record_header_t record_header;
+    shapefile_shp_record_t record;
+    uint64_t offset, end, next;
+    bool success = true, skip;
+
+    shapefile_file_advise(&shapefile->shp.file, true);
+    shapefile->borrowing = shapefile->reuse;
+
+    //a header that claims more than the file has is caught when the record past the end is read
+    end = (uint64_t)(uint32_t)shapefile->shp.header.length * sizeof(int16_t);
+    offset = SHAPEFILE_HEADER_SIZE;
+
+    while (success && !*stop && offset < end) {
+        //records outside the filter are stepped over after reading just their box
+        if (shapefile->filter) {
+            success = shapefile_filter_at(shapefile, offset, &skip, &next);
+            if (!success) {
+                break;
+            }
+
+            if (skip) {
+                offset = next;
+                continue;
+            }
+        }
+
+        success = shapefile_read_shp_at(shapefile, offset, &record_header, &record, &offset);
+        if (!success) {
+            break;
+        }
+
+        if (cb != NULL) {
+            //call the callback, which returns true on success, and false to stop
+            *stop = !cb->shape(record.shape, cb->user_data);
+        }
+
+        shapefile_shape_release(shapefile, record.shape);
+        record.shape = NULL;
+    }
+
+    shapefile->borrowing = false;
+
+    return success;
+}
+
+//only decodes the shapes the index says are inside the filter, in file order
+static bool
+shapefile_parse_index(shapefile_t *shapefile, bool *stop, shapefile_parse_cb_t *cb) {
+    shapefile_shape_t *shape;
+    const uint32_t *indices;
+    unsigned int count, i;
+    bool success = true;
+
+    if (!shapefile_query(shapefile, &shapefile->filter_mbr, &indices, &count)) {
+        return false;
+    }
+
+    shapefile->borrowing = shapefile->reuse;
+
+    for (i = 0; i < count && !*stop; i++) {
+        shape = shapefile_read_index(shapefile, indices[i]);
+        if (shape == NULL) {
+            success = false;
+            break;
+        }
+
+        if (cb != NULL) {
+            *stop = !cb->shape(shape, cb->user_data);
+        }
+
+        shapefile_shape_release(shapefile, shape);
+    }
+
+    shapefile->borrowing = false;
+
+    return success;
+}
+
+shapefile_t *
+shapefile_init() {
+    shapefile_t *shapefile;
+
+    shapefile = calloc(1, sizeof(*shapefile));
+    if (shapefile == NULL) {
+        return NULL;
+    }
+
+    shapefile->mmap = true;
+
+    return shapefile;
+}
+
+void
+shapefile_free(shapefile_t *shapefile) {
+    if (shapefile == NULL) {
+        return;
+    }
+
+    shapefile_close_files(shapefile);
+    free(shapefile->scratch);
+    free(shapefile->results);
+    free(shapefile);
+}
+
+void
+shapefile_set_mmap(shapefile_t *shapefile, bool enabled) {
+    shapefile->mmap = enabled;
+}
+
+void
+shapefile_set_reuse(shapefile_t *shapefile, bool enabled) {
+    shapefile->reuse = enabled;
+}
+
+void
+shapefile_set_validate(shapefile_t *shapefile, bool enabled) {
+    shapefile->validate = enabled;
+}
+
+void
+shapefile_set_crs(shapefile_t *shapefile, int crs) {
+    shapefile->target_crs = crs;
+}
+
+void
+shapefile_set_source_crs(shapefile_t *shapefile, int crs) {
+    shapefile->source_crs = crs;
+}
+
+void
+shapefile_set_transform(shapefile_t *shapefile, const shapefile_transform_t *transform) {
+    if (transform == NULL) {
+        memset(&shapefile->transform, 0, sizeof(shapefile->transform));
+    }
+    else {
+        shapefile->transform = *transform;
+    }
+}
+
+int
+shapefile_crs(shapefile_t *shapefile) {
+    return shapefile->crs;
+}
+
+void
+shapefile_set_filter(shapefile_t *shapefile, const shapefile_mbr_t *mbr) {
+    shapefile->filter = mbr != NULL;
+    if (mbr != NULL) {
+        shapefile->filter_mbr = *mbr;
+    }
+}
+
+bool
+shapefile_parse_cb(shapefile_t *shapefile, const char *path, shapefile_parse_cb_t *cb) {
+    bool success, stop;
+
+    stop = false;
+
+    success = shapefile_open_files(shapefile, path, false);
+    if (success) {
+        //a filtered parse goes through the .rtx when there's one that matches the .shp and .shx just opened, and
+        //otherwise checks every record's box
+        if (shapefile->filter && shapefile_load_index(shapefile)) {
+            success = shapefile_parse_index(shapefile, &stop, cb);
+        }
+        else {
+            shapefile->error[0] = '\0';
+            success = shapefile_parse_shp(shapefile, &stop, cb);
+        }
+    }
+
+    shapefile_close_files(shapefile);
+
+    return success;
+}
+
+bool
+shapefile_open(shapefile_t *shapefile, const char *path) {
+    if (!shapefile_open_files(shapefile, path, true)) {
+        return false;
+    }
+
+    shapefile_file_advise(&shapefile->shx.file, false);
+    shapefile_file_advise(&shapefile->shp.file, false);
+
+    return true;
+}
+
+void
+shapefile_close(shapefile_t *shapefile) {
+    shapefile_close_files(shapefile);
+}
+
+unsigned int
+shapefile_count(shapefile_t *shapefile) {
+    return shapefile->shx.count;
+}
+
+shapefile_shape_t *
+shapefile_get_shape(shapefile_t *shapefile, unsigned int index) {
+    //the caller owns these, so they're never borrowed
+    shapefile->borrowing = false;
+
+    return shapefile_read_index(shapefile, index);
+}
+
+//what a .rtx is checked against before it's used, so one left over from an older version of the shapefile isn't. a
+//rewritten .shp almost always changes its length or its bounding box, even when it has the same number of records
+static void
+shapefile_index_stamp(shapefile_t *shapefile, uint64_t *stamp) {
+    const shapefile_mbr_t *mbr = &shapefile->shp.header.mbr;
+    const double bounds[] = {mbr->min_x, mbr->min_y, mbr->max_x, mbr->max_y};
+    uint64_t bits, hash = 14695981039346656037ULL;
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        memcpy(&bits, &bounds[i], sizeof(bits));
+        hash = (hash ^ bits) * 1099511628211ULL;
+    }
+
+    stamp[0] = shapefile->shx.count;
+    stamp[1] = (uint64_t)(uint32_t)shapefile->shp.header.length * sizeof(int16_t);
+    stamp[2] = hash;
+}
+
+bool
+shapefile_build_index(shapefile_t *shapefile) {
+    uint64_t stamp[RTREE_STAMP_SIZE];
+    shapefile_shx_record_t shx_record;
+    shapefile_mbr_t mbr;
+    rtree_box_t box;
+    rtree_t *index;
+    unsigned int i;
+    bool empty;
+
+    if (!shapefile->open) {
+        strlcpy(shapefile->error, "No shapefile is open", sizeof(shapefile->error));
+        return false;
+    }
+
+    index = rtree_init(0);
+    if (index == NULL) {
+        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+        return false;
+    }
+
+    //null shapes are left out since they can't match anything
+    for (i = 0; i < shapefile->shx.count; i++) {
+        if (!shapefile_read_shx(shapefile, i, &shx_record) ||
+            !shapefile_read_shp_mbr_at(shapefile, ((uint64_t)(uint32_t)shx_record.offset * sizeof(int16_t)) + SHAPEFILE_SHP_RECORD_SIZE, (size_t)(uint32_t)shx_record.length * sizeof(int16_t), &mbr, &empty)) {
+            rtree_free(index);
+            return false;
+        }
+
+        if (empty) {
+            continue;
+        }
+
+        box.min_x = mbr.min_x;
+        box.min_y = mbr.min_y;
+        box.max_x = mbr.max_x;
+        box.max_y = mbr.max_y;
+
+        if (!rtree_add(index, i, &box)) {
+            strlcpy(shapefile->error, rtree_error(index), sizeof(shapefile->error));
+            rtree_free(index);
+            return false;
+        }
+    }
+
+    if (!rtree_finish(index)) {
+        strlcpy(shapefile->error, rtree_error(index), sizeof(shapefile->error));
+        rtree_free(index);
+        return false;
+    }
+
+    shapefile_index_stamp(shapefile, stamp);
+    rtree_set_stamp(index, stamp);
+
+    rtree_free(shapefile->index);
+    shapefile->index = index;
+
+    return true;
+}
+
+bool
+shapefile_save_index(shapefile_t *shapefile) {
+    char *path;
+    bool success;
+
+    if (shapefile->index == NULL) {
+        strlcpy(shapefile->error, "There's no index to save", sizeof(shapefile->error));
+        return false;
+    }
+
+    if (asprintf(&path, "%s.rtx", shapefile->path_prefix) == -1) {
+        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+        return false;
+    }
+
+    success = rtree_save(shapefile->index, path);
+    if (!success) {
+        strlcpy(shapefile->error, rtree_error(shapefile->index), sizeof(shapefile->error));
+    }
+
+    free(path);
+
+    return success;
+}
+
+bool
+shapefile_load_index(shapefile_t *shapefile) {
+    uint64_t stamp[RTREE_STAMP_SIZE], expected[RTREE_STAMP_SIZE];
+    rtree_t *index;
+    char *path;
+    bool success;
+
+    if (!shapefile->open) {
+        strlcpy(shapefile->error, "No shapefile is open", sizeof(shapefile->error));
+        return false;
+    }
+
+    index = rtree_init(0);
+    if (index == NULL || asprintf(&path, "%s.rtx", shapefile->path_prefix) == -1) {
+        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+        rtree_free(index);
+        return false;
+    }
+
+    success = rtree_load(index, path);
+    if (!success) {
+        strlcpy(shapefile->error, rtree_error(index), sizeof(shapefile->error));
+    }
+    else {
+        //an index built for a different version of the shapefile is no good
+        shapefile_index_stamp(shapefile, expected);
+        rtree_stamp(index, stamp);
+        if (memcmp(stamp, expected, sizeof(stamp)) != 0 || rtree_count(index) > shapefile->shx.count) {
+            snprintf(shapefile->error, sizeof(shapefile->error), "%s was built for a different version of the shapefile", path);
+            success = false;
+        }
+    }
+
+    free(path);
+
+    if (!success) {
+        rtree_free(index);
+        return false;
+    }
+
+    rtree_free(shapefile->index);
+    shapefile->index = index;
+
+    return true;
+}
+
+static bool
+shapefile_query_result(uint32_t id, void *user_data) {
+    shapefile_t *shapefile = user_data;
+    uint32_t *results;
+    size_t size;
+
+    if (shapefile->results_len == shapefile->results_size) {
+        size = shapefile->results_size == 0 ? 256 : shapefile->results_size * 2;
+        results = realloc(shapefile->results, size * sizeof(*results));
+        if (results == NULL) {
+            strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+            return false;
+        }
+
+        shapefile->results = results;
+        shapefile->results_size = size;
+    }
+
+    shapefile->results[shapefile->results_len++] = id;
+
+    return true;
+}
+
+static int
+shapefile_query_compare(const void *a, const void *b) {
+    uint32_t index_a = *(const uint32_t *)a, index_b = *(const uint32_t *)b;
+
+    return index_a < index_b ? -1 : (index_a > index_b ? 1 : 0);
+}
+
+bool
+shapefile_query(shapefile_t *shapefile, const shapefile_mbr_t *mbr, const uint32_t **indices, unsigned int *count) {
+    rtree_box_t box;
+
+    *indices = NULL;
+    *count = 0;
+
+    if (shapefile->index == NULL) {
+        strlcpy(shapefile->error, "There's no index, build or load one first", sizeof(shapefile->error));
+        return false;
+    }
+
+    box.min_x = mbr->min_x;
+    box.min_y = mbr->min_y;
+    box.max_x = mbr->max_x;
+    box.max_y = mbr->max_y;
+
+    shapefile->error[0] = '\0';
+    shapefile->results_len = 0;
+
+    if (!rtree_search(shapefile->index, &box, shapefile_query_result, shapefile)) {
+        strlcpy(shapefile->error, rtree_error(shapefile->index), sizeof(shapefile->error));
+        return false;
+    }
+
+    //the callback only stops early when it runs out of memory
+    if (shapefile->error[0] != '\0') {
+        return false;
+    }
+
+    //in file order, so reading the shapes through the .shx moves forward through the .shp
+    qsort(shapefile->results, shapefile->results_len, sizeof(*shapefile->results), shapefile_query_compare);
+
+    *indices = shapefile->results;
+    *count = (unsigned int)shapefile->results_len;
+
+    return true;
+}
+
+bool
+shapefile_next(shapefile_t *shapefile, shapefile_shape_t **shape, shapefile_record_t **record) {
+    shapefile->error[0] = '\0';
+
+    if (!shapefile->open) {
+        strlcpy(shapefile->error, "No shapefile is open", sizeof(shapefile->error));
+        return false;
+    }
+
+    if (shapefile->next >= shapefile->shx.count) {
+        return false;
+    }
+
+    //the record goes first since it can fail without leaving a shape behind
+    if (shapefile->dbf.file.f != NULL) {
+        *record = shapefile_get_record(shapefile, shapefile->next);
+        if (*record == NULL) {
+            return false;
+        }
+    }
+    else {
+        *record = NULL;
+    }
+
+    //the shape lives in the scratch shape until the next call
+    shapefile->borrowing = true;
+    *shape = shapefile_read_index(shapefile, shapefile->next);
+    shapefile->borrowing = false;
+
+    if (*shape == NULL) {
+        return false;
+    }
+
+    shapefile->next++;
+
+    return true;
+}
+
+void
+shapefile_rewind(shapefile_t *shapefile) {
+    shapefile->next = 0;
+}
+
+//the field behind a selected column, or NULL if it's out of range
+static const shapefile_dbf_field_t *
+shapefile_dbf_column(shapefile_dbf_t *dbf, unsigned int column) {
+    if (column >= dbf->num_columns) {
+        return NULL;
+    }
+
+    return &dbf->fields[dbf->columns == NULL ? column : dbf->columns[column]];
+}
+
+//field names are matched without case, like dBASE does
+static bool
+shapefile_dbf_name_eq(const char *a, const char *b) {
+    while (*a != '\0' && tolower((unsigned char)*a) == tolower((unsigned char)*b)) {
+        a++;
+        b++;
+    }
+
+    return *a == *b;
+}
+
+bool
+shapefile_select_fields(shapefile_t *shapefile, const char * const *names, unsigned int count) {
+    shapefile_dbf_t *dbf = &shapefile->dbf;
+    unsigned int *columns, i, j;
+
+    if (!shapefile->open) {
+        strlcpy(shapefile->error, "No shapefile is open", sizeof(shapefile->error));
+        return false;
+    }
+
+    //no names puts every field back
+    if (names == NULL || count == 0) {
+        free(dbf->columns);
+        dbf->columns = NULL;
+        dbf->num_columns = dbf->num_fields;
+        return true;
+    }
+
+    columns = malloc(count * sizeof(*columns));
+    if (columns == NULL) {
+        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < dbf->num_fields; j++) {
+            if (shapefile_dbf_name_eq(names[i], dbf->fields[j].field.name)) {
+                break;
+            }
+        }
+
+        if (j == dbf->num_fields) {
+            snprintf(shapefile->error, sizeof(shapefile->error), "There's no field named %s", names[i]);
+            free(columns);
+            return false;
+        }
+
+        columns[i] = j;
+    }
+
+    free(dbf->columns);
+    dbf->columns = columns;
+    dbf->num_columns = count;
+
+    return true;
+}
+
+unsigned int
+shapefile_num_fields(shapefile_t *shapefile) {
+    return shapefile->dbf.num_columns;
+}
+
+const shapefile_field_t *
+shapefile_field(shapefile_t *shapefile, unsigned int index) {
+    const shapefile_dbf_field_t *field;
+
+    field = shapefile_dbf_column(&shapefile->dbf, index);
+
+    return field == NULL ? NULL : &field->field;
+}
+
+int
+shapefile_field_index(shapefile_t *shapefile, const char *name) {
+    unsigned int i;
+
+    for (i = 0; i < shapefile->dbf.num_columns; i++) {
+        if (shapefile_dbf_name_eq(name, shapefile_dbf_column(&shapefile->dbf, i)->field.name)) {
+            return (int)i;
+        }
+    }
+
+    return -1;
+}
+
+unsigned int
+shapefile_num_records(shapefile_t *shapefile) {
+    return shapefile->dbf.count;
+}
+
+shapefile_record_t *
+shapefile_get_record(shapefile_t *shapefile, unsigned int index) {
+    shapefile_dbf_t *dbf = &shapefile->dbf;
+    const unsigned char *data;
+
+    if (!shapefile->open) {
+        strlcpy(shapefile->error, "No shapefile is open", sizeof(shapefile->error));
+        return NULL;
+    }
+
+    if (dbf->file.f == NULL) {
+        strlcpy(shapefile->error, "The shapefile has no .dbf", sizeof(shapefile->error));
+        return NULL;
+    }
+
+    if (index >= dbf->count) {
+        snprintf(shapefile->error, sizeof(shapefile->error), "Record %u is out of range, there are %u", index, dbf->count);
+        return NULL;
+    }
+
+    data = shapefile_file_view(shapefile, &dbf->file, dbf->header_length + ((uint64_t)index * dbf->record_length), dbf->record_length);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    shapefile->record.dbf = dbf;
+    shapefile->record.data = data;
+    shapefile->record.index = index;
+
+    return &shapefile->record;
+}
+
+unsigned int
+shapefile_record_index(shapefile_record_t *record) {
+    return record->index;
+}
+
+bool
+shapefile_record_deleted(shapefile_record_t *record) {
+    return record->data[0] == '*';
+}
+
+const char *
+shapefile_record_raw(shapefile_record_t *record, unsigned int field, size_t *len) {
+    const shapefile_dbf_field_t *dbf_field;
+    const char *start, *end;
+
+    dbf_field = shapefile_dbf_column(record->dbf, field);
+    if (dbf_field == NULL) {
+        *len = 0;
+        return NULL;
+    }
+
+    start = (const char *)record->data + dbf_field->offset;
+    end = start + dbf_field->field.length;
+
+    //character fields are padded on the right, and numbers on the left as well
+    while (end > start && (end[-1] == ' ' || end[-1] == '\0')) {
+        end--;
+    }
+
+    if (dbf_field->field.type != SHAPEFILE_FIELD_CHARACTER) {
+        while (start < end && *start == ' ') {
+            start++;
+        }
+    }
+
+    *len = (size_t)(end - start);
+
+    return start;
+}
+
+bool
+shapefile_record_is_null(shapefile_record_t *record, unsigned int field) {
+    const shapefile_dbf_field_t *dbf_field;
+    const char *value;
+    size_t len, i;
+    char fill;
+
+    value = shapefile_record_raw(record, field, &len);
+    if (value == NULL || len == 0) {
+        return true;
+    }
+
+    dbf_field = shapefile_dbf_column(record->dbf, field);
+
+    switch (dbf_field->field.type) {
+        case SHAPEFILE_FIELD_NUMERIC:
+        case SHAPEFILE_FIELD_FLOAT:
+            //numbers too wide for their field are written as all asterisks
+            fill = '*';
+            break;
+        case SHAPEFILE_FIELD_DATE:
+            fill = '0';
+            break;
+        case SHAPEFILE_FIELD_LOGICAL:
+            return value[0] == '?';
+        default:
+            return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (value[i] != fill) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t
+shapefile_record_string(shapefile_record_t *record, unsigned int field, char *dst, size_t size) {
+    const char *value;
+    size_t len;
+
+    value = shapefile_record_raw(record, field, &len);
+
+    if (size > 0) {
+        if (len >= size) {
+            memcpy(dst, value, size - 1);
+            dst[size - 1] = '\0';
+        }
+        else {
+            if (len > 0) {
+                memcpy(dst, value, len);
+            }
+            dst[len] = '\0';
+        }
+    }
+
+    return len;
+}
+
+//copies a number out of the record so it can be parsed as a C string
+static bool
+shapefile_record_number(shapefile_record_t *record, unsigned int field, char *dst, size_t size) {
+    if (shapefile_record_is_null(record, field)) {
+        return false;
+    }
+
+    return shapefile_record_string(record, field, dst, size) < size;
+}
+
+bool
+shapefile_record_int64(shapefile_record_t *record, unsigned int field, int64_t *value) {
+    char str[256], *end;
+    long long n;
+
+    if (!shapefile_record_number(record, field, str, sizeof(str))) {
+        return false;
+    }
+
+    errno = 0;
+    n = strtoll(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0') {
+        return false;
+    }
+
+    *value = (int64_t)n;
+    return true;
+}
+
+bool
+shapefile_record_double(shapefile_record_t *record, unsigned int field, double *value) {
+    char str[256], *end;
+    double n;
+
+    if (!shapefile_record_number(record, field, str, sizeof(str))) {
+        return false;
+    }
+
+    n = strtod(str, &end);
+    if (end == str || *end != '\0') {
+        return false;
+    }
+
+    *value = n;
+    return true;
+}
+
+bool
+shapefile_record_date(shapefile_record_t *record, unsigned int field, int *year, int *month, int *day) {
+    const char *value;
+    size_t len, i;
+    int y, m, d;
+
+    if (shapefile_record_is_null(record, field)) {
+        return false;
+    }
+
+    //always YYYYMMDD
+    value = shapefile_record_raw(record, field, &len);
+    if (len != 8) {
+        return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') {
+            return false;
+        }
+    }
+
+    y = ((value[0] - '0') * 1000) + ((value[1] - '0') * 100) + ((value[2] - '0') * 10) + (value[3] - '0');
+    m = ((value[4] - '0') * 10) + (value[5] - '0');
+    d = ((value[6] - '0') * 10) + (value[7] - '0');
+
+    if (m < 1 || m > 12 || d < 1 || d > 31) {
+        return false;
+    }
+
+    *year = y;
+    *month = m;
+    *day = d;
+    return true;
+}
+
+bool
+shapefile_record_bool(shapefile_record_t *record, unsigned int field, bool *value) {
+    const char *str;
+    size_t len;
+
+    str = shapefile_record_raw(record, field, &len);
+    if (len != 1) {
+        return false;
+    }
+
+    switch (str[0]) {
+        case 'T': case 't': case 'Y': case 'y':
+            *value = true;
+            return true;
+        case 'F': case 'f': case 'N': case 'n':
+            *value = false;
+            return true;
+    }
+
+    return false;
+}
+
+/****************************************************************************
+ * GeoJSON features
+ ****************************************************************************/
+
+struct shapefile_geojson_t {
+    buffer_t *json;
+    int precision;
+    bool first;                 //no features have been written yet
+};
+
+static bool
+shapefile_json_string(buffer_t *json, const char *str, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char c;
+    char *dst;
+    size_t i, pos = 0;
+
+    //the worst case is every byte as \u00XX
+    dst = (char *)buffer_reserve(json, (len * 6) + 2);
+    if (dst == NULL) {
+        return false;
+    }
+
+    dst[pos++] = '"';
+
+    for (i = 0; i < len; i++) {
+        c = (unsigned char)str[i];
+
+        if (c == '"' || c == '\\') {
+            dst[pos++] = '\\';
+            dst[pos++] = (char)c;
+        }
+        else if (c == '\n') {
+            dst[pos++] = '\\';
+            dst[pos++] = 'n';
+        }
+        else if (c == '\r') {
+            dst[pos++] = '\\';
+            dst[pos++] = 'r';
+        }
+        else if (c == '\t') {
+            dst[pos++] = '\\';
+            dst[pos++] = 't';
+        }
+        else if (c < 0x20) {
+            memcpy(dst + pos, "\\u00", 4);
+            pos += 4;
+            dst[pos++] = hex[c >> 4];
+            dst[pos++] = hex[c & 0x0f];
+        }
+        else {
+            dst[pos++] = (char)c;
+        }
+    }
+
+    dst[pos++] = '"';
+
+    buffer_commit(json, pos);
+
+    return true;
+}
+
+static bool
+shapefile_geojson_value(buffer_t *json, shapefile_record_t *record, unsigned int column) {
+    const shapefile_dbf_field_t *dbf_field;
+    const char *value;
+    char str[DTOA_BUFFER_SIZE];
+    double number;
+    size_t len;
+    int year, month, day;
+    bool b;
+
+    dbf_field = shapefile_dbf_column(record->dbf, column);
+
+    switch (dbf_field->field.type) {
+        case SHAPEFILE_FIELD_NUMERIC:
+        case SHAPEFILE_FIELD_FLOAT:
+            if (!shapefile_record_double(record, column, &number) || isnan(number) || isinf(number)) {
+                return buffer_write_str(json, "null");
+            }
+            dtoa_format(str, number, DTOA_SHORTEST);
+            return buffer_write_str(json, str);
+        case SHAPEFILE_FIELD_LOGICAL:
+            if (!shapefile_record_bool(record, column, &b)) {
+                return buffer_write_str(json, "null");
+            }
+            return buffer_write_str(json, b ? "true" : "false");
+        case SHAPEFILE_FIELD_DATE:
+            if (!shapefile_record_date(record, column, &year, &month, &day)) {
+                return buffer_write_str(json, "null");
+            }
+            snprintf(str, sizeof(str), "\"%04d-%02d-%02d\"", year, month, day);
+            return buffer_write_str(json, str);
+    }
+
+    value = shapefile_record_raw(record, column, &len);
+
+    return shapefile_json_string(json, value, len);
+}
+
+static bool
+shapefile_geojson_properties(buffer_t *json, shapefile_record_t *record) {
+    const shapefile_dbf_field_t *dbf_field;
+    unsigned int i;
+    bool success;
+
+    if (record == NULL) {
+        return buffer_write_str(json, "null");
+    }
+
+    success = buffer_write_char(json, '{');
+    for (i = 0; success && i < record->dbf->num_columns; i++) {
+        dbf_field = shapefile_dbf_column(record->dbf, i);
+
+        success = (i == 0 || buffer_write_char(json, ',')) &&
+                  shapefile_json_string(json, dbf_field->field.name, strlen(dbf_field->field.name)) &&
+                  buffer_write_char(json, ':') &&
+                  shapefile_geojson_value(json, record, i);
+    }
+
+    return success && buffer_write_char(json, '}');
+}
+
+shapefile_geojson_t *
+shapefile_geojson_init(buffer_t *json, int precision) {
+    shapefile_geojson_t *geojson;
+
+    geojson = calloc(1, sizeof(*geojson));
+    if (geojson == NULL) {
+        return NULL;
+    }
+
+    geojson->json = json;
+    geojson->precision = precision;
+    geojson->first = true;
+
+    if (!buffer_write_str(json, "{\"type\":\"FeatureCollection\",\"features\":[")) {
+        free(geojson);
+        return NULL;
+    }
+
+    return geojson;
+}
+
+void
+shapefile_geojson_free(shapefile_geojson_t *geojson) {
+    free(geojson);
+}
+
+bool
+shapefile_geojson_feature(shapefile_geojson_t *geojson, shapefile_shape_t *shape, shapefile_record_t *record) {
+    bool success;
+
+    success = (geojson->first || buffer_write_char(geojson->json, ',')) &&
+              buffer_write_str(geojson->json, "{\"type\":\"Feature\",\"geometry\":") &&
+              shapefile_shape_geojson_write(shape, geojson->json, geojson->precision) &&
+              buffer_write_str(geojson->json, ",\"properties\":") &&
+              shapefile_geojson_properties(geojson->json, record) &&
+              buffer_write_char(geojson->json, '}');
+
+    geojson->first = false;
+
+    return success;
+}
+
+bool
+shapefile_geojson_finish(shapefile_geojson_t *geojson) {
+    return buffer_write_str(geojson->json, "]}");
+}
+
+//called with the parallel's lock held
+static void
+shapefile_parallel_fail(shapefile_parallel_t *parallel, const char *error) {
+    if (!parallel->failed) {
+        snprintf(parallel->error, sizeof(parallel->error), "%s", error);
+        parallel->failed = true;
+    }
+
+    parallel->stop = true;
+    cond_broadcast(parallel->cond);
+}
+
+static void *
+shapefile_parallel_worker(void *user_data) {
+    shapefile_parallel_t *parallel;
+    shapefile_worker_t *worker;
+    shapefile_shape_t *shape;
+    shapefile_slot_t *slot = NULL;
+    uint32_t chunk, index, end;
+    unsigned int count, i;
+    bool keep = true, skip;
+
+    worker = user_data;
+    parallel = worker->parallel;
+
+    cond_lock(parallel->cond);
+    while (!parallel->stop && parallel->next_chunk < parallel->num_chunks) {
+        chunk = parallel->next_chunk++;
+
+        //ordered workers can only get so far ahead of the callback, since every chunk needs a slot to wait in
+        if (parallel->slots != NULL) {
+            while (!parallel->stop && chunk >= parallel->delivered + parallel->num_slots) {
+                cond_wait(parallel->cond);
+            }
+
+            if (parallel->stop) {
+                break;
+            }
+
+            slot = &parallel->slots[chunk % parallel->num_slots];
+        }
+
+        cond_unlock(parallel->cond);
+
+        index = chunk * SHAPEFILE_PARALLEL_CHUNK;
+        end = index + SHAPEFILE_PARALLEL_CHUNK < parallel->count ? index + SHAPEFILE_PARALLEL_CHUNK : parallel->count;
+        count = 0;
+
+        for (; index < end && keep; index++) {
+            if (worker->shapefile->filter) {
+                if (!shapefile_filter_index(worker->shapefile, index, &skip)) {
+                    break;
+                }
+
+                if (skip) {
+                    continue;
+                }
+            }
+
+            shape = shapefile_read_index(worker->shapefile, index);
+            if (shape == NULL) {
+                break;
+            }
+
+            if (slot != NULL) {
+                slot->shapes[count++] = shape;
+            }
+            else {
+                keep = worker->cb->shape(shape, worker->cb->user_data);
+                shapefile_shape_release(worker->shapefile, shape);
+            }
+        }
+
+        cond_lock(parallel->cond);
+
+        if (index < end && keep) {
+            shapefile_parallel_fail(parallel, shapefile_error(worker->shapefile));
+            for (i = 0; i < count; i++) {
+                shapefile_shape_free(slot->shapes[i]);
+            }
+            break;
+        }
+
+        if (!keep) {
+            parallel->stop = true;
+            cond_broadcast(parallel->cond);
+            break;
+        }
+
+        if (slot != NULL) {
+            slot->chunk = chunk;
+            slot->count = count;
+            slot->ready = true;
+            cond_broadcast(parallel->cond);
+        }
+    }
+    cond_unlock(parallel->cond);
+
+    return NULL;
+}
+
+//delivers the chunks to the callback in order on the calling thread as the workers finish them
+static void
+shapefile_parallel_deliver(shapefile_parallel_t *parallel, shapefile_parse_cb_t *cb) {
+    shapefile_slot_t *slot;
+    unsigned int i;
+    bool keep = true;
+
+    cond_lock(parallel->cond);
+    while (!parallel->stop && parallel->delivered < parallel->num_chunks) {
+        slot = &parallel->slots[parallel->delivered % parallel->num_slots];
+        while (!parallel->stop && !(slot->ready && slot->chunk == parallel->delivered)) {
+            cond_wait(parallel->cond);
+        }
+
+        if (parallel->stop) {
+            break;
+        }
+
+        cond_unlock(parallel->cond);
+
+        for (i = 0; i < slot->count; i++) {
+            if (keep) {
+                keep = cb->shape(slot->shapes[i], cb->user_data);
+            }
+
+            shapefile_shape_free(slot->shapes[i]);
+        }
+
+        cond_lock(parallel->cond);
+        slot->ready = false;
+        ++parallel->delivered;
+        if (!keep) {
+            parallel->stop = true;
+        }
+        cond_broadcast(parallel->cond);
+    }
+
+    parallel->stop = true;
+    cond_broadcast(parallel->cond);
+    cond_unlock(parallel->cond);
+}
+
+static bool
+shapefile_parallel_run(shapefile_t *shapefile, const char *path, unsigned int threads, shapefile_parse_cb_t *cbs, shapefile_parse_cb_t *ordered) {
+    shapefile_parallel_t parallel;
+    shapefile_worker_t *workers;
+    unsigned int i, j, started = 0;
+    bool success;
+
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    if (!shapefile_open_files(shapefile, path, false)) {
+        return false;
+    }
+
+    memset(&parallel, 0, sizeof(parallel));
+    parallel.count = shapefile->shx.count;
+    parallel.num_chunks = (parallel.count + SHAPEFILE_PARALLEL_CHUNK - 1) / SHAPEFILE_PARALLEL_CHUNK;
+    parallel.num_slots = threads * 2;
+
+    shapefile_close_files(shapefile);
+
+    //the callbacks are all per thread, so there can't be fewer threads than asked for even if some go unused
+    parallel.cond = cond_init();
+    workers = calloc(threads, sizeof(*workers));
+    if (ordered != NULL) {
+        parallel.slots = calloc(parallel.num_slots, sizeof(*parallel.slots));
+    }
+
+    success = parallel.cond != NULL && workers != NULL && (ordered == NULL || parallel.slots != NULL);
+    if (!success) {
+        strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+    }
+
+    //every worker opens the files itself, so nothing about reading them is shared between threads
+    for (i = 0; success && i < threads; i++) {
+        workers[i].parallel = &parallel;
+        workers[i].cb = ordered == NULL ? &cbs[i] : NULL;
+        workers[i].shapefile = shapefile_init();
+        if (workers[i].shapefile == NULL) {
+            strlcpy(shapefile->error, "Out of memory", sizeof(shapefile->error));
+            success = false;
+            break;
+        }
+
+        workers[i].shapefile->mmap = shapefile->mmap;
+        workers[i].shapefile->validate = shapefile->validate;
+        workers[i].shapefile->source_crs = shapefile->source_crs;
+        workers[i].shapefile->target_crs = shapefile->target_crs;
+        workers[i].shapefile->transform = shapefile->transform;
+        workers[i].shapefile->filter = shapefile->filter;
+        workers[i].shapefile->filter_mbr = shapefile->filter_mbr;
+
+        //ordered shapes wait in a slot after they're decoded, so only per thread callbacks can borrow
+        workers[i].shapefile->borrowing = shapefile->reuse && ordered == NULL;
+        if (!shapefile_open_files(workers[i].shapefile, path, false)) {
+            strlcpy(shapefile->error, shapefile_error(workers[i].shapefile), sizeof(shapefile->error));
+            success = false;
+            break;
+        }
+
+        shapefile_file_advise(&workers[i].shapefile->shp.file, true);
+    }
+
+    for (i = 0; success && i < threads; i++) {
+        workers[i].thread = thread_create(shapefile_parallel_worker, &workers[i]);
+        if (workers[i].thread == NULL) {
+            cond_lock(parallel.cond);
+            shapefile_parallel_fail(&parallel, "Error creating a thread");
+            cond_unlock(parallel.cond);
+            break;
+        }
+
+        ++started;
+    }
+
+    if (success && ordered != NULL) {
+        shapefile_parallel_deliver(&parallel, ordered);
+    }
+
+    for (i = 0; i < started; i++) {
+        thread_join(workers[i].thread);
+    }
+
+    if (success && parallel.failed) {
+        strlcpy(shapefile->error, parallel.error, sizeof(shapefile->error));
+        success = false;
+    }
+
+    //anything decoded after the callback stopped was never delivered
+    for (i = 0; parallel.slots != NULL && i < parallel.num_slots; i++) {
+        for (j = 0; parallel.slots[i].ready && j < parallel.slots[i].count; j++) {
+            shapefile_shape_free(parallel.slots[i].shapes[j]);
+        }
+    }
+
+    for (i = 0; workers != NULL && i < threads; i++) {
+        shapefile_free(workers[i].shapefile);
+    }
+
+    free(parallel.slots);
+    free(workers);
+    cond_free(parallel.cond);
+
+    return success;
+}
+
+bool
+shapefile_parse_parallel(shapefile_t *shapefile, const char *path, unsigned int threads, shapefile_parse_cb_t *cbs) {
+    return shapefile_parallel_run(shapefile, path, threads, cbs, NULL);
+}
+
+bool
+shapefile_parse_parallel_ordered(shapefile_t *shapefile, const char *path, unsigned int threads, shapefile_parse_cb_t *cb) {
+    return shapefile_parallel_run(shapefile, path, threads, NULL, cb);
+}
+
+const char *
+shapefile_error(shapefile_t *shapefile) {
+    return shapefile->error;
+}
+
+/****************************************************************************
+ * Writer
+ ****************************************************************************/
+
+//one output file, with everything not yet written held in a buffer
+typedef struct {
+    FILE *f;
+    buffer_t *buffer;
+    uint64_t size;              //bytes in the file so far, including the ones still in the buffer
+} shapefile_writer_file_t;
+
+typedef struct {
+    shapefile_field_t field;
+    unsigned int offset;        //where it starts in a record
+} shapefile_writer_field_t;
+
+struct shapefile_writer_t {
+    shapefile_writer_file_t shp;
+    shapefile_writer_file_t shx;
+    shapefile_writer_file_t dbf;
+    shapefile_writer_field_t *fields;
+    unsigned int num_fields;
+    unsigned int record_length; //bytes in a .dbf record, including the deleted flag
+    char *record;               //the .dbf record for the next shape, blank until fields are set
+    int32_t type;
+    uint32_t count;             //records written
+    bool open;
+    bool empty;                 //no points have been written, so the bounds below aren't set yet
+    bool has_m;                 //any M values have been written, so range.m is set
+    shapefile_mbr_t mbr;
+    shapefile_range_t range;
+    char error[256];
+};
+
+shapefile_writer_t *
+shapefile_writer_init() {
+    shapefile_writer_t *writer;
+
+    writer = calloc(1, sizeof(*writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+
+    //the deleted flag
+    writer->record_length = 1;
+
+    return writer;
+}
+
+static void
+shapefile_writer_file_close(shapefile_writer_file_t *file) {
+    if (file->f != NULL) {
+        fclose(file->f);
+        file->f = NULL;
+    }
+
+    buffer_free(file->buffer);
+    file->buffer = NULL;
+    file->size = 0;
+}
+
+void
+shapefile_writer_free(shapefile_writer_t *writer) {
+    if (writer == NULL) {
+        return;
+    }
+
+    if (writer->open) {
+        shapefile_writer_close(writer);
+    }
+
+    free(writer->fields);
+    free(writer->record);
+    free(writer);
+}
+
+bool
+shapefile_writer_add_field(shapefile_writer_t *writer, const char *name, char type, unsigned int length, unsigned int decimals) {
+    shapefile_writer_field_t *fields, *field;
+    unsigned int i;
+    size_t name_len;
+
+    if (writer->open) {
+        strlcpy(writer->error, "Fields can't be added once the writer is open", sizeof(writer->error));
+        return false;
+    }
+
+    //the .dbf header's length is 16 bits, which leaves room for 2046 fields
+    if (SHAPEFILE_DBF_HEADER_SIZE + ((writer->num_fields + 1) * SHAPEFILE_DBF_FIELD_SIZE) + 1 > UINT16_MAX) {
+        snprintf(writer->error, sizeof(writer->error), "A .dbf can't have more than %u fields", writer->num_fields);
+        return false;
+    }
+
+    name_len = strlen(name);
+    if (name_len == 0 || name_len >= sizeof(field->field.name)) {
+        snprintf(writer->error, sizeof(writer->error), "Field name '%s' must be 1 to %zu characters", name, sizeof(field->field.name) - 1);
+        return false;
+    }
+
+    for (i = 0; i < writer->num_fields; i++) {
+        if (shapefile_dbf_name_eq(name, writer->fields[i].field.name)) {
+            snprintf(writer->error, sizeof(writer->error), "There's already a field named %s", writer->fields[i].field.name);
+            return false;
+        }
+    }
+
+    switch (type) {
+        case SHAPEFILE_FIELD_CHARACTER:
+            decimals = 0;
+            break;
+        case SHAPEFILE_FIELD_NUMERIC:
+        case SHAPEFILE_FIELD_FLOAT:
+            if (length > 255 || (decimals > 0 && decimals + 2 > length)) {
+                snprintf(writer->error, sizeof(writer->error), "Field %s can't be %u wide with %u decimals", name, length, decimals);
+                return false;
+            }
+            break;
+        case SHAPEFILE_FIELD_DATE:
+            length = 8;
+            decimals = 0;
+            break;
+        case SHAPEFILE_FIELD_LOGICAL:
+            length = 1;
+            decimals = 0;
+            break;
+        default:
+            snprintf(writer->error, sizeof(writer->error), "Field %s can't be written with type '%c'", name, type);
+            return false;
+    }
+
+    if (length == 0 || writer->record_length + length > UINT16_MAX) {
+        snprintf(writer->error, sizeof(writer->error), "Field %s can't be %u wide", name, length);
+        return false;
+    }
+
+    fields = realloc(writer->fields, (writer->num_fields + 1) * sizeof(*fields));
+    if (fields == NULL) {
+        strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+        return false;
+    }
+
+    writer->fields = fields;
+
+    field = &writer->fields[writer->num_fields++];
+    memset(field, 0, sizeof(*field));
+    memcpy(field->field.name, name, name_len);
+    field->field.type = type;
+    field->field.length = length;
+    field->field.decimals = decimals;
+    field->offset = writer->record_length;
+
+    writer->record_length += length;
+
+    return true;
+}
+
+bool
+shapefile_writer_copy_fields(shapefile_writer_t *writer, shapefile_t *shapefile) {
+    const shapefile_field_t *field;
+    unsigned int i;
+
+    for (i = 0; i < shapefile_num_fields(shapefile); i++) {
+        field = shapefile_field(shapefile, i);
+        if (!shapefile_writer_add_field(writer, field->name, field->type, field->length, field->decimals)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//writes out the buffer once it's a whole chunk, or all of it when forced
+static bool
+shapefile_writer_flush(shapefile_writer_t *writer, shapefile_writer_file_t *file, bool force) {
+    size_t len;
+
+    len = buffer_length(file->buffer);
+    if (len == 0 || (!force && len < SHAPEFILE_WRITE_CHUNK)) {
+        return true;
+    }
+
+    if (fwrite(buffer_data(file->buffer), 1, len, file->f) != len) {
+        snprintf(writer->error, sizeof(writer->error), "Error writing: %s", strerror(errno));
+        return false;
+    }
+
+    buffer_clear(file->buffer);
+
+    return true;
+}
+
+static bool
+shapefile_writer_file_open(shapefile_writer_t *writer, shapefile_writer_file_t *file, const char *path_prefix, const char *extension) {
+    char *path;
+
+    if (asprintf(&path, "%s.%s", path_prefix, extension) == -1) {
+        strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+        return false;
+    }
+
+    file->f = fopen(path, "wb");
+    if (file->f == NULL) {
+        snprintf(writer->error, sizeof(writer->error), "Error opening %s: %s", path, strerror(errno));
+        free(path);
+        return false;
+    }
+
+    free(path);
+
+    //output is already gathered into whole chunks, so stdio buffering would only copy it again
+    setvbuf(file->f, NULL, _IONBF, 0);
+
+    file->buffer = buffer_init();
+    if (file->buffer == NULL) {
+        strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+shapefile_writer_int32_be(buffer_t *buffer, int32_t value) {
+    return buffer_write_uint32(buffer, htobe32((uint32_t)value));
+}
+
+static bool
+shapefile_writer_int32_le(buffer_t *buffer, int32_t value) {
+    return buffer_write_uint32(buffer, htole32((uint32_t)value));
+}
+
+static bool
+shapefile_writer_double_le(buffer_t *buffer, double value) {
+    uint64_t data;
+
+    memcpy(&data, &value, sizeof(data));
+
+    return buffer_write_uint64(buffer, htole64(data));
+}
+
+//copies count values in one go. on little endian machines the byte swapping is a no-op and the loop goes away
+static bool
+shapefile_writer_doubles_le(buffer_t *buffer, const void *values, size_t count) {
+    unsigned char *dst;
+    uint64_t data;
+    size_t i;
+
+    dst = buffer_reserve(buffer, count * sizeof(data));
+    if (dst == NULL) {
+        return false;
+    }
+
+    memcpy(dst, values, count * sizeof(data));
+
+    for (i = 0; i < count; i++) {
+        memcpy(&data, dst + (i * sizeof(data)), sizeof(data));
+        data = htole64(data);
+        memcpy(dst + (i * sizeof(data)), &data, sizeof(data));
+    }
+
+    buffer_commit(buffer, count * sizeof(data));
+
+    return true;
+}
+
+static bool
+shapefile_writer_int32s_le(buffer_t *buffer, const int32_t *values, size_t count) {
+    size_t i;
+    bool success = true;
+
+    for (i = 0; success && i < count; i++) {
+        success = shapefile_writer_int32_le(buffer, values[i]);
+    }
+
+    return success;
+}
+
+//the 100 byte .shp and .shx header, with the length of the file in 16 bit words
+static bool
+shapefile_writer_header(shapefile_writer_t *writer, buffer_t *buffer, uint64_t size) {
+    shapefile_mbr_t mbr;
+    shapefile_range_t range;
+    int i;
+    bool success;
+
+    memset(&mbr, 0, sizeof(mbr));
+    memset(&range, 0, sizeof(range));
+
+    if (!writer->empty) {
+        mbr = writer->mbr;
+        if (shapefile_type_has_z(writer->type)) {
+            range.z = writer->range.z;
+        }
+        if (writer->has_m) {
+            range.m = writer->range.m;
+        }
+    }
+
+    success = shapefile_writer_int32_be(buffer, SHAPEFILE_HEADER_MAGIC);
+    for (i = 0; success && i < 5; i++) {
+        success = shapefile_writer_int32_be(buffer, 0);
+    }
+
+    return success &&
+           shapefile_writer_int32_be(buffer, (int32_t)(size / sizeof(int16_t))) &&
+           shapefile_writer_int32_le(buffer, 1000) &&
+           shapefile_writer_int32_le(buffer, writer->type) &&
+           shapefile_writer_double_le(buffer, mbr.min_x) &&
+           shapefile_writer_double_le(buffer, mbr.min_y) &&
+           shapefile_writer_double_le(buffer, mbr.max_x) &&
+           shapefile_writer_double_le(buffer, mbr.max_y) &&
+           shapefile_writer_double_le(buffer, range.z.min) &&
+           shapefile_writer_double_le(buffer, range.z.max) &&
+           shapefile_writer_double_le(buffer, range.m.min) &&
+           shapefile_writer_double_le(buffer, range.m.max);
+}
+
+//the .dbf header and field descriptors, with the record count filled in on close
+static bool
+shapefile_writer_dbf_header(shapefile_writer_t *writer, buffer_t *buffer) {
+    unsigned char header[SHAPEFILE_DBF_FIELD_SIZE];
+    const shapefile_writer_field_t *field;
+    struct tm tm;
+    time_t now;
+    unsigned int i;
+    bool success;
+
+    now = time(NULL);
+#if defined(_WIN32)
+    localtime_s(&tm, &now);
+#else
+    localtime_r(&now, &tm);
+#endif
+
+    //version 3, then the date it was last updated
+    memset(header, 0, sizeof(header));
+    header[0] = 0x03;
+    header[1] = (unsigned char)tm.tm_year;
+    header[2] = (unsigned char)(tm.tm_mon + 1);
+    header[3] = (unsigned char)tm.tm_mday;
+
+    success = buffer_write(buffer, header, 4) &&
+              shapefile_writer_int32_le(buffer, (int32_t)writer->count) &&
+              buffer_write_uint16(buffer, htole16((uint16_t)(SHAPEFILE_DBF_HEADER_SIZE + (writer->num_fields * SHAPEFILE_DBF_FIELD_SIZE) + 1))) &&
+              buffer_write_uint16(buffer, htole16((uint16_t)writer->record_length));
+
+    memset(header, 0, sizeof(header));
+    success = success && buffer_write(buffer, header, SHAPEFILE_DBF_HEADER_SIZE - 12);
+
+    for (i = 0; success && i < writer->num_fields; i++) {
+        field = &writer->fields[i];
+
+        memset(header, 0, sizeof(header));
+        memcpy(header, field->field.name, strlen(field->field.name));
+        header[11] = (unsigned char)field->field.type;
+        header[16] = (unsigned char)(field->field.length & 0xff);
+
+        //character fields wider than 255 keep the high byte of their length where the decimals would be
+        if (field->field.type == SHAPEFILE_FIELD_CHARACTER) {
+            header[17] = (unsigned char)(field->field.length >> 8);
+        }
+        else {
+            header[17] = (unsigned char)field->field.decimals;
+        }
+
+        success = buffer_write(buffer, header, SHAPEFILE_DBF_FIELD_SIZE);
+    }
+
+    return success && buffer_write_uint8(buffer, SHAPEFILE_DBF_TERMINATOR);
+}
+
+//blanks the record, which makes every field NULL
+static void
+shapefile_writer_record_clear(shapefile_writer_t *writer) {
+    unsigned int i;
+
+    memset(writer->record, ' ', writer->record_length);
+
+    for (i = 0; i < writer->num_fields; i++) {
+        if (writer->fields[i].field.type == SHAPEFILE_FIELD_LOGICAL) {
+            writer->record[writer->fields[i].offset] = '?';
+        }
+    }
+}
+
+bool
+shapefile_writer_open(shapefile_writer_t *writer, const char *path_prefix, int32_t type) {
+    char *record;
+
+    if (writer->open) {
+        strlcpy(writer->error, "The writer is already open", sizeof(writer->error));
+        return false;
+    }
+
+    if (type == SHAPEFILE_TYPE_NULL || !shapefile_type_valid(type)) {
+        snprintf(writer->error, sizeof(writer->error), "Can't write shapefiles of type %d", type);
+        return false;
+    }
+
+    record = realloc(writer->record, writer->record_length);
+    if (record == NULL) {
+        strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+        return false;
+    }
+
+    writer->record = record;
+    writer->type = type;
+    writer->count = 0;
+    writer->empty = true;
+    writer->has_m = false;
+    writer->open = true;
+    writer->error[0] = '\0';
+
+    shapefile_writer_record_clear(writer);
+
+    //the headers are written again on close once the lengths and bounds are known, and the .dbf is only written when
+    //there are fields
+    if (!shapefile_writer_file_open(writer, &writer->shp, path_prefix, "shp") ||
+        !shapefile_writer_file_open(writer, &writer->shx, path_prefix, "shx") ||
+        (writer->num_fields > 0 && !shapefile_writer_file_open(writer, &writer->dbf, path_prefix, "dbf")) ||
+        !shapefile_writer_header(writer, writer->shp.buffer, SHAPEFILE_HEADER_SIZE) ||
+        !shapefile_writer_header(writer, writer->shx.buffer, SHAPEFILE_HEADER_SIZE) ||
+        (writer->num_fields > 0 && !shapefile_writer_dbf_header(writer, writer->dbf.buffer))) {
+        if (writer->error[0] == '\0') {
+            strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+        }
+
+        shapefile_writer_file_close(&writer->shp);
+        shapefile_writer_file_close(&writer->shx);
+        shapefile_writer_file_close(&writer->dbf);
+        writer->open = false;
+        return false;
+    }
+
+    writer->shp.size = buffer_length(writer->shp.buffer);
+    writer->shx.size = buffer_length(writer->shx.buffer);
+    writer->dbf.size = writer->num_fields > 0 ? buffer_length(writer->dbf.buffer) : 0;
+
+    return true;
+}
+
+//writes a file's header over the placeholder written when it was opened
+static bool
+shapefile_writer_backpatch(shapefile_writer_t *writer, shapefile_writer_file_t *file, shapefile_off_t offset, const unsigned char *data, size_t len) {
+    if (fseeko(file->f, offset, SEEK_SET) != 0 || fwrite(data, 1, len, file->f) != len) {
+        snprintf(writer->error, sizeof(writer->error), "Error writing the header: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool
+shapefile_writer_close(shapefile_writer_t *writer) {
+    uint32_t count;
+    bool success;
+
+    if (!writer->open) {
+        strlcpy(writer->error, "The writer isn't open", sizeof(writer->error));
+        return false;
+    }
+
+    success = shapefile_writer_flush(writer, &writer->shp, true) &&
+              shapefile_writer_flush(writer, &writer->shx, true);
+
+    if (success && writer->dbf.f != NULL) {
+        success = buffer_write_uint8(writer->dbf.buffer, SHAPEFILE_DBF_EOF);
+        if (!success) {
+            strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+        }
+
+        success = success && shapefile_writer_flush(writer, &writer->dbf, true);
+    }
+
+    //the headers go through the .shp's buffer since it's empty now
+    if (success) {
+        success = shapefile_writer_header(writer, writer->shp.buffer, writer->shp.size);
+        if (!success) {
+            strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+        }
+    }
+
+    success = success &&
+              shapefile_writer_backpatch(writer, &writer->shp, 0, buffer_data(writer->shp.buffer), buffer_length(writer->shp.buffer));
+
+    if (success) {
+        buffer_clear(writer->shp.buffer);
+        success = shapefile_writer_header(writer, writer->shp.buffer, writer->shx.size) &&
+                  shapefile_writer_backpatch(writer, &writer->shx, 0, buffer_data(writer->shp.buffer), buffer_length(writer->shp.buffer));
+    }
+
+    if (success && writer->dbf.f != NULL) {
+        count = htole32(writer->count);
+        success = shapefile_writer_backpatch(writer, &writer->dbf, 4, (const unsigned char *)&count, sizeof(count));
+    }
+
+    //a failed fclose() can lose what was written last
+    if (writer->shp.f != NULL && fclose(writer->shp.f) != 0 && success) {
+        snprintf(writer->error, sizeof(writer->error), "Error closing the .shp: %s", strerror(errno));
+        success = false;
+    }
+    writer->shp.f = NULL;
+
+    if (writer->shx.f != NULL && fclose(writer->shx.f) != 0 && success) {
+        snprintf(writer->error, sizeof(writer->error), "Error closing the .shx: %s", strerror(errno));
+        success = false;
+    }
+    writer->shx.f = NULL;
+
+    if (writer->dbf.f != NULL && fclose(writer->dbf.f) != 0 && success) {
+        snprintf(writer->error, sizeof(writer->error), "Error closing the .dbf: %s", strerror(errno));
+        success = false;
+    }
+    writer->dbf.f = NULL;
+
+    shapefile_writer_file_close(&writer->shp);
+    shapefile_writer_file_close(&writer->shx);
+    shapefile_writer_file_close(&writer->dbf);
+    writer->open = false;
+
+    return success;
+}
+
+static void
+shapefile_writer_bounds(shapefile_writer_t *writer, const shapefile_mbr_t *mbr, const double *z, const double *m, int32_t num_points) {
+    double min, max;
+    int32_t i;
+
+    if (writer->empty) {
+        writer->mbr = *mbr;
+        writer->range.z.min = z != NULL ? z[0] : 0.0;
+        writer->range.z.max = writer->range.z.min;
+        writer->empty = false;
+    }
+    else {
+        writer->mbr.min_x = mbr->min_x < writer->mbr.min_x ? mbr->min_x : writer->mbr.min_x;
+        writer->mbr.min_y = mbr->min_y < writer->mbr.min_y ? mbr->min_y : writer->mbr.min_y;
+        writer->mbr.max_x = mbr->max_x > writer->mbr.max_x ? mbr->max_x : writer->mbr.max_x;
+        writer->mbr.max_y = mbr->max_y > writer->mbr.max_y ? mbr->max_y : writer->mbr.max_y;
+    }
+
+    if (z != NULL && shapefile_values_range(z, (size_t)num_points, &min, &max)) {
+        writer->range.z.min = min < writer->range.z.min ? min : writer->range.z.min;
+        writer->range.z.max = max > writer->range.z.max ? max : writer->range.z.max;
+    }
+
+    for (i = 0; m != NULL && i < num_points; i++) {
+        if (m[i] < SHAPEFILE_M_NO_DATA) {
+            continue;
+        }
+
+        if (!writer->has_m) {
+            writer->range.m.min = m[i];
+            writer->range.m.max = m[i];
+            writer->has_m = true;
+        }
+        else {
+            writer->range.m.min = m[i] < writer->range.m.min ? m[i] : writer->range.m.min;
+            writer->range.m.max = m[i] > writer->range.m.max ? m[i] : writer->range.m.max;
+        }
+    }
+}
+
+//the range of Z or M values and then the values themselves, or no data when there aren't any
+static bool
+shapefile_writer_measures(buffer_t *buffer, const double *values, int32_t num_points, bool skip_no_data) {
+    double min = 0.0, max = 0.0;
+    int32_t i;
+    bool found = false;
+
+    for (i = 0; values != NULL && i < num_points; i++) {
+        if (skip_no_data && values[i] < SHAPEFILE_M_NO_DATA) {
+            continue;
+        }
+
+        if (!found || values[i] < min) {
+            min = values[i];
+        }
+        if (!found || values[i] > max) {
+            max = values[i];
+        }
+        found = true;
+    }
+
+    if (values == NULL || (skip_no_data && !found)) {
+        min = SHAPEFILE_M_WRITE_NO_DATA;
+        max = SHAPEFILE_M_WRITE_NO_DATA;
+    }
+
+    if (!shapefile_writer_double_le(buffer, min) || !shapefile_writer_double_le(buffer, max)) {
+        return false;
+    }
+
+    if (values != NULL) {
+        return shapefile_writer_doubles_le(buffer, values, (size_t)num_points);
+    }
+
+    for (i = 0; i < num_points; i++) {
+        if (!shapefile_writer_double_le(buffer, SHAPEFILE_M_WRITE_NO_DATA)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+shapefile_writer_check(shapefile_writer_t *writer, const int32_t *parts, const int32_t *part_types, int32_t num_parts, int32_t num_points, const double *z) {
+    int32_t base, i;
+
+    base = shapefile_type_base(writer->type);
+
+    if (num_points < 0 || num_parts < 0) {
+        snprintf(writer->error, sizeof(writer->error), "Shape %u has %d parts and %d points", writer->count, num_parts, num_points);
+        return false;
+    }
+
+    if (base == SHAPEFILE_TYPE_POINT && num_points != 1) {
+        snprintf(writer->error, sizeof(writer->error), "Shape %u is a point with %d points", writer->count, num_points);
+        return false;
+    }
+
+    if (shapefile_type_has_z(writer->type) && z == NULL && num_points > 0) {
+        snprintf(writer->error, sizeof(writer->error), "Shape %u needs Z values for a %s shapefile", writer->count, shapefile_type_str(writer->type));
+        return false;
+    }
+
+    if (base == SHAPEFILE_TYPE_POINT || base == SHAPEFILE_TYPE_MULTIPOINT) {
+        return true;
+    }
+
+    if (base == SHAPEFILE_TYPE_MULTIPATCH && part_types == NULL && num_parts > 0) {
+        snprintf(writer->error, sizeof(writer->error), "Shape %u needs part types for a MultiPatch", writer->count);
+        return false;
+    }
+
+    //parts start at the first point and go up from there
+    if ((num_parts == 0) != (num_points == 0) || (num_parts > 0 && parts[0] != 0)) {
+        snprintf(writer->error, sizeof(writer->error), "Shape %u's parts don't start at its first point", writer->count);
+        return false;
+    }
+
+    for (i = 1; i < num_parts; i++) {
+        if (parts[i] < parts[i - 1] || parts[i] >= num_points) {
+            snprintf(writer->error, sizeof(writer->error), "Shape %u has part %d starting at point %d", writer->count, i, parts[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//the record header in the .shp and its entry in the .shx, then flushes whatever's filled a chunk
+static bool
+shapefile_writer_record(shapefile_writer_t *writer, size_t length) {
+    bool success;
+
+    if (writer->shp.size + SHAPEFILE_SHP_RECORD_SIZE + length > (uint64_t)INT32_MAX * sizeof(int16_t)) {
+        strlcpy(writer->error, "The .shp can't be over 4GB", sizeof(writer->error));
+        return false;
+    }
+
+    success = shapefile_writer_int32_be(writer->shx.buffer, (int32_t)(writer->shp.size / sizeof(int16_t))) &&
+              shapefile_writer_int32_be(writer->shx.buffer, (int32_t)(length / sizeof(int16_t))) &&
+              shapefile_writer_int32_be(writer->shp.buffer, (int32_t)writer->count + 1) &&
+              shapefile_writer_int32_be(writer->shp.buffer, (int32_t)(length / sizeof(int16_t)));
+
+    if (!success) {
+        strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+        return false;
+    }
+
+    writer->shp.size += SHAPEFILE_SHP_RECORD_SIZE + length;
+    writer->shx.size += SHAPEFILE_SHX_RECORD_SIZE;
+
+    return true;
+}
+
+//the .dbf record that goes with the shape just written, then a blank one for the next
+static bool
+shapefile_writer_finish_record(shapefile_writer_t *writer) {
+    if (writer->dbf.f != NULL) {
+        if (!buffer_write(writer->dbf.buffer, (unsigned char *)writer->record, writer->record_length)) {
+            strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+            return false;
+        }
+
+        writer->dbf.size += writer->record_length;
+        shapefile_writer_record_clear(writer);
+    }
+
+    writer->count++;
+
+    return shapefile_writer_flush(writer, &writer->shp, false) &&
+           shapefile_writer_flush(writer, &writer->shx, false) &&
+           (writer->dbf.f == NULL || shapefile_writer_flush(writer, &writer->dbf, false));
+}
+
+bool
+shapefile_writer_write_null(shapefile_writer_t *writer) {
+    if (!writer->open) {
+        strlcpy(writer->error, "The writer isn't open", sizeof(writer->error));
+        return false;
+    }
+
+    if (!shapefile_writer_record(writer, sizeof(int32_t))) {
+        return false;
+    }
+
+    if (!shapefile_writer_int32_le(writer->shp.buffer, SHAPEFILE_TYPE_NULL)) {
+        strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+        return false;
+    }
+
+    return shapefile_writer_finish_record(writer);
+}
+
+bool
+shapefile_writer_write_parts(shapefile_writer_t *writer, const int32_t *parts, const int32_t *part_types, int32_t num_parts,
+                             const shapefile_point_t *points, const double *z, const double *m, int32_t num_points) {
+    shapefile_mbr_t mbr;
+    buffer_t *buffer;
+    size_t length, doubles;
+    int32_t base;
+    bool write_z, write_m, success;
+
+    if (!writer->open) {
+        strlcpy(writer->error, "The writer isn't open", sizeof(writer->error));
+        return false;
+    }
+
+    if (!shapefile_writer_check(writer, parts, part_types, num_parts, num_points, z)) {
+        return false;
+    }
+
+    base = shapefile_type_base(writer->type);
+    if (base == SHAPEFILE_TYPE_POINT || base == SHAPEFILE_TYPE_MULTIPOINT) {
+        num_parts = 0;
+    }
+
+    //M is optional in Z types, so it's only written when there is some, and M types get no data instead
+    write_z = shapefile_type_has_z(writer->type);
+    write_m = shapefile_type_has_m(writer->type) && (m != NULL || !write_z);
+    doubles = (write_z ? 1 : 0) + (write_m ? 1 : 0);
+
+    memset(&mbr, 0, sizeof(mbr));
+    if (num_points > 0 && !shapefile_points_bounds(points, (size_t)num_points, &mbr)) {
+        snprintf(writer->error, sizeof(writer->error), "Shape %u has a coordinate that isn't a number", writer->count);
+        return false;
+    }
+
+    if (base == SHAPEFILE_TYPE_POINT) {
+        length = sizeof(int32_t) + sizeof(*points) + (doubles * sizeof(double));
+    }
+    else {
+        length = sizeof(int32_t) + (4 * sizeof(double)) + sizeof(int32_t) + ((size_t)num_points * sizeof(*points)) +
+                 (doubles * ((2 * sizeof(double)) + ((size_t)num_points * sizeof(double))));
+
+        if (base != SHAPEFILE_TYPE_MULTIPOINT) {
+            length += sizeof(int32_t) + ((size_t)num_parts * sizeof(int32_t));
+        }
+        if (base == SHAPEFILE_TYPE_MULTIPATCH) {
+            length += (size_t)num_parts * sizeof(int32_t);
+        }
+    }
+
+    if (!shapefile_writer_record(writer, length)) {
+        return false;
+    }
+
+    buffer = writer->shp.buffer;
+    success = shapefile_writer_int32_le(buffer, writer->type);
+
+    if (base == SHAPEFILE_TYPE_POINT) {
+        success = success &&
+                  shapefile_writer_doubles_le(buffer, points, 2) &&
+                  (!write_z || shapefile_writer_double_le(buffer, z[0])) &&
+                  (!write_m || shapefile_writer_double_le(buffer, m != NULL ? m[0] : SHAPEFILE_M_WRITE_NO_DATA));
+    }
+    else {
+        success = success &&
+                  shapefile_writer_double_le(buffer, mbr.min_x) &&
+                  shapefile_writer_double_le(buffer, mbr.min_y) &&
+                  shapefile_writer_double_le(buffer, mbr.max_x) &&
+                  shapefile_writer_double_le(buffer, mbr.max_y) &&
+                  (base == SHAPEFILE_TYPE_MULTIPOINT || shapefile_writer_int32_le(buffer, num_parts)) &&
+                  shapefile_writer_int32_le(buffer, num_points) &&
+                  shapefile_writer_int32s_le(buffer, parts, (size_t)num_parts) &&
+                  (base != SHAPEFILE_TYPE_MULTIPATCH || shapefile_writer_int32s_le(buffer, part_types, (size_t)num_parts)) &&
+                  shapefile_writer_doubles_le(buffer, points, (size_t)num_points * 2) &&
+                  (!write_z || shapefile_writer_measures(buffer, z, num_points, false)) &&
+                  (!write_m || shapefile_writer_measures(buffer, m, num_points, true));
+    }
+
+    if (!success) {
+        strlcpy(writer->error, "Out of memory", sizeof(writer->error));
+        return false;
+    }
+
+    if (num_points > 0) {
+        shapefile_writer_bounds(writer, &mbr, write_z ? z : NULL, write_m ? m : NULL, num_points);
+    }
+
+    return shapefile_writer_finish_record(writer);
+}
+
+bool
+shapefile_writer_write(shapefile_writer_t *writer, shapefile_shape_t *shape) {
+    if (shape->type == SHAPEFILE_TYPE_NULL) {
+        return shapefile_writer_write_null(writer);
+    }
+
+    if (shapefile_type_base(shape->type) != shapefile_type_base(writer->type)) {
+        snprintf(writer->error, sizeof(writer->error), "Can't write a %s shape to a %s shapefile", shapefile_type_str(shape->type), shapefile_type_str(writer->type));
+        return false;
+    }
+
+    return shapefile_writer_write_parts(writer, shape->parts, shape->part_types, shape->num_parts, shape->points, shape->z, shape->m, shape->num_points);
+}
+
+//puts a value in the next record, left justified for characters and right justified for everything else
+static bool
+shapefile_writer_set_raw(shapefile_writer_t *writer, unsigned int field, const char *value, size_t len) {
+    const shapefile_writer_field_t *writer_field;
+    char *dst;
+
+    if (!writer->open || field >= writer->num_fields) {
+        snprintf(writer->error, sizeof(writer->error), "There's no field %u to set", field);
+        return false;
+    }
+
+    writer_field = &writer->fields[field];
+    if (len > writer_field->field.length) {
+        snprintf(writer->error, sizeof(writer->error), "'%.*s' doesn't fit in field %s", (int)len, value, writer_field->field.name);
+        return false;
+    }
+
+    dst = writer->record + writer_field->offset;
+    memset(dst, ' ', writer_field->field.length);
+
+    if (len == 0) {
+        return true;
+    }
+
+    if (writer_field->field.type == SHAPEFILE_FIELD_CHARACTER) {
+        memcpy(dst, value, len);
+    }
+    else {
+        memcpy(dst + writer_field->field.length - len, value, len);
+    }
+
+    return true;
+}
+
+bool
+shapefile_writer_set_string(shapefile_writer_t *writer, unsigned int field, const char *value) {
+    return shapefile_writer_set_raw(writer, field, value, strlen(value));
+}
+
+bool
+shapefile_writer_set_int64(shapefile_writer_t *writer, unsigned int field, int64_t value) {
+    char str[32];
+    int len;
+
+    len = snprintf(str, sizeof(str), "%lld", (long long)value);
+
+    return shapefile_writer_set_raw(writer, field, str, (size_t)len);
+}
+
+bool
+shapefile_writer_set_double(shapefile_writer_t *writer, unsigned int field, double value) {
+    char str[DTOA_BUFFER_SIZE];
+    size_t len;
+
+    if (field >= writer->num_fields) {
+        snprintf(writer->error, sizeof(writer->error), "There's no field %u to set", field);
+        return false;
+    }
+
+    if (isnan(value) || isinf(value)) {
+        snprintf(writer->error, sizeof(writer->error), "Field %s can't hold %f", writer->fields[field].field.name, value);
+        return false;
+    }
+
+    len = dtoa_format(str, value, writer->fields[field].field.decimals > 0 ? (int)writer->fields[field].field.decimals : 0);
+
+    return shapefile_writer_set_raw(writer, field, str, len);
+}
+
+bool
+shapefile_writer_set_date(shapefile_writer_t *writer, unsigned int field, int year, int month, int day) {
+    char str[16];
+
+    if (year < 0 || year > 9999 || month < 1 || month > 12 || day < 1 || day > 31) {
+        snprintf(writer->error, sizeof(writer->error), "%d-%d-%d isn't a date", year, month, day);
+        return false;
+    }
+
+    snprintf(str, sizeof(str), "%04d%02d%02d", year, month, day);
+
+    return shapefile_writer_set_raw(writer, field, str, 8);
+}
+
+bool
+shapefile_writer_set_bool(shapefile_writer_t *writer, unsigned int field, bool value) {
+    return shapefile_writer_set_raw(writer, field, value ? "T" : "F", 1);
+}
+
+bool
+shapefile_writer_set_null(shapefile_writer_t *writer, unsigned int field) {
+    if (field < writer->num_fields && writer->fields[field].field.type == SHAPEFILE_FIELD_LOGICAL) {
+        return shapefile_writer_set_raw(writer, field, "?", 1);
+    }
+
+    return shapefile_writer_set_raw(writer, field, "", 0);
+}
+
+void
+shapefile_writer_set_deleted(shapefile_writer_t *writer, bool deleted) {
+    if (writer->record != NULL) {
+        writer->record[0] = deleted ? '*' : ' ';
+    }
+}
+
+bool
+shapefile_writer_set_record(shapefile_writer_t *writer, shapefile_record_t *record) {
+    const char *value;
+    unsigned int i;
+    size_t len;
+
+    for (i = 0; i < writer->num_fields && i < record->dbf->num_columns; i++) {
+        value = shapefile_record_raw(record, i, &len);
+        if (!shapefile_writer_set_raw(writer, i, value, len)) {
+            return false;
+        }
+    }
+
+    shapefile_writer_set_deleted(writer, shapefile_record_deleted(record));
+
+    return true;
+}
+
+uint32_t
+shapefile_writer_count(shapefile_writer_t *writer) {
+    return writer->count;
+}
+
+const char *
+shapefile_writer_error(shapefile_writer_t *writer) {
+    return writer->error;
+}
+
+/****************************************************************************
+ * Simplify
+ *
+ * Each part is simplified by marking the points it keeps, and the kept points
+ * are then moved down over the ones that weren't, which never overtakes the
+ * part being read. Douglas-Peucker splits ranges of a part at their farthest
+ * point, with the ranges still to look at on an explicit stack instead of
+ * recursion. Visvalingam-Whyatt keeps the points in a linked list and their
+ * areas in a binary min-heap, and removes the smallest until none are under
+ * the tolerance. A point's area never drops below that of one removed before
+ * it, so that removing a point can't make its neighbors go sooner.
+ ****************************************************************************/
+
+struct shapefile_simplify_t {
+    int method;
+    double tolerance;
+    int flags;
+    unsigned char *keep;        //per point of the part being simplified
+    int32_t *stack;             //Douglas-Peucker's first and last indices of ranges still to split
+    int32_t *prev;              //Visvalingam-Whyatt's linked list of points still in the part
+    int32_t *next;
+    double *area;
+    int32_t *heap;              //indices of points, smallest area first
+    int32_t *heap_index;        //where each point is in the heap
+    size_t size;                //points that fit in each of the above
+    bool *starts;               //per part, whether it starts a new polygon
+    size_t starts_size;
+};
+
+//the square of the distance from p to the segment from a to b
+static double
+shapefile_segment_distance2(const shapefile_point_t *p, const shapefile_point_t *a, const shapefile_point_t *b) {
+    double dx, dy, length2, t, x, y;
+
+    dx = b->x - a->x;
+    dy = b->y - a->y;
+    length2 = (dx * dx) + (dy * dy);
+    x = a->x;
+    y = a->y;
+
+    if (length2 > 0.0) {
+        t = (((p->x - a->x) * dx) + ((p->y - a->y) * dy)) / length2;
+        if (t >= 1.0) {
+            x = b->x;
+            y = b->y;
+        }
+        else if (t > 0.0) {
+            x += t * dx;
+            y += t * dy;
+        }
+    }
+
+    dx = p->x - x;
+    dy = p->y - y;
+
+    return (dx * dx) + (dy * dy);
+}
+
+//the point between first and last that's farthest from the segment joining them, or -1 if there's nothing between
+static int32_t
+shapefile_simplify_farthest(const shapefile_point_t *points, int32_t first, int32_t last, double *distance2) {
+    int32_t i, farthest = -1;
+    double d;
+
+    *distance2 = -1.0;
+
+    for (i = first + 1; i < last; i++) {
+        d = shapefile_segment_distance2(&points[i], &points[first], &points[last]);
+        if (d > *distance2) {
+            *distance2 = d;
+            farthest = i;
+        }
+    }
+
+    return farthest;
+}
+
+static int32_t
+shapefile_simplify_douglas_peucker(shapefile_simplify_t *simplify, const shapefile_point_t *points, int32_t count) {
+    double tolerance2, d;
+    int32_t first, last, farthest, kept = 2;
+    size_t top = 0;
+
+    tolerance2 = simplify->tolerance > 0.0 ? simplify->tolerance * simplify->tolerance : 0.0;
+
+    memset(simplify->keep, 0, (size_t)count);
+    simplify->keep[0] = 1;
+    simplify->keep[count - 1] = 1;
+
+    //every range on the stack is split from a different kept point, so it never holds more than count of them
+    simplify->stack[top++] = 0;
+    simplify->stack[top++] = count - 1;
+
+    while (top > 0) {
+        last = simplify->stack[--top];
+        first = simplify->stack[--top];
+
+        farthest = shapefile_simplify_farthest(points, first, last, &d);
+        if (farthest < 0 || d <= tolerance2) {
+            continue;
+        }
+
+        simplify->keep[farthest] = 1;
+        kept++;
+
+        if (farthest - first > 1) {
+            simplify->stack[top++] = first;
+            simplify->stack[top++] = farthest;
+        }
+        if (last - farthest > 1) {
+            simplify->stack[top++] = farthest;
+            simplify->stack[top++] = last;
+        }
+    }
+
+    return kept;
+}
+
+static double
+shapefile_triangle_area(const shapefile_point_t *a, const shapefile_point_t *b, const shapefile_point_t *c) {
+    return fabs(((b->x - a->x) * (c->y - a->y)) - ((c->x - a->x) * (b->y - a->y))) * 0.5;
+}
+
+static bool
+shapefile_heap_less(shapefile_simplify_t *simplify, int32_t a, int32_t b) {
+    return simplify->area[a] < simplify->area[b] || (simplify->area[a] == simplify->area[b] && a < b);
+}
+
+static void
+shapefile_heap_set(shapefile_simplify_t *simplify, size_t index, int32_t point) {
+    simplify->heap[index] = point;
+    simplify->heap_index[point] = (int32_t)index;
+}
+
+static void
+shapefile_heap_up(shapefile_simplify_t *simplify, size_t index) {
+    int32_t point = simplify->heap[index];
+    size_t parent;
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+        if (!shapefile_heap_less(simplify, point, simplify->heap[parent])) {
+            break;
+        }
+        shapefile_heap_set(simplify, index, simplify->heap[parent]);
+        index = parent;
+    }
+
+    shapefile_heap_set(simplify, index, point);
+}
+
+static void
+shapefile_heap_down(shapefile_simplify_t *simplify, size_t index, size_t size) {
+    int32_t point = simplify->heap[index];
+    size_t child;
+
+    while ((child = (index * 2) + 1) < size) {
+        if (child + 1 < size && shapefile_heap_less(simplify, simplify->heap[child + 1], simplify->heap[child])) {
+            child++;
+        }
+        if (!shapefile_heap_less(simplify, simplify->heap[child], point)) {
+            break;
+        }
+        shapefile_heap_set(simplify, index, simplify->heap[child]);
+        index = child;
+    }
+
+    shapefile_heap_set(simplify, index, point);
+}
+
+//works out the area of a point that's still in the part after one with removed_area went, and moves it in the heap
+static void
+shapefile_simplify_update(shapefile_simplify_t *simplify, const shapefile_point_t *points, int32_t point, double removed_area, size_t size) {
+    double area;
+
+    area = shapefile_triangle_area(&points[simplify->prev[point]], &points[point], &points[simplify->next[point]]);
+    simplify->area[point] = area > removed_area ? area : removed_area;
+
+    shapefile_heap_up(simplify, (size_t)simplify->heap_index[point]);
+    shapefile_heap_down(simplify, (size_t)simplify->heap_index[point], size);
+}
+
+static int32_t
+shapefile_simplify_visvalingam(shapefile_simplify_t *simplify, const shapefile_point_t *points, int32_t count) {
+    int32_t i, point, prev, next, kept = count;
+    size_t size = 0;
+    double area;
+
+    memset(simplify->keep, 1, (size_t)count);
+
+    for (i = 1; i + 1 < count; i++) {
+        simplify->prev[i] = i - 1;
+        simplify->next[i] = i + 1;
+        simplify->area[i] = shapefile_triangle_area(&points[i - 1], &points[i], &points[i + 1]);
+        shapefile_heap_set(simplify, size++, i);
+    }
+
+    for (i = (int32_t)(size / 2); i > 0; i--) {
+        shapefile_heap_down(simplify, (size_t)(i - 1), size);
+    }
+
+    while (size > 0) {
+        point = simplify->heap[0];
+        area = simplify->area[point];
+        if (area >= simplify->tolerance) {
+            break;
+        }
+
+        shapefile_heap_set(simplify, 0, simplify->heap[--size]);
+        shapefile_heap_down(simplify, 0, size);
+
+        simplify->keep[point] = 0;
+        kept--;
+
+        prev = simplify->prev[point];
+        next = simplify->next[point];
+        if (prev > 0) {
+            simplify->next[prev] = next;
+        }
+        if (next + 1 < count) {
+            simplify->prev[next] = prev;
+        }
+
+        if (prev > 0) {
+            shapefile_simplify_update(simplify, points, prev, area, size);
+        }
+        if (next + 1 < count) {
+            shapefile_simplify_update(simplify, points, next, area, size);
+        }
+    }
+
+    return kept;
+}
+
+//keeps the points farthest from what's left of a part until it has at least minimum of them
+static int32_t
+shapefile_simplify_refill(shapefile_simplify_t *simplify, const shapefile_point_t *points, int32_t count, int32_t kept, int32_t minimum) {
+    int32_t i, first, farthest, best;
+    double d, best_d;
+
+    while (kept < minimum) {
+        best = -1;
+        best_d = -1.0;
+        first = 0;
+
+        for (i = 1; i < count; i++) {
+            if (!simplify->keep[i]) {
+                continue;
+            }
+
+            farthest = shapefile_simplify_farthest(points, first, i, &d);
+            if (farthest >= 0 && d > best_d) {
+                best = farthest;
+                best_d = d;
+            }
+            first = i;
+        }
+
+        if (best < 0) {
+            break;
+        }
+
+        simplify->keep[best] = 1;
+        kept++;
+    }
+
+    return kept;
+}
+
+//shapefile_ring_area() of just the points being kept
+static double
+shapefile_simplify_ring_area(shapefile_simplify_t *simplify, const shapefile_point_t *points, int32_t count) {
+    double area = 0.0;
+    int32_t i, prev = 0;
+
+    for (i = 1; i < count; i++) {
+        if (simplify->keep[i]) {
+            area += (points[prev].x * points[i].y) - (points[i].x * points[prev].y);
+            prev = i;
+        }
+    }
+
+    return area;
+}
+
+static bool
+shapefile_simplify_grow(shapefile_simplify_t *simplify, size_t points, size_t parts) {
+    unsigned char *keep;
+    int32_t *stack, *prev, *next, *heap, *heap_index;
+    double *area;
+    bool *starts;
+
+    if (points > simplify->size) {
+        keep = realloc(simplify->keep, points);
+        if (keep == NULL) {
+            return false;
+        }
+        simplify->keep = keep;
+
+        stack = realloc(simplify->stack, points * 2 * sizeof(*stack));
+        if (stack == NULL) {
+            return false;
+        }
+        simplify->stack = stack;
+
+        prev = realloc(simplify->prev, points * sizeof(*prev));
+        if (prev == NULL) {
+            return false;
+        }
+        simplify->prev = prev;
+
+        next = realloc(simplify->next, points * sizeof(*next));
+        if (next == NULL) {
+            return false;
+        }
+        simplify->next = next;
+
+        area = realloc(simplify->area, points * sizeof(*area));
+        if (area == NULL) {
+            return false;
+        }
+        simplify->area = area;
+
+        heap = realloc(simplify->heap, points * sizeof(*heap));
+        if (heap == NULL) {
+            return false;
+        }
+        simplify->heap = heap;
+
+        heap_index = realloc(simplify->heap_index, points * sizeof(*heap_index));
+        if (heap_index == NULL) {
+            return false;
+        }
+        simplify->heap_index = heap_index;
+
+        simplify->size = points;
+    }
+
+    if (parts > simplify->starts_size) {
+        starts = realloc(simplify->starts, parts * sizeof(*starts));
+        if (starts == NULL) {
+            return false;
+        }
+        simplify->starts = starts;
+        simplify->starts_size = parts;
+    }
+
+    return true;
+}
+
+//a NaN leaves the box or range as it was, which is no worse than it was before simplifying
+static void
+shapefile_simplify_bounds(shapefile_shape_t *shape) {
+    size_t count = (size_t)shape->num_points;
+    bool found = false;
+    size_t i;
+
+    if (count == 0) {
+        memset(&shape->mbr, 0, sizeof(shape->mbr));
+        return;
+    }
+
+    shapefile_points_bounds(shape->points, count, &shape->mbr);
+
+    if (shape->z != NULL) {
+        shapefile_values_range(shape->z, count, &shape->range.z.min, &shape->range.z.max);
+    }
+
+    for (i = 0; shape->m != NULL && i < count; i++) {
+        if (shape->m[i] < SHAPEFILE_M_NO_DATA) {
+            continue;
+        }
+
+        if (!found || shape->m[i] < shape->range.m.min) {
+            shape->range.m.min = shape->m[i];
+        }
+        if (!found || shape->m[i] > shape->range.m.max) {
+            shape->range.m.max = shape->m[i];
+        }
+        found = true;
+    }
+}
+
+shapefile_simplify_t *
+shapefile_simplify_init(int method, double tolerance, int flags) {
+    shapefile_simplify_t *simplify;
+
+    if (method != SHAPEFILE_SIMPLIFY_DOUGLAS_PEUCKER && method != SHAPEFILE_SIMPLIFY_VISVALINGAM) {
+        return NULL;
+    }
+
+    simplify = calloc(1, sizeof(*simplify));
+    if (simplify == NULL) {
+        return NULL;
+    }
+
+    simplify->method = method;
+    simplify->tolerance = tolerance;
+    simplify->flags = flags;
+
+    return simplify;
+}
+
+void
+shapefile_simplify_free(shapefile_simplify_t *simplify) {
+    if (simplify != NULL) {
+        free(simplify->keep);
+        free(simplify->stack);
+        free(simplify->prev);
+        free(simplify->next);
+        free(simplify->area);
+        free(simplify->heap);
+        free(simplify->heap_index);
+        free(simplify->starts);
+        free(simplify);
+    }
+}
+
+void
+shapefile_simplify_set_tolerance(shapefile_simplify_t *simplify, double tolerance) {
+    simplify->tolerance = tolerance;
+}
+
+bool
+shapefile_simplify_shape(shapefile_simplify_t *simplify, shapefile_shape_t *shape) {
+    const shapefile_point_t *points;
+    int32_t i, j, start, count, kept, minimum, largest = 0, num_parts = 0, num_points = 0;
+    double area, kept_area;
+    bool polygon, drop_holes = false;
+
+    switch (shape->type) {
+        case SHAPEFILE_TYPE_POLYLINE:
+        case SHAPEFILE_TYPE_POLYLINE_Z:
+        case SHAPEFILE_TYPE_POLYLINE_M:
+            polygon = false;
+            minimum = 2;
+            break;
+        case SHAPEFILE_TYPE_POLYGON:
+        case SHAPEFILE_TYPE_POLYGON_Z:
+        case SHAPEFILE_TYPE_POLYGON_M:
+            polygon = true;
+            minimum = 4;
+            break;
+        default:
+            return true;
+    }
+
+    for (i = 0; i < shape->num_parts; i++) {
+        count = shapefile_shape_part_end(shape, i) - shape->parts[i];
+        if (count > largest) {
+            largest = count;
+        }
+    }
+
+    if (!shapefile_simplify_grow(simplify, (size_t)largest, polygon ? (size_t)shape->num_parts : 0)) {
+        return false;
+    }
+
+    //which rings are holes has to be worked out before simplifying can change their winding
+    for (i = 0; polygon && i < shape->num_parts; i++) {
+        simplify->starts[i] = shapefile_shape_polygon_starts(shape, i);
+    }
+
+    //parts and points are written behind the ones being read, so the rest of the shape is still there to read
+    for (i = 0; i < shape->num_parts; i++) {
+        start = shape->parts[i];
+        count = shapefile_shape_part_end(shape, i) - start;
+        points = shape->points + start;
+
+        if (polygon && !simplify->starts[i] && drop_holes) {
+            continue;
+        }
+
+        if (count < minimum) {
+            for (j = 0; j < count; j++) {
+                simplify->keep[j] = 1;
+            }
+            kept = count;
+        }
+        else {
+            if (simplify->method == SHAPEFILE_SIMPLIFY_DOUGLAS_PEUCKER) {
+                kept = shapefile_simplify_douglas_peucker(simplify, points, count);
+            }
+            else {
+                kept = shapefile_simplify_visvalingam(simplify, points, count);
+            }
+
+            if (polygon && (simplify->flags & SHAPEFILE_SIMPLIFY_KEEP_PARTS)) {
+                kept = shapefile_simplify_refill(simplify, points, count, kept, minimum);
+            }
+
+            if (polygon && kept >= minimum && (simplify->flags & SHAPEFILE_SIMPLIFY_KEEP_WINDING)) {
+                area = shapefile_ring_area(points, count);
+                kept_area = shapefile_simplify_ring_area(simplify, points, count);
+                if (area != 0.0 && (kept_area == 0.0 || (area < 0.0) != (kept_area < 0.0))) {
+                    memset(simplify->keep, 1, (size_t)count);
+                    kept = count;
+                }
+            }
+        }
+
+        if (polygon) {
+            if (kept < minimum && !(simplify->flags & SHAPEFILE_SIMPLIFY_KEEP_PARTS)) {
+                if (simplify->starts[i]) {
+                    drop_holes = true;
+                }
+                continue;
+            }
+            if (simplify->starts[i]) {
+                drop_holes = false;
+            }
+        }
+
+        shape->parts[num_parts++] = num_points;
+
+        for (j = 0; j < count; j++) {
+            if (!simplify->keep[j]) {
+                continue;
+            }
+
+            shape->points[num_points] = points[j];
+            if (shape->z != NULL) {
+                shape->z[num_points] = shape->z[start + j];
+            }
+            if (shape->m != NULL) {
+                shape->m[num_points] = shape->m[start + j];
+            }
+            num_points++;
+        }
+    }
+
+    shape->num_parts = num_parts;
+    shape->num_points = num_points;
+    shapefile_simplify_bounds(shape);
+
+    return true;
 }
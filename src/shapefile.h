@@ -1,6 +1,10 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+#include "dtoa.h"
 
 #define SHAPEFILE_TYPE_NULL         0
 #define SHAPEFILE_TYPE_POINT        1
@@ -17,14 +21,92 @@
 #define SHAPEFILE_TYPE_MULTIPOINT_M 28
 #define SHAPEFILE_TYPE_MULTIPATCH   31
 
+#define SHAPEFILE_PART_TRIANGLE_STRIP 0
+#define SHAPEFILE_PART_TRIANGLE_FAN   1
+#define SHAPEFILE_PART_OUTER_RING     2
+#define SHAPEFILE_PART_INNER_RING     3
+#define SHAPEFILE_PART_FIRST_RING     4
+#define SHAPEFILE_PART_RING           5
+
+#define SHAPEFILE_WKB_2D 0x01 //!< Leave Z and M out of WKB.
+
+//M values below this mean there's no measure
+#define SHAPEFILE_M_NO_DATA -1e38
+
+//EPSG codes of the projections that can be detected from a .prj and reprojected between
+#define SHAPEFILE_CRS_UNKNOWN      0
+#define SHAPEFILE_CRS_WGS84        4326
+#define SHAPEFILE_CRS_WEB_MERCATOR 3857
+#define SHAPEFILE_CRS_UTM_NORTH    32600 //!< Plus the zone from 1 to 60.
+#define SHAPEFILE_CRS_UTM_SOUTH    32700 //!< Plus the zone from 1 to 60.
+
+//.dbf field types
+#define SHAPEFILE_FIELD_CHARACTER 'C'
+#define SHAPEFILE_FIELD_NUMERIC   'N'
+#define SHAPEFILE_FIELD_FLOAT     'F'
+#define SHAPEFILE_FIELD_DATE      'D'
+#define SHAPEFILE_FIELD_LOGICAL   'L'
+#define SHAPEFILE_FIELD_MEMO      'M'
+
 typedef struct shapefile_t shapefile_t;
 typedef struct shapefile_shape_t shapefile_shape_t;
+typedef struct shapefile_record_t shapefile_record_t;
+typedef struct shapefile_geojson_t shapefile_geojson_t;
+typedef struct shapefile_writer_t shapefile_writer_t;
+typedef struct shapefile_simplify_t shapefile_simplify_t;
+
+typedef struct {
+    double x;
+    double y;
+} shapefile_point_t;
+
+typedef struct {
+    double min_x;
+    double min_y;
+    double max_x;
+    double max_y;
+} shapefile_mbr_t;
+
+typedef struct {
+    struct {
+        double min;
+        double max;
+    } z;
+    struct {
+        double min;
+        double max;
+    } m;
+} shapefile_range_t;
+
+typedef struct {
+    char name[11];
+    char type;                  //one of SHAPEFILE_FIELD_*
+    unsigned int length;        //width in the record
+    unsigned int decimals;
+} shapefile_field_t;
 
 typedef struct {
     bool (*shape)(shapefile_shape_t *shape, void *user_data);
     void *user_data;
 } shapefile_parse_cb_t;
 
+//changes count points, and their Z values when z isn't NULL, in place. returning false fails the shape. with
+//shapefile_parse_parallel() it's called from every thread at once
+typedef struct {
+    bool (*transform)(shapefile_point_t *points, double *z, size_t count, void *user_data);
+    void *user_data;
+} shapefile_transform_t;
+
+//x' = ax + by + c and y' = dx + ey + f, for shapefile_transform_affine()
+typedef struct {
+    double a;
+    double b;
+    double c;
+    double d;
+    double e;
+    double f;
+} shapefile_affine_t;
+
 /*****************************************************************************
  * shapefile
  ****************************************************************************/
@@ -32,11 +114,239 @@ typedef struct {
 shapefile_t * shapefile_init();
 void shapefile_free(shapefile_t *shapefile);
 
+//files are memory mapped by default, and read through a large buffer when disabled or when mapping fails
+void shapefile_set_mmap(shapefile_t *shapefile, bool enabled);
+
+//off by default. when on, the shapes passed to callbacks are borrowed from one scratch shape per thread that grows as
+//needed and is reused for every record, so parsing doesn't allocate. shapefile_get_shape() still allocates
+void shapefile_set_reuse(shapefile_t *shapefile, bool enabled);
+
+//off by default. when on, every decoded shape's coordinates have to be finite and inside the bounding box and Z range
+//in its record, or reading it fails
+void shapefile_set_validate(shapefile_t *shapefile, bool enabled);
+
+//decoded shapes are reprojected in place from the file's projection to crs, and then passed through the transform,
+//before anything else sees them. the projection is read from the .prj when the file is opened, unless set with
+//shapefile_set_source_crs(), and opening fails if crs is set but the file's projection isn't known. boxes and ranges
+//are recomputed after transforming, but the filter and index still work in the file's own coordinates
+void shapefile_set_crs(shapefile_t *shapefile, int crs);
+void shapefile_set_source_crs(shapefile_t *shapefile, int crs);
+void shapefile_set_transform(shapefile_t *shapefile, const shapefile_transform_t *transform);
+int shapefile_crs(shapefile_t *shapefile);
+
+//the built in transforms, which can also be used on their own. longitude and latitude are x and y in degrees
+bool shapefile_reproject(shapefile_point_t *points, size_t count, int from, int to);
+bool shapefile_transform_affine(shapefile_point_t *points, double *z, size_t count, void *user_data);
+
+//when set, parsing only calls back with shapes whose bounding boxes touch mbr. the rest are skipped after reading
+//just their boxes, or aren't read at all when shapefile_parse_cb() finds a .rtx from shapefile_save_index() that
+//shapefile_load_index() accepts for this version of the shapefile. NULL turns it off
+void shapefile_set_filter(shapefile_t *shapefile, const shapefile_mbr_t *mbr);
+
 bool shapefile_parse_cb(shapefile_t *shapefile, const char *path, shapefile_parse_cb_t *cb);
 
+//random access through the .shx. shapes are numbered from 0 and returned ones must be freed with shapefile_shape_free()
+bool shapefile_open(shapefile_t *shapefile, const char *path);
+void shapefile_close(shapefile_t *shapefile);
+unsigned int shapefile_count(shapefile_t *shapefile);
+shapefile_shape_t * shapefile_get_shape(shapefile_t *shapefile, unsigned int index);
+
+//walks an open shapefile in record order, handing back each shape with its .dbf record, or a NULL record when there's
+//no .dbf. both are borrowed until the next call. returns false at the end, when shapefile_error() is empty, or on error
+bool shapefile_next(shapefile_t *shapefile, shapefile_shape_t **shape, shapefile_record_t **record);
+void shapefile_rewind(shapefile_t *shapefile);
+
+//a packed Hilbert R-tree over the bounding boxes of an open shapefile's records, which can be saved next to the .shp
+//as a .rtx and loaded back instead of being built again. a .rtx saved for another version of the shapefile, with a
+//different record count, length or bounding box, isn't loaded. a query gives the indices of every shape whose box
+//touches mbr in increasing order, for shapefile_get_shape(), and they're good until the next query
+bool shapefile_build_index(shapefile_t *shapefile);
+bool shapefile_save_index(shapefile_t *shapefile);
+bool shapefile_load_index(shapefile_t *shapefile);
+bool shapefile_query(shapefile_t *shapefile, const shapefile_mbr_t *mbr, const uint32_t **indices, unsigned int *count);
+
+//decodes on threads, splitting the records by their .shx offsets. cbs has one callback per thread, each called only
+//from its own thread with that thread's share of the records. the ordered version instead calls cb from the calling
+//thread in record order. returning false from a callback stops the parse
+bool shapefile_parse_parallel(shapefile_t *shapefile, const char *path, unsigned int threads, shapefile_parse_cb_t *cbs);
+bool shapefile_parse_parallel_ordered(shapefile_t *shapefile, const char *path, unsigned int threads, shapefile_parse_cb_t *cb);
+
 const char * shapefile_error(shapefile_t *shapefile);
 
+/*****************************************************************************
+ * shapefile_record
+ *
+ * The attributes of one feature from the .dbf that shapefile_open() opens
+ * next to the .shp, if there is one. Records are slices of the file that
+ * aren't decoded until a field is asked for, and are only good until the
+ * next record is read from the same shapefile_t.
+ *
+ * Fields are numbered from 0 in the order of the .dbf, or in the order they
+ * were passed to shapefile_select_fields(), which projects the table down to
+ * just those fields so nothing else is looked at. Character fields are
+ * trimmed on the right and everything else on both sides. The typed getters
+ * return false when the field is out of range, empty (NULL) or can't be
+ * parsed as that type.
+ ****************************************************************************/
+
+bool shapefile_select_fields(shapefile_t *shapefile, const char * const *names, unsigned int count);
+unsigned int shapefile_num_fields(shapefile_t *shapefile);
+const shapefile_field_t * shapefile_field(shapefile_t *shapefile, unsigned int index);
+int shapefile_field_index(shapefile_t *shapefile, const char *name);
+
+unsigned int shapefile_num_records(shapefile_t *shapefile);
+shapefile_record_t * shapefile_get_record(shapefile_t *shapefile, unsigned int index);
+
+unsigned int shapefile_record_index(shapefile_record_t *record);
+bool shapefile_record_deleted(shapefile_record_t *record);
+bool shapefile_record_is_null(shapefile_record_t *record, unsigned int field);
+const char * shapefile_record_raw(shapefile_record_t *record, unsigned int field, size_t *len);
+size_t shapefile_record_string(shapefile_record_t *record, unsigned int field, char *dst, size_t size);
+bool shapefile_record_int64(shapefile_record_t *record, unsigned int field, int64_t *value);
+bool shapefile_record_double(shapefile_record_t *record, unsigned int field, double *value);
+bool shapefile_record_date(shapefile_record_t *record, unsigned int field, int *year, int *month, int *day);
+bool shapefile_record_bool(shapefile_record_t *record, unsigned int field, bool *value);
+
 /*****************************************************************************
  * shapefile_shape
+ *
+ * A shape passed to a callback is only good until the callback returns, and
+ * one from shapefile_get_shape() is the caller's. Polylines and polygons are
+ * made of parts, each a run of the points array starting at its index in the
+ * parts array; a polygon's parts are rings, clockwise for the outside and
+ * counterclockwise for holes. Points and multipoints have no parts.
+ *
+ * Z and M values are separate arrays lined up with the points, NULL when the
+ * shape doesn't have them. M is optional in every type except PointM, so a
+ * Z or M shape can still have a NULL M array, and M values below
+ * SHAPEFILE_M_NO_DATA mean there's no measure. Each part of a MultiPatch
+ * has a SHAPEFILE_PART_* type.
  ****************************************************************************/
+
+int shapefile_shape_type(shapefile_shape_t *shape);
+const shapefile_mbr_t * shapefile_shape_mbr(shapefile_shape_t *shape);
+const shapefile_range_t * shapefile_shape_range(shapefile_shape_t *shape);
+
+unsigned int shapefile_shape_num_parts(shapefile_shape_t *shape);
+unsigned int shapefile_shape_num_points(shapefile_shape_t *shape);
+const int32_t * shapefile_shape_parts(shapefile_shape_t *shape);
+const shapefile_point_t * shapefile_shape_points(shapefile_shape_t *shape);
+const double * shapefile_shape_z(shapefile_shape_t *shape);
+const double * shapefile_shape_m(shapefile_shape_t *shape);
+const int32_t * shapefile_shape_part_types(shapefile_shape_t *shape);
+const shapefile_point_t * shapefile_shape_part(shapefile_shape_t *shape, unsigned int index, unsigned int *count);
+
+//appends the shape to wkt, with each number rounded to precision places after the decimal point, or DTOA_SHORTEST
+//for as many digits as it takes to read back exactly. shapefile_shape_wkt() is the same with DTOA_SHORTEST, but
+//returns a string that has to be freed
+bool shapefile_shape_wkt_write(shapefile_shape_t *shape, buffer_t *wkt, int precision);
 char * shapefile_shape_wkt(shapefile_shape_t *shape);
+
+//appends the shape as WKB in the machine's byte order, so 2D coordinates are copied out in one go. Z and M get the
+//ISO type codes, or PostGIS's flags and the SRID for EWKB, where an SRID of 0 is left out. SHAPEFILE_WKB_2D drops Z
+//and M for readers like MySQL that don't take them. Null shapes are an empty GEOMETRYCOLLECTION
+bool shapefile_shape_wkb_write(shapefile_shape_t *shape, buffer_t *wkb, int flags);
+bool shapefile_shape_ewkb_write(shapefile_shape_t *shape, buffer_t *wkb, uint32_t srid, int flags);
+
+//appends the shape as a GeoJSON geometry, or null for Null shapes. M is dropped, polygon rings are reversed to
+//RFC 7946's winding, and NaN or infinite coordinates are written as null
+bool shapefile_shape_geojson_write(shapefile_shape_t *shape, buffer_t *json, int precision);
+
+void shapefile_shape_free(shapefile_shape_t *shape);
+
+/*****************************************************************************
+ * shapefile_geojson
+ *
+ * Streams a GeoJSON FeatureCollection into a buffer_t one feature at a time,
+ * so it can be flushed to a file or socket between features. Each feature's
+ * properties are the record's selected fields: numbers, booleans and dates
+ * are written as themselves, everything else as strings, and NULLs as null.
+ * A feature without a record has null properties. shapefile_geojson_finish()
+ * closes the collection.
+ ****************************************************************************/
+
+shapefile_geojson_t * shapefile_geojson_init(buffer_t *json, int precision);
+void shapefile_geojson_free(shapefile_geojson_t *geojson);
+
+bool shapefile_geojson_feature(shapefile_geojson_t *geojson, shapefile_shape_t *shape, shapefile_record_t *record);
+bool shapefile_geojson_finish(shapefile_geojson_t *geojson);
+
+/*****************************************************************************
+ * shapefile_writer
+ *
+ * Writes a .shp and .shx, plus a .dbf when fields were added before
+ * shapefile_writer_open(). Output is gathered into large chunks that are each
+ * written with a single write, and the headers are written again on close
+ * with the final lengths and bounds, so nothing is on disk until then.
+ *
+ * Shapes can be passed as read or as bare arrays, where the writer's type
+ * decides which arrays are used. Z types need Z values and write M only when
+ * given some, while M types write no data when M is NULL. A shape's record
+ * starts out NULL in every field; set its fields and then write the shape.
+ * Characters are left justified and everything else right justified, and a
+ * value that doesn't fit is an error. shapefile_writer_set_record() copies
+ * the fields of a record read from a shapefile with the same fields, as set
+ * up by shapefile_writer_copy_fields().
+ ****************************************************************************/
+
+shapefile_writer_t * shapefile_writer_init();
+void shapefile_writer_free(shapefile_writer_t *writer);
+
+bool shapefile_writer_add_field(shapefile_writer_t *writer, const char *name, char type, unsigned int length, unsigned int decimals);
+bool shapefile_writer_copy_fields(shapefile_writer_t *writer, shapefile_t *shapefile);
+
+bool shapefile_writer_open(shapefile_writer_t *writer, const char *path_prefix, int32_t type);
+bool shapefile_writer_close(shapefile_writer_t *writer);
+
+bool shapefile_writer_write(shapefile_writer_t *writer, shapefile_shape_t *shape);
+bool shapefile_writer_write_parts(shapefile_writer_t *writer, const int32_t *parts, const int32_t *part_types, int32_t num_parts,
+                                  const shapefile_point_t *points, const double *z, const double *m, int32_t num_points);
+bool shapefile_writer_write_null(shapefile_writer_t *writer);
+
+bool shapefile_writer_set_string(shapefile_writer_t *writer, unsigned int field, const char *value);
+bool shapefile_writer_set_int64(shapefile_writer_t *writer, unsigned int field, int64_t value);
+bool shapefile_writer_set_double(shapefile_writer_t *writer, unsigned int field, double value);
+bool shapefile_writer_set_date(shapefile_writer_t *writer, unsigned int field, int year, int month, int day);
+bool shapefile_writer_set_bool(shapefile_writer_t *writer, unsigned int field, bool value);
+bool shapefile_writer_set_null(shapefile_writer_t *writer, unsigned int field);
+void shapefile_writer_set_deleted(shapefile_writer_t *writer, bool deleted);
+bool shapefile_writer_set_record(shapefile_writer_t *writer, shapefile_record_t *record);
+
+uint32_t shapefile_writer_count(shapefile_writer_t *writer);
+const char * shapefile_writer_error(shapefile_writer_t *writer);
+
+/*****************************************************************************
+ * shapefile_simplify
+ *
+ * Simplifies decoded polylines and polygons in place, one part at a time,
+ * by moving the kept points down in the shape's own arrays along with their
+ * Z and M and then bringing its box and ranges up to date. Douglas-Peucker's
+ * tolerance is a distance, and Visvalingam-Whyatt's is the area a point has
+ * to make with its neighbors to stay. The ends of every part are always kept.
+ * Points, multipoints and MultiPatches are left alone.
+ *
+ * Without SHAPEFILE_SIMPLIFY_KEEP_PARTS, rings that are left with fewer than
+ * four points are dropped, along with the holes of a dropped outer ring, so
+ * a polygon can end up with no parts at all. With it, those rings keep the
+ * points farthest from what's left until they're a triangle again. With
+ * SHAPEFILE_SIMPLIFY_KEEP_WINDING, a ring that simplifying would turn inside
+ * out or flatten is left as it was, so outer rings never become holes.
+ *
+ * The scratch space grows to the largest part seen and is reused, so one
+ * simplifier per thread can go through every shape of every zoom level.
+ ****************************************************************************/
+
+#define SHAPEFILE_SIMPLIFY_DOUGLAS_PEUCKER 0
+#define SHAPEFILE_SIMPLIFY_VISVALINGAM     1
+
+#define SHAPEFILE_SIMPLIFY_KEEP_PARTS   0x01
+#define SHAPEFILE_SIMPLIFY_KEEP_WINDING 0x02
+
+//returns NULL for an unknown method or when out of memory
+shapefile_simplify_t * shapefile_simplify_init(int method, double tolerance, int flags);
+void shapefile_simplify_free(shapefile_simplify_t *simplify);
+
+void shapefile_simplify_set_tolerance(shapefile_simplify_t *simplify, double tolerance);
+
+//returns false only when out of memory, and the shape is left as it was
+bool shapefile_simplify_shape(shapefile_simplify_t *simplify, shapefile_shape_t *shape);
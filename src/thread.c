@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#if defined(_WIN32)
+# include <Windows.h>
+#else
+# include <pthread.h>
+#endif
+#include "thread.h"
+
+struct thread_t {
+#if defined(_WIN32)
+    HANDLE handle;
+#else
+    pthread_t thread;
+#endif
+    void * (*func)(void *);
+    void *arg;
+    void *ret;
+};
+
+#if defined(_WIN32)
+static DWORD WINAPI
+thread_main(LPVOID param) {
+    thread_t *thread;
+
+    thread = param;
+    thread->ret = thread->func(thread->arg);
+
+    return 0;
+}
+#endif
+
+thread_t *
+thread_create(void * (*func)(void *), void *arg) {
+    thread_t *thread;
+
+    thread = calloc(1, sizeof(*thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+
+    thread->func = func;
+    thread->arg = arg;
+
+#if defined(_WIN32)
+    thread->handle = CreateThread(NULL, 0, thread_main, thread, 0, NULL);
+    if (thread->handle == NULL) {
+        free(thread);
+        return NULL;
+    }
+#else
+    if (pthread_create(&thread->thread, NULL, func, arg) != 0) {
+        free(thread);
+        return NULL;
+    }
+#endif
+
+    return thread;
+}
+
+void *
+thread_join(thread_t *thread) {
+    void *ret;
+
+#if defined(_WIN32)
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    ret = thread->ret;
+#else
+    pthread_join(thread->thread, &ret);
+#endif
+
+    free(thread);
+
+    return ret;
+}
+
+unsigned long
+thread_id() {
+#if defined(_WIN32)
+    return (unsigned long)GetCurrentThreadId();
+#else
+    return (unsigned long)pthread_self();
+#endif
+}
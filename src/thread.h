@@ -0,0 +1,8 @@
+#pragma once
+
+typedef struct thread_t thread_t;
+
+thread_t * thread_create(void * (*func)(void *), void *arg);
+void * thread_join(thread_t *thread);
+
+unsigned long thread_id();
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "../src/scott.h"
+#include "test.h"
+#include "buffer.h"
+
+#define MODULE "buffer"
+
+//true if the buffer holds exactly expected
+static bool
+buffer_test_equals(buffer_t *buffer, const char *expected) {
+    size_t len;
+
+    len = strlen(expected);
+
+    return buffer_length(buffer) == len && (len == 0 || memcmp(buffer_data(buffer), expected, len) == 0);
+}
+
+static int
+buffer_test_remove(void *user_data) {
+    buffer_t *buffer;
+    int failures = 0;
+
+    buffer = buffer_init();
+    if (buffer == NULL || !buffer_write_str(buffer, "hello there world")) {
+        test_printf(MODULE, "Out of memory");
+        buffer_free(buffer);
+        return 1;
+    }
+
+    //more is left than was removed, so all of it has to move down
+    if (buffer_remove(buffer, 6) != 6 || !buffer_test_equals(buffer, "there world")) {
+        test_printf(MODULE, "Expected 'there world' after removing 6 bytes, but got %zu bytes", buffer_length(buffer));
+        failures++;
+    }
+
+    if (buffer_remove(buffer, 0) != 0 || !buffer_test_equals(buffer, "there world")) {
+        test_printf(MODULE, "Removing nothing changed the buffer");
+        failures++;
+    }
+
+    if (buffer_remove(buffer, 100) != 11 || buffer_length(buffer) != 0) {
+        test_printf(MODULE, "Expected removing too much to empty the buffer, but %zu bytes are left", buffer_length(buffer));
+        failures++;
+    }
+
+    buffer_free(buffer);
+
+    return failures;
+}
+
+static int
+buffer_test_write(void *user_data) {
+    unsigned char *dst;
+    buffer_t *buffer;
+    int failures = 0;
+
+    buffer = buffer_init();
+    if (buffer == NULL) {
+        test_printf(MODULE, "Out of memory");
+        return 1;
+    }
+
+    //written in place, then cut back
+    dst = buffer_write_str(buffer, "abc") ? buffer_reserve(buffer, 4096) : NULL;
+    if (dst == NULL) {
+        test_printf(MODULE, "Out of memory");
+        failures++;
+    }
+    else {
+        memcpy(dst, "defg", 4);
+        buffer_commit(buffer, 4);
+        if (!buffer_test_equals(buffer, "abcdefg")) {
+            test_printf(MODULE, "Expected 'abcdefg' after committing 4 bytes");
+            failures++;
+        }
+
+        buffer_truncate(buffer, 10);
+        buffer_truncate(buffer, 2);
+        if (!buffer_test_equals(buffer, "ab")) {
+            test_printf(MODULE, "Expected 'ab' after truncating, but got %zu bytes", buffer_length(buffer));
+            failures++;
+        }
+    }
+
+    buffer_free(buffer);
+
+    return failures;
+}
+
+int
+buffer_test() {
+    int count;
+
+    count = test_run(MODULE, 1, "Remove", buffer_test_remove, NULL) +
+            test_run(MODULE, 2, "Write In Place And Truncate", buffer_test_write, NULL);
+
+    return count;
+}
@@ -0,0 +1,1152 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include "../src/scott.h"
+#include "test.h"
+#include "db.h"
+
+#define MODULE "db"
+
+#define DB_TEST_THREADS    8
+#define DB_TEST_POOL_MAX   4
+#define DB_TEST_ITERATIONS 50
+
+//the tests run against a local mysqld or MariaDB given by these environment variables
+typedef struct {
+    const char *host;
+    const char *user;
+    const char *password;
+    const char *database;
+    unsigned int port;
+} db_test_config_t;
+
+typedef struct {
+    db_pool_t *pool;
+    int failures;
+} db_test_thread_t;
+
+static bool
+db_test_config(db_test_config_t *config) {
+    const char *port;
+
+    config->host = getenv("LIBSCOTT_DB_HOST");
+    config->user = getenv("LIBSCOTT_DB_USER");
+    config->password = getenv("LIBSCOTT_DB_PASSWORD");
+    config->database = getenv("LIBSCOTT_DB_DATABASE");
+
+    port = getenv("LIBSCOTT_DB_PORT");
+    config->port = port == NULL ? 3306 : (unsigned int)strtoul(port, NULL, 10);
+
+    if (config->host == NULL) {
+        test_printf(MODULE, "Skipping, LIBSCOTT_DB_HOST is not set");
+        return false;
+    }
+
+    return true;
+}
+
+static db_pool_t *
+db_test_pool(db_test_config_t *config, unsigned int min, unsigned int max) {
+    db_pool_t *pool;
+
+    pool = db_pool_init(min, max);
+    if (pool == NULL) {
+        test_printf(MODULE, "Out of memory");
+        return NULL;
+    }
+
+    if (!db_pool_connect(pool, config->host, config->user, config->password, config->database, config->port)) {
+        test_printf(MODULE, "Error connecting: %s", db_pool_error(pool));
+        db_pool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+static int
+db_test_pool_affinity(void *user_data) {
+    db_test_config_t config;
+    db_pool_t *pool;
+    db_t *first, *second;
+    bool success = true;
+
+    if (!db_test_config(&config)) {
+        return 0;
+    }
+
+    pool = db_test_pool(&config, 2, 2);
+    if (pool == NULL) {
+        return 1;
+    }
+
+    first = db_pool_checkout(pool);
+    if (first == NULL) {
+        test_printf(MODULE, "Error checking out: %s", db_pool_error(pool));
+        success = false;
+    }
+
+    if (success) {
+        db_pool_return(pool, first);
+
+        second = db_pool_checkout(pool);
+        if (second != first) {
+            test_printf(MODULE, "Expected the same connection back on the same thread");
+            success = false;
+        }
+
+        if (second != NULL) {
+            db_pool_return(pool, second);
+        }
+    }
+
+    db_pool_free(pool);
+
+    return success ? 0 : 1;
+}
+
+static void *
+db_test_pool_thread(void *user_data) {
+    db_test_thread_t *thread;
+    db_result_t *result;
+    unsigned int i;
+    db_t *db;
+
+    thread = user_data;
+
+    for (i = 0; i < DB_TEST_ITERATIONS; i++) {
+        db = db_pool_checkout(thread->pool);
+        if (db == NULL) {
+            test_printf(MODULE, "Error checking out: %s", db_pool_error(thread->pool));
+            thread->failures++;
+            continue;
+        }
+
+        result = db_selectf(db, "SELECT %u", i);
+        if (result == NULL) {
+            test_printf(MODULE, "Error selecting: %s", db_error(db));
+            thread->failures++;
+        }
+        else {
+            if (!db_result_next(result) || strtoul(db_result_str(result, 0), NULL, 10) != i) {
+                test_printf(MODULE, "Expected %u back", i);
+                thread->failures++;
+            }
+
+            db_result_free(result);
+        }
+
+        db_pool_return(thread->pool, db);
+    }
+
+    return NULL;
+}
+
+static int
+db_test_pool_threads(void *user_data) {
+    db_test_thread_t threads[DB_TEST_THREADS];
+    pthread_t ids[DB_TEST_THREADS];
+    db_test_config_t config;
+    db_pool_t *pool;
+    unsigned int i;
+    int failures = 0;
+
+    if (!db_test_config(&config)) {
+        return 0;
+    }
+
+    pool = db_test_pool(&config, 1, DB_TEST_POOL_MAX);
+    if (pool == NULL) {
+        return 1;
+    }
+
+    for (i = 0; i < DB_TEST_THREADS; i++) {
+        threads[i].pool = pool;
+        threads[i].failures = 0;
+        pthread_create(&ids[i], NULL, db_test_pool_thread, &threads[i]);
+    }
+
+    for (i = 0; i < DB_TEST_THREADS; i++) {
+        pthread_join(ids[i], NULL);
+        failures += threads[i].failures;
+    }
+
+    if (db_pool_size(pool) > DB_TEST_POOL_MAX) {
+        test_printf(MODULE, "Expected at most %u connections, but got %u", DB_TEST_POOL_MAX, db_pool_size(pool));
+        failures++;
+    }
+
+    db_pool_free(pool);
+
+    return failures;
+}
+
+static int
+db_test_stmt(void *user_data) {
+    db_test_config_t config;
+    db_stmt_t *stmt;
+    unsigned int i;
+    bool success;
+    db_t *db;
+
+    if (!db_test_config(&config)) {
+        return 0;
+    }
+
+    db = db_init();
+    success = db_connect(db, config.host, config.user, config.password, config.database, config.port);
+    if (!success) {
+        test_printf(MODULE, "Error connecting: %s", db_error(db));
+    }
+
+    if (success) {
+        success = db_queryf(db, "CREATE TEMPORARY TABLE libscott_stmt (id BIGINT, value DOUBLE, name VARCHAR(255))");
+    }
+
+    for (i = 0; success && i < 10; i++) {
+        stmt = db_prepare(db, "INSERT INTO libscott_stmt (id, value, name) VALUES (?, ?, ?)");
+        success = stmt != NULL &&
+                  db_stmt_bind_int64(stmt, 0, i) &&
+                  db_stmt_bind_double(stmt, 1, i * 1.5) &&
+                  db_stmt_bind_str(stmt, 2, "a name that is longer than the initial column buffer of sixty four bytes") &&
+                  db_stmt_execute(stmt);
+    }
+
+    if (success) {
+        stmt = db_prepare(db, "SELECT id, value, name FROM libscott_stmt WHERE id >= ? ORDER BY id");
+        success = stmt != NULL && db_stmt_bind_int64(stmt, 0, 5) && db_stmt_execute(stmt);
+
+        for (i = 5; success && db_stmt_next(stmt); i++) {
+            if (db_stmt_int64(stmt, 0) != i || db_stmt_double(stmt, 1) != i * 1.5 || strlen(db_stmt_str(stmt, 2)) != 72) {
+                test_printf(MODULE, "Row %u came back wrong", i);
+                success = false;
+            }
+        }
+
+        if (success && i != 10) {
+            test_printf(MODULE, "Expected 5 rows, but got %u", i - 5);
+            success = false;
+        }
+    }
+
+    if (!success) {
+        test_printf(MODULE, "Error: %s", db_error(db));
+    }
+
+    db_free(db);
+
+    return success ? 0 : 1;
+}
+
+static int
+db_test_mock_results(void *user_data) {
+    db_result_t *result;
+    db_mock_t *mock;
+    db_cache_t *cache;
+    unsigned int i;
+    bool success;
+    db_t *db;
+
+    mock = db_mock_init();
+    cache = db_cache_init(64 * 1024);
+    db = db_init_driver(db_mock_driver(), mock);
+
+    success = mock != NULL && cache != NULL && db != NULL &&
+              db_mock_result(mock, "SELECT id", 0, "id:integer,name", "1\tone\n2\t\\N\n") &&
+              db_connect(db, "mock", NULL, NULL, NULL, 0);
+    if (!success) {
+        test_printf(MODULE, "Error setting up the mock");
+    }
+
+    if (success) {
+        db_set_cache(db, cache);
+
+        //the second select comes from the cache and never reaches the driver
+        for (i = 0; success && i < 2; i++) {
+            result = db_select_cached(db, "names", "SELECT id, name FROM names", 26);
+            success = result != NULL &&
+                      db_result_column_type(result, 0) == DB_TYPE_INTEGER &&
+                      db_result_next(result) && db_result_int64(result, 0) == 1 && strcmp(db_result_str(result, 1), "one") == 0 &&
+                      db_result_next(result) && db_result_int64(result, 0) == 2 && db_result_is_null(result, 1) &&
+                      !db_result_next(result);
+
+            if (result != NULL) {
+                db_result_free(result);
+            }
+        }
+
+        if (!success) {
+            test_printf(MODULE, "The rows came back wrong: %s", db_error(db));
+        }
+        else if (db_mock_queries(mock) != 1 || db_cache_hits(cache) != 1) {
+            test_printf(MODULE, "Expected 1 query and 1 cache hit, but got %llu and %llu", db_mock_queries(mock), db_cache_hits(cache));
+            success = false;
+        }
+    }
+
+    db_free(db);
+    db_cache_free(cache);
+    db_mock_free(mock);
+
+    return success ? 0 : 1;
+}
+
+static int
+db_test_mock_batch(void *user_data) {
+    db_batch_t *batch = NULL;
+    char query[256];
+    db_mock_t *mock;
+    bool success;
+    db_t *db;
+
+    mock = db_mock_init();
+    db = db_init_driver(db_mock_driver(), mock);
+
+    success = mock != NULL && db != NULL &&
+              db_mock_result(mock, "SELECT @@max_allowed_packet", 0, "packet:integer", "65536") &&
+              db_connect(db, "mock", NULL, NULL, NULL, 0);
+    if (success) {
+        batch = db_batch_init(db, "names", "id, name", DB_BATCH_INSERT);
+        success = batch != NULL &&
+                  db_batch_row(batch) && db_batch_int64(batch, 1) && db_batch_str(batch, "it's") &&
+                  db_batch_row(batch) && db_batch_int64(batch, 2) && db_batch_null(batch) &&
+                  db_batch_flush(batch);
+    }
+
+    if (!success) {
+        test_printf(MODULE, "Error: %s", db == NULL ? "Out of memory" : db_error(db));
+    }
+    else {
+        db_mock_last_query(mock, query, sizeof(query));
+        //one query for max_allowed_packet and one for both rows
+        if (db_mock_queries(mock) != 2 || strcmp(query, "INSERT INTO names (id, name) VALUES (1,'it\\'s'),(2,NULL)") != 0) {
+            test_printf(MODULE, "Unexpected query: %s (%llu queries)", query, db_mock_queries(mock));
+            success = false;
+        }
+    }
+
+    if (batch != NULL) {
+        db_batch_free(batch);
+    }
+
+    db_free(db);
+    db_mock_free(mock);
+
+    return success ? 0 : 1;
+}
+
+static int
+db_test_mock_reconnect(void *user_data) {
+    db_result_t *result;
+    db_mock_t *mock;
+    db_pool_t *pool;
+    bool success;
+    db_t *db;
+
+    mock = db_mock_init();
+    pool = db_pool_init(1, 1);
+
+    success = mock != NULL && pool != NULL &&
+              db_mock_result(mock, "SELECT", 0, "value:integer", "1") &&
+              db_mock_error(mock, "SELECT 'gone'", 0, DB_MOCK_ERROR_LOST, "Server has gone away");
+    if (success) {
+        db_pool_set_driver(pool, db_mock_driver(), mock);
+        success = db_pool_connect(pool, "mock", NULL, NULL, NULL, 0);
+    }
+
+    if (success) {
+        db = db_pool_checkout(pool);
+        success = db != NULL && db_selectf(db, "SELECT 'gone'") == NULL;
+        if (db != NULL) {
+            db_pool_return(pool, db);
+        }
+
+        //the lost connection is reopened on the next checkout
+        db = db_pool_checkout(pool);
+        result = db == NULL ? NULL : db_selectf(db, "SELECT 1");
+        success = success && result != NULL && db_result_next(result) && db_result_int64(result, 0) == 1;
+
+        if (result != NULL) {
+            db_result_free(result);
+        }
+        if (db != NULL) {
+            db_pool_return(pool, db);
+        }
+    }
+
+    if (success && db_mock_connects(mock) != 2) {
+        test_printf(MODULE, "Expected 2 connects, but got %llu", db_mock_connects(mock));
+        success = false;
+    }
+    else if (!success) {
+        test_printf(MODULE, "Error: %s", pool == NULL ? "Out of memory" : db_pool_error(pool));
+    }
+
+    db_pool_free(pool);
+    db_mock_free(mock);
+
+    return success ? 0 : 1;
+}
+
+static int
+db_test_mock_pool_connect(void *user_data) {
+    db_mock_t *mock;
+    db_pool_t *pool;
+    db_t *db, *second;
+    bool success;
+
+    mock = db_mock_init();
+    pool = db_pool_init(1, 1);
+
+    success = mock != NULL && pool != NULL;
+    if (!success) {
+        test_printf(MODULE, "Out of memory");
+    }
+
+    if (success) {
+        db_pool_set_driver(pool, db_mock_driver(), mock);
+        db_pool_set_timeout(pool, 50);
+
+        //a failed connect can be retried, but a successful one can't be repeated
+        db_mock_set_connect_error(mock, "Access denied");
+        success = !db_pool_connect(pool, "mock", "user", "wrong", NULL, 0);
+        db_mock_set_connect_error(mock, NULL);
+        success = success && db_pool_connect(pool, "mock", "user", "right", NULL, 0) &&
+                  !db_pool_connect(pool, "mock", "user", "right", NULL, 0) && strstr(db_pool_error(pool), "already") != NULL &&
+                  db_pool_size(pool) == 1;
+        if (!success) {
+            test_printf(MODULE, "Connecting again didn't work as expected: %s", db_pool_error(pool));
+        }
+    }
+
+    if (success) {
+        db = db_pool_checkout(pool);
+        second = db == NULL ? NULL : db_pool_checkout(pool);
+        if (db == NULL || second != NULL || strstr(db_pool_error(pool), "Timed out") == NULL) {
+            test_printf(MODULE, "Expected the second checkout to time out, but got '%s'", db_pool_error(pool));
+            success = false;
+        }
+
+        if (second != NULL) {
+            db_pool_return(pool, second);
+        }
+        if (db != NULL) {
+            db_pool_return(pool, db);
+        }
+    }
+
+    db_pool_free(pool);
+    db_mock_free(mock);
+
+    return success ? 0 : 1;
+}
+
+static int
+db_test_mock_stream(void *user_data) {
+    db_result_t *result;
+    db_mock_t *mock;
+    unsigned int count;
+    bool success;
+    db_t *db;
+
+    mock = db_mock_init();
+    db = db_init_driver(db_mock_driver(), mock);
+
+    success = mock != NULL && db != NULL &&
+              db_mock_result(mock, "SELECT n", 0, "n:integer", "1\n2\n3\n4\n5\n") &&
+              db_connect(db, "mock", NULL, NULL, NULL, 0);
+    if (!success) {
+        test_printf(MODULE, "Error setting up the mock");
+        db_free(db);
+        db_mock_free(mock);
+        return 1;
+    }
+
+    //every row in order, then the end of the rows rather than an error
+    result = db_select_stream(db, "SELECT n FROM numbers", 21);
+    count = 0;
+    while (result != NULL && db_result_next(result)) {
+        if (db_result_int64(result, 0) != ++count) {
+            break;
+        }
+    }
+
+    if (result == NULL || count != 5 || db_result_failed(result)) {
+        test_printf(MODULE, "Expected 5 streamed rows, but got %u: %s", count, db_error(db));
+        success = false;
+    }
+
+    //the connection belongs to the stream until it's freed
+    if (result != NULL) {
+        if (db_queryf(db, "UPDATE numbers SET n = 0") || strstr(db_error(db), "busy") == NULL ||
+            db_selectf(db, "SELECT n FROM numbers") != NULL) {
+            test_printf(MODULE, "Expected queries to be refused while the stream is open, but got '%s'", db_error(db));
+            success = false;
+        }
+
+        db_result_free(result);
+    }
+
+    if (!db_queryf(db, "UPDATE numbers SET n = 0")) {
+        test_printf(MODULE, "Error querying after the stream was freed: %s", db_error(db));
+        success = false;
+    }
+
+    //freeing after two rows throws away the rest and gives the connection back
+    result = db_select_stream(db, "SELECT n FROM numbers", 21);
+    if (result == NULL || !db_result_next(result) || !db_result_next(result) || db_result_int64(result, 0) != 2) {
+        test_printf(MODULE, "Error reading the first two rows: %s", db_error(db));
+        success = false;
+    }
+
+    if (result != NULL) {
+        db_result_free(result);
+    }
+
+    result = db_selectf(db, "SELECT n FROM numbers");
+    if (result == NULL || !db_result_next(result) || db_result_int64(result, 0) != 1) {
+        test_printf(MODULE, "Error selecting after freeing a stream early: %s", db_error(db));
+        success = false;
+    }
+
+    if (result != NULL) {
+        db_result_free(result);
+    }
+
+    //losing the connection in the middle is a failure, not the end of the rows
+    result = db_select_stream(db, "SELECT n FROM numbers", 21);
+    if (result != NULL) {
+        db_result_next(result);
+        db_disconnect(db);
+        if (db_result_next(result) || !db_result_failed(result)) {
+            test_printf(MODULE, "Expected the stream to fail after disconnecting");
+            success = false;
+        }
+
+        db_result_free(result);
+    }
+    else {
+        test_printf(MODULE, "Error streaming: %s", db_error(db));
+        success = false;
+    }
+
+    db_free(db);
+    db_mock_free(mock);
+
+    return success ? 0 : 1;
+}
+
+typedef struct {
+    unsigned int rows;
+    unsigned int succeeded;
+    unsigned int failed;
+    unsigned int cancelled;
+    int failures;
+} db_test_async_t;
+
+static void
+db_test_async_cb(bool success, db_result_t *result, const char *error, void *user_data) {
+    db_test_async_t *async = user_data;
+
+    if (success) {
+        async->succeeded++;
+        while (result != NULL && db_result_next(result)) {
+            async->rows++;
+        }
+    }
+    else if (error != NULL && strcmp(error, "Cancelled") == 0) {
+        async->cancelled++;
+    }
+    else if (error != NULL && strstr(error, "syntax") != NULL && result == NULL) {
+        async->failed++;
+    }
+    else {
+        test_printf(MODULE, "Unexpected error: %s", error == NULL ? "NULL" : error);
+        async->failures++;
+    }
+
+    if (result != NULL) {
+        db_result_free(result);
+    }
+}
+
+static int
+db_test_mock_async(void *user_data) {
+    db_test_async_t results;
+    struct pollfd pfd;
+    db_async_t *async = NULL;
+    db_mock_t *mock;
+    db_pool_t *pool;
+    unsigned int i, waits;
+    bool success;
+
+    memset(&results, 0, sizeof(results));
+
+    mock = db_mock_init();
+    pool = db_pool_init(1, 4);
+
+    success = mock != NULL && pool != NULL &&
+              db_mock_result(mock, "SELECT", 20000, "n:integer", "1\n2\n") &&
+              db_mock_result(mock, "INSERT", 20000, NULL, NULL) &&
+              db_mock_error(mock, "SELECT bad", 20000, 1064, "You have an error in your SQL syntax") &&
+              db_mock_result(mock, "SELECT SLEEP", 200000, "n:integer", "1");
+    if (success) {
+        db_pool_set_driver(pool, db_mock_driver(), mock);
+        success = db_pool_connect(pool, "mock", NULL, NULL, NULL, 0);
+    }
+    if (success) {
+        async = db_async_init(pool, 3);
+        success = async != NULL && db_async_fd(async) >= 0;
+    }
+
+    if (!success) {
+        test_printf(MODULE, "Error setting up: %s", pool == NULL ? "Out of memory" : db_pool_error(pool));
+        db_async_free(async);
+        db_pool_free(pool);
+        db_mock_free(mock);
+        return 1;
+    }
+
+    //three selects, two inserts and a bad select, all in flight at once
+    for (i = 0; success && i < 3; i++) {
+        success = db_async_select(async, "SELECT n FROM numbers", 21, db_test_async_cb, &results);
+    }
+    for (i = 0; success && i < 2; i++) {
+        success = db_async_query(async, "INSERT INTO numbers VALUES (3)", 30, db_test_async_cb, &results);
+    }
+    success = success && db_async_select(async, "SELECT bad", 10, db_test_async_cb, &results);
+
+    if (!success || db_async_pending(async) == 0) {
+        test_printf(MODULE, "Error submitting the queries");
+        success = false;
+    }
+
+    //the fd wakes the loop up as they finish
+    pfd.fd = db_async_fd(async);
+    pfd.events = POLLIN;
+    for (waits = 0; success && db_async_pending(async) > 0 && waits < 100; waits++) {
+        if (poll(&pfd, 1, 100) > 0) {
+            db_async_process(async);
+        }
+    }
+
+    if (db_async_pending(async) != 0 || results.succeeded != 5 || results.rows != 6 || results.failed != 1 || results.failures != 0) {
+        test_printf(MODULE, "Expected 5 successes with 6 rows and 1 failure, but got %u with %u rows and %u (%u pending)",
+                    results.succeeded, results.rows, results.failed, db_async_pending(async));
+        success = false;
+    }
+
+    //more than the threads can take, so freeing has to wait for some and cancel the rest
+    memset(&results, 0, sizeof(results));
+    for (i = 0; success && i < 6; i++) {
+        success = db_async_select(async, "SELECT SLEEP(0.2)", 17, db_test_async_cb, &results);
+    }
+
+    db_async_free(async);
+
+    if (results.succeeded + results.cancelled != 6 || results.cancelled == 0 || results.failures != 0) {
+        test_printf(MODULE, "Expected 6 callbacks with some cancelled, but got %u successes and %u cancelled", results.succeeded, results.cancelled);
+        success = false;
+    }
+
+    db_pool_free(pool);
+    db_mock_free(mock);
+
+    return success ? 0 : 1;
+}
+
+static int
+db_test_mock_load(void *user_data) {
+    static const char blob[] = {'x', '\0', 'y', '\r'};
+    static const unsigned char bytes[] = {0x01, 0xab};
+    db_batch_t *batch = NULL;
+    unsigned long long queries;
+    char query[256];
+    db_mock_t *mock;
+    unsigned int i;
+    bool success;
+    db_t *db;
+
+    mock = db_mock_init();
+    db = db_init_driver(db_mock_driver(), mock);
+
+    success = mock != NULL && db != NULL && db_connect(db, "mock", NULL, NULL, NULL, 0);
+    if (!success) {
+        test_printf(MODULE, "Error setting up the mock");
+        db_free(db);
+        db_mock_free(mock);
+        return 1;
+    }
+
+    //tabs, newlines, backslashes, NULs and carriage returns are escaped, so the only newlines are between rows.
+    //"1\ta\\tb\\nc\\\\d\tx\\0y\\r\t0.5\n" is 24 bytes and "2\t\\N\t\\N\t\\N\n" is 11
+    batch = db_batch_init(db, "things", "id, name, data, price", DB_BATCH_LOAD_DATA);
+    success = batch != NULL &&
+              db_batch_row(batch) && db_batch_int64(batch, 1) && db_batch_str(batch, "a\tb\nc\\d") &&
+              db_batch_blob(batch, blob, sizeof(blob)) && db_batch_double(batch, 0.5) &&
+              db_batch_row(batch) && db_batch_int64(batch, 2) && db_batch_null(batch) &&
+              db_batch_blob(batch, NULL, 0) && db_batch_double(batch, 0.0 / 0.0) &&
+              db_batch_flush(batch);
+
+    db_mock_last_query(mock, query, sizeof(query));
+    if (!success || db_mock_loaded_rows(mock) != 2 || db_mock_loaded_bytes(mock) != 35 || db_batch_count(batch) != 2 ||
+        strncmp(query, "LOAD DATA LOCAL INFILE", 22) != 0) {
+        test_printf(MODULE, "Expected 2 rows and 35 bytes loaded, but got %llu and %llu: %s",
+                    db_mock_loaded_rows(mock), db_mock_loaded_bytes(mock), db_error(db));
+        success = false;
+    }
+
+    //3 rows at a time makes 4 loads for 10 rows
+    queries = db_mock_queries(mock);
+    if (batch != NULL) {
+        db_batch_set_limits(batch, 3, 0);
+        for (i = 0; success && i < 10; i++) {
+            success = db_batch_row(batch) && db_batch_int64(batch, i);
+        }
+        success = success && db_batch_flush(batch);
+    }
+
+    if (!success || db_mock_queries(mock) - queries != 4 || db_mock_loaded_rows(mock) != 12) {
+        test_printf(MODULE, "Expected 4 loads under the row limit, but got %llu", db_mock_queries(mock) - queries);
+        success = false;
+    }
+
+    //"100000\n" plus room for the row's separators is 10 bytes, so with a 10 byte limit every row goes on its own
+    queries = db_mock_queries(mock);
+    if (batch != NULL) {
+        db_batch_set_limits(batch, 0, 10);
+        for (i = 0; success && i < 5; i++) {
+            success = db_batch_row(batch) && db_batch_int64(batch, 100000 + i);
+        }
+        success = success && db_batch_flush(batch);
+    }
+
+    if (!success || db_mock_queries(mock) - queries != 5 || db_mock_loaded_bytes(mock) != 35 + 20 + 35) {
+        test_printf(MODULE, "Expected 5 loads under the byte limit, but got %llu", db_mock_queries(mock) - queries);
+        success = false;
+    }
+
+    if (batch != NULL) {
+        db_batch_free(batch);
+    }
+
+    //blobs are hex literals and doubles read back exactly in an INSERT, and NaN can't be stored
+    batch = db_batch_init(db, "things", "data, price", DB_BATCH_INSERT);
+    success = success && batch != NULL &&
+              db_batch_row(batch) && db_batch_blob(batch, bytes, sizeof(bytes)) && db_batch_double(batch, 0.1) &&
+              db_batch_row(batch) && db_batch_blob(batch, NULL, 0) && db_batch_double(batch, 1.0 / 0.0) &&
+              db_batch_flush(batch);
+
+    db_mock_last_query(mock, query, sizeof(query));
+    if (!success || strcmp(query, "INSERT INTO things (data, price) VALUES (X'01AB',0.10000000000000001),(NULL,NULL)") != 0) {
+        test_printf(MODULE, "Unexpected query: %s", query);
+        success = false;
+    }
+
+    if (batch != NULL) {
+        db_batch_free(batch);
+    }
+
+    //a string that can't be escaped without a connection leaves the row as it was
+    batch = db_batch_init(db, "things", "id, name", DB_BATCH_INSERT);
+    success = success && batch != NULL && db_batch_row(batch) && db_batch_int64(batch, 1);
+    if (success) {
+        db_disconnect(db);
+        if (db_batch_str(batch, "a") || strcmp(db_error(db), "Not connected") != 0) {
+            test_printf(MODULE, "Expected the string to fail without a connection, but got '%s'", db_error(db));
+            success = false;
+        }
+    }
+
+    success = success && db_connect(db, "mock", NULL, NULL, NULL, 0) && db_batch_str(batch, "a") && db_batch_flush(batch);
+
+    db_mock_last_query(mock, query, sizeof(query));
+    if (!success || strcmp(query, "INSERT INTO things (id, name) VALUES (1,'a')") != 0) {
+        test_printf(MODULE, "Unexpected query after the failed string: %s", query);
+        success = false;
+    }
+
+    if (batch != NULL) {
+        db_batch_free(batch);
+    }
+
+    db_free(db);
+    db_mock_free(mock);
+
+    return success ? 0 : 1;
+}
+
+//each thread gets its own builder, so one begun here isn't the one the main thread is using
+static void *
+db_test_sql_thread(void *user_data) {
+    return db_sql_begin(user_data);
+}
+
+static int
+db_test_mock_sql(void *user_data) {
+    static const char str[] = "it's a \"back\\slash\"\0and\n";
+    static const char expected[] = "it\\'s a \\\"back\\\\slash\\\"\\0and\\n";
+    static const unsigned char bytes[] = {0x00, 0x7f, 0xff};
+    db_sql_t *sql, *other;
+    db_result_t *result;
+    pthread_t thread;
+    buffer_t *buffer;
+    char query[256];
+    const char *data;
+    db_mock_t *mock;
+    bool success;
+    size_t len;
+    db_t *db;
+
+    mock = db_mock_init();
+    db = db_init_driver(db_mock_driver(), mock);
+
+    //starts with less room than the escaped string needs, so it has to grow
+    buffer = buffer_init_ex(4);
+
+    success = mock != NULL && db != NULL && buffer != NULL &&
+              db_mock_result(mock, "SELECT name", 0, "name", "one\n") &&
+              db_connect(db, "mock", NULL, NULL, NULL, 0);
+    if (!success) {
+        test_printf(MODULE, "Error setting up the mock");
+        buffer_free(buffer);
+        db_free(db);
+        db_mock_free(mock);
+        return 1;
+    }
+
+    //quotes, backslashes, NULs and newlines are escaped, and appending twice keeps the first
+    success = buffer_write_str(buffer, "x") && db_escape_into(db, buffer, str, sizeof(str) - 1) &&
+              db_escape_into(db, buffer, "", 0) && buffer_write_char(buffer, '\0');
+    if (!success || strncmp((const char *)buffer_data(buffer), "x", 1) != 0 || strcmp((const char *)buffer_data(buffer) + 1, expected) != 0 ||
+        buffer_length(buffer) != sizeof(expected) + 1) {
+        test_printf(MODULE, "Unexpected escaping: %s", success ? (const char *)buffer_data(buffer) : db_error(db));
+        success = false;
+    }
+
+    sql = db_sql_begin(db);
+    success = success && sql != NULL &&
+              db_sql_append(sql, "INSERT INTO t VALUES (") && db_sql_int64(sql, -42) && db_sql_append_len(sql, ",", 1) &&
+              db_sql_str(sql, "O'Brien\\") && db_sql_append_len(sql, ",", 1) && db_sql_str(sql, NULL) && db_sql_append_len(sql, ",", 1) &&
+              db_sql_blob(sql, bytes, sizeof(bytes)) && db_sql_append_len(sql, ",", 1) && db_sql_blob(sql, NULL, 0) && db_sql_append_len(sql, ",", 1) &&
+              db_sql_double(sql, 0.1) && db_sql_append_len(sql, ",", 1) && db_sql_double(sql, -1.0 / 0.0) && db_sql_append_len(sql, ",", 1) &&
+              db_sql_null(sql) && db_sql_append(sql, ")") &&
+              db_sql_query(sql);
+
+    db_mock_last_query(mock, query, sizeof(query));
+    if (!success || strcmp(query, "INSERT INTO t VALUES (-42,'O\\'Brien\\\\',NULL,X'007FFF',NULL,0.10000000000000001,NULL,NULL)") != 0) {
+        test_printf(MODULE, "Unexpected query: %s", success ? query : db_error(db));
+        success = false;
+    }
+
+    //beginning again on the same thread reuses the builder and throws away what was there
+    other = db_sql_begin(db);
+    success = success && other == sql &&
+              db_sql_append(other, "SELECT name FROM t WHERE name = ") && db_sql_str(other, "one");
+    data = success ? db_sql_data(other, &len) : NULL;
+    if (!success || len != 37 || strncmp(data, "SELECT name FROM t WHERE name = 'one'", len) != 0) {
+        test_printf(MODULE, "Expected the builder to be reused and cleared");
+        success = false;
+    }
+
+    result = success ? db_sql_select(other) : NULL;
+    if (result == NULL || !db_result_next(result) || strcmp(db_result_str(result, 0), "one") != 0) {
+        test_printf(MODULE, "The select came back wrong: %s", db_error(db));
+        success = false;
+    }
+
+    if (result != NULL) {
+        db_result_free(result);
+    }
+
+    other = NULL;
+    if (pthread_create(&thread, NULL, db_test_sql_thread, db) != 0 || pthread_join(thread, (void **)&other) != 0 ||
+        other == NULL || other == sql) {
+        test_printf(MODULE, "Expected another thread to get its own builder");
+        success = false;
+    }
+
+    //nothing can be escaped or sent without a connection
+    db_disconnect(db);
+    buffer_clear(buffer);
+    sql = db_sql_begin(db);
+    if (db_escape_into(db, buffer, "a", 1) || sql == NULL || db_sql_str(sql, "a") || db_sql_query(sql)) {
+        test_printf(MODULE, "Expected escaping to fail once disconnected");
+        success = false;
+    }
+
+    buffer_free(buffer);
+    db_free(db);
+    db_mock_free(mock);
+
+    return success ? 0 : 1;
+}
+
+typedef struct {
+    unsigned int calls;
+    uint64_t rows;
+    char query[64];
+} db_test_slow_t;
+
+static void
+db_test_slow_cb(db_t *db, const char *query, unsigned int len, const db_timings_t *timings, void *user_data) {
+    db_test_slow_t *slow;
+
+    slow = user_data;
+    ++slow->calls;
+    slow->rows = timings->rows;
+    snprintf(slow->query, sizeof(slow->query), "%.*s", (int)len, query);
+}
+
+static int
+db_test_mock_metrics(void *user_data) {
+    db_metrics_t metrics;
+    db_result_t *result;
+    db_test_slow_t slow;
+    uint64_t total = 0, slower = 0;
+    db_mock_t *mock;
+    unsigned int i;
+    bool success;
+    db_t *db;
+
+    memset(&slow, 0, sizeof(slow));
+
+    mock = db_mock_init();
+    db = db_init_driver(db_mock_driver(), mock);
+
+    //20ms is well over the 10ms threshold and lands in the histogram's 2^14 microsecond bucket or later
+    success = mock != NULL && db != NULL &&
+              db_mock_result(mock, "SELECT", 0, "id:integer,name", "1\tab\n2\t\\N\n3\tcde\n") &&
+              db_mock_result(mock, "SELECT slow", 20000, "id:integer", "1\n2\n3\n") &&
+              db_mock_result(mock, "UPDATE slow", 20000, "n", "") &&
+              db_mock_error(mock, "BAD", 0, 1064, "You have an error in your SQL syntax") &&
+              db_connect(db, "mock", NULL, NULL, NULL, 0);
+    if (!success) {
+        test_printf(MODULE, "Error setting up the mock");
+        db_free(db);
+        db_mock_free(mock);
+        return 1;
+    }
+
+    db_set_metrics(db, true);
+    db_set_slow_query(db, 10, db_test_slow_cb, &slow);
+
+    //only the two rows that are read count towards the bytes, "1" "ab" "2" and a NULL
+    result = db_select(db, "SELECT id, name FROM t", 22);
+    success = result != NULL && db_result_next(result) && db_result_next(result);
+    if (result != NULL) {
+        db_result_free(result);
+    }
+
+    success = success && db_query(db, "INSERT INTO t VALUES (1)", 24) && !db_query(db, "BAD", 3);
+    if (!success || slow.calls != 0) {
+        test_printf(MODULE, "Expected the fast queries to run without calling the slow hook: %s", db_error(db));
+        success = false;
+    }
+
+    success = success && db_query(db, "UPDATE slow SET n = 1", 21);
+    if (!success || slow.calls != 1 || strcmp(slow.query, "UPDATE slow SET n = 1") != 0) {
+        test_printf(MODULE, "Expected the slow hook to be called for the update, but got %u calls: %s", slow.calls, slow.query);
+        success = false;
+    }
+
+    result = success ? db_select(db, "SELECT slow", 11) : NULL;
+    if (result == NULL || slow.calls != 2 || slow.rows != 3 || strcmp(slow.query, "SELECT slow") != 0) {
+        test_printf(MODULE, "Expected the slow hook to be called with 3 rows, but got %u calls and %llu rows",
+                    slow.calls, (unsigned long long)slow.rows);
+        success = false;
+    }
+
+    //a buffered result's bytes aren't counted until it's freed
+    db_metrics(db, &metrics);
+    if (result != NULL) {
+        while (db_result_next(result)) {
+        }
+        db_result_free(result);
+    }
+
+    if (success && metrics.bytes != 4) {
+        test_printf(MODULE, "Expected 4 bytes before the slow select was freed, but got %llu", (unsigned long long)metrics.bytes);
+        success = false;
+    }
+
+    db_metrics(db, &metrics);
+    for (i = 0; i < DB_METRICS_BUCKETS; i++) {
+        total += metrics.histogram[i];
+        if (i >= 14) {
+            slower += metrics.histogram[i];
+        }
+    }
+
+    if (success && (metrics.queries != 3 || metrics.selects != 2 || metrics.errors != 1 || metrics.rows != 6 || metrics.bytes != 7 ||
+                    total != 5 || slower != 2 || metrics.exec_ns < 40000000)) {
+        test_printf(MODULE, "Unexpected metrics: %llu queries, %llu selects, %llu errors, %llu rows, %llu bytes, %llu in the histogram",
+                    (unsigned long long)metrics.queries, (unsigned long long)metrics.selects, (unsigned long long)metrics.errors,
+                    (unsigned long long)metrics.rows, (unsigned long long)metrics.bytes, (unsigned long long)total);
+        success = false;
+    }
+
+    //once reset and turned off nothing is counted, but the slow hook still works on its own
+    db_metrics_reset(db);
+    db_set_metrics(db, false);
+    success = success && db_query(db, "UPDATE slow SET n = 2", 21) && !db_query(db, "BAD", 3);
+
+    db_metrics(db, &metrics);
+    if (!success || metrics.queries != 0 || metrics.errors != 0 || metrics.exec_ns != 0 || slow.calls != 3) {
+        test_printf(MODULE, "Expected nothing to be counted once metrics were off, and 3 slow calls, but got %u", slow.calls);
+        success = false;
+    }
+
+    //a threshold above the latency never calls it
+    db_set_slow_query(db, 1000, db_test_slow_cb, &slow);
+    success = success && db_query(db, "UPDATE slow SET n = 3", 21);
+    if (!success || slow.calls != 3) {
+        test_printf(MODULE, "Expected the slow hook not to be called under its threshold");
+        success = false;
+    }
+
+    //a buffered result can still be read and freed after its connection is gone
+    db_set_metrics(db, true);
+    result = db_select(db, "SELECT id, name FROM t", 22);
+    db_free(db);
+
+    if (result == NULL || !db_result_next(result) || strcmp(db_result_str(result, 1), "ab") != 0) {
+        test_printf(MODULE, "Expected the result to outlive its connection");
+        success = false;
+    }
+
+    if (result != NULL) {
+        db_result_free(result);
+    }
+
+    db_mock_free(mock);
+
+    return success ? 0 : 1;
+}
+
+//checks every accessor against the two rows db_test_mock_types() sets up
+static bool
+db_test_types_check(db_result_t *result) {
+    static const int types[] = {DB_TYPE_INTEGER, DB_TYPE_FLOAT, DB_TYPE_DECIMAL, DB_TYPE_STRING, DB_TYPE_BLOB, DB_TYPE_TEMPORAL, DB_TYPE_NULL, DB_TYPE_STRING};
+    const void *blob;
+    unsigned long len;
+    unsigned int i;
+
+    if (db_result_columns(result) != 8 || strcmp(db_result_column_name(result, 4), "data") != 0) {
+        return false;
+    }
+
+    for (i = 0; i < 8; i++) {
+        if (db_result_column_type(result, i) != types[i]) {
+            return false;
+        }
+    }
+
+    //a name used twice finds its first column
+    if (db_result_index(result, "id") != 0 || db_result_index(result, "at") != 5 || db_result_index(result, "missing") != -1) {
+        return false;
+    }
+
+    if (!db_result_next(result) ||
+        db_result_int64(result, 0) != -7 || db_result_double(result, 0) != -7.0 ||
+        db_result_double(result, 1) != 2.5 || db_result_int64(result, 1) != 2 ||
+        db_result_double(result, 2) != 12.25 || db_result_int64(result, 2) != 12 ||
+        db_result_len(result, 3) != 3 || strcmp(db_result_str(result, 3), "abc") != 0 ||
+        strcmp(db_result_str(result, 5), "2024-01-02") != 0 || !db_result_is_null(result, 6) || db_result_int64(result, 7) != 99) {
+        return false;
+    }
+
+    blob = db_result_blob(result, 4, &len);
+    if (blob == NULL || len != 5 || db_result_len(result, 4) != 5 || memcmp(blob, "x\0y\\z", 5) != 0) {
+        return false;
+    }
+
+    if (!db_result_next(result)) {
+        return false;
+    }
+
+    for (i = 0; i < 8; i++) {
+        if (!db_result_is_null(result, i) || db_result_int64(result, i) != 0 || db_result_double(result, i) != 0.0) {
+            return false;
+        }
+    }
+
+    len = 1;
+    blob = db_result_blob(result, 4, &len);
+
+    return blob == NULL && len == 0 && !db_result_next(result);
+}
+
+static int
+db_test_mock_types(void *user_data) {
+    db_result_t *result;
+    db_cache_t *cache;
+    db_mock_t *mock;
+    unsigned int i;
+    bool success;
+    db_t *db;
+
+    mock = db_mock_init();
+    cache = db_cache_init(64 * 1024);
+    db = db_init_driver(db_mock_driver(), mock);
+
+    success = mock != NULL && cache != NULL && db != NULL &&
+              db_mock_result(mock, "SELECT", 0, "id:integer,price:float,total:decimal,name,data:blob,at:temporal,nothing:null,id",
+                             "-7\t2.5\t12.25\tabc\tx\\0y\\\\z\t2024-01-02\t\\N\t99\n"
+                             "\\N\t\\N\t\\N\t\\N\t\\N\t\\N\t\\N\t\\N\n") &&
+              db_connect(db, "mock", NULL, NULL, NULL, 0);
+    if (!success) {
+        test_printf(MODULE, "Error setting up the mock");
+    }
+
+    if (success) {
+        db_set_cache(db, cache);
+
+        //straight from the driver, then copied into the cache, then from the cache
+        for (i = 0; success && i < 3; i++) {
+            result = i == 0 ? db_select(db, "SELECT * FROM t", 15) : db_select_cached(db, "t", "SELECT * FROM t", 15);
+            success = result != NULL && db_test_types_check(result);
+            if (!success) {
+                test_printf(MODULE, "The typed columns came back wrong on pass %u: %s", i + 1, db_error(db));
+            }
+
+            if (result != NULL) {
+                db_result_free(result);
+            }
+        }
+
+        if (success && db_cache_hits(cache) != 1) {
+            test_printf(MODULE, "Expected 1 cache hit, but got %llu", db_cache_hits(cache));
+            success = false;
+        }
+    }
+
+    db_free(db);
+    db_cache_free(cache);
+    db_mock_free(mock);
+
+    return success ? 0 : 1;
+}
+
+int
+db_test() {
+    int count;
+
+    count = test_run(MODULE, 1, "Pool Thread Affinity", db_test_pool_affinity, NULL) +
+            test_run(MODULE, 2, "Pool With More Threads Than Connections", db_test_pool_threads, NULL) +
+            test_run(MODULE, 3, "Prepared Statements", db_test_stmt, NULL) +
+            test_run(MODULE, 4, "Mock Results And Cache", db_test_mock_results, NULL) +
+            test_run(MODULE, 5, "Mock Batch Insert", db_test_mock_batch, NULL) +
+            test_run(MODULE, 6, "Mock Pool Reconnect", db_test_mock_reconnect, NULL) +
+            test_run(MODULE, 7, "Mock Pool Connect And Timeout", db_test_mock_pool_connect, NULL) +
+            test_run(MODULE, 8, "Mock Streaming", db_test_mock_stream, NULL) +
+            test_run(MODULE, 9, "Mock Async", db_test_mock_async, NULL) +
+            test_run(MODULE, 10, "Mock Batch Load Data And Limits", db_test_mock_load, NULL) +
+            test_run(MODULE, 11, "Mock Escaping And SQL Builder", db_test_mock_sql, NULL) +
+            test_run(MODULE, 12, "Mock Metrics And Slow Queries", db_test_mock_metrics, NULL) +
+            test_run(MODULE, 13, "Mock Typed Columns", db_test_mock_types, NULL);
+
+    return count;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int db_test();
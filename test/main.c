@@ -2,6 +2,8 @@
 #include "../src/scott.h"
 #include "test.h"
 #include "alist.h"
+#include "buffer.h"
+#include "db.h"
 #include "shapefile.h"
 
 #define MODULE "Main"
@@ -13,7 +15,9 @@ main(int argc, char **argv) {
     test_printf(MODULE, "Starting");
 
     //count = alist_test();
-    count = shapefile_test();
+    count = buffer_test();
+    count += shapefile_test();
+    count += db_test();
 
     test_printf(MODULE, "Done");
 
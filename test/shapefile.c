@@ -1,10 +1,57 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include "../src/scott.h"
+#include "../src/endian.h"
 #include "test.h"
 #include "shapefile.h"
 
 #define MODULE "shapefile"
 
+#define SHAPEFILE_TEST_PATH   "/tmp/libscott_shapefile_test"
+#define SHAPEFILE_TEST_POINTS 1000
+
+typedef struct {
+    unsigned int count;
+    int failures;
+    shapefile_shape_t *last;    //the shape from the last callback
+    unsigned int distinct;      //number of times the shape was a different one than last time
+} shapefile_test_points_t;
+
+typedef struct {
+    int32_t type;
+    int32_t num_parts;
+    int32_t parts[3];
+    int32_t num_points;
+    double coords[32];
+    const char *wkt;
+    const char *geojson;        //rings go the other way around
+    size_t wkb_size;
+} shapefile_test_poly_t;
+
+//a square with a square hole, then a second square, and lines and points using the same coordinates
+#define SHAPEFILE_TEST_SQUARES 0,0, 0,4, 4,4, 4,0, 0,0, 1,1, 3,1, 3,3, 1,3, 1,1, 5,5, 5,6, 6,6, 6,5, 5,5
+
+static const shapefile_test_poly_t shapefile_test_polys[] = {
+    {3, 1, {0},       3,  {0,0, 1,1, 2,0},       "LINESTRING(0 0, 1 1, 2 0)",
+                                                  "{\"type\":\"LineString\",\"coordinates\":[[0,0],[1,1],[2,0]]}", 57},
+    {3, 2, {0, 2},    4,  {0,0, 1,1, 5,5, 6,6},  "MULTILINESTRING((0 0, 1 1), (5 5, 6 6))",
+                                                  "{\"type\":\"MultiLineString\",\"coordinates\":[[[0,0],[1,1]],[[5,5],[6,6]]]}", 91},
+    {5, 2, {0, 5},    10, {SHAPEFILE_TEST_SQUARES}, "POLYGON((0 0, 0 4, 4 4, 4 0, 0 0), "
+                                                              "(1 1, 3 1, 3 3, 1 3, 1 1))",
+                                                  "{\"type\":\"Polygon\",\"coordinates\":[[[0,0],[4,0],[4,4],[0,4],[0,0]],"
+                                                                                     "[[1,1],[1,3],[3,3],[3,1],[1,1]]]}", 177},
+    {5, 3, {0, 5, 10}, 15, {SHAPEFILE_TEST_SQUARES}, "MULTIPOLYGON(((0 0, 0 4, 4 4, 4 0, 0 0), "
+                                                               "(1 1, 3 1, 3 3, 1 3, 1 1)), "
+                                                              "((5 5, 5 6, 6 6, 6 5, 5 5)))",
+                                                  "{\"type\":\"MultiPolygon\",\"coordinates\":[[[[0,0],[4,0],[4,4],[0,4],[0,0]],"
+                                                                                          "[[1,1],[1,3],[3,3],[3,1],[1,1]]],"
+                                                                                         "[[[5,5],[6,5],[6,6],[5,6],[5,5]]]]}", 279},
+    {8, 0, {0},       2,  {1,2, 3,4},            "MULTIPOINT((1 2), (3 4))",
+                                                  "{\"type\":\"MultiPoint\",\"coordinates\":[[1,2],[3,4]]}", 51}
+};
+
 static bool
 shapefile_shape(shapefile_shape_t *shape, void *user_data) {
     char *wkt;
@@ -38,11 +85,2240 @@ shapefile_test_main(void *user_data) {
     return success ? 0 : 1;
 }
 
+static bool
+shapefile_test_int32_be(buffer_t *buffer, int32_t value) {
+    return buffer_write_uint32(buffer, htobe32((uint32_t)value));
+}
+
+static bool
+shapefile_test_int32_le(buffer_t *buffer, int32_t value) {
+    return buffer_write_uint32(buffer, htole32((uint32_t)value));
+}
+
+static bool
+shapefile_test_double_le(buffer_t *buffer, double value) {
+    uint64_t data;
+
+    memcpy(&data, &value, sizeof(data));
+
+    return buffer_write_uint64(buffer, htole64(data));
+}
+
+static bool
+shapefile_test_header(buffer_t *buffer, int32_t type, size_t length) {
+    unsigned int i;
+    bool success;
+
+    success = shapefile_test_int32_be(buffer, 0x0000270a);
+    for (i = 0; i < 5; i++) {
+        success = success && shapefile_test_int32_be(buffer, 0);
+    }
+
+    success = success &&
+              shapefile_test_int32_be(buffer, (int32_t)(length / 2)) &&
+              shapefile_test_int32_le(buffer, 1000) &&
+              shapefile_test_int32_le(buffer, type);
+
+    for (i = 0; i < 8; i++) {
+        success = success && shapefile_test_double_le(buffer, 0.0);
+    }
+
+    return success;
+}
+
+//writes a .shp and .shx holding the given record contents, each of which starts with its shape type
+static bool
+shapefile_test_write(const char *path_prefix, int32_t type, buffer_t **records, unsigned int count) {
+    buffer_t *shp, *shx;
+    size_t shp_length;
+    unsigned int i;
+    char path[256];
+    bool success;
+    FILE *f;
+
+    shp = buffer_init();
+    shx = buffer_init();
+    success = shp != NULL && shx != NULL;
+
+    shp_length = 100;
+    for (i = 0; i < count; i++) {
+        shp_length += 8 + buffer_length(records[i]);
+    }
+
+    success = success &&
+              shapefile_test_header(shp, type, shp_length) &&
+              shapefile_test_header(shx, type, 100 + (8 * count));
+
+    for (i = 0; success && i < count; i++) {
+        success = shapefile_test_int32_be(shx, (int32_t)(buffer_length(shp) / 2)) &&
+                  shapefile_test_int32_be(shx, (int32_t)(buffer_length(records[i]) / 2)) &&
+                  shapefile_test_int32_be(shp, (int32_t)(i + 1)) &&
+                  shapefile_test_int32_be(shp, (int32_t)(buffer_length(records[i]) / 2)) &&
+                  buffer_write(shp, (unsigned char *)buffer_data(records[i]), buffer_length(records[i]));
+    }
+
+    snprintf(path, sizeof(path), "%s.shp", path_prefix);
+    f = success ? fopen(path, "wb") : NULL;
+    success = f != NULL && fwrite(buffer_data(shp), 1, buffer_length(shp), f) == buffer_length(shp);
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    snprintf(path, sizeof(path), "%s.shx", path_prefix);
+    f = success ? fopen(path, "wb") : NULL;
+    success = f != NULL && fwrite(buffer_data(shx), 1, buffer_length(shx), f) == buffer_length(shx);
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    buffer_free(shp);
+    buffer_free(shx);
+
+    return success;
+}
+
+static void
+shapefile_test_remove(const char *path_prefix) {
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s.shp", path_prefix);
+    remove(path);
+    snprintf(path, sizeof(path), "%s.shx", path_prefix);
+    remove(path);
+    snprintf(path, sizeof(path), "%s.dbf", path_prefix);
+    remove(path);
+    snprintf(path, sizeof(path), "%s.rtx", path_prefix);
+    remove(path);
+    snprintf(path, sizeof(path), "%s.prj", path_prefix);
+    remove(path);
+}
+
+static bool
+shapefile_test_points_shape(shapefile_shape_t *shape, void *user_data) {
+    shapefile_test_points_t *points;
+    char expected[64];
+    char *wkt;
+
+    points = user_data;
+
+    //the first y is -0, which WKT writes as 0
+    snprintf(expected, sizeof(expected), "POINT(%g %g)", points->count * 1.5, (points->count * -0.25) + 0.0);
+
+    wkt = shapefile_shape_wkt(shape);
+    if (wkt == NULL || strcmp(wkt, expected) != 0) {
+        test_printf(MODULE, "Expected %s, but got %s", expected, wkt == NULL ? "NULL" : wkt);
+        points->failures++;
+    }
+
+    free(wkt);
+    points->count++;
+
+    if (shape != points->last) {
+        points->distinct++;
+        points->last = shape;
+    }
+
+    return true;
+}
+
+//writes SHAPEFILE_TEST_POINTS points, the nth being (n * 1.5, n * -0.25)
+static bool
+shapefile_test_write_points() {
+    buffer_t *records[SHAPEFILE_TEST_POINTS];
+    unsigned int i;
+    bool success = true;
+
+    for (i = 0; i < SHAPEFILE_TEST_POINTS; i++) {
+        records[i] = buffer_init();
+        success = success && records[i] != NULL &&
+                  shapefile_test_int32_le(records[i], 1) &&
+                  shapefile_test_double_le(records[i], i * 1.5) &&
+                  shapefile_test_double_le(records[i], i * -0.25);
+    }
+
+    success = success && shapefile_test_write(SHAPEFILE_TEST_PATH, 1, records, SHAPEFILE_TEST_POINTS);
+    if (!success) {
+        test_printf(MODULE, "Error writing the test shapefile");
+    }
+
+    for (i = 0; i < SHAPEFILE_TEST_POINTS; i++) {
+        buffer_free(records[i]);
+    }
+
+    return success;
+}
+
+static int
+shapefile_test_points(void *user_data) {
+    shapefile_test_points_t points;
+    shapefile_parse_cb_t cb;
+    shapefile_t *file;
+    unsigned int pass;
+    int failures = 0;
+
+    if (!shapefile_test_write_points()) {
+        return 1;
+    }
+
+    //memory mapped and through the read buffer, each with and without reusing the shape
+    for (pass = 0; pass < 4; pass++) {
+        memset(&points, 0, sizeof(points));
+        cb.shape = shapefile_test_points_shape;
+        cb.user_data = &points;
+
+        file = shapefile_init();
+        shapefile_set_mmap(file, pass % 2 == 0);
+        shapefile_set_reuse(file, pass >= 2);
+
+        if (!shapefile_parse_cb(file, SHAPEFILE_TEST_PATH ".shp", &cb)) {
+            test_printf(MODULE, "Error parsing: %s", shapefile_error(file));
+            failures++;
+        }
+        else if (points.count != SHAPEFILE_TEST_POINTS) {
+            test_printf(MODULE, "Expected %u points, but got %u", SHAPEFILE_TEST_POINTS, points.count);
+            failures++;
+        }
+        else if (pass >= 2 && points.distinct != 1) {
+            test_printf(MODULE, "Expected every callback to get the same reused shape, but got %u different ones", points.distinct);
+            failures++;
+        }
+
+        failures += points.failures;
+        shapefile_free(file);
+    }
+
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+static int
+shapefile_test_random(void *user_data) {
+    const shapefile_point_t *point;
+    shapefile_shape_t *shape;
+    shapefile_t *file;
+    unsigned int i, pass;
+    int failures = 0;
+
+    if (!shapefile_test_write_points()) {
+        return 1;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        file = shapefile_init();
+        shapefile_set_mmap(file, pass == 0);
+
+        if (!shapefile_open(file, SHAPEFILE_TEST_PATH)) {
+            test_printf(MODULE, "Error opening: %s", shapefile_error(file));
+            shapefile_free(file);
+            failures++;
+            continue;
+        }
+
+        if (shapefile_count(file) != SHAPEFILE_TEST_POINTS) {
+            test_printf(MODULE, "Expected %u shapes, but got %u", SHAPEFILE_TEST_POINTS, shapefile_count(file));
+            failures++;
+        }
+
+        //backwards and skipping around, so nothing is read in order
+        for (i = SHAPEFILE_TEST_POINTS; i > 0; i -= 7) {
+            shape = shapefile_get_shape(file, i - 1);
+            if (shape == NULL) {
+                test_printf(MODULE, "Error getting shape %u: %s", i - 1, shapefile_error(file));
+                failures++;
+                break;
+            }
+
+            point = shapefile_shape_points(shape);
+            if (point->x != (i - 1) * 1.5 || point->y != (i - 1) * -0.25) {
+                test_printf(MODULE, "Shape %u is (%f, %f)", i - 1, point->x, point->y);
+                failures++;
+            }
+
+            shapefile_shape_free(shape);
+
+            if (i < 7) {
+                break;
+            }
+        }
+
+        if (shapefile_get_shape(file, SHAPEFILE_TEST_POINTS) != NULL) {
+            test_printf(MODULE, "Expected shape %u to be out of range", SHAPEFILE_TEST_POINTS);
+            failures++;
+        }
+
+        shapefile_close(file);
+        shapefile_free(file);
+    }
+
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+static bool
+shapefile_test_dbf_field(buffer_t *dbf, const char *name, char type, unsigned char length, unsigned char decimals) {
+    unsigned char field[32];
+
+    memset(field, 0, sizeof(field));
+    memcpy(field, name, strlen(name));
+    field[11] = (unsigned char)type;
+    field[16] = length;
+    field[17] = decimals;
+
+    return buffer_write(dbf, field, sizeof(field));
+}
+
+//NAME C(10), COUNT N(6), VALUE N(10,3), WHEN D and OK L for each of the test points. record 3 is deleted, and COUNT
+//in record 5, WHEN in record 6 and OK in record 7 are NULL
+static bool
+shapefile_test_write_dbf() {
+    unsigned char reserved[20];
+    char record[37], name[11], count[7], when[9];
+    buffer_t *dbf;
+    unsigned int i;
+    bool success;
+    FILE *f;
+
+    dbf = buffer_init();
+    success = dbf != NULL;
+
+    //version 3, last updated 2024-01-01
+    memset(reserved, 0, sizeof(reserved));
+    success = success &&
+              buffer_write(dbf, (unsigned char *)"\x03\x7c\x01\x01", 4) &&
+              shapefile_test_int32_le(dbf, SHAPEFILE_TEST_POINTS) &&
+              buffer_write_uint16(dbf, htole16(32 + (5 * 32) + 1)) &&
+              buffer_write_uint16(dbf, htole16(36)) &&
+              buffer_write(dbf, reserved, sizeof(reserved)) &&
+              shapefile_test_dbf_field(dbf, "NAME", 'C', 10, 0) &&
+              shapefile_test_dbf_field(dbf, "COUNT", 'N', 6, 0) &&
+              shapefile_test_dbf_field(dbf, "VALUE", 'N', 10, 3) &&
+              shapefile_test_dbf_field(dbf, "WHEN", 'D', 8, 0) &&
+              shapefile_test_dbf_field(dbf, "OK", 'L', 1, 0) &&
+              buffer_write(dbf, (unsigned char *)"\r", 1);
+
+    for (i = 0; success && i < SHAPEFILE_TEST_POINTS; i++) {
+        snprintf(name, sizeof(name), "pt%u", i);
+        snprintf(count, sizeof(count), "%u", i);
+        snprintf(when, sizeof(when), "2020%02u%02u", (i % 12) + 1, (i % 28) + 1);
+        if (i == 5) {
+            count[0] = '\0';
+        }
+        if (i == 6) {
+            when[0] = '\0';
+        }
+        snprintf(record, sizeof(record), "%c%-10s%6s%10.3f%8s%c", i == 3 ? '*' : ' ', name, count, i * 1.5, when, i == 7 ? '?' : (i % 2 == 0 ? 'F' : 'T'));
+
+        success = buffer_write(dbf, (unsigned char *)record, 36);
+    }
+
+    f = success ? fopen(SHAPEFILE_TEST_PATH ".dbf", "wb") : NULL;
+    success = f != NULL && fwrite(buffer_data(dbf), 1, buffer_length(dbf), f) == buffer_length(dbf);
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    buffer_free(dbf);
+
+    if (!success) {
+        test_printf(MODULE, "Error writing the test .dbf");
+    }
+
+    return success;
+}
+
+static int
+shapefile_test_attributes_record(shapefile_record_t *record, unsigned int i) {
+    char name[16], expected[16];
+    int year, month, day;
+    int64_t count;
+    double value;
+    bool ok;
+    int failures = 0;
+
+    snprintf(expected, sizeof(expected), "pt%u", i);
+    if (shapefile_record_string(record, 0, name, sizeof(name)) != strlen(expected) || strcmp(name, expected) != 0) {
+        test_printf(MODULE, "Record %u has NAME '%s'", i, name);
+        failures++;
+    }
+
+    if (shapefile_record_deleted(record) != (i == 3)) {
+        test_printf(MODULE, "Record %u has the wrong deleted flag", i);
+        failures++;
+    }
+
+    if (i == 5) {
+        if (!shapefile_record_is_null(record, 1) || shapefile_record_int64(record, 1, &count)) {
+            test_printf(MODULE, "Expected COUNT to be NULL in record %u", i);
+            failures++;
+        }
+    }
+    else if (!shapefile_record_int64(record, 1, &count) || count != (int64_t)i) {
+        test_printf(MODULE, "Record %u has the wrong COUNT", i);
+        failures++;
+    }
+
+    if (!shapefile_record_double(record, 2, &value) || value != i * 1.5) {
+        test_printf(MODULE, "Record %u has the wrong VALUE", i);
+        failures++;
+    }
+
+    if (i == 6) {
+        if (!shapefile_record_is_null(record, 3) || shapefile_record_date(record, 3, &year, &month, &day)) {
+            test_printf(MODULE, "Expected WHEN to be NULL in record %u", i);
+            failures++;
+        }
+    }
+    else if (!shapefile_record_date(record, 3, &year, &month, &day) || year != 2020 || month != (int)(i % 12) + 1 || day != (int)(i % 28) + 1) {
+        test_printf(MODULE, "Record %u has the wrong WHEN", i);
+        failures++;
+    }
+
+    if (i == 7) {
+        if (!shapefile_record_is_null(record, 4) || shapefile_record_bool(record, 4, &ok)) {
+            test_printf(MODULE, "Expected OK to be NULL in record %u", i);
+            failures++;
+        }
+    }
+    else if (!shapefile_record_bool(record, 4, &ok) || ok != (i % 2 == 1)) {
+        test_printf(MODULE, "Record %u has the wrong OK", i);
+        failures++;
+    }
+
+    return failures;
+}
+
+static int
+shapefile_test_attributes(void *user_data) {
+    static const char * const projection[] = {"ok", "NAME"};
+    static const char * const missing[] = {"missing"};
+    const shapefile_field_t *field;
+    const shapefile_point_t *point;
+    shapefile_record_t *record;
+    shapefile_shape_t *shape;
+    shapefile_t *file;
+    unsigned int i, pass;
+    char name[16];
+    size_t len;
+    bool ok;
+    int failures = 0;
+
+    if (!shapefile_test_write_points() || !shapefile_test_write_dbf()) {
+        return 1;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        file = shapefile_init();
+        shapefile_set_mmap(file, pass == 0);
+
+        if (!shapefile_open(file, SHAPEFILE_TEST_PATH)) {
+            test_printf(MODULE, "Error opening: %s", shapefile_error(file));
+            shapefile_free(file);
+            failures++;
+            continue;
+        }
+
+        field = shapefile_field(file, 2);
+        if (shapefile_num_fields(file) != 5 || shapefile_num_records(file) != SHAPEFILE_TEST_POINTS || field == NULL ||
+            strcmp(field->name, "VALUE") != 0 || field->type != SHAPEFILE_FIELD_NUMERIC || field->length != 10 || field->decimals != 3) {
+            test_printf(MODULE, "The .dbf header or field descriptors are wrong");
+            failures++;
+        }
+
+        if (shapefile_field_index(file, "when") != 3 || shapefile_field_index(file, "missing") != -1) {
+            test_printf(MODULE, "Field names aren't found correctly");
+            failures++;
+        }
+
+        //every shape comes back with its own record
+        i = 0;
+        while (shapefile_next(file, &shape, &record)) {
+            point = shapefile_shape_points(shape);
+            if (record == NULL || shapefile_record_index(record) != i || point->x != i * 1.5) {
+                test_printf(MODULE, "Shape %u was paired with the wrong record", i);
+                failures++;
+                break;
+            }
+
+            failures += shapefile_test_attributes_record(record, i);
+            i++;
+        }
+
+        if (shapefile_error(file)[0] != '\0' || i != SHAPEFILE_TEST_POINTS) {
+            test_printf(MODULE, "Expected %u records, but got %u: %s", SHAPEFILE_TEST_POINTS, i, shapefile_error(file));
+            failures++;
+        }
+
+        //only the projected fields, in the order they were asked for
+        if (!shapefile_select_fields(file, projection, 2)) {
+            test_printf(MODULE, "Error selecting fields: %s", shapefile_error(file));
+            failures++;
+        }
+        else {
+            record = shapefile_get_record(file, 10);
+            if (shapefile_num_fields(file) != 2 || strcmp(shapefile_field(file, 0)->name, "OK") != 0 || record == NULL ||
+                !shapefile_record_bool(record, 0, &ok) || ok || shapefile_record_string(record, 1, name, sizeof(name)) != 4 ||
+                strcmp(name, "pt10") != 0 || shapefile_record_raw(record, 2, &len) != NULL) {
+                test_printf(MODULE, "The projected record is wrong");
+                failures++;
+            }
+        }
+
+        if (shapefile_select_fields(file, missing, 1) ||
+            !shapefile_select_fields(file, NULL, 0) || shapefile_num_fields(file) != 5) {
+            test_printf(MODULE, "Selecting a missing field or resetting the projection didn't work");
+            failures++;
+        }
+
+        if (shapefile_get_record(file, SHAPEFILE_TEST_POINTS) != NULL) {
+            test_printf(MODULE, "Expected record %u to be out of range", SHAPEFILE_TEST_POINTS);
+            failures++;
+        }
+
+        shapefile_free(file);
+    }
+
+    //the .dbf is optional
+    remove(SHAPEFILE_TEST_PATH ".dbf");
+
+    file = shapefile_init();
+    if (!shapefile_open(file, SHAPEFILE_TEST_PATH) || !shapefile_next(file, &shape, &record) || record != NULL) {
+        test_printf(MODULE, "Expected a shapefile without a .dbf to open without records: %s", shapefile_error(file));
+        failures++;
+    }
+
+    shapefile_free(file);
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+//checks a query against every point, which is (n * 1.5, n * -0.25)
+static int
+shapefile_test_index_query(shapefile_t *file, const shapefile_mbr_t *mbr) {
+    const uint32_t *indices;
+    unsigned int count, i, j;
+    double x, y;
+
+    if (!shapefile_query(file, mbr, &indices, &count)) {
+        test_printf(MODULE, "Error querying: %s", shapefile_error(file));
+        return 1;
+    }
+
+    j = 0;
+    for (i = 0; i < SHAPEFILE_TEST_POINTS; i++) {
+        x = i * 1.5;
+        y = i * -0.25;
+
+        if (x < mbr->min_x || x > mbr->max_x || y < mbr->min_y || y > mbr->max_y) {
+            continue;
+        }
+
+        if (j >= count || indices[j] != i) {
+            test_printf(MODULE, "Querying (%f, %f, %f, %f) missed shape %u", mbr->min_x, mbr->min_y, mbr->max_x, mbr->max_y, i);
+            return 1;
+        }
+
+        j++;
+    }
+
+    if (j != count) {
+        test_printf(MODULE, "Querying (%f, %f, %f, %f) got %u shapes instead of %u", mbr->min_x, mbr->min_y, mbr->max_x, mbr->max_y, count, j);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+shapefile_test_index(void *user_data) {
+    shapefile_writer_t *writer;
+    shapefile_point_t point;
+    shapefile_mbr_t mbr;
+    shapefile_t *file;
+    bool success;
+    unsigned int i, pass, seed;
+    const uint32_t *indices;
+    unsigned char header[36];
+    unsigned int count;
+    int failures = 0;
+    FILE *f;
+
+    if (!shapefile_test_write_points()) {
+        return 1;
+    }
+
+    memset(&mbr, 0, sizeof(mbr));
+
+    //built and saved, then loaded back from the .rtx
+    for (pass = 0; pass < 2; pass++) {
+        file = shapefile_init();
+
+        if (!shapefile_open(file, SHAPEFILE_TEST_PATH)) {
+            test_printf(MODULE, "Error opening: %s", shapefile_error(file));
+            shapefile_free(file);
+            failures++;
+            continue;
+        }
+
+        if (pass == 0 && shapefile_query(file, &mbr, &indices, &count)) {
+            test_printf(MODULE, "Expected querying without an index to fail");
+            failures++;
+        }
+
+        if (pass == 0 ? !shapefile_build_index(file) || !shapefile_save_index(file) : !shapefile_load_index(file)) {
+            test_printf(MODULE, "Error %s the index: %s", pass == 0 ? "building" : "loading", shapefile_error(file));
+            shapefile_free(file);
+            failures++;
+            continue;
+        }
+
+        //everything, nothing, and a bunch of boxes all over the place
+        mbr.min_x = -1;
+        mbr.min_y = -1000;
+        mbr.max_x = 10000;
+        mbr.max_y = 1;
+        failures += shapefile_test_index_query(file, &mbr);
+
+        mbr.min_x = 10;
+        mbr.min_y = 10;
+        mbr.max_x = 20;
+        mbr.max_y = 20;
+        failures += shapefile_test_index_query(file, &mbr);
+
+        seed = 12345;
+        for (i = 0; i < 200 && failures == 0; i++) {
+            seed = (seed * 1103515245) + 12345;
+            mbr.min_x = (double)(seed % 1600) - 50;
+            seed = (seed * 1103515245) + 12345;
+            mbr.min_y = -(double)(seed % 260);
+            seed = (seed * 1103515245) + 12345;
+            mbr.max_x = mbr.min_x + (seed % 300);
+            seed = (seed * 1103515245) + 12345;
+            mbr.max_y = mbr.min_y + (seed % 60);
+            failures += shapefile_test_index_query(file, &mbr);
+        }
+
+        shapefile_free(file);
+    }
+
+    //the same number of points somewhere else makes the .rtx stale
+    writer = shapefile_writer_init();
+    success = writer != NULL && shapefile_writer_open(writer, SHAPEFILE_TEST_PATH, SHAPEFILE_TYPE_POINT);
+    for (i = 0; success && i < SHAPEFILE_TEST_POINTS; i++) {
+        point.x = i * 2.0;
+        point.y = i * -0.5;
+        success = shapefile_writer_write_parts(writer, NULL, NULL, 0, &point, NULL, NULL, 1);
+    }
+    success = success && shapefile_writer_close(writer);
+    shapefile_writer_free(writer);
+
+    file = shapefile_init();
+    if (!success || !shapefile_open(file, SHAPEFILE_TEST_PATH)) {
+        test_printf(MODULE, "Error rewriting the shapefile: %s", shapefile_error(file));
+        failures++;
+    }
+    else if (shapefile_load_index(file) || strstr(shapefile_error(file), "different version") == NULL) {
+        test_printf(MODULE, "Expected the stale index not to load, but got '%s'", shapefile_error(file));
+        failures++;
+    }
+
+    //just the header, claiming more items than any file could hold, is turned down before anything is allocated
+    f = fopen(SHAPEFILE_TEST_PATH ".rtx", "r+b");
+    success = f != NULL && fread(header, 1, sizeof(header), f) == sizeof(header);
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    header[8] = 0xff;
+    header[9] = 0xff;
+    header[10] = 0xff;
+    header[11] = 0x0f;
+    f = success ? fopen(SHAPEFILE_TEST_PATH ".rtx", "wb") : NULL;
+    success = f != NULL && fwrite(header, 1, sizeof(header), f) == sizeof(header);
+    if (f != NULL && fclose(f) != 0) {
+        success = false;
+    }
+
+    if (!success) {
+        test_printf(MODULE, "Error corrupting the .rtx");
+        failures++;
+    }
+    else if (shapefile_load_index(file) || strstr(shapefile_error(file), "truncated or corrupt") == NULL) {
+        test_printf(MODULE, "Expected the corrupt index not to load, but got '%s'", shapefile_error(file));
+        failures++;
+    }
+
+    shapefile_free(file);
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+static bool
+shapefile_test_poly_shape(shapefile_shape_t *shape, void *user_data) {
+    const shapefile_test_poly_t *poly;
+    const shapefile_point_t *points;
+    unsigned int count;
+    buffer_t *json;
+    int *failures;
+    char *wkt;
+
+    poly = ((void **)user_data)[0];
+    failures = ((void **)user_data)[1];
+
+    wkt = shapefile_shape_wkt(shape);
+    if (wkt == NULL || strcmp(wkt, poly->wkt) != 0) {
+        test_printf(MODULE, "Expected %s, but got %s", poly->wkt, wkt == NULL ? "NULL" : wkt);
+        (*failures)++;
+    }
+
+    free(wkt);
+
+    json = buffer_init();
+    if (json == NULL) {
+        test_printf(MODULE, "Out of memory");
+        (*failures)++;
+        return false;
+    }
+
+    if (!shapefile_shape_geojson_write(shape, json, DTOA_SHORTEST) || !buffer_write_char(json, '\0') ||
+        strcmp((const char *)buffer_data(json), poly->geojson) != 0) {
+        test_printf(MODULE, "Expected %s, but got %s", poly->geojson, (const char *)buffer_data(json));
+        (*failures)++;
+    }
+
+    //the layout is checked byte for byte in the WKB test, so here the size is enough
+    buffer_clear(json);
+    if (!shapefile_shape_wkb_write(shape, json, 0) || buffer_length(json) != poly->wkb_size) {
+        test_printf(MODULE, "Shape type %d has %zu bytes of WKB instead of %zu", poly->type, buffer_length(json), poly->wkb_size);
+        (*failures)++;
+    }
+
+    buffer_free(json);
+
+    if (shapefile_shape_type(shape) != poly->type ||
+        shapefile_shape_num_parts(shape) != (unsigned int)poly->num_parts ||
+        shapefile_shape_num_points(shape) != (unsigned int)poly->num_points ||
+        shapefile_shape_points(shape)[poly->num_points - 1].y != poly->coords[(poly->num_points * 2) - 1]) {
+        test_printf(MODULE, "Shape type %d has the wrong type, counts or points", poly->type);
+        (*failures)++;
+    }
+
+    if (poly->num_parts > 1) {
+        points = shapefile_shape_part(shape, 1, &count);
+        if (points == NULL || count != (unsigned int)(poly->num_parts > 2 ? poly->parts[2] - poly->parts[1] : poly->num_points - poly->parts[1]) || points->x != poly->coords[poly->parts[1] * 2]) {
+            test_printf(MODULE, "Shape type %d has the wrong second part", poly->type);
+            (*failures)++;
+        }
+    }
+
+    return true;
+}
+
+static int
+shapefile_test_poly(void *user_data) {
+    const shapefile_test_poly_t *poly;
+    shapefile_parse_cb_t cb;
+    shapefile_t *file;
+    buffer_t *record;
+    void *data[2];
+    unsigned int i;
+    int32_t j;
+    int failures = 0;
+    bool success;
+
+    for (i = 0; i < sizeof(shapefile_test_polys) / sizeof(shapefile_test_polys[0]); i++) {
+        poly = &shapefile_test_polys[i];
+
+        record = buffer_init();
+        success = record != NULL &&
+                  shapefile_test_int32_le(record, poly->type);
+
+        //the bounding box isn't checked, so it's left empty
+        for (j = 0; success && j < 4; j++) {
+            success = shapefile_test_double_le(record, 0.0);
+        }
+
+        success = success &&
+                  (poly->type == 8 || shapefile_test_int32_le(record, poly->num_parts)) &&
+                  shapefile_test_int32_le(record, poly->num_points);
+
+        for (j = 0; success && j < poly->num_parts; j++) {
+            success = shapefile_test_int32_le(record, poly->parts[j]);
+        }
+        for (j = 0; success && j < poly->num_points * 2; j++) {
+            success = shapefile_test_double_le(record, poly->coords[j]);
+        }
+
+        success = success && shapefile_test_write(SHAPEFILE_TEST_PATH, poly->type, &record, 1);
+        buffer_free(record);
+
+        if (!success) {
+            test_printf(MODULE, "Error writing the test shapefile");
+            failures++;
+            continue;
+        }
+
+        data[0] = (void *)poly;
+        data[1] = &failures;
+        cb.shape = shapefile_test_poly_shape;
+        cb.user_data = data;
+
+        file = shapefile_init();
+        if (!shapefile_parse_cb(file, SHAPEFILE_TEST_PATH, &cb)) {
+            test_printf(MODULE, "Error parsing: %s", shapefile_error(file));
+            failures++;
+        }
+
+        shapefile_free(file);
+    }
+
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+//writes a record with parts unless num_parts is negative, and the Z and M sections when they aren't NULL
+static bool
+shapefile_test_zm_record(buffer_t *record, int32_t type, int32_t num_parts, const int32_t *part_types, const double *coords, int32_t num_points, const double *z, const double *m) {
+    int32_t i;
+    bool success;
+
+    success = shapefile_test_int32_le(record, type);
+    for (i = 0; success && i < 4; i++) {
+        success = shapefile_test_double_le(record, 0.0);
+    }
+
+    success = success &&
+              (num_parts < 0 || shapefile_test_int32_le(record, num_parts)) &&
+              shapefile_test_int32_le(record, num_points);
+
+    for (i = 0; success && i < num_parts; i++) {
+        success = shapefile_test_int32_le(record, 0);
+    }
+    for (i = 0; success && part_types != NULL && i < num_parts; i++) {
+        success = shapefile_test_int32_le(record, part_types[i]);
+    }
+    for (i = 0; success && i < num_points * 2; i++) {
+        success = shapefile_test_double_le(record, coords[i]);
+    }
+    for (i = -2; success && z != NULL && i < num_points; i++) {
+        success = shapefile_test_double_le(record, i < 0 ? 0.0 : z[i]);
+    }
+    for (i = -2; success && m != NULL && i < num_points; i++) {
+        success = shapefile_test_double_le(record, i < 0 ? 0.0 : m[i]);
+    }
+
+    return success;
+}
+
+static bool
+shapefile_test_zm_shape(shapefile_shape_t *shape, void *user_data) {
+    static const char *expected[] = {
+        "POINT ZM(1 2 3 4)",
+        "POINT Z(1 2 3)",
+        "LINESTRING Z(0 0 7, 1 1 8)",
+        "MULTIPOINT M((0 0 5), (1 1 6))",
+        "MULTIPOLYGON Z(((0 0 1, 1 0 2, 0 1 3, 0 0 1)), "
+                       "((1 0 2, 0 1 3, 1 1 4, 1 0 2)))"
+    };
+    static const char *geojson = "{\"type\":\"MultiPolygon\",\"coordinates\":[[[[0,0,1],[1,0,2],[0,1,3],[0,0,1]]],"
+                                                                         "[[[1,0,2],[0,1,3],[1,1,4],[1,0,2]]]]}";
+    unsigned int *count;
+    buffer_t *json;
+    bool has_m;
+    char *wkt;
+
+    count = user_data;
+
+    wkt = shapefile_shape_wkt(shape);
+    if (wkt == NULL || strcmp(wkt, expected[*count]) != 0) {
+        test_printf(MODULE, "Expected %s, but got %s", expected[*count], wkt == NULL ? "NULL" : wkt);
+        count[1]++;
+    }
+
+    free(wkt);
+
+    //the optional M is only in the first and fourth records
+    has_m = *count == 0 || *count == 3;
+    if ((shapefile_shape_m(shape) != NULL) != has_m || (shapefile_shape_z(shape) != NULL) != (*count != 3)) {
+        test_printf(MODULE, "Record %u has the wrong Z or M arrays", *count + 1);
+        count[1]++;
+    }
+
+    if (*count == 2 && (shapefile_shape_range(shape)->z.min != 0.0 || shapefile_shape_z(shape)[1] != 8.0)) {
+        test_printf(MODULE, "Record 3 has the wrong Z values");
+        count[1]++;
+    }
+
+    if (*count == 4 && (shapefile_shape_part_types(shape) == NULL || shapefile_shape_part_types(shape)[0] != SHAPEFILE_PART_TRIANGLE_STRIP)) {
+        test_printf(MODULE, "Record 5 has the wrong part types");
+        count[1]++;
+    }
+
+    //each triangle of the strip is a polygon of its own, with Z in both
+    if (*count == 4) {
+        json = buffer_init();
+        if (json == NULL || !shapefile_shape_geojson_write(shape, json, DTOA_SHORTEST) || !buffer_write_char(json, '\0') ||
+            strcmp((const char *)buffer_data(json), geojson) != 0) {
+            test_printf(MODULE, "Expected %s, but got %s", geojson, json == NULL ? "NULL" : (const char *)buffer_data(json));
+            count[1]++;
+        }
+        else {
+            buffer_clear(json);
+            if (!shapefile_shape_wkb_write(shape, json, 0) || buffer_length(json) != 9 + (2 * (9 + 4 + (4 * 24)))) {
+                test_printf(MODULE, "Record 5 has %zu bytes of WKB", buffer_length(json));
+                count[1]++;
+            }
+        }
+
+        buffer_free(json);
+    }
+
+    (*count)++;
+
+    return true;
+}
+
+static int
+shapefile_test_zm(void *user_data) {
+    static const double point[] = {1, 2}, point_z[] = {3}, point_m[] = {4};
+    static const double line[] = {0,0, 1,1}, line_z[] = {7, 8}, line_m[] = {5, 6};
+    static const double patch[] = {0,0, 1,0, 0,1, 1,1}, patch_z[] = {1, 2, 3, 4};
+    static const int32_t strip[] = {SHAPEFILE_PART_TRIANGLE_STRIP};
+    buffer_t *records[5];
+    shapefile_parse_cb_t cb;
+    shapefile_t *file;
+    unsigned int i, count[2] = {0, 0};
+    bool success = true;
+
+    for (i = 0; i < 5; i++) {
+        records[i] = buffer_init();
+        success = success && records[i] != NULL;
+    }
+
+    //points don't have a bounding box or counts, so they're written by hand
+    success = success &&
+              shapefile_test_int32_le(records[0], SHAPEFILE_TYPE_POINT_Z) &&
+              shapefile_test_double_le(records[0], point[0]) && shapefile_test_double_le(records[0], point[1]) &&
+              shapefile_test_double_le(records[0], point_z[0]) && shapefile_test_double_le(records[0], point_m[0]) &&
+              shapefile_test_int32_le(records[1], SHAPEFILE_TYPE_POINT_Z) &&
+              shapefile_test_double_le(records[1], point[0]) && shapefile_test_double_le(records[1], point[1]) &&
+              shapefile_test_double_le(records[1], point_z[0]) &&
+              shapefile_test_zm_record(records[2], SHAPEFILE_TYPE_POLYLINE_Z, 1, NULL, line, 2, line_z, NULL) &&
+              shapefile_test_zm_record(records[3], SHAPEFILE_TYPE_MULTIPOINT_M, -1, NULL, line, 2, NULL, line_m) &&
+              shapefile_test_zm_record(records[4], SHAPEFILE_TYPE_MULTIPATCH, 1, strip, patch, 4, patch_z, NULL) &&
+              shapefile_test_write(SHAPEFILE_TEST_PATH, SHAPEFILE_TYPE_POINT_Z, records, 5);
+
+    if (!success) {
+        test_printf(MODULE, "Error writing the test shapefile");
+        count[1]++;
+    }
+    else {
+        cb.shape = shapefile_test_zm_shape;
+        cb.user_data = count;
+
+        file = shapefile_init();
+        if (!shapefile_parse_cb(file, SHAPEFILE_TEST_PATH, &cb)) {
+            test_printf(MODULE, "Error parsing: %s", shapefile_error(file));
+            count[1]++;
+        }
+        else if (count[0] != 5) {
+            test_printf(MODULE, "Expected 5 shapes, but got %u", count[0]);
+            count[1]++;
+        }
+
+        shapefile_free(file);
+    }
+
+    for (i = 0; i < 5; i++) {
+        buffer_free(records[i]);
+    }
+
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return (int)count[1];
+}
+
+//a MultiPatch with a strip of two triangles followed by a ring, which is a polygon of its own since there's nothing
+//before it to be a hole in, and then one with a strip too short to make a triangle
+static bool
+shapefile_test_write_multipatch(shapefile_shape_t **shapes) {
+    static const shapefile_point_t points[] = {{0, 0}, {1, 0}, {0, 1}, {1, 1}, {5, 5}, {6, 5}, {6, 6}, {5, 6}, {5, 5}};
+    static const double z[9] = {0};
+    static const int32_t parts[] = {0, 4};
+    static const int32_t part_types[] = {SHAPEFILE_PART_TRIANGLE_STRIP, SHAPEFILE_PART_RING};
+    shapefile_writer_t *writer;
+    shapefile_t *file;
+    bool success;
+
+    shapes[0] = NULL;
+    shapes[1] = NULL;
+
+    writer = shapefile_writer_init();
+    success = writer != NULL && shapefile_writer_open(writer, SHAPEFILE_TEST_PATH, SHAPEFILE_TYPE_MULTIPATCH) &&
+              shapefile_writer_write_parts(writer, parts, part_types, 2, points, z, NULL, 9) &&
+              shapefile_writer_write_parts(writer, parts, part_types, 1, points, z, NULL, 2) &&
+              shapefile_writer_close(writer);
+    shapefile_writer_free(writer);
+
+    if (!success) {
+        return false;
+    }
+
+    file = shapefile_init();
+    success = shapefile_open(file, SHAPEFILE_TEST_PATH) &&
+              (shapes[0] = shapefile_get_shape(file, 0)) != NULL && (shapes[1] = shapefile_get_shape(file, 1)) != NULL;
+    shapefile_free(file);
+
+    return success;
+}
+
+static int
+shapefile_test_wkt(void *user_data) {
+    static const double line[] = {0.1, 0.2, 123456.789, 1e21};
+    static const char *expected = "POINT Z(0.3333333333333333 -0.6666666666666666 1e-7);LINESTRING(0.1 0.2, 123456.8 1e21);POINT Z(0.333 -0.667 0)";
+    static const char *multipatch = "MULTIPOLYGON Z(((0 0 0, 1 0 0, 0 1 0, 0 0 0)), ((1 0 0, 0 1 0, 1 1 0, 1 0 0)), "
+                                    "((5 5 0, 6 5 0, 6 6 0, 5 6 0, 5 5 0)));MULTIPOLYGON Z EMPTY";
+    shapefile_shape_t *shapes[2] = {NULL, NULL};
+    buffer_t *records[2], *wkt;
+    shapefile_t *file;
+    char str[DTOA_BUFFER_SIZE];
+    uint64_t bits = 88172645463325252ULL;
+    double value;
+    unsigned int i;
+    bool success = true;
+    int failures = 0;
+
+    //every double reads back the same
+    for (i = 0; i < 100000; i++) {
+        bits ^= bits << 13;
+        bits ^= bits >> 7;
+        bits ^= bits << 17;
+        memcpy(&value, &bits, sizeof(value));
+
+        if (value != value || value - value != 0) {
+            continue;
+        }
+
+        dtoa_format(str, value, DTOA_SHORTEST);
+        if (strtod(str, NULL) != value) {
+            test_printf(MODULE, "%.17g was written as %s", value, str);
+            failures++;
+            break;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        records[i] = buffer_init();
+        success = success && records[i] != NULL;
+    }
+
+    success = success &&
+              shapefile_test_int32_le(records[0], SHAPEFILE_TYPE_POINT_Z) &&
+              shapefile_test_double_le(records[0], 1.0 / 3) && shapefile_test_double_le(records[0], -2.0 / 3) &&
+              shapefile_test_double_le(records[0], 1e-7) &&
+              shapefile_test_zm_record(records[1], SHAPEFILE_TYPE_POLYLINE, 1, NULL, line, 2, NULL, NULL) &&
+              shapefile_test_write(SHAPEFILE_TEST_PATH, SHAPEFILE_TYPE_POINT_Z, records, 2);
+
+    for (i = 0; i < 2; i++) {
+        buffer_free(records[i]);
+    }
+
+    if (!success) {
+        test_printf(MODULE, "Error writing the test shapefile");
+        return failures + 1;
+    }
+
+    //all appended to the same buffer
+    file = shapefile_init();
+    wkt = buffer_init();
+
+    if (wkt == NULL || !shapefile_open(file, SHAPEFILE_TEST_PATH) ||
+        (shapes[0] = shapefile_get_shape(file, 0)) == NULL || (shapes[1] = shapefile_get_shape(file, 1)) == NULL) {
+        test_printf(MODULE, "Error reading the shapes: %s", shapefile_error(file));
+        failures++;
+    }
+    else if (!shapefile_shape_wkt_write(shapes[0], wkt, DTOA_SHORTEST) || !buffer_write_char(wkt, ';') ||
+             !shapefile_shape_wkt_write(shapes[1], wkt, 1) || !buffer_write_char(wkt, ';') ||
+             !shapefile_shape_wkt_write(shapes[0], wkt, 3) || !buffer_write_char(wkt, '\0')) {
+        test_printf(MODULE, "Error writing WKT");
+        failures++;
+    }
+    else if (strcmp((const char *)buffer_data(wkt), expected) != 0) {
+        test_printf(MODULE, "Expected %s, but got %s", expected, (const char *)buffer_data(wkt));
+        failures++;
+    }
+
+    shapefile_shape_free(shapes[0]);
+    shapefile_shape_free(shapes[1]);
+
+    //the ring after the strip is its own polygon, not a hole in the last triangle
+    if (wkt == NULL || !shapefile_test_write_multipatch(shapes)) {
+        test_printf(MODULE, "Error writing the MultiPatch");
+        failures++;
+    }
+    else {
+        buffer_clear(wkt);
+        if (!shapefile_shape_wkt_write(shapes[0], wkt, DTOA_SHORTEST) || !buffer_write_char(wkt, ';') ||
+            !shapefile_shape_wkt_write(shapes[1], wkt, DTOA_SHORTEST) || !buffer_write_char(wkt, '\0') ||
+            strcmp((const char *)buffer_data(wkt), multipatch) != 0) {
+            test_printf(MODULE, "Expected %s, but got %s", multipatch, wkt == NULL ? "nothing" : (const char *)buffer_data(wkt));
+            failures++;
+        }
+    }
+
+    shapefile_shape_free(shapes[0]);
+    shapefile_shape_free(shapes[1]);
+    buffer_free(wkt);
+    shapefile_free(file);
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+//reads a value out of WKB in the machine's byte order
+static uint32_t
+shapefile_test_wkb_uint32(buffer_t *wkb, size_t offset) {
+    uint32_t value;
+
+    memcpy(&value, (const unsigned char *)buffer_data(wkb) + offset, sizeof(value));
+    return value;
+}
+
+static double
+shapefile_test_wkb_double(buffer_t *wkb, size_t offset) {
+    double value;
+
+    memcpy(&value, (const unsigned char *)buffer_data(wkb) + offset, sizeof(value));
+    return value;
+}
+
+static int
+shapefile_test_wkb(void *user_data) {
+    static const char * const fields[] = {"NAME", "COUNT", "OK", "WHEN"};
+    static const char *expected = "{\"type\":\"FeatureCollection\",\"features\":["
+                                  "{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\",\"coordinates\":[1.5,-2,0.25]},\"properties\":null},"
+                                  "{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\",\"coordinates\":[0,0]},"
+                                  "\"properties\":{\"NAME\":\"pt0\",\"COUNT\":0,\"OK\":false,\"WHEN\":\"2020-01-01\"}},"
+                                  "{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\",\"coordinates\":[1.5,-0.25]},"
+                                  "\"properties\":{\"NAME\":\"pt1\",\"COUNT\":1,\"OK\":true,\"WHEN\":\"2020-02-02\"}}]}";
+    static const char *multipatch = "{\"type\":\"MultiPolygon\",\"coordinates\":[[[[0,0,0],[1,0,0],[0,1,0],[0,0,0]]],"
+                                    "[[[1,0,0],[0,1,0],[1,1,0],[1,0,0]]],[[[5,5,0],[5,6,0],[6,6,0],[6,5,0],[5,5,0]]]]}";
+    shapefile_shape_t *point = NULL, *shape, *shapes[2];
+    shapefile_geojson_t *geojson = NULL;
+    shapefile_record_t *record;
+    shapefile_t *file;
+    buffer_t *record_z, *wkb, *json;
+    uint32_t one = 1;
+    uint8_t order;
+    unsigned int i;
+    bool success;
+    int failures = 0;
+
+    memcpy(&order, &one, sizeof(order));
+
+    record_z = buffer_init();
+    success = record_z != NULL &&
+              shapefile_test_int32_le(record_z, SHAPEFILE_TYPE_POINT_Z) &&
+              shapefile_test_double_le(record_z, 1.5) && shapefile_test_double_le(record_z, -2.0) &&
+              shapefile_test_double_le(record_z, 0.25) &&
+              shapefile_test_write(SHAPEFILE_TEST_PATH, SHAPEFILE_TYPE_POINT_Z, &record_z, 1);
+    buffer_free(record_z);
+
+    if (!success) {
+        test_printf(MODULE, "Error writing the test shapefile");
+        return 1;
+    }
+
+    file = shapefile_init();
+    wkb = buffer_init();
+    json = buffer_init();
+
+    if (wkb == NULL || json == NULL || !shapefile_open(file, SHAPEFILE_TEST_PATH) || (point = shapefile_get_shape(file, 0)) == NULL) {
+        test_printf(MODULE, "Error reading the shape: %s", shapefile_error(file));
+        failures++;
+        success = false;
+    }
+
+    //ISO WKB, then EWKB with the SRID, then 2D only
+    if (success &&
+        (!shapefile_shape_wkb_write(point, wkb, 0) || buffer_length(wkb) != 29 ||
+         ((const unsigned char *)buffer_data(wkb))[0] != order || shapefile_test_wkb_uint32(wkb, 1) != 1001 ||
+         shapefile_test_wkb_double(wkb, 5) != 1.5 || shapefile_test_wkb_double(wkb, 13) != -2.0 || shapefile_test_wkb_double(wkb, 21) != 0.25)) {
+        test_printf(MODULE, "The WKB for a PointZ is wrong");
+        failures++;
+    }
+
+    if (success) {
+        buffer_clear(wkb);
+        if (!shapefile_shape_ewkb_write(point, wkb, 4326, 0) || buffer_length(wkb) != 33 ||
+            shapefile_test_wkb_uint32(wkb, 1) != 0xa0000001 || shapefile_test_wkb_uint32(wkb, 5) != 4326 ||
+            shapefile_test_wkb_double(wkb, 9) != 1.5 || shapefile_test_wkb_double(wkb, 25) != 0.25) {
+            test_printf(MODULE, "The EWKB for a PointZ is wrong");
+            failures++;
+        }
+
+        buffer_clear(wkb);
+        if (!shapefile_shape_ewkb_write(point, wkb, 0, SHAPEFILE_WKB_2D) || buffer_length(wkb) != 21 ||
+            shapefile_test_wkb_uint32(wkb, 1) != 1 || shapefile_test_wkb_double(wkb, 13) != -2.0) {
+            test_printf(MODULE, "The 2D EWKB for a PointZ is wrong");
+            failures++;
+        }
+    }
+
+    //a feature without a record, then two with their attributes
+    if (success) {
+        geojson = shapefile_geojson_init(json, DTOA_SHORTEST);
+        success = geojson != NULL && shapefile_geojson_feature(geojson, point, NULL);
+
+        shapefile_free(file);
+        file = shapefile_init();
+
+        success = success && shapefile_test_write_points() && shapefile_test_write_dbf() &&
+                  shapefile_open(file, SHAPEFILE_TEST_PATH) && shapefile_select_fields(file, fields, 4);
+
+        for (i = 0; success && i < 2; i++) {
+            success = shapefile_next(file, &shape, &record) && shapefile_geojson_feature(geojson, shape, record);
+        }
+
+        if (!success || !shapefile_geojson_finish(geojson) || !buffer_write_char(json, '\0')) {
+            test_printf(MODULE, "Error writing GeoJSON: %s", shapefile_error(file));
+            failures++;
+        }
+        else if (strcmp((const char *)buffer_data(json), expected) != 0) {
+            test_printf(MODULE, "Expected %s, but got %s", expected, (const char *)buffer_data(json));
+            failures++;
+        }
+    }
+
+    //the same MultiPatch as the WKT test, as three polygons and then none
+    if (wkb != NULL && json != NULL) {
+        if (!shapefile_test_write_multipatch(shapes)) {
+            test_printf(MODULE, "Error writing the MultiPatch");
+            failures++;
+        }
+        else {
+            buffer_clear(wkb);
+            buffer_clear(json);
+            if (!shapefile_shape_wkb_write(shapes[0], wkb, 0) || buffer_length(wkb) != 9 + 109 + 109 + 133 ||
+                shapefile_test_wkb_uint32(wkb, 1) != 1006 || shapefile_test_wkb_uint32(wkb, 5) != 3 ||
+                !shapefile_shape_wkb_write(shapes[1], wkb, 0) || buffer_length(wkb) != 360 + 9 || shapefile_test_wkb_uint32(wkb, 365) != 0 ||
+                !shapefile_shape_geojson_write(shapes[0], json, DTOA_SHORTEST) || !buffer_write_char(json, '\0') ||
+                strcmp((const char *)buffer_data(json), multipatch) != 0) {
+                test_printf(MODULE, "The MultiPatch was split up differently from its WKT");
+                failures++;
+            }
+        }
+
+        shapefile_shape_free(shapes[0]);
+        shapefile_shape_free(shapes[1]);
+    }
+
+    //NaN and infinity aren't JSON
+    shapefile_shape_free(point);
+    point = NULL;
+    record_z = buffer_init();
+    success = record_z != NULL &&
+              shapefile_test_int32_le(record_z, SHAPEFILE_TYPE_POINT_Z) &&
+              shapefile_test_double_le(record_z, NAN) && shapefile_test_double_le(record_z, -2.0) &&
+              shapefile_test_double_le(record_z, INFINITY) &&
+              shapefile_test_write(SHAPEFILE_TEST_PATH, SHAPEFILE_TYPE_POINT_Z, &record_z, 1);
+    buffer_free(record_z);
+
+    shapefile_free(file);
+    file = shapefile_init();
+    if (json != NULL) {
+        buffer_clear(json);
+    }
+
+    success = success && json != NULL && shapefile_open(file, SHAPEFILE_TEST_PATH) && (point = shapefile_get_shape(file, 0)) != NULL &&
+              shapefile_shape_geojson_write(point, json, DTOA_SHORTEST) && buffer_write_char(json, '\0');
+    if (!success) {
+        test_printf(MODULE, "Error writing the non-finite point as GeoJSON: %s", shapefile_error(file));
+        failures++;
+    }
+    else if (strcmp((const char *)buffer_data(json), "{\"type\":\"Point\",\"coordinates\":[null,-2,null]}") != 0) {
+        test_printf(MODULE, "Expected non-finite coordinates to be null, but got %s", (const char *)buffer_data(json));
+        failures++;
+    }
+
+    shapefile_geojson_free(geojson);
+    shapefile_shape_free(point);
+    buffer_free(wkb);
+    buffer_free(json);
+    shapefile_free(file);
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+static bool
+shapefile_test_parallel_shape(shapefile_shape_t *shape, void *user_data) {
+    shapefile_test_points_t *points;
+
+    points = user_data;
+    points->count++;
+
+    //x is 1.5 times the record number, so the sum across every thread says whether each record came out once
+    points->failures += (int)(shapefile_shape_points(shape)->x / 1.5);
+
+    return true;
+}
+
+static bool
+shapefile_test_parallel_stop(shapefile_shape_t *shape, void *user_data) {
+    return ++((shapefile_test_points_t *)user_data)->count < 10;
+}
+
+static int
+shapefile_test_parallel(void *user_data) {
+    shapefile_test_points_t points[4];
+    shapefile_parse_cb_t cbs[4];
+    shapefile_t *file;
+    unsigned int i, count = 0;
+    int failures = 0, sum = 0;
+
+    if (!shapefile_test_write_points()) {
+        return 1;
+    }
+
+    file = shapefile_init();
+    shapefile_set_reuse(file, true);
+
+    //one callback per thread, where the records can come out in any order
+    for (i = 0; i < 4; i++) {
+        memset(&points[i], 0, sizeof(points[i]));
+        cbs[i].shape = shapefile_test_parallel_shape;
+        cbs[i].user_data = &points[i];
+    }
+
+    if (!shapefile_parse_parallel(file, SHAPEFILE_TEST_PATH, 4, cbs)) {
+        test_printf(MODULE, "Error parsing: %s", shapefile_error(file));
+        failures++;
+    }
+
+    for (i = 0; i < 4; i++) {
+        count += points[i].count;
+        sum += points[i].failures;
+    }
+
+    if (count != SHAPEFILE_TEST_POINTS || sum != (SHAPEFILE_TEST_POINTS * (SHAPEFILE_TEST_POINTS - 1)) / 2) {
+        test_printf(MODULE, "Expected %u records across the threads, but got %u", SHAPEFILE_TEST_POINTS, count);
+        failures++;
+    }
+
+    //ordered, which the points callback checks
+    points[0].count = 0;
+    points[0].failures = 0;
+    cbs[0].shape = shapefile_test_points_shape;
+
+    if (!shapefile_parse_parallel_ordered(file, SHAPEFILE_TEST_PATH, 3, &cbs[0])) {
+        test_printf(MODULE, "Error parsing: %s", shapefile_error(file));
+        failures++;
+    }
+    else if (points[0].count != SHAPEFILE_TEST_POINTS) {
+        test_printf(MODULE, "Expected %u points in order, but got %u", SHAPEFILE_TEST_POINTS, points[0].count);
+        failures++;
+    }
+
+    failures += points[0].failures;
+
+    //stopping early has to throw away whatever the workers decoded ahead of the callback
+    points[0].count = 0;
+    cbs[0].shape = shapefile_test_parallel_stop;
+
+    if (!shapefile_parse_parallel_ordered(file, SHAPEFILE_TEST_PATH, 4, &cbs[0]) || points[0].count != 10) {
+        test_printf(MODULE, "Expected the parse to stop after 10 points, but got %u", points[0].count);
+        failures++;
+    }
+
+    shapefile_free(file);
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+//points 100 through 300 are inside the filter
+#define SHAPEFILE_TEST_FILTER_COUNT 201
+#define SHAPEFILE_TEST_FILTER_SUM   40200
+
+static int
+shapefile_test_filter(void *user_data) {
+    shapefile_test_points_t points[4];
+    shapefile_parse_cb_t cbs[4];
+    shapefile_writer_t *writer;
+    shapefile_point_t point;
+    shapefile_mbr_t mbr;
+    shapefile_t *file;
+    bool success;
+    unsigned int i, pass, count;
+    int failures = 0, sum;
+
+    if (!shapefile_test_write_points()) {
+        return 1;
+    }
+
+    mbr.min_x = 150;
+    mbr.min_y = -200;
+    mbr.max_x = 450;
+    mbr.max_y = 0;
+
+    for (i = 0; i < 4; i++) {
+        cbs[i].shape = shapefile_test_parallel_shape;
+        cbs[i].user_data = &points[i];
+    }
+
+    //checking each box memory mapped and through the read buffer, then through the .rtx, then on threads
+    for (pass = 0; pass < 4; pass++) {
+        memset(points, 0, sizeof(points));
+
+        file = shapefile_init();
+        shapefile_set_mmap(file, pass != 1);
+        shapefile_set_filter(file, &mbr);
+
+        if (pass == 2) {
+            if (!shapefile_open(file, SHAPEFILE_TEST_PATH) || !shapefile_build_index(file) || !shapefile_save_index(file)) {
+                test_printf(MODULE, "Error saving the index: %s", shapefile_error(file));
+                failures++;
+            }
+
+            shapefile_close(file);
+        }
+
+        if (!(pass == 3 ? shapefile_parse_parallel(file, SHAPEFILE_TEST_PATH, 4, cbs) : shapefile_parse_cb(file, SHAPEFILE_TEST_PATH, cbs))) {
+            test_printf(MODULE, "Error parsing: %s", shapefile_error(file));
+            failures++;
+        }
+
+        count = 0;
+        sum = 0;
+        for (i = 0; i < 4; i++) {
+            count += points[i].count;
+            sum += points[i].failures;
+        }
+
+        if (count != SHAPEFILE_TEST_FILTER_COUNT || sum != SHAPEFILE_TEST_FILTER_SUM) {
+            test_printf(MODULE, "Expected %u shapes inside the filter, but got %u", SHAPEFILE_TEST_FILTER_COUNT, count);
+            failures++;
+        }
+
+        shapefile_free(file);
+    }
+
+    //turning it off gets everything again, even with the .rtx there
+    memset(points, 0, sizeof(points));
+    file = shapefile_init();
+    shapefile_set_filter(file, &mbr);
+    shapefile_set_filter(file, NULL);
+
+    if (!shapefile_parse_cb(file, SHAPEFILE_TEST_PATH, cbs) || points[0].count != SHAPEFILE_TEST_POINTS) {
+        test_printf(MODULE, "Expected %u shapes without the filter, but got %u", SHAPEFILE_TEST_POINTS, points[0].count);
+        failures++;
+    }
+
+    shapefile_free(file);
+
+    //the points moved along by 50 records' worth leave the .rtx stale, so it has to be passed over for the boxes
+    writer = shapefile_writer_init();
+    success = writer != NULL && shapefile_writer_open(writer, SHAPEFILE_TEST_PATH, SHAPEFILE_TYPE_POINT);
+    for (i = 0; success && i < SHAPEFILE_TEST_POINTS; i++) {
+        point.x = ((double)i - 50) * 1.5;
+        point.y = i * -0.25;
+        success = shapefile_writer_write_parts(writer, NULL, NULL, 0, &point, NULL, NULL, 1);
+    }
+    success = success && shapefile_writer_close(writer);
+    shapefile_writer_free(writer);
+
+    memset(points, 0, sizeof(points));
+    file = shapefile_init();
+    shapefile_set_filter(file, &mbr);
+
+    if (!success || !shapefile_parse_cb(file, SHAPEFILE_TEST_PATH, cbs) ||
+        points[0].count != SHAPEFILE_TEST_FILTER_COUNT || points[0].failures != SHAPEFILE_TEST_FILTER_SUM) {
+        test_printf(MODULE, "Expected %u shapes inside the filter with a stale index, but got %u", SHAPEFILE_TEST_FILTER_COUNT, points[0].count);
+        failures++;
+    }
+
+    shapefile_free(file);
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+#define SHAPEFILE_TEST_WRITER_POINTS 100000
+
+static bool
+shapefile_test_writer_shape(shapefile_shape_t *shape, void *user_data) {
+    shapefile_test_points_t *points;
+    const double *z;
+
+    points = user_data;
+
+    //the last record is a Null, and the rest are PointZ with Z the same as the record number
+    z = shapefile_shape_z(shape);
+    if (points->count == SHAPEFILE_TEST_WRITER_POINTS) {
+        if (shapefile_shape_type(shape) != SHAPEFILE_TYPE_NULL) {
+            points->failures++;
+        }
+    }
+    else if (z == NULL || shapefile_shape_m(shape) != NULL || *z != points->count ||
+             shapefile_shape_points(shape)->x != points->count * 1.5 || shapefile_shape_points(shape)->y != points->count * -0.25) {
+        points->failures++;
+    }
+
+    points->count++;
+
+    return true;
+}
+
+//writes shapes and attributes and reads them back with the reader
+static int
+shapefile_test_writer(void *user_data) {
+    static const char *path = SHAPEFILE_TEST_PATH "_out";
+    const shapefile_test_poly_t *poly;
+    const shapefile_mbr_t *mbr;
+    shapefile_test_points_t points;
+    shapefile_writer_t *writer;
+    shapefile_parse_cb_t cb;
+    shapefile_shape_t *shape;
+    shapefile_record_t *record;
+    shapefile_point_t point;
+    shapefile_t *file, *out;
+    double min_x, max_y, z;
+    void *data[2];
+    char name[16];
+    unsigned int i, pass;
+    int32_t j;
+    int failures = 0;
+
+    //every shape from the polyline, polygon and multipoint test, from bare arrays
+    for (i = 0; i < sizeof(shapefile_test_polys) / sizeof(shapefile_test_polys[0]); i++) {
+        poly = &shapefile_test_polys[i];
+
+        writer = shapefile_writer_init();
+        if (writer == NULL || !shapefile_writer_open(writer, path, poly->type) ||
+            !shapefile_writer_write_parts(writer, poly->parts, NULL, poly->num_parts, (const shapefile_point_t *)poly->coords, NULL, NULL, poly->num_points) ||
+            !shapefile_writer_close(writer)) {
+            test_printf(MODULE, "Error writing shape type %d: %s", poly->type, writer == NULL ? "Out of memory" : shapefile_writer_error(writer));
+            shapefile_writer_free(writer);
+            failures++;
+            continue;
+        }
+
+        shapefile_writer_free(writer);
+
+        file = shapefile_init();
+        shape = NULL;
+
+        if (!shapefile_open(file, path) || shapefile_count(file) != 1 || (shape = shapefile_get_shape(file, 0)) == NULL) {
+            test_printf(MODULE, "Error reading back shape type %d: %s", poly->type, shapefile_error(file));
+            failures++;
+        }
+        else {
+            data[0] = (void *)poly;
+            data[1] = &failures;
+            shapefile_test_poly_shape(shape, data);
+
+            min_x = poly->coords[0];
+            max_y = poly->coords[1];
+            for (j = 1; j < poly->num_points; j++) {
+                min_x = poly->coords[j * 2] < min_x ? poly->coords[j * 2] : min_x;
+                max_y = poly->coords[(j * 2) + 1] > max_y ? poly->coords[(j * 2) + 1] : max_y;
+            }
+
+            mbr = shapefile_shape_mbr(shape);
+            if (poly->type != SHAPEFILE_TYPE_POINT && (mbr->min_x != min_x || mbr->max_y != max_y)) {
+                test_printf(MODULE, "Shape type %d was written with the wrong bounding box", poly->type);
+                failures++;
+            }
+        }
+
+        shapefile_shape_free(shape);
+        shapefile_free(file);
+    }
+
+    //the points and their attributes, copied over as they are and then set one field at a time
+    if (!shapefile_test_write_points() || !shapefile_test_write_dbf()) {
+        return failures + 1;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        file = shapefile_init();
+        writer = shapefile_writer_init();
+
+        if (writer == NULL || !shapefile_open(file, SHAPEFILE_TEST_PATH)) {
+            test_printf(MODULE, "Error opening the points: %s", shapefile_error(file));
+            shapefile_writer_free(writer);
+            shapefile_free(file);
+            failures++;
+            continue;
+        }
+
+        if (pass == 0) {
+            shapefile_writer_copy_fields(writer, file);
+        }
+        else {
+            shapefile_writer_add_field(writer, "NAME", SHAPEFILE_FIELD_CHARACTER, 10, 0);
+            shapefile_writer_add_field(writer, "COUNT", SHAPEFILE_FIELD_NUMERIC, 6, 0);
+            shapefile_writer_add_field(writer, "VALUE", SHAPEFILE_FIELD_NUMERIC, 10, 3);
+            shapefile_writer_add_field(writer, "WHEN", SHAPEFILE_FIELD_DATE, 8, 0);
+            shapefile_writer_add_field(writer, "OK", SHAPEFILE_FIELD_LOGICAL, 1, 0);
+        }
+
+        if (!shapefile_writer_open(writer, path, SHAPEFILE_TYPE_POINT)) {
+            test_printf(MODULE, "Error opening the writer: %s", shapefile_writer_error(writer));
+            failures++;
+        }
+
+        for (i = 0; failures == 0 && shapefile_next(file, &shape, &record); i++) {
+            if (pass == 0) {
+                shapefile_writer_set_record(writer, record);
+            }
+            else {
+                //left NULL in the same records as the test .dbf
+                shapefile_writer_set_deleted(writer, i == 3);
+                snprintf(name, sizeof(name), "pt%u", i);
+                shapefile_writer_set_string(writer, 0, name);
+                if (i != 5) {
+                    shapefile_writer_set_int64(writer, 1, i);
+                }
+                shapefile_writer_set_double(writer, 2, i * 1.5);
+                if (i != 6) {
+                    shapefile_writer_set_date(writer, 3, 2020, (int)(i % 12) + 1, (int)(i % 28) + 1);
+                }
+                if (i != 7) {
+                    shapefile_writer_set_bool(writer, 4, i % 2 != 0);
+                }
+            }
+
+            if (!shapefile_writer_write(writer, shape)) {
+                test_printf(MODULE, "Error writing point %u: %s", i, shapefile_writer_error(writer));
+                failures++;
+            }
+        }
+
+        if (failures == 0 && !shapefile_writer_close(writer)) {
+            test_printf(MODULE, "Error closing the writer: %s", shapefile_writer_error(writer));
+            failures++;
+        }
+
+        shapefile_writer_free(writer);
+        shapefile_free(file);
+
+        out = shapefile_init();
+        if (failures > 0 || !shapefile_open(out, path) || shapefile_count(out) != SHAPEFILE_TEST_POINTS || shapefile_num_records(out) != SHAPEFILE_TEST_POINTS) {
+            test_printf(MODULE, "Error reading back the points: %s", shapefile_error(out));
+            shapefile_free(out);
+            failures++;
+            break;
+        }
+
+        for (i = 0; failures == 0 && shapefile_next(out, &shape, &record); i++) {
+            point = shapefile_shape_points(shape)[0];
+            if (point.x != i * 1.5 || point.y != i * -0.25) {
+                test_printf(MODULE, "Point %u was written as (%f %f)", i, point.x, point.y);
+                failures++;
+            }
+
+            failures += shapefile_test_attributes_record(record, i);
+        }
+
+        shapefile_free(out);
+    }
+
+    //enough PointZ records to fill several chunks, and a Null at the end
+    writer = shapefile_writer_init();
+    if (writer == NULL || !shapefile_writer_open(writer, path, SHAPEFILE_TYPE_POINT_Z)) {
+        test_printf(MODULE, "Error opening the writer: %s", writer == NULL ? "Out of memory" : shapefile_writer_error(writer));
+        failures++;
+    }
+
+    for (i = 0; failures == 0 && i < SHAPEFILE_TEST_WRITER_POINTS; i++) {
+        point.x = i * 1.5;
+        point.y = i * -0.25;
+        z = i;
+
+        if (!shapefile_writer_write_parts(writer, NULL, NULL, 0, &point, &z, NULL, 1)) {
+            test_printf(MODULE, "Error writing point %u: %s", i, shapefile_writer_error(writer));
+            failures++;
+        }
+    }
+
+    if (failures == 0 && (!shapefile_writer_write_null(writer) || shapefile_writer_count(writer) != SHAPEFILE_TEST_WRITER_POINTS + 1 || !shapefile_writer_close(writer))) {
+        test_printf(MODULE, "Error closing the writer: %s", shapefile_writer_error(writer));
+        failures++;
+    }
+
+    shapefile_writer_free(writer);
+
+    if (failures == 0) {
+        memset(&points, 0, sizeof(points));
+        cb.shape = shapefile_test_writer_shape;
+        cb.user_data = &points;
+
+        file = shapefile_init();
+        if (!shapefile_parse_cb(file, path, &cb) || points.count != SHAPEFILE_TEST_WRITER_POINTS + 1 || points.failures > 0) {
+            test_printf(MODULE, "Read back %u of %u points with %d wrong: %s", points.count, SHAPEFILE_TEST_WRITER_POINTS + 1, points.failures, shapefile_error(file));
+            failures++;
+        }
+
+        shapefile_free(file);
+    }
+
+    //the most fields whose descriptors fit in the .dbf header, then one too many
+    writer = shapefile_writer_init();
+    for (i = 0; failures == 0 && i < 2046; i++) {
+        snprintf(name, sizeof(name), "F%u", i);
+        if (writer == NULL || !shapefile_writer_add_field(writer, name, SHAPEFILE_FIELD_LOGICAL, 1, 0)) {
+            test_printf(MODULE, "Error adding field %u: %s", i, writer == NULL ? "Out of memory" : shapefile_writer_error(writer));
+            failures++;
+        }
+    }
+
+    if (failures == 0 && shapefile_writer_add_field(writer, "F2046", SHAPEFILE_FIELD_LOGICAL, 1, 0)) {
+        test_printf(MODULE, "Expected the 2047th field to be rejected");
+        failures++;
+    }
+
+    point.x = 1;
+    point.y = 2;
+    if (failures == 0 && (!shapefile_writer_open(writer, path, SHAPEFILE_TYPE_POINT) || !shapefile_writer_set_bool(writer, 2045, true) ||
+                          !shapefile_writer_write_parts(writer, NULL, NULL, 0, &point, NULL, NULL, 1) || !shapefile_writer_close(writer))) {
+        test_printf(MODULE, "Error writing 2046 fields: %s", shapefile_writer_error(writer));
+        failures++;
+    }
+
+    shapefile_writer_free(writer);
+
+    if (failures == 0) {
+        out = shapefile_init();
+        if (!shapefile_open(out, path) || shapefile_num_fields(out) != 2046 || shapefile_num_records(out) != 1) {
+            test_printf(MODULE, "Expected 2046 fields, but got %u: %s", shapefile_num_fields(out), shapefile_error(out));
+            failures++;
+        }
+
+        shapefile_free(out);
+    }
+
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+    shapefile_test_remove(path);
+
+    return failures;
+}
+
+#define SHAPEFILE_TEST_VALIDATE_POINTS 37
+
+//bounds from the SIMD kernels against a plain loop, then validation of what's read
+static int
+shapefile_test_validate(void *user_data) {
+    static const char *path = SHAPEFILE_TEST_PATH "_out";
+    shapefile_point_t points[SHAPEFILE_TEST_VALIDATE_POINTS];
+    shapefile_mbr_t expected[SHAPEFILE_TEST_VALIDATE_POINTS];
+    const shapefile_mbr_t *mbr;
+    shapefile_writer_t *writer;
+    shapefile_shape_t *shape;
+    shapefile_t *file;
+    buffer_t *record;
+    uint64_t bits = 88172645463325252ULL;
+    unsigned int i, n;
+    bool success;
+    int failures = 0;
+
+    //multipoints of every length up to a few vectors' worth, so each kernel's leftover points get used too
+    writer = shapefile_writer_init();
+    success = writer != NULL && shapefile_writer_open(writer, path, SHAPEFILE_TYPE_MULTIPOINT);
+
+    for (n = 1; success && n <= SHAPEFILE_TEST_VALIDATE_POINTS; n++) {
+        for (i = 0; i < n; i++) {
+            bits ^= bits << 13;
+            bits ^= bits >> 7;
+            bits ^= bits << 17;
+            points[i].x = ((double)(bits % 2000001) - 1000000.0) / 7.0;
+            points[i].y = ((double)((bits >> 21) % 2000001) - 1000000.0) / 3.0;
+
+            if (i == 0 || points[i].x < expected[n - 1].min_x) {
+                expected[n - 1].min_x = points[i].x;
+            }
+            if (i == 0 || points[i].y < expected[n - 1].min_y) {
+                expected[n - 1].min_y = points[i].y;
+            }
+            if (i == 0 || points[i].x > expected[n - 1].max_x) {
+                expected[n - 1].max_x = points[i].x;
+            }
+            if (i == 0 || points[i].y > expected[n - 1].max_y) {
+                expected[n - 1].max_y = points[i].y;
+            }
+        }
+
+        success = shapefile_writer_write_parts(writer, NULL, NULL, 0, points, NULL, NULL, (int32_t)n);
+    }
+
+    //NaN can't be written
+    points[3].y = NAN;
+    if (success && shapefile_writer_write_parts(writer, NULL, NULL, 0, points, NULL, NULL, 5)) {
+        test_printf(MODULE, "Wrote a NaN coordinate");
+        failures++;
+    }
+
+    if (!success || !shapefile_writer_close(writer)) {
+        test_printf(MODULE, "Error writing the multipoints: %s", writer == NULL ? "Out of memory" : shapefile_writer_error(writer));
+        shapefile_writer_free(writer);
+        return failures + 1;
+    }
+
+    shapefile_writer_free(writer);
+
+    file = shapefile_init();
+    shapefile_set_validate(file, true);
+
+    if (!shapefile_open(file, path) || shapefile_count(file) != SHAPEFILE_TEST_VALIDATE_POINTS) {
+        test_printf(MODULE, "Error opening the multipoints: %s", shapefile_error(file));
+        failures++;
+    }
+
+    for (n = 0; failures == 0 && n < SHAPEFILE_TEST_VALIDATE_POINTS; n++) {
+        shape = shapefile_get_shape(file, n);
+        if (shape == NULL) {
+            test_printf(MODULE, "Error reading multipoint %u: %s", n, shapefile_error(file));
+            failures++;
+            break;
+        }
+
+        mbr = shapefile_shape_mbr(shape);
+        if (mbr->min_x != expected[n].min_x || mbr->min_y != expected[n].min_y || mbr->max_x != expected[n].max_x || mbr->max_y != expected[n].max_y) {
+            test_printf(MODULE, "Multipoint %u has the box (%f %f, %f %f) instead of (%f %f, %f %f)", n,
+                        mbr->min_x, mbr->min_y, mbr->max_x, mbr->max_y, expected[n].min_x, expected[n].min_y, expected[n].max_x, expected[n].max_y);
+            failures++;
+        }
+
+        shapefile_shape_free(shape);
+    }
+
+    shapefile_free(file);
+    shapefile_test_remove(path);
+
+    //a line outside the empty box it was written with only fails when validating
+    record = buffer_init();
+    success = record != NULL &&
+              shapefile_test_zm_record(record, SHAPEFILE_TYPE_POLYLINE, 1, NULL, (const double *)points, 2, NULL, NULL) &&
+              shapefile_test_write(SHAPEFILE_TEST_PATH, SHAPEFILE_TYPE_POLYLINE, &record, 1);
+    buffer_free(record);
+
+    if (!success) {
+        test_printf(MODULE, "Error writing the test shapefile");
+        return failures + 1;
+    }
+
+    file = shapefile_init();
+    if (!shapefile_open(file, SHAPEFILE_TEST_PATH) || (shape = shapefile_get_shape(file, 0)) == NULL) {
+        test_printf(MODULE, "Error reading the line without validation: %s", shapefile_error(file));
+        failures++;
+    }
+    else {
+        shapefile_shape_free(shape);
+
+        shapefile_set_validate(file, true);
+        shape = shapefile_get_shape(file, 0);
+        if (shape != NULL || strstr(shapefile_error(file), "outside its bounding box") == NULL) {
+            test_printf(MODULE, "Expected the line to be outside its box, but got '%s'", shapefile_error(file));
+            shapefile_shape_free(shape);
+            failures++;
+        }
+    }
+
+    shapefile_free(file);
+
+    //and a NaN point
+    record = buffer_init();
+    success = record != NULL &&
+              shapefile_test_int32_le(record, SHAPEFILE_TYPE_POINT) &&
+              shapefile_test_double_le(record, 1.0) && shapefile_test_double_le(record, NAN) &&
+              shapefile_test_write(SHAPEFILE_TEST_PATH, SHAPEFILE_TYPE_POINT, &record, 1);
+    buffer_free(record);
+
+    file = shapefile_init();
+    shapefile_set_validate(file, true);
+
+    if (!success || !shapefile_open(file, SHAPEFILE_TEST_PATH)) {
+        test_printf(MODULE, "Error opening the NaN point: %s", shapefile_error(file));
+        failures++;
+    }
+    else if ((shape = shapefile_get_shape(file, 0)) != NULL || strstr(shapefile_error(file), "finite") == NULL) {
+        test_printf(MODULE, "Expected the NaN point to fail, but got '%s'", shapefile_error(file));
+        shapefile_shape_free(shape);
+        failures++;
+    }
+
+    shapefile_free(file);
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+static bool
+shapefile_test_write_prj(const char *prj) {
+    bool success;
+    FILE *f;
+
+    f = fopen(SHAPEFILE_TEST_PATH ".prj", "wb");
+    success = f != NULL && fwrite(prj, 1, strlen(prj), f) == strlen(prj);
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    return success;
+}
+
+static bool
+shapefile_test_transform_fail(shapefile_point_t *points, double *z, size_t count, void *user_data) {
+    return count < 3;
+}
+
+static int
+shapefile_test_transforms(void *user_data) {
+    static const struct {
+        const char *prj;
+        int crs;
+    } prjs[] = {
+        {"GEOGCS[\"GCS_WGS_1984\",DATUM[\"D_WGS_1984\",SPHEROID[\"WGS_1984\",6378137.0,298.257223563]],PRIMEM[\"Greenwich\",0.0],UNIT[\"Degree\",0.0174532925199433]]", SHAPEFILE_CRS_WGS84},
+        {"PROJCS[\"WGS_1984_UTM_Zone_33N\",GEOGCS[\"GCS_WGS_1984\",DATUM[\"D_WGS_1984\",SPHEROID[\"WGS_1984\",6378137.0,298.257223563]]],PROJECTION[\"Transverse_Mercator\"]]", SHAPEFILE_CRS_UTM_NORTH + 33},
+        {"PROJCS[\"WGS 84 / UTM zone 7S\",GEOGCS[\"WGS 84\",DATUM[\"WGS_1984\",SPHEROID[\"WGS 84\",6378137,298.257223563]]]]", SHAPEFILE_CRS_UTM_SOUTH + 7},
+        {"PROJCS[\"WGS_1984_Web_Mercator_Auxiliary_Sphere\",GEOGCS[\"GCS_WGS_1984\",DATUM[\"D_WGS_1984\",SPHEROID[\"WGS_1984\",6378137.0,298.257223563]]],PROJECTION[\"Mercator_Auxiliary_Sphere\"]]", SHAPEFILE_CRS_WEB_MERCATOR},
+        {"GEOGCS[\"WGS 84\",DATUM[\"World Geodetic System 1984\",SPHEROID[\"WGS 84\",6378137,298.257223563]],PRIMEM[\"Greenwich\",0],UNIT[\"degree\",0.0174532925199433]]", SHAPEFILE_CRS_WGS84},
+        {"PROJCS[\"NAD_1983_UTM_Zone_18N\",GEOGCS[\"GCS_North_American_1983\",DATUM[\"D_North_American_1983\",SPHEROID[\"GRS_1980\",6378137.0,298.257222101]]]]", SHAPEFILE_CRS_UNKNOWN},
+        //TOWGS84 only says how to shift NAD27 onto WGS84, it doesn't make it WGS84
+        {"PROJCS[\"NAD27 / UTM zone 15N\",GEOGCS[\"NAD27\",DATUM[\"North_American_Datum_1927\",SPHEROID[\"Clarke 1866\",6378206.4,294.9786982138982],TOWGS84[-8,160,176,0,0,0,0]]],PROJECTION[\"Transverse_Mercator\"]]", SHAPEFILE_CRS_UNKNOWN},
+        {"GEOGCS[\"NAD27\",DATUM[\"North_American_Datum_1927\",SPHEROID[\"Clarke 1866\",6378206.4,294.9786982138982],TOWGS84[-8,160,176,0,0,0,0]],PRIMEM[\"Greenwich\",0],UNIT[\"degree\",0.0174532925199433]]", SHAPEFILE_CRS_UNKNOWN}
+    };
+    static const shapefile_point_t line[] = {{-122.4194, 37.7749}, {2.3522, 48.8566}, {151.2093, -33.8688}, {0, 0}};
+    static const int32_t parts[] = {0};
+    static const shapefile_affine_t affine = {2, 0, 0, 0, 1, 10};
+    shapefile_point_t points[4], expected[4];
+    shapefile_transform_t transform;
+    const shapefile_point_t *decoded;
+    const shapefile_mbr_t *mbr;
+    shapefile_writer_t *writer;
+    shapefile_shape_t *shape;
+    shapefile_t *file;
+    unsigned int i, pass;
+    int failures = 0;
+
+    //known points, each with a different reference
+    points[0].x = 180;
+    points[0].y = 0;
+    points[1].x = 0;
+    points[1].y = 85.0511287798066;
+    shapefile_reproject(points, 2, SHAPEFILE_CRS_WGS84, SHAPEFILE_CRS_WEB_MERCATOR);
+    if (fabs(points[0].x - 20037508.342789244) > 1e-6 || fabs(points[0].y) > 1e-6 || fabs(points[1].y - 20037508.342789244) > 1e-3) {
+        test_printf(MODULE, "Web Mercator gave (%f %f) and (%f %f)", points[0].x, points[0].y, points[1].x, points[1].y);
+        failures++;
+    }
+
+    points[0].x = 3;
+    points[0].y = 0;
+    points[1].x = 0;
+    points[1].y = 0;
+    points[2].x = 3;
+    points[2].y = 45;
+    shapefile_reproject(points, 3, SHAPEFILE_CRS_WGS84, SHAPEFILE_CRS_UTM_NORTH + 31);
+    if (fabs(points[0].x - 500000) > 1e-6 || fabs(points[0].y) > 1e-6 || fabs(points[1].x - 166021.4431) > 1e-3 || fabs(points[1].y) > 1e-6 ||
+        fabs(points[2].x - 500000) > 1e-6 || fabs(points[2].y - 4982950.4) > 0.5) {
+        test_printf(MODULE, "UTM gave (%f %f), (%f %f) and (%f %f)", points[0].x, points[0].y, points[1].x, points[1].y, points[2].x, points[2].y);
+        failures++;
+    }
+
+    //there and back through each projection, within a couple of degrees of the UTM zone's meridian
+    for (pass = 0; pass < 3; pass++) {
+        for (i = 0; i < 4; i++) {
+            points[i].x = 13.5 + (i * 0.7) - 1.0;
+            points[i].y = (pass == 2 ? -60.0 : 10.0) + (i * 17.3);
+        }
+
+        memcpy(expected, points, sizeof(points));
+        shapefile_reproject(points, 4, SHAPEFILE_CRS_WGS84, pass == 0 ? SHAPEFILE_CRS_WEB_MERCATOR : (pass == 1 ? SHAPEFILE_CRS_UTM_NORTH + 33 : SHAPEFILE_CRS_UTM_SOUTH + 33));
+        shapefile_reproject(points, 4, pass == 0 ? SHAPEFILE_CRS_WEB_MERCATOR : (pass == 1 ? SHAPEFILE_CRS_UTM_NORTH + 33 : SHAPEFILE_CRS_UTM_SOUTH + 33), SHAPEFILE_CRS_WGS84);
+
+        for (i = 0; i < 4; i++) {
+            if (fabs(points[i].x - expected[i].x) > 1e-7 || fabs(points[i].y - expected[i].y) > 1e-7) {
+                test_printf(MODULE, "(%f %f) came back as (%.10f %.10f) in pass %u", expected[i].x, expected[i].y, points[i].x, points[i].y, pass);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    if (shapefile_reproject(points, 1, SHAPEFILE_CRS_WGS84, 2154)) {
+        test_printf(MODULE, "Reprojected to an unknown projection");
+        failures++;
+    }
+
+    //projections read from a .prj
+    writer = shapefile_writer_init();
+    if (writer == NULL || !shapefile_writer_open(writer, SHAPEFILE_TEST_PATH, SHAPEFILE_TYPE_POLYLINE) ||
+        !shapefile_writer_write_parts(writer, parts, NULL, 1, line, NULL, NULL, 4) || !shapefile_writer_close(writer)) {
+        test_printf(MODULE, "Error writing the test shapefile");
+        shapefile_writer_free(writer);
+        return failures + 1;
+    }
+
+    shapefile_writer_free(writer);
+
+    for (i = 0; i < sizeof(prjs) / sizeof(prjs[0]); i++) {
+        file = shapefile_init();
+        if (!shapefile_test_write_prj(prjs[i].prj) || !shapefile_open(file, SHAPEFILE_TEST_PATH) || shapefile_crs(file) != prjs[i].crs) {
+            test_printf(MODULE, "Read EPSG:%d from .prj %u instead of EPSG:%d", shapefile_crs(file), i, prjs[i].crs);
+            failures++;
+        }
+
+        shapefile_free(file);
+    }
+
+    //the NAD27 .prj can't be reprojected from until it's overridden
+    file = shapefile_init();
+    shapefile_set_crs(file, SHAPEFILE_CRS_WEB_MERCATOR);
+    if (shapefile_open(file, SHAPEFILE_TEST_PATH) || strstr(shapefile_error(file), "projection") == NULL) {
+        test_printf(MODULE, "Expected a file of unknown projection not to open, but got '%s'", shapefile_error(file));
+        failures++;
+    }
+
+    shapefile_close(file);
+    shapefile_set_source_crs(file, SHAPEFILE_CRS_WGS84);
+    if (!shapefile_open(file, SHAPEFILE_TEST_PATH) || shapefile_crs(file) != SHAPEFILE_CRS_WGS84) {
+        test_printf(MODULE, "Error opening with the projection overridden: %s", shapefile_error(file));
+        failures++;
+    }
+
+    shapefile_free(file);
+
+    //reprojected to Web Mercator and then through an affine transform while decoding
+    for (pass = 0; pass < 2; pass++) {
+        memcpy(expected, line, sizeof(line));
+        shapefile_reproject(expected, 4, SHAPEFILE_CRS_WGS84, SHAPEFILE_CRS_WEB_MERCATOR);
+        if (pass == 1) {
+            shapefile_transform_affine(expected, NULL, 4, (void *)&affine);
+        }
+
+        transform.transform = shapefile_transform_affine;
+        transform.user_data = (void *)&affine;
+
+        file = shapefile_init();
+        shapefile_set_crs(file, SHAPEFILE_CRS_WEB_MERCATOR);
+        shapefile_set_transform(file, pass == 1 ? &transform : NULL);
+
+        if (!shapefile_test_write_prj(prjs[0].prj) || !shapefile_open(file, SHAPEFILE_TEST_PATH) || (shape = shapefile_get_shape(file, 0)) == NULL) {
+            test_printf(MODULE, "Error reading the reprojected line: %s", shapefile_error(file));
+            shapefile_free(file);
+            failures++;
+            continue;
+        }
+
+        decoded = shapefile_shape_points(shape);
+        for (i = 0; i < 4; i++) {
+            if (decoded[i].x != expected[i].x || decoded[i].y != expected[i].y) {
+                test_printf(MODULE, "Point %u was decoded as (%f %f) instead of (%f %f)", i, decoded[i].x, decoded[i].y, expected[i].x, expected[i].y);
+                failures++;
+            }
+        }
+
+        mbr = shapefile_shape_mbr(shape);
+        if (mbr->min_x != expected[0].x || mbr->max_x != expected[2].x || mbr->min_y != expected[2].y || mbr->max_y != expected[1].y) {
+            test_printf(MODULE, "The reprojected line's box wasn't updated");
+            failures++;
+        }
+
+        shapefile_shape_free(shape);
+        shapefile_free(file);
+    }
+
+    //a transform that fails fails the shape
+    transform.transform = shapefile_test_transform_fail;
+    transform.user_data = NULL;
+
+    file = shapefile_init();
+    shapefile_set_transform(file, &transform);
+    if (!shapefile_open(file, SHAPEFILE_TEST_PATH) || shapefile_get_shape(file, 0) != NULL || strstr(shapefile_error(file), "transform") == NULL) {
+        test_printf(MODULE, "Expected the transform to fail, but got '%s'", shapefile_error(file));
+        failures++;
+    }
+
+    shapefile_free(file);
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
+//writes one shape, simplifies it with simplify and checks how many parts and points are left
+static int
+shapefile_test_simplify_shape(shapefile_simplify_t *simplify, int32_t type, const int32_t *parts, int32_t num_parts, const shapefile_point_t *points,
+                              const double *z, int32_t num_points, int32_t expected_parts, int32_t expected_points, shapefile_shape_t **shape) {
+    shapefile_writer_t *writer;
+    shapefile_t *file;
+    int failures = 0;
+
+    *shape = NULL;
+
+    writer = shapefile_writer_init();
+    if (writer == NULL || !shapefile_writer_open(writer, SHAPEFILE_TEST_PATH, type) ||
+        !shapefile_writer_write_parts(writer, parts, NULL, num_parts, points, z, NULL, num_points) || !shapefile_writer_close(writer)) {
+        test_printf(MODULE, "Error writing the test shapefile");
+        shapefile_writer_free(writer);
+        return 1;
+    }
+
+    shapefile_writer_free(writer);
+
+    file = shapefile_init();
+    if (!shapefile_open(file, SHAPEFILE_TEST_PATH) || (*shape = shapefile_get_shape(file, 0)) == NULL) {
+        test_printf(MODULE, "Error reading the test shapefile: %s", shapefile_error(file));
+        shapefile_free(file);
+        return 1;
+    }
+
+    shapefile_free(file);
+
+    if (!shapefile_simplify_shape(simplify, *shape)) {
+        test_printf(MODULE, "Error simplifying");
+        failures++;
+    }
+    else if ((int32_t)shapefile_shape_num_parts(*shape) != expected_parts || (int32_t)shapefile_shape_num_points(*shape) != expected_points) {
+        test_printf(MODULE, "Simplified to %u parts and %u points instead of %d and %d",
+                    shapefile_shape_num_parts(*shape), shapefile_shape_num_points(*shape), expected_parts, expected_points);
+        failures++;
+    }
+
+    return failures;
+}
+
+static int
+shapefile_test_simplify(void *user_data) {
+    //a wobbly line with a spike, which both methods take down to its ends, the spike and its corners
+    static const shapefile_point_t line[] = {{0, 0}, {1, 0.1}, {2, -0.1}, {3, 0}, {3.5, 3}, {4, 0}, {5, 0.1}, {6, 0}};
+    static const double line_z[] = {0, 10, 20, 30, 40, 50, 60, 70};
+    static const shapefile_point_t line_kept[] = {{0, 0}, {3, 0}, {3.5, 3}, {4, 0}, {6, 0}};
+    static const double line_z_kept[] = {0, 30, 40, 50, 70};
+    //a square with a small hole, then a thin polygon with a large hole
+    static const shapefile_point_t rings[] = {
+        {0, 0}, {0, 10}, {5, 10.1}, {10, 10}, {10, 0}, {0, 0},
+        {2, 2}, {2.2, 2}, {2.2, 2.2}, {2, 2.2}, {2, 2},
+        {20, 20}, {20, 30}, {20.1, 30}, {20.1, 20}, {20, 20},
+        {50, 50}, {60, 50}, {60, 60}, {50, 60}, {50, 50}
+    };
+    static const int32_t rings_parts[] = {0, 6, 11, 16};
+    //a clockwise ring that Douglas-Peucker turns counterclockwise
+    static const shapefile_point_t flip[] = {{0, 9}, {6, 9}, {10, 8}, {5, 6}, {10, 9}, {8, 7}, {0, 9}};
+    static const int32_t parts[] = {0};
+    static const double tolerances[] = {0.5, 1.0};
+    const shapefile_point_t *points;
+    const shapefile_mbr_t *mbr;
+    shapefile_simplify_t *simplify;
+    shapefile_shape_t *shape;
+    const double *z;
+    int method, failures = 0;
+    unsigned int i;
+
+    if (shapefile_simplify_init(-1, 1.0, 0) != NULL) {
+        test_printf(MODULE, "Made a simplifier with an unknown method");
+        failures++;
+    }
+
+    for (method = SHAPEFILE_SIMPLIFY_DOUGLAS_PEUCKER; method <= SHAPEFILE_SIMPLIFY_VISVALINGAM; method++) {
+        simplify = shapefile_simplify_init(method, tolerances[method], 0);
+        if (simplify == NULL) {
+            test_printf(MODULE, "Error making a simplifier");
+            return failures + 1;
+        }
+
+        //the line, along with its Z values
+        failures += shapefile_test_simplify_shape(simplify, SHAPEFILE_TYPE_POLYLINE_Z, parts, 1, line, line_z, 8, 1, 5, &shape);
+        if (shape != NULL && shapefile_shape_num_points(shape) == 5) {
+            points = shapefile_shape_points(shape);
+            z = shapefile_shape_z(shape);
+            for (i = 0; i < 5; i++) {
+                if (points[i].x != line_kept[i].x || points[i].y != line_kept[i].y || z[i] != line_z_kept[i]) {
+                    test_printf(MODULE, "Point %u of the line is (%f %f %f) with method %d", i, points[i].x, points[i].y, z[i], method);
+                    failures++;
+                }
+            }
+
+            mbr = shapefile_shape_mbr(shape);
+            if (mbr->min_x != 0 || mbr->max_x != 6 || mbr->min_y != 0 || mbr->max_y != 3 ||
+                shapefile_shape_range(shape)->z.min != 0 || shapefile_shape_range(shape)->z.max != 70) {
+                test_printf(MODULE, "The simplified line's box or Z range is wrong with method %d", method);
+                failures++;
+            }
+        }
+
+        shapefile_shape_free(shape);
+
+        //the small hole is dropped, and the large one goes with the thin polygon it belongs to
+        failures += shapefile_test_simplify_shape(simplify, SHAPEFILE_TYPE_POLYGON, rings_parts, 4, rings, NULL, 21, 1, 5, &shape);
+        if (shape != NULL && shapefile_shape_num_points(shape) == 5) {
+            mbr = shapefile_shape_mbr(shape);
+            if (mbr->min_x != 0 || mbr->max_x != 10 || mbr->min_y != 0 || mbr->max_y != 10) {
+                test_printf(MODULE, "The simplified polygon's box is (%f %f, %f %f) with method %d", mbr->min_x, mbr->min_y, mbr->max_x, mbr->max_y, method);
+                failures++;
+            }
+        }
+
+        shapefile_shape_free(shape);
+        shapefile_simplify_free(simplify);
+
+        //every ring is kept, at least as a triangle
+        simplify = shapefile_simplify_init(method, tolerances[method], SHAPEFILE_SIMPLIFY_KEEP_PARTS);
+        failures += shapefile_test_simplify_shape(simplify, SHAPEFILE_TYPE_POLYGON, rings_parts, 4, rings, NULL, 21, 4, 18, &shape);
+        shapefile_shape_free(shape);
+
+        //nothing is taken out with no tolerance
+        shapefile_simplify_set_tolerance(simplify, 0.0);
+        failures += shapefile_test_simplify_shape(simplify, SHAPEFILE_TYPE_POLYLINE_Z, parts, 1, line, line_z, 8, 1, 8, &shape);
+        shapefile_shape_free(shape);
+        shapefile_simplify_free(simplify);
+    }
+
+    //the ring comes out inside out unless its winding is kept
+    simplify = shapefile_simplify_init(SHAPEFILE_SIMPLIFY_DOUGLAS_PEUCKER, 2.0, 0);
+    failures += shapefile_test_simplify_shape(simplify, SHAPEFILE_TYPE_POLYGON, parts, 1, flip, NULL, 7, 1, 5, &shape);
+    shapefile_shape_free(shape);
+    shapefile_simplify_free(simplify);
+
+    simplify = shapefile_simplify_init(SHAPEFILE_SIMPLIFY_DOUGLAS_PEUCKER, 2.0, SHAPEFILE_SIMPLIFY_KEEP_WINDING);
+    failures += shapefile_test_simplify_shape(simplify, SHAPEFILE_TYPE_POLYGON, parts, 1, flip, NULL, 7, 1, 7, &shape);
+    shapefile_shape_free(shape);
+    shapefile_simplify_free(simplify);
+
+    //points are left alone
+    simplify = shapefile_simplify_init(SHAPEFILE_SIMPLIFY_VISVALINGAM, 100.0, 0);
+    failures += shapefile_test_simplify_shape(simplify, SHAPEFILE_TYPE_MULTIPOINT, NULL, 0, line, NULL, 8, 0, 8, &shape);
+    shapefile_shape_free(shape);
+    shapefile_simplify_free(simplify);
+
+    shapefile_test_remove(SHAPEFILE_TEST_PATH);
+
+    return failures;
+}
+
 int
 shapefile_test() {
     int count;
 
-    count = test_run(MODULE, 1, "Main", shapefile_test_main, NULL);
+    count = test_run(MODULE, 1, "Main", shapefile_test_main, NULL) +
+            test_run(MODULE, 2, "Points", shapefile_test_points, NULL) +
+            test_run(MODULE, 3, "Polylines, Polygons And MultiPoints", shapefile_test_poly, NULL) +
+            test_run(MODULE, 4, "Z, M And MultiPatch", shapefile_test_zm, NULL) +
+            test_run(MODULE, 5, "Random Access", shapefile_test_random, NULL) +
+            test_run(MODULE, 6, "Parallel", shapefile_test_parallel, NULL) +
+            test_run(MODULE, 7, "Attributes", shapefile_test_attributes, NULL) +
+            test_run(MODULE, 8, "Spatial Index", shapefile_test_index, NULL) +
+            test_run(MODULE, 9, "Filter", shapefile_test_filter, NULL) +
+            test_run(MODULE, 10, "WKT", shapefile_test_wkt, NULL) +
+            test_run(MODULE, 11, "WKB And GeoJSON", shapefile_test_wkb, NULL) +
+            test_run(MODULE, 12, "Writer", shapefile_test_writer, NULL) +
+            test_run(MODULE, 13, "Validation", shapefile_test_validate, NULL) +
+            test_run(MODULE, 14, "Transforms", shapefile_test_transforms, NULL) +
+            test_run(MODULE, 15, "Simplification", shapefile_test_simplify, NULL);
 
     return count;
 }